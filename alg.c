@@ -8,6 +8,9 @@
  */
 #include "motion.h"
 #include "alg.h"
+#include "alg_simd.h"
+#include "alg_bg.h"
+#include "alg_workers.h"
 
 #ifdef __MMX__
 #define HAVE_MMX
@@ -17,15 +20,135 @@
 #define MAX2(x, y) ((x) > (y) ? (x) : (y))
 #define MAX3(x, y, z) ((x) > (y) ? ((x) > (z) ? (x) : (z)) : ((y) > (z) ? (y) : (z)))
 
-/** 
- * alg_locate_center_size 
- *      Locates the center and size of the movement. 
+/**
+ * det_pixels
+ *      Converts a number of pixels in the detection image to full image pixels,
+ *      so diffs and thresholds mean the same whatever the detection_scale.
  */
-void alg_locate_center_size(struct images *imgs, int width, int height, struct coord *cent)
+static int det_pixels(struct images *imgs, int count)
 {
-    unsigned char *out = imgs->out;
-    int *labels = imgs->labels;
-    int x, y, centc = 0, xdist = 0, ydist = 0;
+    return count * imgs->det_scale * imgs->det_scale;
+}
+
+/**
+ * pack_row
+ *      Packs row y of det_out into the motion bitmap, one bit per non zero
+ *      pixel. The bits past the end of the row are always left zero.
+ */
+static void pack_row(struct images *imgs, int y)
+{
+    unsigned char *out = imgs->det_out + y * imgs->det_width;
+    uint64_t *bits = DET_BITS_ROW(imgs, y);
+    uint64_t word;
+    int x = 0, k, width = imgs->det_width;
+
+    if (alg_simd.pack) {
+        x = width - width % 64;
+        alg_simd.pack(out, bits, x);
+    }
+
+    for (; x < width; x += 64) {
+        word = 0;
+
+        for (k = 0; k < 64 && x + k < width; k++)
+            if (out[x + k])
+                word |= (uint64_t)1 << k;
+
+        bits[x / 64] = word;
+    }
+}
+
+/**
+ * bits_next
+ *      Returns the first pixel from x on in a row of the motion bitmap that is
+ *      set, or clear when set is 0. Returns width when there is none.
+ */
+static int bits_next(uint64_t *row, int width, int x, int set)
+{
+    int j = x / 64, words = (width + 63) / 64;
+    uint64_t word;
+
+    if (x >= width)
+        return width;
+
+    word = (set ? row[j] : ~row[j]) & (~(uint64_t)0 << (x % 64));
+
+    while (!word) {
+        if (++j == words)
+            return width;
+
+        word = set ? row[j] : ~row[j];
+    }
+
+    x = j * 64 + __builtin_ctzll(word);
+
+    return x < width ? x : width;
+}
+
+/**
+ * label_location
+ *      Locates the labels above threshold from the label table. The box is
+ *      the bounding box of the labels, in full image coordinates.
+ */
+static void label_location(struct images *imgs, struct coord *cent)
+{
+    struct label_stat *stat;
+    long long sumx = 0, sumy = 0;
+    int minx = imgs->det_width, miny = imgs->det_height, maxx = 0, maxy = 0;
+    int i, area = 0, scale = imgs->det_scale;
+
+    for (i = 1; i <= imgs->label_count; i++) {
+        stat = &imgs->label_stats[i];
+
+        if (!stat->above)
+            continue;
+
+        area += stat->area;
+        sumx += stat->sumx;
+        sumy += stat->sumy;
+
+        if (minx > stat->minx)
+            minx = stat->minx;
+
+        if (maxx < stat->maxx)
+            maxx = stat->maxx;
+
+        if (miny > stat->miny)
+            miny = stat->miny;
+
+        if (maxy < stat->maxy)
+            maxy = stat->maxy;
+    }
+
+    if (!area) {
+        cent->x = 0;
+        cent->y = 0;
+        cent->minx = imgs->width;
+        cent->miny = imgs->height;
+        cent->maxx = 0;
+        cent->maxy = 0;
+        return;
+    }
+
+    cent->x = sumx / area * scale;
+    cent->y = sumy / area * scale;
+    cent->minx = minx * scale;
+    cent->maxx = (maxx + 1) * scale - 1;
+    /* A quarter extra above for the heads, as for the motion image below. */
+    cent->miny = (miny - (maxy - miny + 1) / 4) * scale;
+    cent->maxy = (maxy + 1) * scale - 1;
+}
+
+/**
+ * out_location
+ *      Locates the center and size of all movement in the motion bitmap of
+ *      width x height pixels. The result is in full image coordinates.
+ */
+static void out_location(struct images *imgs, int width, int height, struct coord *cent)
+{
+    uint64_t *row, word;
+    int x, y, j, centc = 0, xdist = 0, ydist = 0;
+    int scale = imgs->det_scale;
 
     cent->x = 0;
     cent->y = 0;
@@ -34,31 +157,18 @@ void alg_locate_center_size(struct images *imgs, int width, int height, struct c
     cent->minx = width;
     cent->miny = height;
 
-    /* If Labeling enabled - locate center of largest labelgroup. */
-    if (imgs->labelsize_max) {
-        /* Locate largest labelgroup */
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                if (*(labels++) & 32768) {
-                    cent->x += x;
-                    cent->y += y;
-                    centc++;
-                }
-            }
-        }
-
-    } else {
-        /* Locate movement */
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                if (*(out++)) {
-                    cent->x += x;
-                    cent->y += y;
-                    centc++;
-                }
+    /* Locate movement */
+    for (y = 0; y < height; y++) {
+        row = DET_BITS_ROW(imgs, y);
+
+        for (j = 0; j < imgs->det_bits_words; j++) {
+            for (word = row[j]; word; word &= word - 1) {
+                x = j * 64 + __builtin_ctzll(word);
+                cent->x += x;
+                cent->y += y;
+                centc++;
             }
         }
-
     }
 
     if (centc) {
@@ -68,52 +178,36 @@ void alg_locate_center_size(struct images *imgs, int width, int height, struct c
     
     /* Now we find the size of the Motion. */
 
-    /* First reset pointers back to initial value. */
     centc = 0;
-    labels = imgs->labels;
-    out = imgs->out;
 
-    /* If Labeling then we find the area around largest labelgroup instead. */
-    if (imgs->labelsize_max) {
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                if (*(labels++) & 32768) {
-                    if (x > cent->x)
-                        xdist += x - cent->x;
-                    else if (x < cent->x)
-                        xdist += cent->x - x;
-
-                    if (y > cent->y)
-                        ydist += y - cent->y;
-                    else if (y < cent->y)
-                        ydist += cent->y - y;
-
-                    centc++;
-                }
-            }    
-        }
+    for (y = 0; y < height; y++) {
+        row = DET_BITS_ROW(imgs, y);
 
-    } else {
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                if (*(out++)) {
-                    if (x > cent->x)
-                        xdist += x - cent->x;
-                    else if (x < cent->x)
-                        xdist += cent->x - x;
-
-                    if (y > cent->y)
-                        ydist += y - cent->y;
-                    else if (y < cent->y)
-                        ydist += cent->y - y;
-
-                    centc++;
-                }
-            }    
-        }
+        for (j = 0; j < imgs->det_bits_words; j++) {
+            for (word = row[j]; word; word &= word - 1) {
+                x = j * 64 + __builtin_ctzll(word);
+
+                if (x > cent->x)
+                    xdist += x - cent->x;
+                else if (x < cent->x)
+                    xdist += cent->x - x;
+
+                if (y > cent->y)
+                    ydist += y - cent->y;
+                else if (y < cent->y)
+                    ydist += cent->y - y;
 
+                centc++;
+            }
+        }    
     }
     
+    /* Map back from the detection image to the full image. */
+    cent->x *= scale;
+    cent->y *= scale;
+    xdist *= scale;
+    ydist *= scale;
+
     if (centc) {
         cent->minx = cent->x - xdist / centc * 2;
         cent->maxx = cent->x + xdist / centc * 2;
@@ -125,6 +219,23 @@ void alg_locate_center_size(struct images *imgs, int width, int height, struct c
         cent->miny = cent->y - ydist / centc * 3;
         cent->maxy = cent->y + ydist / centc * 2;
     }
+}
+
+/** 
+ * alg_locate_center_size 
+ *      Locates the center and size of the movement. width and height are
+ *      those of the detection image, the result is in full image coordinates.
+ */
+void alg_locate_center_size(struct images *imgs, int width, int height, struct coord *cent)
+{
+    /* If Labeling enabled - the label table has the labels above threshold. */
+    if (imgs->labelsize_max)
+        label_location(imgs, cent);
+    else
+        out_location(imgs, width, height, cent);
+
+    width = imgs->width;
+    height = imgs->height;
 
     if (cent->maxx > width - 1)
         cent->maxx = width - 1;
@@ -352,21 +463,149 @@ void alg_draw_red_location(struct coord *cent, struct images *imgs, int width, u
 #define DIFF(x, y)         (ABS((x)-(y)))
 #define NDIFF(x, y)        (ABS(x) * NORM / (ABS(x) + 2 * DIFF(x, y)))
 
+/*
+ * Gaps between two pixels with a non zero mask up to this long are made part
+ * of the span around them. Short gaps cost more to step over than to diff.
+ */
+#define MASK_SPAN_MIN_GAP 32
+
 /**
- * alg_noise_tune
- *
+ * mask_span_tiles
+ *      Sets imgs.mask_tiles from the span index and returns the number of
+ *      pixels in the spans.
  */
-void alg_noise_tune(struct context *cnt, unsigned char *new)
+static int mask_span_tiles(struct images *imgs)
+{
+    int *inside = mymalloc(imgs->tile_cols * imgs->tile_rows * sizeof(int));
+    struct mask_span *span, *end;
+    int x, y, t, tx, ty, w, h, total = 0;
+
+    for (y = 0; y < imgs->det_height; y++) {
+        int *row = inside + (y / ALG_TILE_SIZE) * imgs->tile_cols;
+
+        span = imgs->mask_spans + imgs->mask_span_row[y];
+        end = imgs->mask_spans + imgs->mask_span_row[y + 1];
+
+        for (; span < end; span++) {
+            total += span->x1 - span->x0;
+
+            for (x = span->x0; x < span->x1; x++)
+                row[x / ALG_TILE_SIZE]++;
+        }
+    }
+
+    for (t = 0; t < imgs->tile_cols * imgs->tile_rows; t++) {
+        tx = t % imgs->tile_cols;
+        ty = t / imgs->tile_cols;
+        w = imgs->det_width - tx * ALG_TILE_SIZE;
+        h = imgs->det_height - ty * ALG_TILE_SIZE;
+        w = (w < ALG_TILE_SIZE ? w : ALG_TILE_SIZE) * (h < ALG_TILE_SIZE ? h : ALG_TILE_SIZE);
+
+        if (!inside[t])
+            imgs->mask_tiles[t] = MASK_TILE_NONE;
+        else if (inside[t] == w)
+            imgs->mask_tiles[t] = MASK_TILE_FULL;
+        else
+            imgs->mask_tiles[t] = MASK_TILE_PARTIAL;
+    }
+
+    free(inside);
+
+    return total;
+}
+
+/**
+ * alg_mask_spans
+ *      Builds the span index of the mask: the runs of every row in which the
+ *      mask is not 0, so the per pixel stages can skip the masked out parts
+ *      of the image. Called when the mask has been loaded.
+ */
+void alg_mask_spans(struct context *cnt)
 {
     struct images *imgs = &cnt->imgs;
-    int i;
-    unsigned char *ref = imgs->ref;
-    int diff, sum = 0, count = 0;
     unsigned char *mask = imgs->mask;
-    unsigned char *smartmask = imgs->smartmask_final;
+    int width = imgs->det_width;
+    int x, y, x0, gap, nspans = 0, size = imgs->det_height;
+
+    imgs->mask_spans = mymalloc(size * sizeof(*imgs->mask_spans));
+    imgs->mask_span_row = mymalloc((imgs->det_height + 1) * sizeof(*imgs->mask_span_row));
+    imgs->mask_tiles = mymalloc(imgs->tile_cols * imgs->tile_rows);
+
+    for (y = 0; y < imgs->det_height; y++, mask += width) {
+        imgs->mask_span_row[y] = nspans;
+        x = 0;
+
+        for (;;) {
+            while (x < width && !mask[x])
+                x++;
+
+            if (x == width)
+                break;
+
+            x0 = x;
+
+            /* The span goes on over gaps that are too short to skip. */
+            for (;;) {
+                while (x < width && mask[x])
+                    x++;
+
+                for (gap = x; gap < width && !mask[gap]; gap++);
+
+                if (gap == width || gap - x > MASK_SPAN_MIN_GAP)
+                    break;
+
+                x = gap;
+            }
+
+            if (nspans == size) {
+                size *= 2;
+                imgs->mask_spans = myrealloc(imgs->mask_spans, size * sizeof(*imgs->mask_spans),
+                                             "alg_mask_spans");
+            }
+
+            imgs->mask_spans[nspans].x0 = x0;
+            imgs->mask_spans[nspans].x1 = x;
+            nspans++;
+        }
+    }
+
+    imgs->mask_span_row[y] = nspans;
+
+    MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Motion detection skips the masked out %d%% of the image",
+               100 - (int)(100LL * mask_span_tiles(imgs) / imgs->det_motionsize));
+}
+
+/**
+ * alg_row_spans
+ *      Points *spans at the spans of row y that the per pixel stages have to
+ *      visit and returns their number. That is the whole row without a span
+ *      index. With a negative noise level masked out pixels still have
+ *      motion, so the index is not used then either.
+ */
+int alg_row_spans(struct context *cnt, int y, struct mask_span **spans)
+{
+    struct images *imgs = &cnt->imgs;
+
+    if (!imgs->mask_spans || cnt->noise < 0) {
+        *spans = &imgs->mask_full_row;
+        return 1;
+    }
+
+    *spans = imgs->mask_spans + imgs->mask_span_row[y];
+
+    return imgs->mask_span_row[y + 1] - imgs->mask_span_row[y];
+}
+
+/**
+ * noise_sum_range
+ *      Adds the masked differences of 'i' pixels to *sum and *count.
+ *      mask may be NULL.
+ */
+static void noise_sum_range(unsigned char *ref, unsigned char *new, unsigned char *mask,
+                            unsigned char *smartmask, int i, int *sum, int *count)
+{
+    int diff;
 
-    i = imgs->motionsize;
-            
     for (; i > 0; i--) {
         diff = ABS(*ref - *new);
 
@@ -374,14 +613,70 @@ void alg_noise_tune(struct context *cnt, unsigned char *new)
             diff = ((diff * *mask++) / 255);
 
         if (*smartmask) {
-            sum += diff + 1;
-            count++;
+            *sum += diff + 1;
+            (*count)++;
         }
 
         ref++;
         new++;
         smartmask++;
     }
+}
+
+/**
+ * noise_sum_row
+ *      noise_sum_range over row y, visiting only the mask spans. Outside the
+ *      spans the mask is 0, so every pixel there with the smartmask set adds
+ *      1 to both sums whatever the image says.
+ */
+static void noise_sum_row(struct context *cnt, unsigned char *new, int y, int *sum, int *count)
+{
+    struct images *imgs = &cnt->imgs;
+    unsigned char *smartmask = imgs->smartmask_final + y * imgs->det_width;
+    struct mask_span *spans;
+    int n = alg_row_spans(cnt, y, &spans);
+    int i, x = 0, pos = y * imgs->det_width, gaps = 0;
+
+    for (i = 0; i <= n; i++) {
+        int end = i < n ? spans[i].x0 : imgs->det_width;
+
+        /* smartmask_final is all 255 while the smartmask is off. */
+        if (!cnt->smartmask_speed) {
+            gaps += end - x;
+        } else {
+            for (; x < end; x++)
+                gaps += smartmask[x] != 0;
+        }
+
+        if (i < n) {
+            x = spans[i].x0;
+            noise_sum_range(imgs->ref + pos + x, new + pos + x, imgs->mask ? imgs->mask + pos + x : NULL,
+                            smartmask + x, spans[i].x1 - x, sum, count);
+            x = spans[i].x1;
+        }
+    }
+
+    *sum += gaps;
+    *count += gaps;
+}
+
+/**
+ * alg_noise_tune
+ *
+ */
+void alg_noise_tune(struct context *cnt, unsigned char *new)
+{
+    struct images *imgs = &cnt->imgs;
+    int y, sum = 0, count = 0;
+
+    /* alg_diff_fused may already have collected the sums for this frame. */
+    if (imgs->fused.noise_valid) {
+        sum = imgs->fused.noise_sum;
+        count = imgs->fused.noise_count;
+    } else {
+        for (y = 0; y < imgs->det_height; y++)
+            noise_sum_row(cnt, new, y, &sum, &count);
+    }
 
     if (count > 3)  /* Avoid divide by zero. */
         sum /= count / 3;
@@ -431,163 +726,240 @@ void alg_threshold_tune(struct context *cnt, int diffs, int motion)
 
 /*
  * Labeling by Joerg Weber. Based on an idea from Hubert Mara.
- * Floodfill enhanced by Ian McConnel based on code from
- * http://www.acm.org/pubs/tog/GraphicsGems/
- * http://www.codeproject.com/gdi/QuickFill.asp
-
- * Filled horizontal segment of scanline y for xl <= x <= xr.
- * Parent segment was on line y - dy.  dy = 1 or -1
+ *
+ * The motion bitmap is labelled in two passes over its horizontal runs of
+ * motion pixels. The first pass collects the runs of every row and joins each
+ * run with the runs of the row above that it touches in a union-find forest.
+ * The second pass resolves every run to its component, sums the component
+ * statistics into imgs->label_stats and writes the label plane. Components
+ * are four connected.
  */
 
-#define MAXS 10000               /* max depth of stack */
+/**
+ * label_find
+ *      Returns the root run of the component of run i, halving the path.
+ */
+static int label_find(struct label_run *runs, int i)
+{
+    while (runs[i].parent != i) {
+        runs[i].parent = runs[runs[i].parent].parent;
+        i = runs[i].parent;
+    }
 
-#define PUSH(Y, XL, XR, DY)     /* push new segment on stack */  \
-        if (sp<stack+MAXS && Y+(DY) >= 0 && Y+(DY) < height)     \
-        {sp->y = Y; sp->xl = XL; sp->xr = XR; sp->dy = DY; sp++;}
+    return i;
+}
 
-#define POP(Y, XL, XR, DY)      /* pop segment off stack */      \
-        {sp--; Y = sp->y+(DY = sp->dy); XL = sp->xl; XR = sp->xr;}
+/**
+ * label_union
+ *      Joins the components of runs a and b. The root is always the run that
+ *      comes first, so components are numbered in scan order.
+ */
+static void label_union(struct label_run *runs, int a, int b)
+{
+    a = label_find(runs, a);
+    b = label_find(runs, b);
 
-typedef struct {
-    short y, xl, xr, dy;
-} Segment;
+    if (a < b)
+        runs[b].parent = a;
+    else if (b < a)
+        runs[a].parent = b;
+}
 
 /**
- * iflood
- *
- */ 
-static int iflood(int x, int y, int width, int height, 
-                  unsigned char *out, int *labels, int newvalue, int oldvalue)
+ * label_runs
+ *      First labeling pass. Collects the runs of the motion bitmap and joins
+ *      the runs that touch. Returns the number of runs.
+ */
+static int label_runs(struct images *imgs)
 {
-    int l, x1, x2, dy;
-    Segment stack[MAXS], *sp = stack;    /* Stack of filled segments. */
-    int count = 0;
+    struct label_run *runs = imgs->label_runs;
+    int width = imgs->det_width;
+    int height = imgs->det_height;
+    int nruns = 0, prev = 0, prev_end = 0;
+    int x, y, x0, x1, p, row;
+    uint64_t *bits;
 
-    if (x < 0 || x >= width || y < 0 || y >= height)
-        return 0;
+    for (y = 0; y < height; y++) {
+        bits = DET_BITS_ROW(imgs, y);
+        row = nruns;
+        x = 0;
 
-    PUSH(y, x, x, 1);             /* Needed in some cases. */
-    PUSH(y+1, x, x, -1);          /* Seed segment (popped 1st). */
+        for (;;) {
+            x0 = bits_next(bits, width, x, 1);
 
-    while (sp > stack) {
-        /* Pop segment off stack and fill a neighboring scan line. */
-        POP(y, x1, x2, dy);
-        /*
-         * Segment of scan line y-dy for x1<=x<=x2 was previously filled,
-         * now explore adjacent pixels in scan line y
-         */
-        for (x = x1; x >= 0 && out[y * width + x] != 0 && labels[y * width + x] == oldvalue; x--) {
-            labels[y * width + x] = newvalue;
-            count++;
+            if (x0 == width)
+                break;
+
+            x = bits_next(bits, width, x0, 0);
+            x1 = x - 1;
+
+            if (nruns == imgs->label_runs_size) {
+                imgs->label_runs_size *= 2;
+                imgs->label_runs = myrealloc(imgs->label_runs, imgs->label_runs_size *
+                                             sizeof(*imgs->label_runs), "label_runs");
+                runs = imgs->label_runs;
+            }
+
+            runs[nruns].y = y;
+            runs[nruns].x0 = x0;
+            runs[nruns].x1 = x1;
+            runs[nruns].parent = nruns;
+
+            /* 
+             * Skip the runs above that end left of this one. The last run
+             * touching this one may touch the next one as well, so prev
+             * does not move past it.
+             */
+            while (prev < prev_end && runs[prev].x1 < x0)
+                prev++;
+
+            for (p = prev; p < prev_end && runs[p].x0 <= x1; p++)
+                label_union(runs, p, nruns);
+
+            nruns++;
         }
-        
-        if (x >= x1)
-            goto skip;
-        
-        l = x + 1;
-        
-        if (l < x1)
-            PUSH(y, l, x1 - 1, -dy);  /* Leak on left? */
-        
-        x = x1 + 1;
-        
-        do {
-            for (; x < width && out[y * width + x] != 0 && labels[y * width + x] == oldvalue; x++) {
-                labels[y * width + x] = newvalue;
-                count++;
+
+        prev = row;
+        prev_end = nruns;
+    }
+
+    return nruns;
+}
+
+/**
+ * label_stats
+ *      Second labeling pass. Numbers the components, sums their statistics
+ *      and writes the label plane. Returns the number of components.
+ */
+static int label_stats(struct images *imgs, int nruns)
+{
+    struct label_run *runs = imgs->label_runs;
+    struct label_run *run;
+    struct label_stat *stat;
+    unsigned short *labels = imgs->labels;
+    int count = 0, pos = 0, i, start, len, label;
+
+    for (i = 0; i < nruns; i++) {
+        run = &runs[i];
+
+        if (label_find(runs, i) == i) {
+            if (++count == imgs->label_stats_size) {
+                imgs->label_stats_size *= 2;
+                imgs->label_stats = myrealloc(imgs->label_stats, imgs->label_stats_size *
+                                              sizeof(*imgs->label_stats), "label_stats");
             }
-            
-            PUSH(y, l, x - 1, dy);
-            
-            if (x > x2 + 1)
-                PUSH(y, x2 + 1, x - 1, -dy);  /* Leak on right? */
-            
-            skip:
-            
-            for (x++; x <= x2 && !(out[y * width + x] != 0 && labels[y * width + x] == oldvalue); x++);
-            
-            l = x;
-        } while (x <= x2);
+
+            run->label = count;
+            stat = &imgs->label_stats[count];
+            memset(stat, 0, sizeof(*stat));
+            stat->minx = run->x0;
+            stat->maxx = run->x1;
+            stat->miny = run->y;
+        } else {
+            /* The root came earlier and already has its number. */
+            run->label = runs[run->parent].label;
+            stat = &imgs->label_stats[run->label];
+
+            if (stat->minx > run->x0)
+                stat->minx = run->x0;
+
+            if (stat->maxx < run->x1)
+                stat->maxx = run->x1;
+        }
+
+        /* Runs are in scan order, so this is the lowest row so far. */
+        stat->maxy = run->y;
+
+        len = run->x1 - run->x0 + 1;
+        stat->area += len;
+        stat->sumx += (long long)len * (run->x0 + run->x1) / 2;
+        stat->sumy += (long long)len * run->y;
+
+        /* Components past LABEL_MAX are in the table but not in the plane. */
+        label = run->label <= LABEL_MAX ? run->label : 0;
+        start = run->y * imgs->det_width + run->x0;
+
+        memset(labels + pos, 0, (start - pos) * sizeof(*labels));
+
+        for (pos = start; pos < start + len; pos++)
+            labels[pos] = label;
     }
+
+    memset(labels + pos, 0, (imgs->det_motionsize - pos) * sizeof(*labels));
+
     return count;
 }
 
 /**
  * alg_labeling
- *
- */ 
+ *      Labels the connected areas of the motion image and marks the ones
+ *      larger than the threshold in the label table.
+ */
 static int alg_labeling(struct context *cnt)
 {
     struct images *imgs = &cnt->imgs;
-    unsigned char *out = imgs->out;
-    int *labels = imgs->labels;
-    int ix, iy, pixelpos;
-    int width = imgs->width;
-    int height = imgs->height;
-    int labelsize = 0;
-    int current_label = 2;
+    struct label_stat *stat;
+    int i;
+
+    imgs->label_count = label_stats(imgs, label_runs(imgs));
 
-    cnt->current_image->total_labels = 0;
+    cnt->current_image->total_labels = imgs->label_count;
     imgs->labelsize_max = 0;
+    imgs->largest_label = 0;
     /* ALL labels above threshold are counted as labelgroup. */
     imgs->labelgroup_max = 0;
     imgs->labels_above = 0;
 
-    /* Init: 0 means no label set / not checked. */
-    memset(labels, 0, width * height * sizeof(labels));
-    pixelpos = 0;
+    for (i = 1; i <= imgs->label_count; i++) {
+        stat = &imgs->label_stats[i];
+        stat->above = det_pixels(imgs, stat->area) > cnt->threshold;
 
-    for (iy = 0; iy < height - 1; iy++) {
-        for (ix = 0; ix < width - 1; ix++, pixelpos++) {
-            /* No motion - no label */
-            if (out[pixelpos] == 0) {
-                labels[pixelpos] = 1;
-                continue;
-            }
-            
-            /* Already visited by iflood */
-            if (labels[pixelpos] > 0)
-                continue;
+        if (stat->above) {
+            imgs->labelgroup_max += stat->area;
+            imgs->labels_above++;
+        }
 
-            labelsize = iflood(ix, iy, width, height, out, labels, current_label, 0);
-            
-            if (labelsize > 0) {
-                MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: Label: %i (%i) Size: %i (%i,%i)", 
-                            current_label, cnt->current_image->total_labels, 
-                           labelsize, ix, iy);
-
-                /* Label above threshold? Mark it again (add 32768 to labelnumber). */
-                if (labelsize > cnt->threshold) {
-                    labelsize = iflood(ix, iy, width, height, out, labels, current_label + 32768, current_label);
-                    imgs->labelgroup_max += labelsize;
-                    imgs->labels_above++;
-                }
-                
-                if (imgs->labelsize_max < labelsize) {
-                    imgs->labelsize_max = labelsize;
-                    imgs->largest_label = current_label;
-                }
-                
-                cnt->current_image->total_labels++;
-                current_label++;
-            }
+        if (imgs->labelsize_max < stat->area) {
+            imgs->labelsize_max = stat->area;
+            imgs->largest_label = i;
         }
-        pixelpos++; /* Compensate for ix < width - 1 */
     }
 
     MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: %i Labels found. Largest connected Area: %i Pixel(s). "
-               "Largest Label: %i", imgs->largest_label, imgs->labelsize_max, 
-               cnt->current_image->total_labels);
+               "Largest Label: %i", cnt->current_image->total_labels, imgs->labelsize_max,
+               imgs->largest_label);
     
-    /* Return group of significant labels. */
+    /* Return group of significant labels, in pixels of the detection image. */
     return imgs->labelgroup_max;
 }
 
+/**
+ * morph_simd
+ *      Runs the SIMD kernel for filter over as many columns of a row as it can,
+ *      starting at column 1. Adds the set pixels to sum and returns the first
+ *      column left for the scalar code.
+ */
+static int morph_simd(void *row1, void *row2, void *row3, unsigned char *dst, int width,
+                      char filter, int *sum)
+{
+    int count = (width - 2) - (width - 2) % 16;
+
+    if (!alg_simd.morph || count <= 0)
+        return 1;
+
+    *sum += alg_simd.morph((unsigned char *)row1 + 1, (unsigned char *)row2 + 1,
+                           (unsigned char *)row3 + 1, dst + 1, count, filter);
+
+    return count + 1;
+}
+
 /** 
  * dilate9 
- *      Dilates a 3x3 box. 
+ *      Dilates a 3x3 box. above and below are the image rows next to img, or
+ *      NULL at the edges of the image.
  */
-static int dilate9(unsigned char *img, int width, int height, void *buffer)
+static int dilate9(unsigned char *img, int width, int height, void *buffer,
+                   unsigned char *above, unsigned char *below)
 {
     /* 
      * - row1, row2 and row3 represent lines in the temporary buffer. 
@@ -597,7 +969,7 @@ static int dilate9(unsigned char *img, int width, int height, void *buffer)
      *   doing modulo 3 on i).
      * - blob keeps the current max value.
      */
-    int y, i, sum = 0, widx;
+    int y, i, sum = 0, widx, start;
     unsigned char *row1, *row2, *row3, *rowTemp,*yp;
     unsigned char window[3], blob, latest;
 
@@ -607,7 +979,11 @@ static int dilate9(unsigned char *img, int width, int height, void *buffer)
     row3 = row2 + width;
 
     /* Init rows 2 and 3. */
-    memset(row2, 0, width);
+    if (above)
+        memcpy(row2, above, width);
+    else
+        memset(row2, 0, width);
+
     memcpy(row3, img, width);
 
     /* Pointer to the current row in img. */
@@ -620,15 +996,23 @@ static int dilate9(unsigned char *img, int width, int height, void *buffer)
         row2 = row3;
         row3 = rowTemp;
 
-        /* If we're at the last row, fill with zeros, otherwise copy from img. */
-        if (y == height - 1)
+        /* 
+         * If we're at the last row, use the row below or fill with zeros,
+         * otherwise copy from img.
+         */
+        if (y == height - 1 && below)
+            memcpy(row3, below, width);
+        else if (y == height - 1)
             memset(row3, 0, width);
         else
             memcpy(row3, yp+width, width);
         
+        /* The SIMD kernel does what it can, the window takes over from start. */
+        start = morph_simd(row1, row2, row3, yp, width, 'D', &sum);
+
         /* Init slots 0 and 1 in the moving window. */
-        window[0] = MAX3(row1[0], row2[0], row3[0]);
-        window[1] = MAX3(row1[1], row2[1], row3[1]);
+        window[0] = MAX3(row1[start - 1], row2[start - 1], row3[start - 1]);
+        window[1] = MAX3(row1[start], row2[start], row3[start]);
 
         /* Init blob to the current max, and set window index. */
         blob = MAX2(window[0], window[1]);
@@ -638,7 +1022,7 @@ static int dilate9(unsigned char *img, int width, int height, void *buffer)
          * Iterate over the current row; index i is off by one to eliminate
          * a lot of +1es in the loop.
          */
-        for (i = 2; i <= width - 1; i++) {
+        for (i = start + 1; i <= width - 1; i++) {
             /* Get the max value of the next column in the 3x3 matrix. */
             latest = window[widx] = MAX3(row1[i], row2[i], row3[i]);
 
@@ -672,15 +1056,16 @@ static int dilate9(unsigned char *img, int width, int height, void *buffer)
 
 /** 
  * dilate5 
- *      Dilates a + shape. 
+ *      Dilates a + shape. above and below as for dilate9.
  */
-static int dilate5(unsigned char *img, int width, int height, void *buffer)
+static int dilate5(unsigned char *img, int width, int height, void *buffer,
+                   unsigned char *above, unsigned char *below)
 {
     /* 
      * - row1, row2 and row3 represent lines in the temporary buffer. 
      * - mem holds the max value of the overlapping part of two + shapes.
      */
-    int y, i, sum = 0;
+    int y, i, sum = 0, start;
     unsigned char *row1, *row2, *row3, *rowTemp, *yp;
     unsigned char blob, mem, latest;
     
@@ -690,7 +1075,11 @@ static int dilate5(unsigned char *img, int width, int height, void *buffer)
     row3 = row2 + width;
     
     /* Init rows 2 and 3. */
-    memset(row2, 0, width);
+    if (above)
+        memcpy(row2, above, width);
+    else
+        memset(row2, 0, width);
+
     memcpy(row3, img, width);
     
     /* Pointer to the current row in img. */
@@ -703,17 +1092,25 @@ static int dilate5(unsigned char *img, int width, int height, void *buffer)
         row2 = row3;
         row3 = rowTemp;
         
-        /* If we're at the last row, fill with zeros, otherwise copy from img. */
-        if (y == height - 1)
+        /* 
+         * If we're at the last row, use the row below or fill with zeros,
+         * otherwise copy from img.
+         */
+        if (y == height - 1 && below)
+            memcpy(row3, below, width);
+        else if (y == height - 1)
             memset(row3, 0, width);
         else
             memcpy(row3, yp + width, width);
 
+        /* The SIMD kernel does what it can, the scalar code takes over from start. */
+        start = morph_simd(row1, row2, row3, yp, width, 'd', &sum);
+
         /* Init mem and set blob to force an evaluation of the entire + shape. */
-        mem = MAX2(row2[0], row2[1]);
+        mem = MAX2(row2[start - 1], row2[start]);
         blob = 1; /* dummy value, must be > 0 */
         
-        for (i = 1; i < width - 1; i++) {
+        for (i = start; i < width - 1; i++) {
             /* Get the max value of the "right edge" of the + shape. */
             latest = MAX3(row1[i], row2[i + 1], row3[i]);
             
@@ -743,29 +1140,38 @@ static int dilate5(unsigned char *img, int width, int height, void *buffer)
 
 /** 
  * erode9 
- *      Erodes a 3x3 box. 
+ *      Erodes a 3x3 box. above and below as for dilate9.
  */
-static int erode9(unsigned char *img, int width, int height, void *buffer, unsigned char flag)
+static int erode9(unsigned char *img, int width, int height, void *buffer, unsigned char flag,
+                  unsigned char *above, unsigned char *below)
 {
-    int y, i, sum = 0;
+    int y, i, sum = 0, start;
     char *Row1,*Row2,*Row3;
 
     Row1 = buffer;
     Row2 = Row1 + width;
     Row3 = Row1 + 2 * width;
-    memset(Row2, flag, width);
+    if (above)
+        memcpy(Row2, above, width);
+    else
+        memset(Row2, flag, width);
+
     memcpy(Row3, img, width);
 
     for (y = 0; y < height; y++) {
         memcpy(Row1, Row2, width);
         memcpy(Row2, Row3, width);
 
-        if (y == height-1)
+        if (y == height - 1 && below)
+            memcpy(Row3, below, width);
+        else if (y == height - 1)
             memset(Row3, flag, width);
         else
             memcpy(Row3, img + (y+1) * width, width);
 
-        for (i = width - 2; i >= 1; i--) {
+        start = morph_simd(Row1, Row2, Row3, img + y * width, width, 'E', &sum);
+
+        for (i = width - 2; i >= start; i--) {
             if (Row1[i - 1] == 0 ||
                 Row1[i]     == 0 ||
                 Row1[i + 1] == 0 ||
@@ -787,29 +1193,38 @@ static int erode9(unsigned char *img, int width, int height, void *buffer, unsig
 
 /**
  * erode5 
- *      Erodes in a + shape. 
+ *      Erodes in a + shape. above and below as for dilate9.
  */
-static int erode5(unsigned char *img, int width, int height, void *buffer, unsigned char flag)
+static int erode5(unsigned char *img, int width, int height, void *buffer, unsigned char flag,
+                  unsigned char *above, unsigned char *below)
 {
-    int y, i, sum = 0;
+    int y, i, sum = 0, start;
     char *Row1,*Row2,*Row3;
 
     Row1 = buffer;
     Row2 = Row1 + width;
     Row3 = Row1 + 2 * width;
-    memset(Row2, flag, width);
+    if (above)
+        memcpy(Row2, above, width);
+    else
+        memset(Row2, flag, width);
+
     memcpy(Row3, img, width);
 
     for (y = 0; y < height; y++) {
         memcpy(Row1, Row2, width);
         memcpy(Row2, Row3, width);
     
-        if (y == height-1)
+        if (y == height - 1 && below)
+            memcpy(Row3, below, width);
+        else if (y == height - 1)
             memset(Row3, flag, width);
         else
             memcpy(Row3, img + (y + 1) * width, width);
 
-        for (i = width - 2; i >= 1; i--) {
+        start = morph_simd(Row1, Row2, Row3, img + y * width, width, 'e', &sum);
+
+        for (i = width - 2; i >= start; i--) {
             if (Row1[i]     == 0 ||
                 Row2[i - 1] == 0 ||
                 Row2[i]     == 0 ||
@@ -825,37 +1240,190 @@ static int erode5(unsigned char *img, int width, int height, void *buffer, unsig
     return sum;
 }
 
-/** 
- * alg_despeckle 
- *      Despeckling routine to remove noisy detections.
+/* Arguments of morph_band. */
+struct morph_job {
+    unsigned char *img;
+    char filter;            /* E, e, D or d as in despeckle_filter */
+    unsigned char flag;     /* Value assumed outside the image when eroding */
+};
+
+/**
+ * morph_band
+ *      Band job running one erode or dilate step over the rows of a band. Each
+ *      band has its own three rows of scratch space in common_buffer.
  */
-int alg_despeckle(struct context *cnt, int olddiffs)
+static int morph_band(struct context *cnt, int band, int y0, int y1, void *arg)
 {
-    int diffs = 0;
-    unsigned char *out = cnt->imgs.out;
-    int width = cnt->imgs.width;
-    int height = cnt->imgs.height;
+    struct morph_job *job = arg;
+    int width = cnt->imgs.det_width;
+    unsigned char *img = job->img + y0 * width;
+    unsigned char *buffer = cnt->imgs.common_buffer + 3 * band * width;
+    unsigned char *above, *below;
+
+    alg_workers_halo(cnt, band, &above, &below);
+
+    switch (job->filter) {
+    case 'E':
+        return erode9(img, width, y1 - y0, buffer, job->flag, above, below);
+    case 'e':
+        return erode5(img, width, y1 - y0, buffer, job->flag, above, below);
+    case 'D':
+        return dilate9(img, width, y1 - y0, buffer, above, below);
+    case 'd':
+        return dilate5(img, width, y1 - y0, buffer, above, below);
+    }
+
+    return 0;
+}
+
+/**
+ * alg_morph
+ *      Runs one erode or dilate step over the whole image, in bands when the
+ *      camera has detection threads. Returns the number of set pixels.
+ */
+static int alg_morph(struct context *cnt, unsigned char *img, char filter, unsigned char flag)
+{
+    struct morph_job job;
+
+    job.img = img;
+    job.filter = filter;
+    job.flag = flag;
+
+    alg_workers_save_halos(cnt, img);
+
+    return alg_workers_run(cnt, morph_band, &job);
+}
+
+/* Row word j shifted so that every bit holds its left or right neighbour. */
+#define BITS_LEFT(row, j, words) \
+        (((row)[j] << 1) | ((j) > 0 ? (row)[(j) - 1] >> 63 : 0))
+#define BITS_RIGHT(row, j, words) \
+        (((row)[j] >> 1) | ((j) < (words) - 1 ? (row)[(j) + 1] << 63 : 0))
+
+/**
+ * bits_morph
+ *      Runs one erode or dilate step over the motion bitmap, 64 pixels at a
+ *      time. Gives the same pixels as erode9, erode5, dilate9 and dilate5 with
+ *      a flag of 0: outside the image counts as no motion and the first and
+ *      last columns are cleared. Returns the number of set pixels.
+ */
+static int bits_morph(struct images *imgs, char filter)
+{
+    int words = imgs->det_bits_words;
+    int width = imgs->det_width;
+    int height = imgs->det_height;
+    uint64_t *src = imgs->det_bits;
+    uint64_t *dst = imgs->det_bits_tmp;
+    uint64_t *above, *row, *below, *res;
+    uint64_t up, mid, down, keep;
+    int y, j, sum = 0;
+
+    for (y = 0; y < height; y++) {
+        row = src + y * words;
+        above = y > 0 ? row - words : NULL;
+        below = y < height - 1 ? row + words : NULL;
+        res = dst + y * words;
+
+        for (j = 0; j < words; j++) {
+            mid = row[j];
+
+            switch (filter) {
+            case 'E':
+                up = above ? above[j] & BITS_LEFT(above, j, words) & BITS_RIGHT(above, j, words) : 0;
+                down = below ? below[j] & BITS_LEFT(below, j, words) & BITS_RIGHT(below, j, words) : 0;
+                res[j] = up & down & mid & BITS_LEFT(row, j, words) & BITS_RIGHT(row, j, words);
+                break;
+            case 'e':
+                up = above ? above[j] : 0;
+                down = below ? below[j] : 0;
+                res[j] = up & down & mid & BITS_LEFT(row, j, words) & BITS_RIGHT(row, j, words);
+                break;
+            case 'D':
+                up = above ? above[j] | BITS_LEFT(above, j, words) | BITS_RIGHT(above, j, words) : 0;
+                down = below ? below[j] | BITS_LEFT(below, j, words) | BITS_RIGHT(below, j, words) : 0;
+                res[j] = up | down | mid | BITS_LEFT(row, j, words) | BITS_RIGHT(row, j, words);
+                break;
+            case 'd':
+                up = above ? above[j] : 0;
+                down = below ? below[j] : 0;
+                res[j] = up | down | mid | BITS_LEFT(row, j, words) | BITS_RIGHT(row, j, words);
+                break;
+            }
+        }
+
+        /* Clear the vertical sides and whatever spilled past the end of the row. */
+        keep = width % 64 ? ~(uint64_t)0 >> (64 - width % 64) : ~(uint64_t)0;
+        res[0] &= ~(uint64_t)1;
+        res[words - 1] &= keep & ~((uint64_t)1 << ((width - 1) % 64));
+
+        for (j = 0; j < words; j++)
+            sum += __builtin_popcountll(res[j]);
+    }
+
+    imgs->det_bits = dst;
+    imgs->det_bits_tmp = src;
+    imgs->det_bits_changed = 1;
+
+    return sum;
+}
+
+/**
+ * alg_despeckle_out
+ *      Brings det_out in line with the motion bitmap after alg_despeckle has
+ *      changed it. Eroded pixels are cleared and dilated pixels get the value
+ *      of the new image, as the diff would have written. Only needed when the
+ *      motion image itself is shown or saved.
+ */
+void alg_despeckle_out(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    unsigned char *out = imgs->det_out;
+    unsigned char *new = imgs->det_image;
+    uint64_t *bits;
+    int x, y;
+
+    if (!imgs->det_bits_changed)
+        return;
+
+    for (y = 0; y < imgs->det_height; y++) {
+        bits = DET_BITS_ROW(imgs, y);
+
+        for (x = 0; x < imgs->det_width; x++, out++, new++) {
+            if (!((bits[x / 64] >> (x % 64)) & 1))
+                *out = 0;
+            else if (!*out)
+                *out = *new ? *new : 1;
+        }
+    }
+
+    imgs->det_bits_changed = 0;
+}
+
+/** 
+ * alg_despeckle 
+ *      Despeckling routine to remove noisy detections. Erode and dilate work
+ *      on the motion bitmap, see alg_despeckle_out for det_out.
+ */
+int alg_despeckle(struct context *cnt, int olddiffs)
+{
+    int diffs = 0;
     int done = 0, i, len = strlen(cnt->conf.despeckle_filter);
-    unsigned char *common_buffer = cnt->imgs.common_buffer;
+
+    /* Erode and dilate change the motion pixels, which the reference frame update depends on. */
+    if (strpbrk(cnt->conf.despeckle_filter, "EeDd"))
+        cnt->imgs.fused.ref_valid = 0;
 
     for (i = 0; i < len; i++) {
         switch (cnt->conf.despeckle_filter[i]) {
         case 'E':
-            if ((diffs = erode9(out, width, height, common_buffer, 0)) == 0) 
-                i = len;
-            done = 1;
-            break;
         case 'e':
-            if ((diffs = erode5(out, width, height, common_buffer, 0)) == 0) 
+            if ((diffs = bits_morph(&cnt->imgs, cnt->conf.despeckle_filter[i])) == 0) 
                 i = len;
             done = 1;
             break;
         case 'D':
-            diffs = dilate9(out, width, height, common_buffer);
-            done = 1;
-            break;
         case 'd':
-            diffs = dilate5(out, width, height, common_buffer);
+            diffs = bits_morph(&cnt->imgs, cnt->conf.despeckle_filter[i]);
             done = 1;
             break;
         /* No further despeckle after labeling! */
@@ -871,7 +1439,7 @@ int alg_despeckle(struct context *cnt, int olddiffs)
     if (done) {
         if (done != 2) 
             cnt->imgs.labelsize_max = 0; // Disable Labeling
-        return diffs;
+        return det_pixels(&cnt->imgs, diffs);
     } else {
         cnt->imgs.labelsize_max = 0; // Disable Labeling
     }    
@@ -879,32 +1447,51 @@ int alg_despeckle(struct context *cnt, int olddiffs)
     return olddiffs;
 }
 
-/** 
- * alg_tune_smartmask 
- *      Generates actual smartmask. Calculate sensitivity based on motion.
+/* Arguments of smartmask_band. */
+struct smartmask_job {
+    int sensitivity;
+    unsigned int magic;     /* ALG_RECIPROCAL of sensitivity, 0 when too large */
+};
+
+/**
+ * smartmask_band
+ *      Band job for alg_tune_smartmask.
  */
-void alg_tune_smartmask(struct context *cnt)
+static int smartmask_band(struct context *cnt, int band ATTRIBUTE_UNUSED, int y0, int y1, void *arg)
 {
-    int i, diff;
-    int motionsize = cnt->imgs.motionsize;
+    struct smartmask_job *job = arg;
+    int i = y0 * cnt->imgs.det_width;
+    int end = y1 * cnt->imgs.det_width;
     unsigned char *smartmask = cnt->imgs.smartmask;
     unsigned char *smartmask_final = cnt->imgs.smartmask_final;
-    int *smartmask_buffer = cnt->imgs.smartmask_buffer;
-    int sensitivity = cnt->lastrate * (11 - cnt->smartmask_speed);
+    unsigned short *smartmask_buffer = cnt->imgs.smartmask_buffer;
+    int sensitivity = job->sensitivity;
+    unsigned int diff;
+
+    if (alg_simd.smartmask && job->magic) {
+        int count = (end - i) - (end - i) % 16;
 
-    for (i = 0; i < motionsize; i++) {
+        alg_simd.smartmask(smartmask + i, smartmask_final + i, smartmask_buffer + i, count,
+                           sensitivity, job->magic);
+        i += count;
+    }
+
+    for (; i < end; i++) {
         /* Decrease smart_mask sensitivity every 5*speed seconds only. */
         if (smartmask[i] > 0)
             smartmask[i]--;
         /* Increase smart_mask sensitivity based on the buffered values. */
-        diff = smartmask_buffer[i]/sensitivity;
+        if (job->magic)
+            diff = ((uint64_t)smartmask_buffer[i] * job->magic) >> 31;
+        else
+            diff = smartmask_buffer[i] / sensitivity;
 
         if (diff) {
             if (smartmask[i] <= diff + 80)
                 smartmask[i] += diff;
             else
                 smartmask[i] = 80;
-            smartmask_buffer[i] %= sensitivity;
+            smartmask_buffer[i] -= diff * sensitivity;
         }
         /* Transfer raw mask to the final stage when above trigger value. */
         if (smartmask[i] > 20)
@@ -912,46 +1499,302 @@ void alg_tune_smartmask(struct context *cnt)
         else
             smartmask_final[i] = 255;
     }
+
+    return 0;
+}
+
+/** 
+ * alg_tune_smartmask 
+ *      Generates actual smartmask. Calculate sensitivity based on motion.
+ */
+void alg_tune_smartmask(struct context *cnt)
+{
+    struct smartmask_job job;
+
+    job.sensitivity = cnt->lastrate * (11 - cnt->smartmask_speed);
+    job.magic = 0;
+
+    /* Multiply by the reciprocal instead of dividing every pixel. */
+    if (job.sensitivity > 0 && job.sensitivity < ALG_RECIPROCAL_MAX)
+        job.magic = ALG_RECIPROCAL(job.sensitivity);
+
+    /* A new smartmask_final invalidates anything alg_diff_fused derived from the old one. */
+    cnt->imgs.fused.noise_valid = 0;
+    cnt->imgs.fused.ref_valid = 0;
+
+    alg_workers_run(cnt, smartmask_band, &job);
+
     /* Further expansion (here:erode due to inverted logic!) of the mask. */
-    diff = erode9(smartmask_final, cnt->imgs.width, cnt->imgs.height, 
-                  cnt->imgs.common_buffer, 255);
-    diff = erode5(smartmask_final, cnt->imgs.width, cnt->imgs.height, 
-                  cnt->imgs.common_buffer, 255);
+    alg_morph(cnt, cnt->imgs.smartmask_final, 'E', 255);
+    alg_morph(cnt, cnt->imgs.smartmask_final, 'e', 255);
 }
 
-/* Increment for *smartmask_buffer in alg_diff_standard. */
-#define SMARTMASK_SENSITIVITY_INCR 5
+/* Adds the increment to a smartmask_buffer counter, saturating at 65535. */
+#define SMARTMASK_ADD(c) \
+        ((c) = (c) > 65535 - SMARTMASK_SENSITIVITY_INCR ? 65535 : (c) + SMARTMASK_SENSITIVITY_INCR)
 
 /**
- * alg_diff_standard
- *
+ * diff_scalar
+ *      Portable diff of count pixels, the reference for the kernels of
+ *      alg_simd.c. variant is a constant in every caller, so each variant is
+ *      compiled without the tests for the steps it does not do.
  */
-int alg_diff_standard(struct context *cnt, unsigned char *new)
+static ALG_INLINE int diff_scalar(unsigned char *ref, unsigned char *new, unsigned char *out,
+                                  unsigned char *thresh, unsigned char *smartmask_final,
+                                  unsigned short *smartmask_buffer, int noise, int count,
+                                  const int variant)
 {
-    struct images *imgs = &cnt->imgs;
     int i, diffs = 0;
+
+    for (i = 0; i < count; i++) {
+        int curdiff = abs(ref[i] - new[i]);
+        int limit = (variant & ALG_DIFF_MASK) ? thresh[i] : noise;
+
+        if ((variant & ALG_DIFF_SMARTMASK) && curdiff > limit) {
+            /* 
+             * Increase smart_mask sensitivity every frame when motion
+             * is detected. (with speed=5, mask is increased by 1 every
+             * second. To be able to increase by 5 every second (with
+             * speed=10) we add 5 here. NOT related to the 5 at ratio-
+             * calculation. 
+             */
+            if (variant & ALG_DIFF_INCR)
+                SMARTMASK_ADD(smartmask_buffer[i]);
+
+            /* Apply smart_mask */
+            if (!smartmask_final[i])
+                curdiff = 0;
+        }
+
+        /* Pixel still in motion after all the masks? */
+        if (curdiff > limit) {
+            out[i] = new[i];
+            diffs++;
+        } else {
+            out[i] = 0;
+        }
+    }
+
+    return diffs;
+}
+
+/* Defines diff_scalar_<variant>, an alg_diff_kernel for one variant. */
+#define DIFF_SCALAR_VARIANT(variant) \
+    static int diff_scalar_##variant(unsigned char *ref, unsigned char *new, unsigned char *out, \
+                                     unsigned char *thresh, unsigned char *smartmask_final, \
+                                     unsigned short *smartmask_buffer, int noise, int count) \
+    { \
+        return diff_scalar(ref, new, out, thresh, smartmask_final, smartmask_buffer, \
+                           noise, count, variant); \
+    }
+
+DIFF_SCALAR_VARIANT(0) DIFF_SCALAR_VARIANT(1) DIFF_SCALAR_VARIANT(2) DIFF_SCALAR_VARIANT(3)
+DIFF_SCALAR_VARIANT(4) DIFF_SCALAR_VARIANT(5) DIFF_SCALAR_VARIANT(6) DIFF_SCALAR_VARIANT(7)
+
+static const alg_diff_kernel diff_scalar_variants[ALG_DIFF_VARIANTS] = {
+    diff_scalar_0, diff_scalar_1, diff_scalar_2, diff_scalar_3,
+    diff_scalar_4, diff_scalar_5, diff_scalar_6, diff_scalar_7,
+};
+
+/* ALG_RECIPROCAL of every mask value but 0, which limit_threshold_range does not divide by. */
+#define MASK_MAGIC(m)    ALG_RECIPROCAL((m) ? (m) : 1)
+#define MASK_MAGIC4(m)   MASK_MAGIC(m), MASK_MAGIC((m) + 1), MASK_MAGIC((m) + 2), MASK_MAGIC((m) + 3)
+#define MASK_MAGIC16(m)  MASK_MAGIC4(m), MASK_MAGIC4((m) + 4), MASK_MAGIC4((m) + 8), MASK_MAGIC4((m) + 12)
+#define MASK_MAGIC64(m)  MASK_MAGIC16(m), MASK_MAGIC16((m) + 16), MASK_MAGIC16((m) + 32), \
+                         MASK_MAGIC16((m) + 48)
+
+static const unsigned int mask_magic[256] = {
+    MASK_MAGIC64(0), MASK_MAGIC64(64), MASK_MAGIC64(128), MASK_MAGIC64(192)
+};
+
+/**
+ * limit_threshold_range
+ *      Fills mask_threshold from pixel i up to end with per pixel noise levels
+ *      from the background model: the noise level of a pixel is the higher of
+ *      imgs.bg_limit and cnt->noise. The mask values are divided by with
+ *      mask_magic, as a division per pixel would be too slow to do every frame.
+ */
+static void limit_threshold_range(struct context *cnt, int i, int end)
+{
+    struct images *imgs = &cnt->imgs;
+    int noise = cnt->noise > 255 ? 255 : cnt->noise;
+    int n, m, t;
+
+    for (; i < end; i++) {
+        n = MAX2(noise, imgs->bg_limit[i]);
+        m = imgs->mask ? imgs->mask[i] : 255;
+
+        if (m == 255) {
+            t = n;
+        } else if (m) {
+            t = ((255 * (n + 1) + m - 1) * (unsigned long long)mask_magic[m] >> 31) - 1;
+            t = t > 255 ? 255 : t;
+        } else {
+            t = 255;
+        }
+
+        imgs->mask_threshold[i] = t;
+    }
+}
+
+/**
+ * limit_threshold_band
+ *      Band job of mask_threshold with per pixel noise levels.
+ */
+static int limit_threshold_band(struct context *cnt, int band ATTRIBUTE_UNUSED, int y0, int y1,
+                                void *arg ATTRIBUTE_UNUSED)
+{
+    limit_threshold_range(cnt, y0 * cnt->imgs.det_width, y1 * cnt->imgs.det_width);
+
+    return 0;
+}
+
+/**
+ * alg_limit_threshold
+ *      Called by a background model that changed bg_limit for count pixels from
+ *      pos. Brings those pixels of mask_threshold up to date, so diff_select
+ *      does not have to redo the whole plane. When the plane is stale anyway
+ *      diff_select rebuilds it and nothing is done here.
+ */
+void alg_limit_threshold(struct context *cnt, int pos, int count)
+{
+    struct images *imgs = &cnt->imgs;
+
+    if (!imgs->mask_threshold || imgs->mask_threshold_noise != cnt->noise)
+        return;
+
+    limit_threshold_range(cnt, pos, pos + count);
+}
+
+/**
+ * mask_threshold
+ *      Fills imgs.mask_threshold for the current noise level. A pixel passes
+ *      the mask when diff * mask / 255 > noise, which for integers is the same
+ *      as diff > ceil(255 * (noise + 1) / mask) - 1. That limit is stored per
+ *      pixel, capped at 255 which no difference is above. Without a mask the
+ *      limit is just the noise level of the pixel.
+ */
+static void mask_threshold(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    unsigned char limit[256];
+    int i, m;
+
+    if (imgs->bg_limit) {
+        alg_workers_run(cnt, limit_threshold_band, NULL);
+    } else {
+        limit[0] = 255;
+
+        for (m = 1; m < 256; m++) {
+            int t = (255 * (cnt->noise + 1) + m - 1) / m - 1;
+
+            limit[m] = t > 255 ? 255 : t;
+        }
+
+        for (i = 0; i < imgs->det_motionsize; i++)
+            imgs->mask_threshold[i] = limit[imgs->mask[i]];
+    }
+
+    imgs->mask_threshold_noise = cnt->noise;
+    imgs->bg_limit_changed = 0;
+}
+
+/**
+ * diff_select
+ *      Picks the diff variant for this frame into imgs.diff_variant and
+ *      brings the mask threshold plane up to date with the noise level and
+ *      the noise levels of the background model. With a negative noise level
+ *      every difference passes the mask, so the mask is ignored then.
+ */
+static void diff_select(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    int variant = 0;
+
+    if ((imgs->mask || imgs->bg_limit) && cnt->noise >= 0) {
+        /* The plane is only needed when a mask or per pixel noise levels are in use. */
+        if (!imgs->mask_threshold) {
+            imgs->mask_threshold = mymalloc(imgs->det_motionsize);
+            mask_threshold(cnt);
+        } else if (imgs->mask_threshold_noise != cnt->noise || imgs->bg_limit_changed) {
+            mask_threshold(cnt);
+        }
+
+        variant |= ALG_DIFF_MASK;
+    }
+
+    if (cnt->smartmask_speed) {
+        variant |= ALG_DIFF_SMARTMASK;
+
+        if (cnt->event_nr != cnt->prev_event)
+            variant |= ALG_DIFF_INCR;
+    }
+
+    imgs->diff_variant = variant;
+}
+
+/**
+ * alg_diff_range
+ *      Diffs 'i' pixels of the Y plane of new starting at pixel pos with the
+ *      variant chosen by diff_select. This is the body of alg_diff_standard,
+ *      split out so alg_diff_tiles and alg_diff_fused can run it piecewise.
+ */
+static int alg_diff_range(struct context *cnt, unsigned char *new, int pos, int i)
+{
+    struct images *imgs = &cnt->imgs;
+    int variant = imgs->diff_variant;
+    unsigned char *ref = imgs->ref + pos;
+    unsigned char *out = imgs->det_out + pos;
+    unsigned char *thresh = (variant & ALG_DIFF_MASK) ? imgs->mask_threshold + pos : NULL;
+    unsigned char *smartmask_final = imgs->smartmask_final + pos;
+    unsigned short *smartmask_buffer = imgs->smartmask_buffer + pos;
+    int diffs = 0;
     int noise = cnt->noise;
-    int smartmask_speed = cnt->smartmask_speed;
-    unsigned char *ref = imgs->ref;
-    unsigned char *out = imgs->out;
-    unsigned char *mask = imgs->mask;
-    unsigned char *smartmask_final = imgs->smartmask_final;
-    int *smartmask_buffer = imgs->smartmask_buffer;
 #ifdef HAVE_MMX
+    unsigned char *mask = imgs->mask ? imgs->mask + pos : NULL;
+    int smartmask_speed = cnt->smartmask_speed;
+    int start;
     mmx_t mmtemp; /* Used for transferring to/from memory. */
     int unload;   /* Counter for unloading diff counts. */
+    /* The MMX code knows the mask but not the noise levels of the background model. */
+    int mmx = !(imgs->bg_limit && (variant & ALG_DIFF_MASK));
+#endif
+
+    new += pos;
+
+    /*
+     * Let the SSE2/AVX2 kernel chosen by alg_simd_init do as many pixels as
+     * it can. Negative noise levels are left to the scalar code.
+     */
+    if (alg_simd.diff[variant] && noise >= 0) {
+        int count = i - i % alg_simd.pixels;
+
+        diffs = alg_simd.diff[variant](ref, new, out, thresh, smartmask_final, smartmask_buffer,
+                                       noise > 255 ? 255 : noise, count);
+        i -= count;
+        ref += count;
+        new += count;
+        out += count;
+        smartmask_final += count;
+        smartmask_buffer += count;
+
+        if (thresh)
+            thresh += count;
+#ifdef HAVE_MMX
+        if (mask)
+            mask += count;
 #endif
+    }
 
-    i = imgs->motionsize;
-    memset(out + i, 128, i / 2); /* Motion pictures are now b/w i.o. green */
+#ifdef HAVE_MMX
     /* 
      * Keeping this memset in the MMX case when zeroes are necessarily 
      * written anyway seems to be beneficial in terms of speed. Perhaps a
      * cache thing?
      */
     memset(out, 0, i);
+    start = i;
 
-#ifdef HAVE_MMX
     /* 
      * NOTE: The Pentium has two instruction pipes: U and V. I have grouped MMX
      * instructions in pairs according to how I think they will be scheduled in 
@@ -991,7 +1834,7 @@ int alg_diff_standard(struct context *cnt, unsigned char *new)
      */
     unload = 255;
     
-    for (; i > 7; i -= 8) {
+    for (; mmx && i > 7; i -= 8) {
         /* Calculate abs(*ref-*new) for 8 pixels in parallel. */
         movq_m2r(*ref, mm0);           /* U: mm0 = r7 r6 r5 r4 r3 r2 r1 r0 */
         pxor_r2r(mm4, mm4);            /* V: mm4 = 0 */
@@ -1091,14 +1934,14 @@ int alg_diff_standard(struct context *cnt, unsigned char *new)
 
             /* Add to *smartmask_buffer. This is probably the fastest way to do it. */
             if (cnt->event_nr != cnt->prev_event) {
-                if (mmtemp.ub[0]) smartmask_buffer[0] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[1]) smartmask_buffer[1] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[2]) smartmask_buffer[2] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[3]) smartmask_buffer[3] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[4]) smartmask_buffer[4] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[5]) smartmask_buffer[5] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[6]) smartmask_buffer[6] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[7]) smartmask_buffer[7] += SMARTMASK_SENSITIVITY_INCR;
+                if (mmtemp.ub[0]) SMARTMASK_ADD(smartmask_buffer[0]);
+                if (mmtemp.ub[1]) SMARTMASK_ADD(smartmask_buffer[1]);
+                if (mmtemp.ub[2]) SMARTMASK_ADD(smartmask_buffer[2]);
+                if (mmtemp.ub[3]) SMARTMASK_ADD(smartmask_buffer[3]);
+                if (mmtemp.ub[4]) SMARTMASK_ADD(smartmask_buffer[4]);
+                if (mmtemp.ub[5]) SMARTMASK_ADD(smartmask_buffer[5]);
+                if (mmtemp.ub[6]) SMARTMASK_ADD(smartmask_buffer[6]);
+                if (mmtemp.ub[7]) SMARTMASK_ADD(smartmask_buffer[7]);
             }
 
             smartmask_buffer += 8;
@@ -1152,92 +1995,279 @@ int alg_diff_standard(struct context *cnt, unsigned char *new)
 
     emms();
 
+    if (thresh)
+        thresh += start - i;
 #endif
     /*
      * Note that the non-MMX code is present even if the MMX code is present.
      * This is necessary if the resolution is not a multiple of 8, in which
      * case the non-MMX code needs to take care of the remaining pixels.
      */
+    diffs += diff_scalar_variants[variant](ref, new, out, thresh, smartmask_final,
+                                           smartmask_buffer, noise, i);
 
-    for (; i > 0; i--) {
-        register unsigned char curdiff = (int)(abs(*ref - *new)); /* Using a temp variable is 12% faster. */
-        /* Apply fixed mask */
-        if (mask)
-            curdiff = ((int)(curdiff * *mask++) / 255);
-            
-        if (smartmask_speed) {
-            if (curdiff > noise) {
-                /* 
-                 * Increase smart_mask sensitivity every frame when motion
-                 * is detected. (with speed=5, mask is increased by 1 every
-                 * second. To be able to increase by 5 every second (with
-                 * speed=10) we add 5 here. NOT related to the 5 at ratio-
-                 * calculation. 
-                 */
-                if (cnt->event_nr != cnt->prev_event)
-                    (*smartmask_buffer) += SMARTMASK_SENSITIVITY_INCR;
-                /* Apply smart_mask */
-                if (!*smartmask_final)
-                    curdiff = 0;
-            }
-            smartmask_final++;
-            smartmask_buffer++;
+    return diffs;
+}
+
+/**
+ * diff_spans
+ *      Diffs pixels x0 up to x1 of row y of new, only where the row has mask
+ *      spans. out is cleared in between, where nothing can be in motion.
+ */
+static int diff_spans(struct context *cnt, unsigned char *new, int y, int x0, int x1)
+{
+    struct images *imgs = &cnt->imgs;
+    unsigned char *out = imgs->det_out + y * imgs->det_width;
+    struct mask_span *spans;
+    int n = alg_row_spans(cnt, y, &spans);
+    int i, x = x0, diffs = 0;
+
+    for (i = 0; i < n && x < x1; i++) {
+        int start = spans[i].x0 > x ? spans[i].x0 : x;
+        int end = spans[i].x1 < x1 ? spans[i].x1 : x1;
+
+        if (start >= end)
+            continue;
+
+        memset(out + x, 0, start - x);
+        diffs += alg_diff_range(cnt, new, y * imgs->det_width + start, end - start);
+        x = end;
+    }
+
+    memset(out + x, 0, x1 - x);
+
+    return diffs;
+}
+
+/**
+ * diff_band
+ *      Band job for alg_diff_standard. arg is the new image. Every row is
+ *      packed into the motion bitmap while it is still in the cache.
+ */
+static int diff_band(struct context *cnt, int band ATTRIBUTE_UNUSED, int y0, int y1, void *arg)
+{
+    struct images *imgs = &cnt->imgs;
+    int y, diffs = 0;
+
+    for (y = y0; y < y1; y++) {
+        diffs += diff_spans(cnt, arg, y, 0, imgs->det_width);
+        pack_row(imgs, y);
+    }
+
+    return diffs;
+}
+
+/**
+ * alg_diff_standard
+ *      Diffs the new image against the reference frame into det_out and the
+ *      motion bitmap det_bits.
+ */
+int alg_diff_standard(struct context *cnt, unsigned char *new)
+{
+    struct images *imgs = &cnt->imgs;
+    int i = imgs->det_motionsize;
+
+    memset(imgs->det_out + i, 128, i / 2); /* Motion pictures are now b/w i.o. green */
+    imgs->det_bits_changed = 0;
+    diff_select(cnt);
+
+    return det_pixels(imgs, alg_workers_run(cnt, diff_band, new));
+}
+
+/**
+ * tile_scalar
+ *      Portable statistics of the tile whose pixels x up to end of the 'rows'
+ *      lines at ref and new are visited.
+ */
+static void tile_scalar(unsigned char *ref, unsigned char *new, int width, int rows,
+                        int x, int end, int noise, struct tile_stat *tile)
+{
+    int line, i;
+
+    tile->changed = 0;
+
+    for (line = 0; line < rows; line++) {
+        for (i = x; i < end; i++) {
+            if (abs(ref[line * width + i] - new[line * width + i]) > noise)
+                tile->changed++;
         }
-        /* Pixel still in motion after all the masks? */
-        if (curdiff > noise) {
-            *out = *new;
-            diffs++;
+    }
+}
+
+/**
+ * tile_spans
+ *      Statistics of a tile that is partly masked out, from its pixels in the
+ *      mask spans only. y is the first image row of the tile.
+ */
+static void tile_spans(struct context *cnt, unsigned char *new, int y, int rows, int tx,
+                       struct tile_stat *tile)
+{
+    struct images *imgs = &cnt->imgs;
+    struct tile_stat part;
+    struct mask_span *spans;
+    int x = tx * ALG_TILE_SIZE;
+    int end = x + ALG_TILE_SIZE > imgs->det_width ? imgs->det_width : x + ALG_TILE_SIZE;
+    int line, n, i, pos;
+
+    tile->changed = 0;
+
+    for (line = y; line < y + rows; line++) {
+        pos = line * imgs->det_width;
+        n = alg_row_spans(cnt, line, &spans);
+
+        for (i = 0; i < n; i++) {
+            int x0 = spans[i].x0 > x ? spans[i].x0 : x;
+            int x1 = spans[i].x1 < end ? spans[i].x1 : end;
+
+            if (x0 < x1) {
+                tile_scalar(imgs->ref + pos, new + pos, imgs->det_width, 1, x0, x1, cnt->noise, &part);
+                tile->changed += part.changed;
+            }
         }
-        out++;
-        ref++;
-        new++;
     }
-    return diffs;
 }
 
 /**
- * alg_diff_fast 
- *      Very fast diff function, does not apply mask overlaying.
+ * alg_tile_map
+ *      Fills imgs.tiles with the number of pixels above the noise level of
+ *      every ALG_TILE_SIZE square tile. The
+ *      fixed mask and the smartmask are not applied: they can only remove
+ *      motion, so a tile without changed pixels here has no motion at all.
+ *      With a mask span index only the pixels in the spans are counted.
+ *
+ *      Returns the number of changed pixels in the whole image.
  */
-static char alg_diff_fast(struct context *cnt, int max_n_changes, unsigned char *new)
+static int alg_tile_map(struct context *cnt, unsigned char *new)
 {
     struct images *imgs = &cnt->imgs;
-    int i, diffs = 0, step = imgs->motionsize/10000;
-    int noise = cnt->noise;
+    struct tile_stat *tiles = imgs->tiles;
     unsigned char *ref = imgs->ref;
+    unsigned char *image = new;
+    unsigned char *coverage = NULL;
+    int width = imgs->det_width;
+    int noise = cnt->noise;
+    int x, y, end, rows, total = 0;
 
-    if (!step % 2)
-        step++;
-    /* We're checking only 1 of several pixels. */
-    max_n_changes /= step;
+    for (y = 0; y < imgs->det_height; y += ALG_TILE_SIZE) {
+        rows = imgs->det_height - y < ALG_TILE_SIZE ? imgs->det_height - y : ALG_TILE_SIZE;
 
-    i = imgs->motionsize;
+        if (imgs->mask_spans && noise >= 0)
+            coverage = imgs->mask_tiles + (y / ALG_TILE_SIZE) * imgs->tile_cols;
 
-    for (; i > 0; i -= step) {
-        register unsigned char curdiff = (int)(abs((char)(*ref - *new))); /* Using a temp variable is 12% faster. */
-        if (curdiff >  noise) {
-            diffs++;
-            if (diffs > max_n_changes)
-                return 1;
+        for (x = 0; x < width; ) {
+            if (coverage && coverage[x / ALG_TILE_SIZE] != MASK_TILE_FULL) {
+                if (coverage[x / ALG_TILE_SIZE] == MASK_TILE_NONE)
+                    tiles[x / ALG_TILE_SIZE].changed = 0;
+                else
+                    tile_spans(cnt, image, y, rows, x / ALG_TILE_SIZE, tiles + x / ALG_TILE_SIZE);
+
+                x += ALG_TILE_SIZE;
+                continue;
+            }
+
+            /* A run of tiles that the mask does not cut into. */
+            for (end = x; end < width && (!coverage || coverage[end / ALG_TILE_SIZE] == MASK_TILE_FULL);
+                 end += ALG_TILE_SIZE);
+
+            if (end > width)
+                end = width;
+
+            /* The last tile may only be 8 pixels wide; leave it to the scalar code. */
+            if (alg_simd.tile_row && noise >= 0) {
+                int count = (end - x) - (end - x) % ALG_TILE_SIZE;
+
+                if (count)
+                    alg_simd.tile_row(ref + x, new + x, count, width, rows, noise > 255 ? 255 : noise,
+                                      tiles + x / ALG_TILE_SIZE);
+
+                x += count;
+            }
+
+            for (; x < end; x += ALG_TILE_SIZE) {
+                tile_scalar(ref, new, width, rows, x, x + ALG_TILE_SIZE > width ? width : x + ALG_TILE_SIZE,
+                            noise, tiles + x / ALG_TILE_SIZE);
+            }
         }
-        ref += step;
-        new += step;
+
+        for (x = 0; x < imgs->tile_cols; x++)
+            total += tiles[x].changed;
+
+        tiles += imgs->tile_cols;
+        ref += rows * width;
+        new += rows * width;
     }
 
-    return 0;
+    return total;
+}
+
+/**
+ * alg_diff_tiles
+ *      alg_diff_standard restricted to the tiles where alg_tile_map found
+ *      changed pixels. Runs of active tiles are handed to alg_diff_range one
+ *      image row at a time, out is cleared everywhere else. A row of tiles
+ *      that is mostly active is diffed in full, which is cheaper than many
+ *      short runs. The result is the same as alg_diff_standard over the
+ *      whole image.
+ */
+static int alg_diff_tiles(struct context *cnt, unsigned char *new)
+{
+    struct images *imgs = &cnt->imgs;
+    int width = imgs->det_width;
+    int x, y, tx, start, active, pos, len, diffs = 0;
+
+    memset(imgs->det_out + imgs->det_motionsize, 128, imgs->det_motionsize / 2);
+    imgs->det_bits_changed = 0;
+    diff_select(cnt);
+
+    for (y = 0; y < imgs->det_height; y++) {
+        struct tile_stat *row_tiles = imgs->tiles + (y / ALG_TILE_SIZE) * imgs->tile_cols;
+
+        for (active = 0, tx = 0; tx < imgs->tile_cols; tx++)
+            active += row_tiles[tx].changed > 0;
+
+        if (active * 2 >= imgs->tile_cols) {
+            diffs += diff_spans(cnt, new, y, 0, width);
+            pack_row(imgs, y);
+            continue;
+        }
+
+        for (tx = 0; tx < imgs->tile_cols; ) {
+            active = row_tiles[tx].changed > 0;
+
+            for (start = tx; tx < imgs->tile_cols && (row_tiles[tx].changed > 0) == active; tx++);
+
+            x = start * ALG_TILE_SIZE;
+            pos = y * width + x;
+            len = (tx * ALG_TILE_SIZE > width ? width : tx * ALG_TILE_SIZE) - x;
+
+            if (active) {
+                diffs += diff_spans(cnt, new, y, x, x + len);
+            } else {
+                memset(imgs->det_out + pos, 0, len);
+            }
+        }
+
+        pack_row(imgs, y);
+    }
+
+    return diffs;
 }
 
 /** 
  * alg_diff 
- *      Uses diff_fast to quickly decide if there is anything worth
- *      sending to diff_standard.
+ *      Builds the tile change map to quickly decide if there is anything worth
+ *      a full diff, and if so diffs only the tiles that changed.
  */
 int alg_diff(struct context *cnt, unsigned char *new)
 {
     int diffs = 0;
     
-    if (alg_diff_fast(cnt, cnt->conf.max_changes / 2, new))
-        diffs = alg_diff_standard(cnt, new);
+    if (det_pixels(&cnt->imgs, alg_tile_map(cnt, new)) > cnt->conf.max_changes / 2) {
+        if (cnt->conf.fused_detection)
+            diffs = alg_diff_fused(cnt, new);
+        else
+            diffs = det_pixels(&cnt->imgs, alg_diff_tiles(cnt, new));
+    }
 
     return diffs;
 }
@@ -1270,27 +2300,27 @@ int alg_lightswitch(struct context *cnt, int diffs)
  */ 
 int alg_switchfilter(struct context *cnt, int diffs, unsigned char *newimg)
 {
-    int linediff = diffs / cnt->imgs.height;
-    unsigned char *out = cnt->imgs.out;
-    int y, x, line;
+    int linediff = diffs / det_pixels(&cnt->imgs, cnt->imgs.det_height);
+    uint64_t *bits;
+    int y, j, line;
     int lines = 0, vertlines = 0;
 
-    for (y = 0; y < cnt->imgs.height; y++) {
+    for (y = 0; y < cnt->imgs.det_height; y++) {
+        bits = DET_BITS_ROW(&cnt->imgs, y);
         line = 0;
-        for (x = 0; x < cnt->imgs.width; x++) {
-            if (*(out++)) 
-                line++;
-        }
 
-        if (line > cnt->imgs.width / 18) 
+        for (j = 0; j < cnt->imgs.det_bits_words; j++)
+            line += __builtin_popcountll(bits[j]);
+
+        if (line > cnt->imgs.det_width / 18) 
             vertlines++;
         
         if (line > linediff * 2) 
             lines++;
     }
 
-    if (vertlines > cnt->imgs.height / 10 && lines < vertlines / 3 &&
-        (vertlines > cnt->imgs.height / 4 || lines - vertlines > lines / 2)) {
+    if (vertlines > cnt->imgs.det_height / 10 && lines < vertlines / 3 &&
+        (vertlines > cnt->imgs.det_height / 4 || lines - vertlines > lines / 2)) {
         if (cnt->conf.text_changes) {
             char tmp[80];
             sprintf(tmp, "%d %d", lines, vertlines);
@@ -1301,12 +2331,164 @@ int alg_switchfilter(struct context *cnt, int diffs, unsigned char *newimg)
     return 0;
 }
 
+#define ACCEPT_STATIC_OBJECT_TIME 10  /* Seconds */
+#define EXCLUDE_LEVEL_PERCENT 20
+
+/**
+ * ref_accept_timer
+ *      Number of frames a static object is excluded from the reference frame.
+ */
+static int ref_accept_timer(struct context *cnt)
+{
+    int accept_timer = cnt->lastrate * ACCEPT_STATIC_OBJECT_TIME;
+
+    if (cnt->lastrate > 5)  /* Match rate limit */
+        accept_timer /= (cnt->lastrate / 3);
+
+    return accept_timer;
+}
+
+/**
+ * update_ref_range
+ *      Updates pixels x0 up to x1 of an image row of the reference frame. All
+ *      pointers are to the start of the row, bits is its motion bitmap row.
+ *      The new ref and ref_dyn values are written to ref_new and ref_dyn_new,
+ *      which may be the same buffers as ref and ref_dyn for an in-place update.
+ */
+static void update_ref_range(unsigned char *ref, unsigned char *ref_new, int *ref_dyn, int *ref_dyn_new,
+                             unsigned char *image_virgin, unsigned char *smartmask, uint64_t *bits,
+                             int x0, int x1, int threshold_ref, int accept_timer)
+{
+    int x;
+
+    for (x = x0; x < x1; x++) {
+        /* Exclude pixels from ref frame well below noise level. */
+        if (((int)(abs(ref[x] - image_virgin[x])) > threshold_ref) && (smartmask[x])) {
+            if (ref_dyn[x] == 0) { /* Always give new pixels a chance. */
+                ref_dyn_new[x] = 1;
+                ref_new[x] = ref[x];
+            } else if (ref_dyn[x] > accept_timer) { /* Include static Object after some time. */
+                ref_dyn_new[x] = 0;
+                ref_new[x] = image_virgin[x];
+            } else if ((bits[x / 64] >> (x % 64)) & 1) {
+                ref_dyn_new[x] = ref_dyn[x] + 1; /* Motionpixel? Keep excluding from ref frame. */
+                ref_new[x] = ref[x];
+            } else {
+                ref_dyn_new[x] = 0; /* Nothing special - release pixel. */
+                ref_new[x] = (ref[x] + image_virgin[x]) / 2;
+            }
+
+        } else {  /* No motion: copy to ref frame. */
+            ref_dyn_new[x] = 0; /* Reset pixel */
+            ref_new[x] = image_virgin[x];
+        }
+    } /* end for x */
+}
+
+/**
+ * update_ref_row
+ *      Updates row y of the reference frame into ref_new and ref_dyn_new,
+ *      only in the mask spans. Masked out pixels never have motion from the
+ *      diff, so their reference values are never looked at.
+ */
+static void update_ref_row(struct context *cnt, unsigned char *ref_new, int *ref_dyn_new, int y,
+                           int threshold_ref, int accept_timer)
+{
+    struct images *imgs = &cnt->imgs;
+    struct mask_span *spans;
+    int n = alg_row_spans(cnt, y, &spans);
+    int i, pos = y * imgs->det_width;
+
+    for (i = 0; i < n; i++) {
+        update_ref_range(imgs->ref + pos, ref_new + pos, imgs->ref_dyn + pos, ref_dyn_new + pos,
+                         imgs->det_image + pos, imgs->smartmask_final + pos, DET_BITS_ROW(imgs, y),
+                         spans[i].x0, spans[i].x1, threshold_ref, accept_timer);
+    }
+}
+
+/* Arguments of update_ref_band. */
+struct update_ref_job {
+    int threshold_ref;
+    int accept_timer;
+};
+
+/**
+ * update_ref_band
+ *      Band job for the in place UPDATE_REF_FRAME pass.
+ */
+static int update_ref_band(struct context *cnt, int band ATTRIBUTE_UNUSED, int y0, int y1, void *arg)
+{
+    struct images *imgs = &cnt->imgs;
+    struct update_ref_job *job = arg;
+    int y;
+
+    for (y = y0; y < y1; y++)
+        update_ref_row(cnt, imgs->ref, imgs->ref_dyn, y, job->threshold_ref, job->accept_timer);
+
+    return 0;
+}
+
+/**
+ * reference_update
+ *      UPDATE_REF_FRAME of the reference engine. Moving objects are excluded
+ *      from the reference frame for a certain amount of time to improve
+ *      detection.
+ */
+static void reference_update(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    int accept_timer = ref_accept_timer(cnt);
+    int threshold_ref = cnt->noise * EXCLUDE_LEVEL_PERCENT / 100;
+
+    /* 
+     * If alg_diff_fused already built the next reference frame with the
+     * same parameters, all that is left is to swap the buffers.
+     */
+    if (imgs->fused.ref_valid && imgs->fused.threshold_ref == threshold_ref &&
+        imgs->fused.accept_timer == accept_timer) {
+        unsigned char *ref = imgs->ref;
+        int *ref_dyn = imgs->ref_dyn;
+
+        imgs->ref = imgs->ref_next;
+        imgs->ref_next = ref;
+        imgs->ref_dyn = imgs->ref_dyn_next;
+        imgs->ref_dyn_next = ref_dyn;
+    } else {
+        struct update_ref_job job;
+
+        job.threshold_ref = threshold_ref;
+        job.accept_timer = accept_timer;
+        alg_workers_run(cnt, update_ref_band, &job);
+    }
+}
+
+/**
+ * reference_reset
+ *      RESET_REF_FRAME of the reference engine.
+ */
+static void reference_reset(struct context *cnt)
+{
+    /* Copy fresh image */
+    memcpy(cnt->imgs.ref, cnt->imgs.det_image, cnt->imgs.det_motionsize);
+    /* Reset static objects */
+    memset(cnt->imgs.ref_dyn, 0, cnt->imgs.det_motionsize * sizeof(*cnt->imgs.ref_dyn));
+}
+
+const struct alg_bg_model alg_bg_reference = {
+    name:   "reference",
+    start:  NULL,
+    stop:   NULL,
+    reset:  reference_reset,
+    update: reference_update,
+};
+
 /** 
  * alg_update_reference_frame
  *
- *   Called from 'motion_loop' to calculate the reference frame
- *   Moving objects are excluded from the reference frame for a certain
- *   amount of time to improve detection.
+ *   Called from 'motion_loop' to update the background model of the camera,
+ *   see alg_bg.c. The time the model takes is added up and logged every
+ *   ALG_BG_COST_FRAMES calls. With fused detection most of the work of the
+ *   reference engine is done in alg_diff_fused and not counted here.
  * 
  * Parameters:
  *
@@ -1314,55 +2496,254 @@ int alg_switchfilter(struct context *cnt, int diffs, unsigned char *newimg)
  *   action - UPDATE_REF_FRAME or RESET_REF_FRAME
  *
  */
-#define ACCEPT_STATIC_OBJECT_TIME 10  /* Seconds */
-#define EXCLUDE_LEVEL_PERCENT 20
 void alg_update_reference_frame(struct context *cnt, int action) 
 {
-    int accept_timer = cnt->lastrate * ACCEPT_STATIC_OBJECT_TIME;
-    int i, threshold_ref;
-    int *ref_dyn = cnt->imgs.ref_dyn;
-    unsigned char *image_virgin = cnt->imgs.image_virgin;
-    unsigned char *ref = cnt->imgs.ref;
-    unsigned char *smartmask = cnt->imgs.smartmask_final;
-    unsigned char *out = cnt->imgs.out;
+    struct images *imgs = &cnt->imgs;
+    const struct alg_bg_model *model = cnt->bg_model;
+    struct timeval tv1, tv2;
 
-    if (cnt->lastrate > 5)  /* Match rate limit */
-        accept_timer /= (cnt->lastrate / 3);
+    gettimeofday(&tv1, NULL);
 
-    if (action == UPDATE_REF_FRAME) { /* Black&white only for better performance. */
-        threshold_ref = cnt->noise * EXCLUDE_LEVEL_PERCENT / 100;
-
-        for (i = cnt->imgs.motionsize; i > 0; i--) {
-            /* Exclude pixels from ref frame well below noise level. */
-            if (((int)(abs(*ref - *image_virgin)) > threshold_ref) && (*smartmask)) {
-                if (*ref_dyn == 0) { /* Always give new pixels a chance. */
-                    *ref_dyn = 1;
-                } else if (*ref_dyn > accept_timer) { /* Include static Object after some time. */
-                    *ref_dyn = 0;
-                    *ref = *image_virgin;
-                } else if (*out) {
-                    (*ref_dyn)++; /* Motionpixel? Keep excluding from ref frame. */
-                } else {
-                    *ref_dyn = 0; /* Nothing special - release pixel. */
-                    *ref = (*ref + *image_virgin) / 2;
-                }
-
-            } else {  /* No motion: copy to ref frame. */
-                *ref_dyn = 0; /* Reset pixel */
-                *ref = *image_virgin;
-            }
+    if (action == UPDATE_REF_FRAME)
+        model->update(cnt);
+    else    /* action == RESET_REF_FRAME - also used to initialize the frame at startup. */
+        model->reset(cnt);
+
+    gettimeofday(&tv2, NULL);
+    cnt->bg_cost += (tv2.tv_sec - tv1.tv_sec) * 1000000LL + (tv2.tv_usec - tv1.tv_usec);
+
+    if (++cnt->bg_cost_frames == ALG_BG_COST_FRAMES) {
+        MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Background model %s takes %d us per frame",
+                   model->name, (int)(cnt->bg_cost / ALG_BG_COST_FRAMES));
+        cnt->bg_cost = 0;
+        cnt->bg_cost_frames = 0;
+    }
+
+    /* Whatever alg_diff_fused prepared belongs to this frame only. */
+    imgs->fused.noise_valid = 0;
+    imgs->fused.ref_valid = 0;
+}
+
+/* 
+ * Pixels per block in alg_diff_fused, small enough to stay in the L2 cache.
+ * Blocks are whole image rows, so wide images get bigger blocks.
+ */
+#define FUSED_BLOCK_SIZE 4096
+
+/**
+ * alg_diff_fused
+ *
+ *   Does the work of alg_diff_standard, the sums of alg_noise_tune and the
+ *   UPDATE_REF_FRAME pass of alg_update_reference_frame in one sweep over the
+ *   image, block by block, so each block is only fetched from memory once.
+ *   The update is only done here for the reference background model.
+ *
+ *   The noise sums and the next reference frame are stored in imgs.fused and
+ *   imgs.ref_next/ref_dyn_next. alg_noise_tune and alg_update_reference_frame
+ *   use them later in the frame when nothing they depend on has changed in
+ *   between; otherwise they do their own pass over the untouched ref frame, so
+ *   the results are always identical to the separate functions.
+ *
+ * Parameters:
+ *
+ *   cnt    - current thread's context struct
+ *   new    - the new image, i.e. imgs.det_image
+ *
+ * Returns: number of changed pixels, as alg_diff_standard
+ */
+int alg_diff_fused(struct context *cnt, unsigned char *new)
+{
+    struct images *imgs = &cnt->imgs;
+    int width = imgs->det_width;
+    int y, yb, rows, diffs = 0;
+    int noise_sum = 0, noise_count = 0;
+    int threshold_ref = cnt->noise * EXCLUDE_LEVEL_PERCENT / 100;
+    int accept_timer = ref_accept_timer(cnt);
+    /* Only the reference engine has its update fused in. */
+    int update_ref = cnt->bg_model == &alg_bg_reference;
+
+    /* The buffers are only needed when fused detection is in use. */
+    if (update_ref && !imgs->ref_next) {
+        imgs->ref_next = mymalloc(imgs->det_motionsize);
+        imgs->ref_dyn_next = mymalloc(imgs->det_motionsize * sizeof(*imgs->ref_dyn_next));
+    }
+
+    memset(imgs->det_out + imgs->det_motionsize, 128, imgs->det_motionsize / 2);
+    imgs->det_bits_changed = 0;
+    diff_select(cnt);
+
+    rows = FUSED_BLOCK_SIZE / width;
+
+    if (rows < 1)
+        rows = 1;
+
+    for (yb = 0; yb < imgs->det_height; yb += rows) {
+        if (rows > imgs->det_height - yb)
+            rows = imgs->det_height - yb;
+
+        for (y = yb; y < yb + rows; y++) {
+            diffs += diff_spans(cnt, new, y, 0, width);
+            noise_sum_row(cnt, new, y, &noise_sum, &noise_count);
+        }
+
+        for (y = yb; y < yb + rows; y++) {
+            pack_row(imgs, y);
+
+            if (update_ref)
+                update_ref_row(cnt, imgs->ref_next, imgs->ref_dyn_next, y, threshold_ref, accept_timer);
+        }
+    }
+
+    imgs->fused.noise_sum = noise_sum;
+    imgs->fused.noise_count = noise_count;
+    imgs->fused.threshold_ref = threshold_ref;
+    imgs->fused.accept_timer = accept_timer;
+    imgs->fused.noise_valid = 1;
+    imgs->fused.ref_valid = update_ref;
+
+    return det_pixels(imgs, diffs);
+}
+
+/**
+ * alg_det_init
+ *      Sets the detection image size from conf.detection_scale. The scale must
+ *      be 1, 2, 4 or 8 and is lowered until the detection image has even
+ *      dimensions, which the YUV420P motion image needs.
+ */
+void alg_det_init(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    int scale = cnt->conf.detection_scale;
+
+    if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: detection_scale %d is not 1, 2, 4 or 8, using 1",
+                   scale);
+        scale = 1;
+    }
+
+    while (scale > 1 && ((imgs->width / scale) % 2 || (imgs->height / scale) % 2))
+        scale /= 2;
+
+    if (scale != cnt->conf.detection_scale && cnt->conf.detection_scale > 1)
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Image size %dx%d does not allow detection_scale %d, "
+                   "using %d", imgs->width, imgs->height, cnt->conf.detection_scale, scale);
+
+    imgs->det_scale = scale;
+    imgs->det_width = imgs->width / scale;
+    imgs->det_height = imgs->height / scale;
+    imgs->det_motionsize = imgs->det_width * imgs->det_height;
+
+    /* Without a mask span index the stages visit every row in full. */
+    imgs->mask_full_row.x0 = 0;
+    imgs->mask_full_row.x1 = imgs->det_width;
+
+    if (scale > 1)
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Motion detection at %dx%d",
+                   imgs->det_width, imgs->det_height);
+}
+
+/**
+ * halve_plane
+ *      Averages 2x2 blocks of a width x height plane into dst.
+ */
+static void halve_plane(unsigned char *src, int width, int height, unsigned char *dst)
+{
+    int x, y, count;
+    int dwidth = width / 2;
 
-            ref++;
-            image_virgin++;
-            smartmask++;
-            ref_dyn++;
-            out++;
-        } /* end for i */
-
-    } else {   /* action == RESET_REF_FRAME - also used to initialize the frame at startup. */
-        /* Copy fresh image */
-        memcpy(cnt->imgs.ref, cnt->imgs.image_virgin, cnt->imgs.size);
-        /* Reset static objects */
-        memset(cnt->imgs.ref_dyn, 0, cnt->imgs.motionsize * sizeof(cnt->imgs.ref_dyn)); 
+    for (y = 0; y < height / 2; y++) {
+        x = 0;
+
+        if (alg_simd.halve) {
+            count = dwidth - dwidth % 16;
+            alg_simd.halve(src, width, dst, count);
+            x = count;
+        }
+
+        for (; x < dwidth; x++)
+            dst[x] = (src[2 * x] + src[2 * x + 1] + src[width + 2 * x] + src[width + 2 * x + 1] + 2) / 4;
+
+        src += 2 * width;
+        dst += dwidth;
     }
 }
+
+/**
+ * alg_det_downscale
+ *      Scales the full size plane src down to the detection size in dst with
+ *      a pyramid of 2x2 box filters. The intermediate levels use common_buffer.
+ */
+void alg_det_downscale(struct context *cnt, unsigned char *src, unsigned char *dst)
+{
+    struct images *imgs = &cnt->imgs;
+    unsigned char *level[2];
+    int width = imgs->width;
+    int height = imgs->height;
+    int scale, i = 0;
+
+    if (imgs->det_scale == 1) {
+        if (src != dst)
+            memcpy(dst, src, imgs->motionsize);
+        return;
+    }
+
+    level[0] = imgs->common_buffer;
+    level[1] = imgs->common_buffer + imgs->motionsize / 4;
+
+    for (scale = imgs->det_scale; scale > 2; scale /= 2) {
+        halve_plane(src, width, height, level[i]);
+        src = level[i];
+        width /= 2;
+        height /= 2;
+        i ^= 1;
+    }
+
+    halve_plane(src, width, height, dst);
+}
+
+/**
+ * upscale_plane
+ *      Nearest neighbour upscale of a width x height plane by scale into dst.
+ */
+static void upscale_plane(unsigned char *src, int width, int height, int scale, unsigned char *dst)
+{
+    int x, y, i;
+    int dwidth = width * scale;
+
+    for (y = 0; y < height; y++) {
+        unsigned char *row = dst;
+
+        for (x = 0; x < width; x++) {
+            for (i = 0; i < scale; i++)
+                *dst++ = src[x];
+        }
+
+        for (i = 1; i < scale; i++) {
+            memcpy(dst, row, dwidth);
+            dst += dwidth;
+        }
+
+        src += width;
+    }
+}
+
+/**
+ * alg_det_upscale
+ *      Copies the motion image det_out to out in full size. Nothing to do when
+ *      both are the same buffer.
+ */
+void alg_det_upscale(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    int scale = imgs->det_scale;
+    int dsize = imgs->det_motionsize;
+
+    if (scale == 1)
+        return;
+
+    upscale_plane(imgs->det_out, imgs->det_width, imgs->det_height, scale, imgs->out);
+    upscale_plane(imgs->det_out + dsize, imgs->det_width / 2, imgs->det_height / 2, scale,
+                  imgs->out + imgs->motionsize);
+    upscale_plane(imgs->det_out + dsize + dsize / 4, imgs->det_width / 2, imgs->det_height / 2, scale,
+                  imgs->out + imgs->motionsize + imgs->motionsize / 4);
+}
@@ -31,17 +31,84 @@ struct segment {
     int count;
 };
 
+/* Width and height in pixels of the tiles in imgs.tiles. */
+#define ALG_TILE_SIZE 16
+
+/* Per tile statistics from the tile pass in alg_diff. */
+struct tile_stat {
+    unsigned int changed;         /* Pixels that differ by more than the noise level */
+};
+
+/* A run of pixels of one row that the mask does not hide, see alg_mask_spans. */
+struct mask_span {
+    int x0;                       /* First pixel of the span */
+    int x1;                       /* One past the last pixel */
+};
+
+/* Row y of the motion bitmap imgs.det_bits. */
+#define DET_BITS_ROW(imgs, y) ((imgs)->det_bits + (y) * (imgs)->det_bits_words)
+
+/* How much of a tile is covered by mask spans, in imgs.mask_tiles. */
+#define MASK_TILE_NONE    0
+#define MASK_TILE_PARTIAL 1
+#define MASK_TILE_FULL    2
+
+/* Largest component number that is stored in the label plane imgs.labels. */
+#define LABEL_MAX 65535
+
+/* A horizontal run of motion pixels, see alg_labeling. */
+struct label_run {
+    int y;
+    int x0;                       /* First pixel of the run */
+    int x1;                       /* Last pixel of the run */
+    int parent;                   /* Union-find parent run */
+    int label;                    /* Component number */
+};
+
+/* Statistics of one component of the motion image, see alg_labeling. */
+struct label_stat {
+    int area;                     /* Pixels of the detection image */
+    int minx;                     /* Bounding box */
+    int maxx;
+    int miny;
+    int maxy;
+    long long sumx;               /* Sums of the pixel coordinates, for the centroid */
+    long long sumy;
+    int above;                    /* Larger than the threshold */
+};
+
+/* 
+ * Results of alg_diff_fused that the later stages of the same frame pick up
+ * instead of sweeping the image again.
+ */
+struct fused_pass {
+    int noise_valid;              /* noise_sum/noise_count belong to this frame */
+    int ref_valid;                /* ref_next/ref_dyn_next hold the updated reference frame */
+    int noise_sum;
+    int noise_count;
+    int threshold_ref;            /* Values the reference frame update was made with */
+    int accept_timer;
+};
+
 void alg_locate_center_size(struct images *, int width, int height, struct coord *);
 void alg_draw_location(struct coord *, struct images *, int width, unsigned char *, int, int, int);
 void alg_draw_red_location(struct coord *, struct images *, int width, unsigned char *, int, int, int);
 int alg_diff(struct context *, unsigned char *);
 int alg_diff_standard(struct context *, unsigned char *);
+int alg_diff_fused(struct context *, unsigned char *);
 int alg_lightswitch(struct context *, int diffs);
 int alg_switchfilter(struct context *, int, unsigned char *);
 void alg_noise_tune(struct context *, unsigned char *);
 void alg_threshold_tune(struct context *, int, int);
 int alg_despeckle(struct context *, int);
+void alg_despeckle_out(struct context *);
 void alg_tune_smartmask(struct context *);
 void alg_update_reference_frame(struct context *, int);
+void alg_mask_spans(struct context *);
+int alg_row_spans(struct context *, int, struct mask_span **);
+void alg_limit_threshold(struct context *, int, int);
+void alg_det_init(struct context *);
+void alg_det_downscale(struct context *, unsigned char *, unsigned char *);
+void alg_det_upscale(struct context *);
 
 #endif /* _INCLUDE_ALG_H */
@@ -0,0 +1,426 @@
+/*    alg_bg.c
+ *
+ *    Background models for the motion detection algorithms in alg.c.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ *
+ *    The background model is what the diff compares every new frame with.
+ *    The background_model option picks one of these engines per camera:
+ *
+ *    reference  The original reference frame of alg.c. Pixels with motion are
+ *               kept out of it by the ref_dyn timer for a while.
+ *    average    An exponential running average in fixed point. Pixels with
+ *               motion are learnt at a lower rate. Cheaper than reference.
+ *    gmm        A mixture of ALG_GMM_MODES modes per pixel. Values that keep
+ *               coming back, like leaves or water, become background, and the
+ *               width of the background modes raises the noise level of just
+ *               those pixels. The most expensive one.
+ *
+ *    alg_update_reference_frame measures what every update costs and logs
+ *    the average every ALG_BG_COST_FRAMES updates.
+ */
+#include "motion.h"
+#include "alg.h"
+#include "alg_bg.h"
+#include "alg_simd.h"
+#include "alg_workers.h"
+
+/* Seconds for the average to follow a change, and to take in a motion pixel. */
+#define AVERAGE_TIME        2
+#define AVERAGE_MOTION_TIME 10
+
+/*
+ * Seconds for a value that stays to become background in the mixture. The
+ * old background mode then has to lose about a third of its weight, which
+ * takes around a third of the learning time constant.
+ */
+#define GMM_TIME            10
+
+/* Upper limit of the learning shifts, which work on 16 bit values. */
+#define BG_SHIFT_MAX        12
+
+/**
+ * bg_shift
+ *      Returns the shift that makes a model follow a change in about 'seconds'
+ *      worth of detection frames. Above 5 fps detection runs at about 3 fps.
+ */
+static int bg_shift(struct context *cnt, int seconds)
+{
+    int frames = seconds * (cnt->lastrate > 5 ? 3 : (int)cnt->lastrate);
+    int shift = 1;
+
+    while (shift < BG_SHIFT_MAX && (2 << shift) <= frames)
+        shift++;
+
+    return shift;
+}
+
+/* Learning shifts of a band job. */
+struct bg_job {
+    int shift;
+    int shift_motion;
+};
+
+/**
+ * bg_stop
+ *      Frees the model of the average and gmm engines.
+ */
+static void bg_stop(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+
+    if (imgs->bg_state) {
+        free(imgs->bg_state);
+        imgs->bg_state = NULL;
+    }
+
+    if (imgs->bg_limit) {
+        free(imgs->bg_limit);
+        imgs->bg_limit = NULL;
+    }
+}
+
+/**
+ * average_start
+ *      Allocates the running average, one 16 bit value per pixel.
+ */
+static void average_start(struct context *cnt)
+{
+    cnt->imgs.bg_state = mymalloc(cnt->imgs.det_motionsize * sizeof(*cnt->imgs.bg_state));
+}
+
+/**
+ * average_reset
+ *      Sets the average and the reference frame to the current image.
+ */
+static void average_reset(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    int i;
+
+    for (i = 0; i < imgs->det_motionsize; i++)
+        imgs->bg_state[i] = imgs->det_image[i] << 7;
+
+    memcpy(imgs->ref, imgs->det_image, imgs->det_motionsize);
+}
+
+/**
+ * average_range
+ *      Updates pixels x0 up to x1 of a row of the average. All pointers are
+ *      to the start of the row, bits is its motion bitmap row.
+ */
+static void average_range(unsigned char *new, unsigned short *avg, unsigned char *ref, uint64_t *bits,
+                          int x0, int x1, int shift, int shift_motion)
+{
+    int x;
+
+    if (alg_simd.average) {
+        int count = (x1 - x0) - (x1 - x0) % 16;
+
+        alg_simd.average(new, avg, ref, bits, x0, count, shift, shift_motion);
+        x0 += count;
+    }
+
+    for (x = x0; x < x1; x++) {
+        int s = (bits[x / 64] >> (x % 64)) & 1 ? shift_motion : shift;
+
+        avg[x] += ((new[x] << 7) - avg[x]) >> s;
+        ref[x] = (avg[x] + 64) >> 7;
+    }
+}
+
+/**
+ * average_band
+ *      Band job of average_update, only in the mask spans.
+ */
+static int average_band(struct context *cnt, int band ATTRIBUTE_UNUSED, int y0, int y1, void *arg)
+{
+    struct images *imgs = &cnt->imgs;
+    struct bg_job *job = arg;
+    struct mask_span *spans;
+    int y, i, n, pos;
+
+    for (y = y0; y < y1; y++) {
+        n = alg_row_spans(cnt, y, &spans);
+        pos = y * imgs->det_width;
+
+        for (i = 0; i < n; i++) {
+            average_range(imgs->det_image + pos, imgs->bg_state + pos, imgs->ref + pos,
+                          DET_BITS_ROW(imgs, y), spans[i].x0, spans[i].x1,
+                          job->shift, job->shift_motion);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * average_update
+ *      Moves the average towards the current image.
+ */
+static void average_update(struct context *cnt)
+{
+    struct bg_job job;
+
+    job.shift = bg_shift(cnt, AVERAGE_TIME);
+    job.shift_motion = bg_shift(cnt, AVERAGE_MOTION_TIME);
+    alg_workers_run(cnt, average_band, &job);
+}
+
+static const struct alg_bg_model alg_bg_average = {
+    name:   "average",
+    start:  average_start,
+    stop:   bg_stop,
+    reset:  average_reset,
+    update: average_update,
+};
+
+/**
+ * gmm_start
+ *      Allocates the ALG_GMM_PLANES planes of the mixture and the per pixel
+ *      noise levels.
+ */
+static void gmm_start(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+
+    imgs->bg_state = mymalloc(ALG_GMM_PLANES * imgs->det_motionsize * sizeof(*imgs->bg_state));
+    imgs->bg_limit = mymalloc(imgs->det_motionsize);
+}
+
+/**
+ * gmm_output
+ *      Sets the reference value and the noise level of a pixel from its modes.
+ *      The background is the range the strongest modes cover, up to
+ *      ALG_GMM_BACKGROUND of the weight, each with three deviations around its
+ *      mean. The reference is the middle of the range and the noise level half
+ *      its width, so the diff passes exactly what is outside the range.
+ */
+static void gmm_output(unsigned short *m, int stride, unsigned char *ref, unsigned char *limit)
+{
+    int k, lo = 0, hi = 0, sum = 0;
+
+    for (k = 0; k < ALG_GMM_MODES; k++) {
+        int mean = m[ALG_GMM_MEAN(k) * stride];
+        int spread = 3 * m[ALG_GMM_DEV(k) * stride];
+        int l = mean > spread ? mean - spread : 0;
+        int h = mean + spread < 255 * 128 ? mean + spread : 255 * 128;
+
+        if (k == 0) {
+            lo = l;
+            hi = h;
+        } else if (sum < ALG_GMM_BACKGROUND) {
+            lo = l < lo ? l : lo;
+            hi = h > hi ? h : hi;
+        }
+
+        sum += m[ALG_GMM_WEIGHT(k) * stride];
+    }
+
+    *ref = (((lo + hi + 1) >> 1) + 64) >> 7;
+    *limit = (hi - lo + 255) >> 8;
+}
+
+/**
+ * gmm_pixel
+ *      Learns value x into the modes of a pixel. The first mode within three
+ *      deviations of x moves towards it and gains weight, the others lose
+ *      weight. Without one the weakest mode is replaced by a new mode at x.
+ *      Then the modes are put back in order of weight; only the matched mode
+ *      gained, so one pass from the weakest up does that.
+ */
+static void gmm_pixel(unsigned char x, unsigned short *m, int stride, unsigned char *ref,
+                      unsigned char *limit, int shift)
+{
+    int mean[ALG_GMM_MODES], dev[ALG_GMM_MODES], weight[ALG_GMM_MODES];
+    int k, t, found = 0;
+    int value = x << 7;
+
+    for (k = 0; k < ALG_GMM_MODES; k++) {
+        int d;
+
+        mean[k] = m[ALG_GMM_MEAN(k) * stride];
+        dev[k] = m[ALG_GMM_DEV(k) * stride];
+        weight[k] = m[ALG_GMM_WEIGHT(k) * stride];
+        d = abs(value - mean[k]);
+
+        if (!found && d <= 3 * dev[k]) {
+            found = 1;
+            mean[k] += (value - mean[k]) >> shift;
+            dev[k] += (d - dev[k]) >> shift;
+            dev[k] = dev[k] > ALG_GMM_DEV_MAX ? ALG_GMM_DEV_MAX :
+                     dev[k] < ALG_GMM_DEV_MIN ? ALG_GMM_DEV_MIN : dev[k];
+            weight[k] += (ALG_GMM_WEIGHT_MAX - weight[k]) >> shift;
+        } else {
+            weight[k] -= weight[k] >> shift;
+        }
+    }
+
+    if (!found) {
+        k = ALG_GMM_MODES - 1;
+        mean[k] = value;
+        dev[k] = ALG_GMM_DEV_INIT;
+        weight[k] = ALG_GMM_WEIGHT_INIT;
+    }
+
+    for (k = ALG_GMM_MODES - 1; k > 0; k--) {
+        if (weight[k] > weight[k - 1]) {
+            t = mean[k]; mean[k] = mean[k - 1]; mean[k - 1] = t;
+            t = dev[k]; dev[k] = dev[k - 1]; dev[k - 1] = t;
+            t = weight[k]; weight[k] = weight[k - 1]; weight[k - 1] = t;
+        }
+    }
+
+    for (k = 0; k < ALG_GMM_MODES; k++) {
+        m[ALG_GMM_MEAN(k) * stride] = mean[k];
+        m[ALG_GMM_DEV(k) * stride] = dev[k];
+        m[ALG_GMM_WEIGHT(k) * stride] = weight[k];
+    }
+
+    gmm_output(m, stride, ref, limit);
+}
+
+/**
+ * gmm_range
+ *      Learns count pixels of a row into the mixture. All pointers are to the
+ *      first of them, model in the first plane.
+ */
+static void gmm_range(unsigned char *new, unsigned short *model, int stride, unsigned char *ref,
+                      unsigned char *limit, int count, int shift)
+{
+    int x = 0;
+
+    if (alg_simd.gmm) {
+        x = count - count % 8;
+        alg_simd.gmm(new, model, stride, ref, limit, x, shift);
+    }
+
+    for (; x < count; x++)
+        gmm_pixel(new[x], model + x, stride, ref + x, limit + x, shift);
+}
+
+/**
+ * gmm_reset
+ *      Starts every pixel with a single mode at its current value.
+ */
+static void gmm_reset(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    int stride = imgs->det_motionsize;
+    int i, k;
+
+    for (i = 0; i < imgs->det_motionsize; i++) {
+        unsigned short *m = imgs->bg_state + i;
+
+        for (k = 0; k < ALG_GMM_MODES; k++) {
+            m[ALG_GMM_MEAN(k) * stride] = imgs->det_image[i] << 7;
+            m[ALG_GMM_DEV(k) * stride] = ALG_GMM_DEV_INIT;
+            m[ALG_GMM_WEIGHT(k) * stride] = k ? 0 : ALG_GMM_WEIGHT_MAX;
+        }
+
+        gmm_output(m, stride, imgs->ref + i, imgs->bg_limit + i);
+    }
+
+    imgs->bg_limit_changed = 1;
+}
+
+/**
+ * gmm_band
+ *      Band job of gmm_update, only in the mask spans. The noise levels of
+ *      the spans change with the mixture, so their part of mask_threshold is
+ *      redone here while it is still in the cache.
+ */
+static int gmm_band(struct context *cnt, int band ATTRIBUTE_UNUSED, int y0, int y1, void *arg)
+{
+    struct images *imgs = &cnt->imgs;
+    struct bg_job *job = arg;
+    struct mask_span *spans;
+    int stride = imgs->det_motionsize;
+    int y, i, n, pos;
+
+    for (y = y0; y < y1; y++) {
+        n = alg_row_spans(cnt, y, &spans);
+
+        for (i = 0; i < n; i++) {
+            pos = y * imgs->det_width + spans[i].x0;
+
+            gmm_range(imgs->det_image + pos, imgs->bg_state + pos, stride, imgs->ref + pos,
+                      imgs->bg_limit + pos, spans[i].x1 - spans[i].x0, job->shift);
+            alg_limit_threshold(cnt, pos, spans[i].x1 - spans[i].x0);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * gmm_update
+ *      Learns the current image into the mixture. The mixture decides by
+ *      itself what is background, so the motion bitmap is not used.
+ */
+static void gmm_update(struct context *cnt)
+{
+    struct bg_job job;
+
+    job.shift = bg_shift(cnt, 3 * GMM_TIME);
+    job.shift_motion = job.shift;
+    alg_workers_run(cnt, gmm_band, &job);
+}
+
+static const struct alg_bg_model alg_bg_gmm = {
+    name:   "gmm",
+    start:  gmm_start,
+    stop:   bg_stop,
+    reset:  gmm_reset,
+    update: gmm_update,
+};
+
+static const struct alg_bg_model *bg_models[] = {
+    &alg_bg_reference,
+    &alg_bg_average,
+    &alg_bg_gmm,
+    NULL
+};
+
+/**
+ * alg_bg_start
+ *      Starts the engine named by conf.background_model, the reference frame
+ *      when the option is not set or unknown. Must be called after
+ *      alg_det_init and before the first alg_update_reference_frame.
+ */
+void alg_bg_start(struct context *cnt)
+{
+    const char *name = cnt->conf.background_model;
+    int i;
+
+    cnt->bg_model = &alg_bg_reference;
+    cnt->bg_cost = 0;
+    cnt->bg_cost_frames = 0;
+
+    if (name) {
+        for (i = 0; bg_models[i] && strcmp(bg_models[i]->name, name); i++);
+
+        if (bg_models[i])
+            cnt->bg_model = bg_models[i];
+        else
+            MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Unknown background_model %s, using %s",
+                       name, cnt->bg_model->name);
+    }
+
+    if (cnt->bg_model->start)
+        cnt->bg_model->start(cnt);
+
+    MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Using the %s background model", cnt->bg_model->name);
+}
+
+/**
+ * alg_bg_stop
+ *      Frees the model of the engine. May be called when none was started.
+ */
+void alg_bg_stop(struct context *cnt)
+{
+    if (cnt->bg_model && cnt->bg_model->stop)
+        cnt->bg_model->stop(cnt);
+
+    cnt->bg_model = NULL;
+}
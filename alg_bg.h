@@ -0,0 +1,37 @@
+/*    alg_bg.h
+ *
+ *    Background models for the motion detection algorithms in alg.c.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ *
+ */
+
+#ifndef _INCLUDE_ALG_BG_H
+#define _INCLUDE_ALG_BG_H
+
+#include "motion.h"
+
+/*
+ * A background model engine. It keeps imgs.ref, the image the diff compares
+ * every new frame with, and may also keep imgs.bg_limit, a per pixel noise
+ * level the diff uses where it is above the noise option. Both are at the
+ * detection size. The functions are called from alg_update_reference_frame.
+ */
+struct alg_bg_model {
+    const char *name;                       /* Value of the background_model option */
+    void (*start)(struct context *cnt);     /* Allocates the model, may be NULL */
+    void (*stop)(struct context *cnt);      /* Frees what start allocated, may be NULL */
+    void (*reset)(struct context *cnt);     /* Starts over from imgs.det_image */
+    void (*update)(struct context *cnt);    /* Learns imgs.det_image and its motion bitmap */
+};
+
+/* The original reference frame with its exclusion timer, in alg.c. */
+extern const struct alg_bg_model alg_bg_reference;
+
+/* Updates after which the average cost of the model is logged. */
+#define ALG_BG_COST_FRAMES 1000
+
+void alg_bg_start(struct context *cnt);
+void alg_bg_stop(struct context *cnt);
+
+#endif /* _INCLUDE_ALG_BG_H */
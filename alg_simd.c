@@ -0,0 +1,746 @@
+/*    alg_simd.c
+ *
+ *    Vectorised kernels for the motion detection algorithms in alg.c.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ *
+ *    The kernels are compiled for SSE2 and AVX2 using function attributes so
+ *    one binary runs on any x86 CPU. alg_simd_init picks the best set the CPU
+ *    supports. The scalar code in alg.c stays the reference: every kernel here
+ *    must produce bit-exact results with it.
+ */
+#include "motion.h"
+#include "alg_simd.h"
+
+#ifdef HAVE_ALG_SIMD_X86
+#include <immintrin.h>
+#endif
+
+struct alg_simd_ops alg_simd = {
+    name:     "scalar",
+    pixels:   1,
+    diff:     { NULL },
+    tile_row: NULL,
+    halve:    NULL,
+    pack:     NULL,
+    morph:    NULL,
+    smartmask: NULL,
+    average:  NULL,
+    gmm:      NULL,
+};
+
+static pthread_once_t alg_simd_once = PTHREAD_ONCE_INIT;
+
+#ifdef HAVE_ALG_SIMD_X86
+
+/**
+ * diff_sse2
+ *      alg_diff_standard inner loop for 16 pixels per iteration. The
+ *      absolute difference is compared with the noise level or with the
+ *      per pixel limits of the mask threshold plane as packed bytes.
+ *      variant is a constant in every caller, so each variant is compiled
+ *      without the tests for the steps it does not do.
+ */
+__attribute__((target("sse2")))
+static ALG_INLINE int diff_sse2(unsigned char *ref, unsigned char *new, unsigned char *out,
+                                unsigned char *thresh, unsigned char *smartmask_final,
+                                unsigned short *smartmask_buffer, int noise, int count,
+                                const int variant)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_cmpeq_epi8(zero, zero);
+    const __m128i noise8 = _mm_set1_epi8((char)noise);
+    const __m128i incr = _mm_set1_epi16(SMARTMASK_SENSITIVITY_INCR);
+    int i, diffs = 0;
+
+    for (i = 0; i < count; i += 16) {
+        __m128i r = _mm_loadu_si128((const __m128i *)(ref + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new + i));
+        __m128i d = _mm_or_si128(_mm_subs_epu8(r, n), _mm_subs_epu8(n, r));
+        __m128i limit = noise8;
+        __m128i flags;
+
+        if (variant & ALG_DIFF_MASK)
+            limit = _mm_loadu_si128((const __m128i *)(thresh + i));
+
+        flags = _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(d, limit), zero), ones);
+
+        if (variant & ALG_DIFF_SMARTMASK) {
+            __m128i s = _mm_loadu_si128((const __m128i *)(smartmask_final + i));
+
+            /* Widen the motion flags to 16 bits and add the increment, saturating. */
+            if ((variant & ALG_DIFF_INCR) && _mm_movemask_epi8(flags)) {
+                __m128i *buf = (__m128i *)(smartmask_buffer + i);
+
+                _mm_storeu_si128(buf, _mm_adds_epu16(_mm_loadu_si128(buf),
+                                 _mm_and_si128(_mm_unpacklo_epi8(flags, flags), incr)));
+                _mm_storeu_si128(buf + 1, _mm_adds_epu16(_mm_loadu_si128(buf + 1),
+                                 _mm_and_si128(_mm_unpackhi_epi8(flags, flags), incr)));
+            }
+
+            /* Reset the flags where the smartmask is 0. */
+            flags = _mm_andnot_si128(_mm_cmpeq_epi8(s, zero), flags);
+        }
+
+        _mm_storeu_si128((__m128i *)(out + i), _mm_and_si128(n, flags));
+        diffs += __builtin_popcount(_mm_movemask_epi8(flags));
+    }
+
+    return diffs;
+}
+
+/**
+ * diff_avx2
+ *      Same as diff_sse2 for 32 pixels per iteration. A last block of 16
+ *      pixels is passed on to diff_sse2.
+ */
+__attribute__((target("avx2")))
+static ALG_INLINE int diff_avx2(unsigned char *ref, unsigned char *new, unsigned char *out,
+                                unsigned char *thresh, unsigned char *smartmask_final,
+                                unsigned short *smartmask_buffer, int noise, int count,
+                                const int variant)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_cmpeq_epi8(zero, zero);
+    const __m256i noise8 = _mm256_set1_epi8((char)noise);
+    const __m256i incr = _mm256_set1_epi16(SMARTMASK_SENSITIVITY_INCR);
+    int i, diffs = 0;
+
+    for (i = 0; i + 32 <= count; i += 32) {
+        __m256i r = _mm256_loadu_si256((const __m256i *)(ref + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new + i));
+        __m256i d = _mm256_or_si256(_mm256_subs_epu8(r, n), _mm256_subs_epu8(n, r));
+        __m256i limit = noise8;
+        __m256i flags;
+
+        if (variant & ALG_DIFF_MASK)
+            limit = _mm256_loadu_si256((const __m256i *)(thresh + i));
+
+        flags = _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_subs_epu8(d, limit), zero), ones);
+
+        if (variant & ALG_DIFF_SMARTMASK) {
+            __m256i s = _mm256_loadu_si256((const __m256i *)(smartmask_final + i));
+
+            if ((variant & ALG_DIFF_INCR) && _mm256_movemask_epi8(flags)) {
+                __m256i *buf = (__m256i *)(smartmask_buffer + i);
+                __m128i f0 = _mm256_castsi256_si128(flags);
+                __m128i f1 = _mm256_extracti128_si256(flags, 1);
+
+                /* Sign extension turns each 0xff flag into 0xffff. */
+                _mm256_storeu_si256(buf, _mm256_adds_epu16(_mm256_loadu_si256(buf),
+                                    _mm256_and_si256(_mm256_cvtepi8_epi16(f0), incr)));
+                _mm256_storeu_si256(buf + 1, _mm256_adds_epu16(_mm256_loadu_si256(buf + 1),
+                                    _mm256_and_si256(_mm256_cvtepi8_epi16(f1), incr)));
+            }
+
+            flags = _mm256_andnot_si256(_mm256_cmpeq_epi8(s, zero), flags);
+        }
+
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_and_si256(n, flags));
+        diffs += __builtin_popcount((unsigned int)_mm256_movemask_epi8(flags));
+    }
+
+    /* count is a multiple of 16, so there may be 16 pixels left. */
+    if (i < count) {
+        diffs += diff_sse2(ref + i, new + i, out + i,
+                           (variant & ALG_DIFF_MASK) ? thresh + i : NULL,
+                           (variant & ALG_DIFF_SMARTMASK) ? smartmask_final + i : NULL,
+                           (variant & ALG_DIFF_INCR) ? smartmask_buffer + i : NULL,
+                           noise, count - i, variant);
+    }
+
+    return diffs;
+}
+
+/*
+ * Defines diff_<isa>_<variant> for one variant and the table of all variants
+ * of an instruction set, in the order of the ALG_DIFF_* flags.
+ */
+#define DIFF_VARIANT(isa, variant) \
+    __attribute__((target(#isa))) \
+    static int diff_##isa##_##variant(unsigned char *ref, unsigned char *new, unsigned char *out, \
+                                      unsigned char *thresh, unsigned char *smartmask_final, \
+                                      unsigned short *smartmask_buffer, int noise, int count) \
+    { \
+        return diff_##isa(ref, new, out, thresh, smartmask_final, smartmask_buffer, \
+                          noise, count, variant); \
+    }
+
+#define DIFF_VARIANTS(isa) \
+    DIFF_VARIANT(isa, 0) DIFF_VARIANT(isa, 1) DIFF_VARIANT(isa, 2) DIFF_VARIANT(isa, 3) \
+    DIFF_VARIANT(isa, 4) DIFF_VARIANT(isa, 5) DIFF_VARIANT(isa, 6) DIFF_VARIANT(isa, 7) \
+    static const alg_diff_kernel diff_##isa##_variants[ALG_DIFF_VARIANTS] = { \
+        diff_##isa##_0, diff_##isa##_1, diff_##isa##_2, diff_##isa##_3, \
+        diff_##isa##_4, diff_##isa##_5, diff_##isa##_6, diff_##isa##_7, \
+    };
+
+DIFF_VARIANTS(sse2)
+DIFF_VARIANTS(avx2)
+
+/**
+ * tile_row_sse2
+ *      Tile statistics for one row of tiles, one 16 pixel wide column of
+ *      tiles at a time. Changed pixels are counted per byte lane (at most 16
+ *      per lane) and summed with psadbw at the end, so the tile is written to
+ *      memory only once.
+ */
+__attribute__((target("sse2")))
+static void tile_row_sse2(unsigned char *ref, unsigned char *new, int width, int stride,
+                          int rows, int noise, struct tile_stat *tiles)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i noise8 = _mm_set1_epi8((char)noise);
+    int x, y;
+
+    for (x = 0; x < width; x += 16, tiles++) {
+        __m128i changed = zero;
+
+        for (y = 0; y < rows; y++) {
+            __m128i r = _mm_loadu_si128((const __m128i *)(ref + y * stride + x));
+            __m128i n = _mm_loadu_si128((const __m128i *)(new + y * stride + x));
+            __m128i d = _mm_or_si128(_mm_subs_epu8(r, n), _mm_subs_epu8(n, r));
+
+            /* Subtracting the 0xff compare result adds 1 per changed pixel. */
+            changed = _mm_sub_epi8(changed, _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(d, noise8), zero),
+                                                          _mm_cmpeq_epi8(zero, zero)));
+        }
+
+        changed = _mm_sad_epu8(changed, zero);
+        tiles->changed = _mm_cvtsi128_si32(changed) + _mm_cvtsi128_si32(_mm_srli_si128(changed, 8));
+    }
+}
+
+/**
+ * tile_row_avx2
+ *      Same as tile_row_sse2 for two tiles at a time. The low lane holds the
+ *      first tile and the high lane the second.
+ */
+__attribute__((target("avx2")))
+static void tile_row_avx2(unsigned char *ref, unsigned char *new, int width, int stride,
+                          int rows, int noise, struct tile_stat *tiles)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_cmpeq_epi8(zero, zero);
+    const __m256i noise8 = _mm256_set1_epi8((char)noise);
+    int x, y;
+
+    for (x = 0; x + 32 <= width; x += 32, tiles += 2) {
+        __m256i changed = zero;
+
+        for (y = 0; y < rows; y++) {
+            __m256i r = _mm256_loadu_si256((const __m256i *)(ref + y * stride + x));
+            __m256i n = _mm256_loadu_si256((const __m256i *)(new + y * stride + x));
+            __m256i d = _mm256_or_si256(_mm256_subs_epu8(r, n), _mm256_subs_epu8(n, r));
+
+            changed = _mm256_sub_epi8(changed, _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_subs_epu8(d, noise8),
+                                                                                  zero), ones));
+        }
+
+        changed = _mm256_sad_epu8(changed, zero);
+        tiles[0].changed = _mm256_extract_epi32(changed, 0) + _mm256_extract_epi32(changed, 2);
+        tiles[1].changed = _mm256_extract_epi32(changed, 4) + _mm256_extract_epi32(changed, 6);
+    }
+
+    /* An odd number of tiles leaves one for the 128 bit code. */
+    if (x < width)
+        tile_row_sse2(ref + x, new + x, width - x, stride, rows, noise, tiles);
+}
+
+/**
+ * halve_sse2
+ *      Averages 2x2 blocks of the source rows src and src + width into count
+ *      pixels of dst, rounding to nearest like the scalar code in alg.c.
+ */
+__attribute__((target("sse2")))
+static void halve_sse2(unsigned char *src, int width, unsigned char *dst, int count)
+{
+    const __m128i even = _mm_set1_epi16(0x00ff);
+    const __m128i two = _mm_set1_epi16(2);
+    int i;
+
+    for (i = 0; i < count; i += 16) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(src + width + 2 * i));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(src + width + 2 * i + 16));
+        __m128i s0, s1;
+
+        /* Sum the even and odd bytes of both rows as words. */
+        s0 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a0, even), _mm_srli_epi16(a0, 8)),
+                           _mm_add_epi16(_mm_and_si128(b0, even), _mm_srli_epi16(b0, 8)));
+        s1 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a1, even), _mm_srli_epi16(a1, 8)),
+                           _mm_add_epi16(_mm_and_si128(b1, even), _mm_srli_epi16(b1, 8)));
+        s0 = _mm_srli_epi16(_mm_add_epi16(s0, two), 2);
+        s1 = _mm_srli_epi16(_mm_add_epi16(s1, two), 2);
+
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(s0, s1));
+    }
+}
+
+/**
+ * halve_avx2
+ *      Same as halve_sse2 for 32 pixels per iteration. The pack works per
+ *      128 bit lane, so the quadwords are put back in order afterwards.
+ */
+__attribute__((target("avx2")))
+static void halve_avx2(unsigned char *src, int width, unsigned char *dst, int count)
+{
+    const __m256i even = _mm256_set1_epi16(0x00ff);
+    const __m256i two = _mm256_set1_epi16(2);
+    int i;
+
+    for (i = 0; i + 32 <= count; i += 32) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(src + 2 * i + 32));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(src + width + 2 * i));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(src + width + 2 * i + 32));
+        __m256i s0, s1;
+
+        s0 = _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(a0, even), _mm256_srli_epi16(a0, 8)),
+                              _mm256_add_epi16(_mm256_and_si256(b0, even), _mm256_srli_epi16(b0, 8)));
+        s1 = _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(a1, even), _mm256_srli_epi16(a1, 8)),
+                              _mm256_add_epi16(_mm256_and_si256(b1, even), _mm256_srli_epi16(b1, 8)));
+        s0 = _mm256_srli_epi16(_mm256_add_epi16(s0, two), 2);
+        s1 = _mm256_srli_epi16(_mm256_add_epi16(s1, two), 2);
+
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_permute4x64_epi64(_mm256_packus_epi16(s0, s1), 0xd8));
+    }
+
+    /* count is a multiple of 16, so there may be 16 pixels left. */
+    if (i < count)
+        halve_sse2(src + 2 * i, width, dst + i, count - i);
+}
+
+/**
+ * pack_sse2
+ *      Packs count bytes of src into count / 64 words of one bit per pixel.
+ */
+__attribute__((target("sse2")))
+static void pack_sse2(unsigned char *src, uint64_t *dst, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i, k;
+
+    for (i = 0; i < count; i += 64) {
+        uint64_t word = 0;
+
+        for (k = 0; k < 4; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + i + 16 * k));
+
+            word |= (uint64_t)(~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & 0xffff) << (16 * k);
+        }
+
+        *dst++ = word;
+    }
+}
+
+/**
+ * pack_avx2
+ *      As pack_sse2.
+ */
+__attribute__((target("avx2")))
+static void pack_avx2(unsigned char *src, uint64_t *dst, int count)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    int i;
+
+    for (i = 0; i < count; i += 64) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+        uint32_t lo = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, zero));
+        uint32_t hi = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, zero));
+
+        *dst++ = (uint64_t)hi << 32 | lo;
+    }
+}
+
+/* Loads 16 or 32 pixels starting at p. */
+#define LOAD128(p) _mm_loadu_si128((const __m128i *)(p))
+#define LOAD256(p) _mm256_loadu_si256((const __m256i *)(p))
+
+/**
+ * morph_sse2
+ *      erode9, erode5, dilate9 and dilate5 for count pixels of one row, 16 at
+ *      a time. The minimum or maximum is taken down the columns first and then
+ *      along the row. Erode keeps the pixel unless the minimum is zero, which
+ *      is the test of the scalar code.
+ */
+__attribute__((target("sse2")))
+static int morph_sse2(unsigned char *row1, unsigned char *row2, unsigned char *row3,
+                      unsigned char *dst, int count, char filter)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i res = zero, left, mid, right;
+    int i, sum = 0;
+
+    for (i = 0; i < count; i += 16) {
+        switch (filter) {
+        case 'E':
+            left = _mm_min_epu8(_mm_min_epu8(LOAD128(row1 + i - 1), LOAD128(row2 + i - 1)),
+                                LOAD128(row3 + i - 1));
+            mid = _mm_min_epu8(_mm_min_epu8(LOAD128(row1 + i), LOAD128(row2 + i)), LOAD128(row3 + i));
+            right = _mm_min_epu8(_mm_min_epu8(LOAD128(row1 + i + 1), LOAD128(row2 + i + 1)),
+                                 LOAD128(row3 + i + 1));
+            mid = _mm_min_epu8(_mm_min_epu8(left, mid), right);
+            res = _mm_andnot_si128(_mm_cmpeq_epi8(mid, zero), LOAD128(row2 + i));
+            break;
+        case 'e':
+            mid = _mm_min_epu8(_mm_min_epu8(LOAD128(row1 + i), LOAD128(row2 + i)), LOAD128(row3 + i));
+            mid = _mm_min_epu8(_mm_min_epu8(LOAD128(row2 + i - 1), mid), LOAD128(row2 + i + 1));
+            res = _mm_andnot_si128(_mm_cmpeq_epi8(mid, zero), LOAD128(row2 + i));
+            break;
+        case 'D':
+            left = _mm_max_epu8(_mm_max_epu8(LOAD128(row1 + i - 1), LOAD128(row2 + i - 1)),
+                                LOAD128(row3 + i - 1));
+            mid = _mm_max_epu8(_mm_max_epu8(LOAD128(row1 + i), LOAD128(row2 + i)), LOAD128(row3 + i));
+            right = _mm_max_epu8(_mm_max_epu8(LOAD128(row1 + i + 1), LOAD128(row2 + i + 1)),
+                                 LOAD128(row3 + i + 1));
+            res = _mm_max_epu8(_mm_max_epu8(left, mid), right);
+            break;
+        case 'd':
+            mid = _mm_max_epu8(_mm_max_epu8(LOAD128(row1 + i), LOAD128(row2 + i)), LOAD128(row3 + i));
+            res = _mm_max_epu8(_mm_max_epu8(LOAD128(row2 + i - 1), mid), LOAD128(row2 + i + 1));
+            break;
+        }
+
+        _mm_storeu_si128((__m128i *)(dst + i), res);
+        sum += 16 - __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(res, zero)));
+    }
+
+    return sum;
+}
+
+/**
+ * morph_avx2
+ *      As morph_sse2, 32 pixels at a time.
+ */
+__attribute__((target("avx2")))
+static int morph_avx2(unsigned char *row1, unsigned char *row2, unsigned char *row3,
+                      unsigned char *dst, int count, char filter)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i res = zero, left, mid, right;
+    int i, sum = 0;
+
+    for (i = 0; i + 32 <= count; i += 32) {
+        switch (filter) {
+        case 'E':
+            left = _mm256_min_epu8(_mm256_min_epu8(LOAD256(row1 + i - 1), LOAD256(row2 + i - 1)),
+                                   LOAD256(row3 + i - 1));
+            mid = _mm256_min_epu8(_mm256_min_epu8(LOAD256(row1 + i), LOAD256(row2 + i)),
+                                  LOAD256(row3 + i));
+            right = _mm256_min_epu8(_mm256_min_epu8(LOAD256(row1 + i + 1), LOAD256(row2 + i + 1)),
+                                    LOAD256(row3 + i + 1));
+            mid = _mm256_min_epu8(_mm256_min_epu8(left, mid), right);
+            res = _mm256_andnot_si256(_mm256_cmpeq_epi8(mid, zero), LOAD256(row2 + i));
+            break;
+        case 'e':
+            mid = _mm256_min_epu8(_mm256_min_epu8(LOAD256(row1 + i), LOAD256(row2 + i)),
+                                  LOAD256(row3 + i));
+            mid = _mm256_min_epu8(_mm256_min_epu8(LOAD256(row2 + i - 1), mid), LOAD256(row2 + i + 1));
+            res = _mm256_andnot_si256(_mm256_cmpeq_epi8(mid, zero), LOAD256(row2 + i));
+            break;
+        case 'D':
+            left = _mm256_max_epu8(_mm256_max_epu8(LOAD256(row1 + i - 1), LOAD256(row2 + i - 1)),
+                                   LOAD256(row3 + i - 1));
+            mid = _mm256_max_epu8(_mm256_max_epu8(LOAD256(row1 + i), LOAD256(row2 + i)),
+                                  LOAD256(row3 + i));
+            right = _mm256_max_epu8(_mm256_max_epu8(LOAD256(row1 + i + 1), LOAD256(row2 + i + 1)),
+                                    LOAD256(row3 + i + 1));
+            res = _mm256_max_epu8(_mm256_max_epu8(left, mid), right);
+            break;
+        case 'd':
+            mid = _mm256_max_epu8(_mm256_max_epu8(LOAD256(row1 + i), LOAD256(row2 + i)),
+                                  LOAD256(row3 + i));
+            res = _mm256_max_epu8(_mm256_max_epu8(LOAD256(row2 + i - 1), mid), LOAD256(row2 + i + 1));
+            break;
+        }
+
+        _mm256_storeu_si256((__m256i *)(dst + i), res);
+        sum += 32 - __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(res, zero)));
+    }
+
+    /* count is a multiple of 16, so there may be 16 pixels left. */
+    if (i < count)
+        sum += morph_sse2(row1 + i, row2 + i, row3 + i, dst + i, count - i, filter);
+
+    return sum;
+}
+
+/**
+ * div_sse2
+ *      Divides eight 16 bit values by the divisor whose ALG_RECIPROCAL is in
+ *      every 32 bit lane of magic.
+ */
+__attribute__((target("sse2")))
+static __m128i div_sse2(__m128i n, __m128i magic)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias32 = _mm_set1_epi32(32768);
+    const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+    __m128i half[2];
+    int k;
+
+    for (k = 0; k < 2; k++) {
+        __m128i x = k ? _mm_unpackhi_epi16(n, zero) : _mm_unpacklo_epi16(n, zero);
+        __m128i even = _mm_srli_epi64(_mm_mul_epu32(x, magic), 31);
+        __m128i odd = _mm_srli_epi64(_mm_mul_epu32(_mm_srli_epi64(x, 32), magic), 31);
+
+        half[k] = _mm_sub_epi32(_mm_or_si128(even, _mm_slli_epi64(odd, 32)), bias32);
+    }
+
+    /* SSE2 can only pack signed, so pack around 32768 and move back. */
+    return _mm_xor_si128(_mm_packs_epi32(half[0], half[1]), bias16);
+}
+
+/**
+ * smartmask_sse2
+ *      The smartmask update of alg_tune_smartmask for 16 pixels at a time.
+ *      It runs once every few seconds, so there is no AVX2 version.
+ */
+__attribute__((target("sse2")))
+static void smartmask_sse2(unsigned char *smartmask, unsigned char *smartmask_final,
+                           unsigned short *smartmask_buffer, int count,
+                           int sensitivity, unsigned int magic)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i trigger = _mm_set1_epi8(20);
+    const __m128i cap = _mm_set1_epi16(80);
+    const __m128i low = _mm_set1_epi16(0xff);
+    const __m128i sens = _mm_set1_epi16((short)sensitivity);
+    const __m128i mag = _mm_set1_epi32((int)magic);
+    __m128i s, half[2];
+    int i, k;
+
+    for (i = 0; i < count; i += 16) {
+        s = _mm_subs_epu8(LOAD128(smartmask + i), one);
+
+        for (k = 0; k < 2; k++) {
+            __m128i *buf = (__m128i *)(smartmask_buffer + i + 8 * k);
+            __m128i n = _mm_loadu_si128(buf);
+            __m128i diff = div_sse2(n, mag);
+            __m128i s16 = k ? _mm_unpackhi_epi8(s, zero) : _mm_unpacklo_epi8(s, zero);
+            /* s <= diff + 80 ? (s + diff) & 0xff : 80, only where diff is not 0. */
+            __m128i grow = _mm_cmpeq_epi16(_mm_subs_epu16(s16, _mm_adds_epu16(diff, cap)), zero);
+            __m128i keep = _mm_cmpeq_epi16(diff, zero);
+            __m128i upd = _mm_or_si128(_mm_and_si128(grow, _mm_and_si128(_mm_add_epi16(s16, diff), low)),
+                                       _mm_andnot_si128(grow, cap));
+
+            half[k] = _mm_or_si128(_mm_and_si128(keep, s16), _mm_andnot_si128(keep, upd));
+            _mm_storeu_si128(buf, _mm_sub_epi16(n, _mm_mullo_epi16(diff, sens)));
+        }
+
+        s = _mm_packus_epi16(half[0], half[1]);
+        _mm_storeu_si128((__m128i *)(smartmask + i), s);
+        _mm_storeu_si128((__m128i *)(smartmask_final + i),
+                         _mm_cmpeq_epi8(_mm_subs_epu8(s, trigger), zero));
+    }
+}
+
+/**
+ * bits16
+ *      Returns the 16 bits of a motion bitmap row from pixel x on.
+ */
+static unsigned int bits16(uint64_t *bits, int x)
+{
+    uint64_t word = bits[x / 64] >> (x % 64);
+
+    if (x % 64 > 48)
+        word |= bits[x / 64 + 1] << (64 - x % 64);
+
+    return word & 0xffff;
+}
+
+/**
+ * average_sse2
+ *      The running average of alg_bg.c for 16 pixels at a time. The shift is
+ *      done for both rates and the motion bits pick one per pixel.
+ */
+__attribute__((target("sse2")))
+static void average_sse2(unsigned char *new, unsigned short *avg, unsigned char *ref,
+                         uint64_t *bits, int x, int count, int shift, int shift_motion)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(64);
+    const __m128i bitsel = _mm_set_epi16(128, 64, 32, 16, 8, 4, 2, 1);
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    const __m128i shm = _mm_cvtsi32_si128(shift_motion);
+    __m128i pix, half[2];
+    int i, k;
+
+    for (i = x; i < x + count; i += 16) {
+        unsigned int b = bits16(bits, i);
+
+        pix = LOAD128(new + i);
+
+        for (k = 0; k < 2; k++) {
+            __m128i *p = (__m128i *)(avg + i + 8 * k);
+            __m128i a = _mm_loadu_si128(p);
+            __m128i target = _mm_slli_epi16(k ? _mm_unpackhi_epi8(pix, zero) :
+                                            _mm_unpacklo_epi8(pix, zero), 7);
+            __m128i motion = _mm_cmpeq_epi16(_mm_and_si128(_mm_set1_epi16((b >> 8 * k) & 0xff), bitsel),
+                                             bitsel);
+            __m128i d = _mm_sub_epi16(target, a);
+
+            d = _mm_or_si128(_mm_and_si128(motion, _mm_sra_epi16(d, shm)),
+                             _mm_andnot_si128(motion, _mm_sra_epi16(d, sh)));
+            a = _mm_add_epi16(a, d);
+            _mm_storeu_si128(p, a);
+            half[k] = _mm_srli_epi16(_mm_add_epi16(a, round), 7);
+        }
+
+        _mm_storeu_si128((__m128i *)(ref + i), _mm_packus_epi16(half[0], half[1]));
+    }
+}
+
+/* Lanes of a where mask is set, of b elsewhere. */
+#define SELECT128(mask, a, b) _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b))
+
+/**
+ * gmm_sse2
+ *      The mixture model update of alg_bg.c for 8 pixels at a time. Every
+ *      mode is updated as if it matched and the first matching one keeps it.
+ *      There is no AVX2 version; the 16 bit lanes of SSE2 already keep it
+ *      close to the speed of loading and storing the model.
+ */
+__attribute__((target("sse2")))
+static void gmm_sse2(unsigned char *new, unsigned short *model, int stride,
+                     unsigned char *ref, unsigned char *limit, int count, int shift)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_cmpeq_epi16(zero, zero);
+    const __m128i wmax = _mm_set1_epi16(ALG_GMM_WEIGHT_MAX);
+    const __m128i dmin = _mm_set1_epi16(ALG_GMM_DEV_MIN);
+    const __m128i dmax = _mm_set1_epi16(ALG_GMM_DEV_MAX);
+    const __m128i top = _mm_set1_epi16(255 * 128);
+    const __m128i background = _mm_set1_epi16(ALG_GMM_BACKGROUND);
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    __m128i mean[ALG_GMM_MODES], dev[ALG_GMM_MODES], weight[ALG_GMM_MODES];
+    __m128i x, d, match, found, lo, hi, sum, t;
+    int i, k;
+
+    for (i = 0; i < count; i += 8) {
+        unsigned short *m = model + i;
+
+        x = _mm_slli_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(new + i)), zero), 7);
+        found = zero;
+
+        for (k = 0; k < ALG_GMM_MODES; k++) {
+            mean[k] = _mm_loadu_si128((__m128i *)(m + ALG_GMM_MEAN(k) * stride));
+            dev[k] = _mm_loadu_si128((__m128i *)(m + ALG_GMM_DEV(k) * stride));
+            weight[k] = _mm_loadu_si128((__m128i *)(m + ALG_GMM_WEIGHT(k) * stride));
+
+            d = _mm_max_epi16(_mm_sub_epi16(x, mean[k]), _mm_sub_epi16(mean[k], x));
+            t = _mm_add_epi16(dev[k], _mm_add_epi16(dev[k], dev[k]));
+            match = _mm_andnot_si128(_mm_or_si128(found, _mm_cmpgt_epi16(d, t)), ones);
+            found = _mm_or_si128(found, match);
+
+            t = _mm_add_epi16(mean[k], _mm_sra_epi16(_mm_sub_epi16(x, mean[k]), sh));
+            mean[k] = SELECT128(match, t, mean[k]);
+            t = _mm_add_epi16(dev[k], _mm_sra_epi16(_mm_sub_epi16(d, dev[k]), sh));
+            t = _mm_max_epi16(_mm_min_epi16(t, dmax), dmin);
+            dev[k] = SELECT128(match, t, dev[k]);
+            weight[k] = SELECT128(match,
+                                  _mm_add_epi16(weight[k], _mm_srl_epi16(_mm_sub_epi16(wmax, weight[k]), sh)),
+                                  _mm_sub_epi16(weight[k], _mm_srl_epi16(weight[k], sh)));
+        }
+
+        /* Nothing matched: the weakest mode starts over at this value. */
+        k = ALG_GMM_MODES - 1;
+        mean[k] = SELECT128(found, mean[k], x);
+        dev[k] = SELECT128(found, dev[k], _mm_set1_epi16(ALG_GMM_DEV_INIT));
+        weight[k] = SELECT128(found, weight[k], _mm_set1_epi16(ALG_GMM_WEIGHT_INIT));
+
+        for (k = ALG_GMM_MODES - 1; k > 0; k--) {
+            __m128i swap = _mm_cmpgt_epi16(weight[k], weight[k - 1]);
+
+            t = mean[k];
+            mean[k] = SELECT128(swap, mean[k - 1], t);
+            mean[k - 1] = SELECT128(swap, t, mean[k - 1]);
+            t = dev[k];
+            dev[k] = SELECT128(swap, dev[k - 1], t);
+            dev[k - 1] = SELECT128(swap, t, dev[k - 1]);
+            t = weight[k];
+            weight[k] = SELECT128(swap, weight[k - 1], t);
+            weight[k - 1] = SELECT128(swap, t, weight[k - 1]);
+        }
+
+        lo = hi = zero;
+        sum = zero;
+
+        for (k = 0; k < ALG_GMM_MODES; k++) {
+            __m128i spread = _mm_add_epi16(dev[k], _mm_add_epi16(dev[k], dev[k]));
+            __m128i in = k ? _mm_xor_si128(_mm_cmpeq_epi16(_mm_subs_epu16(background, sum), zero), ones) : ones;
+            __m128i l = _mm_subs_epu16(mean[k], spread);
+            __m128i h = _mm_adds_epu16(mean[k], spread);
+
+            /* Clamp h to 255 * 128 without an unsigned min. */
+            h = _mm_sub_epi16(h, _mm_subs_epu16(h, top));
+
+            lo = k ? SELECT128(in, _mm_min_epi16(lo, l), lo) : l;
+            hi = k ? SELECT128(in, _mm_max_epi16(hi, h), hi) : h;
+            sum = _mm_adds_epu16(sum, weight[k]);
+
+            _mm_storeu_si128((__m128i *)(m + ALG_GMM_MEAN(k) * stride), mean[k]);
+            _mm_storeu_si128((__m128i *)(m + ALG_GMM_DEV(k) * stride), dev[k]);
+            _mm_storeu_si128((__m128i *)(m + ALG_GMM_WEIGHT(k) * stride), weight[k]);
+        }
+
+        t = _mm_srli_epi16(_mm_add_epi16(_mm_avg_epu16(lo, hi), _mm_set1_epi16(64)), 7);
+        _mm_storel_epi64((__m128i *)(ref + i), _mm_packus_epi16(t, zero));
+        t = _mm_srli_epi16(_mm_add_epi16(_mm_sub_epi16(hi, lo), _mm_set1_epi16(255)), 8);
+        _mm_storel_epi64((__m128i *)(limit + i), _mm_packus_epi16(t, zero));
+    }
+}
+
+#endif /* HAVE_ALG_SIMD_X86 */
+
+/**
+ * alg_simd_select
+ *      Checks the CPU features once and fills in alg_simd.
+ */
+static void alg_simd_select(void)
+{
+#ifdef HAVE_ALG_SIMD_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        alg_simd.name = "AVX2";
+        alg_simd.pixels = 16;
+        memcpy(alg_simd.diff, diff_avx2_variants, sizeof(alg_simd.diff));
+        alg_simd.tile_row = tile_row_avx2;
+        alg_simd.halve = halve_avx2;
+        alg_simd.pack = pack_avx2;
+        alg_simd.morph = morph_avx2;
+        alg_simd.smartmask = smartmask_sse2;
+        alg_simd.average = average_sse2;
+        alg_simd.gmm = gmm_sse2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        alg_simd.name = "SSE2";
+        alg_simd.pixels = 16;
+        memcpy(alg_simd.diff, diff_sse2_variants, sizeof(alg_simd.diff));
+        alg_simd.tile_row = tile_row_sse2;
+        alg_simd.halve = halve_sse2;
+        alg_simd.pack = pack_sse2;
+        alg_simd.morph = morph_sse2;
+        alg_simd.smartmask = smartmask_sse2;
+        alg_simd.average = average_sse2;
+        alg_simd.gmm = gmm_sse2;
+    }
+#endif
+}
+
+/**
+ * alg_simd_init
+ *      Selects the fastest kernels for this CPU. Called from motion_init
+ *      of every thread, the selection itself only happens once.
+ */
+void alg_simd_init(void)
+{
+    pthread_once(&alg_simd_once, alg_simd_select);
+
+    MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Using %s motion detection kernels",
+               alg_simd.name);
+}
@@ -0,0 +1,153 @@
+/*    alg_simd.h
+ *
+ *    Vectorised kernels for the motion detection algorithms in alg.c.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ *
+ */
+
+#ifndef _INCLUDE_ALG_SIMD_H
+#define _INCLUDE_ALG_SIMD_H
+
+#include "motion.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_ALG_SIMD_X86
+#endif
+
+/*
+ * Like inline, but also when the compiler would rather not. Used for the
+ * bodies that are compiled once for every ALG_DIFF_* variant.
+ */
+#ifdef __GNUC__
+#define ALG_INLINE inline __attribute__((always_inline))
+#else
+#define ALG_INLINE inline
+#endif
+
+/* Increment for *smartmask_buffer in alg_diff_standard. */
+#define SMARTMASK_SENSITIVITY_INCR 5
+
+/*
+ * Diff kernels come in one variant for every combination of these flags, so
+ * the choices that are the same for the whole frame are not made again for
+ * every pixel. The variant is the index into the kernel tables.
+ */
+#define ALG_DIFF_MASK      1    /* Per pixel limits from the mask threshold plane */
+#define ALG_DIFF_SMARTMASK 2    /* Apply smartmask_final */
+#define ALG_DIFF_INCR      4    /* Add SMARTMASK_SENSITIVITY_INCR to smartmask_buffer */
+#define ALG_DIFF_VARIANTS  8
+
+/*
+ * Signature of a diff kernel. A kernel handles 'count' pixels, which must be a
+ * multiple of the kernel's 'pixels' width, and must give exactly the same
+ * diffs, out and smartmask_buffer results as the scalar diff of alg.c. A pixel
+ * has motion when its difference is above thresh[i] with ALG_DIFF_MASK and
+ * above noise otherwise; noise must be in the range 0 - 255. The arrays of
+ * the steps the variant does not do may be NULL.
+ */
+typedef int (*alg_diff_kernel)(unsigned char *ref, unsigned char *new, unsigned char *out,
+                               unsigned char *thresh, unsigned char *smartmask_final,
+                               unsigned short *smartmask_buffer, int noise, int count);
+
+/*
+ * Signature of a tile kernel. It stores the number of pixels above noise of
+ * one row of tiles, 'rows' image lines of 'stride' bytes, in tiles.
+ * width must be a multiple of ALG_TILE_SIZE and noise in the range 0 - 255.
+ */
+typedef void (*alg_tile_kernel)(unsigned char *ref, unsigned char *new, int width, int stride,
+                                int rows, int noise, struct tile_stat *tiles);
+
+/*
+ * Signature of a downscale kernel. It writes count pixels of dst, each the
+ * rounded average of a 2x2 block of the two source rows at src and src + width.
+ * count must be a multiple of 16.
+ */
+typedef void (*alg_halve_kernel)(unsigned char *src, int width, unsigned char *dst, int count);
+
+/*
+ * Signature of a pack kernel. It sets bit i % 64 of dst[i / 64] for every non zero
+ * byte i of the count bytes at src. count must be a multiple of 64.
+ */
+typedef void (*alg_pack_kernel)(unsigned char *src, uint64_t *dst, int count);
+
+/*
+ * Signature of a morphology kernel. It runs the erode9, erode5, dilate9 or
+ * dilate5 step selected by filter ('E', 'e', 'D' or 'd') for count pixels of
+ * the middle row row2, reading the pixel before and after them in all three
+ * rows. Results go to dst and the number of non zero results is returned.
+ * count must be a multiple of 16.
+ */
+typedef int (*alg_morph_kernel)(unsigned char *row1, unsigned char *row2, unsigned char *row3,
+                                unsigned char *dst, int count, char filter);
+
+/*
+ * Divisors below ALG_RECIPROCAL_MAX divide any 16 bit value n exactly as
+ * (n * ALG_RECIPROCAL(d)) >> 31.
+ */
+#define ALG_RECIPROCAL_MAX 32768
+#define ALG_RECIPROCAL(d) ((unsigned int)(((1ULL << 31) + (d) - 1) / (d)))
+
+/*
+ * Signature of a smartmask kernel. It does the update of alg_tune_smartmask
+ * for count pixels, a multiple of 16. sensitivity must be below
+ * ALG_RECIPROCAL_MAX and magic its ALG_RECIPROCAL.
+ */
+typedef void (*alg_smartmask_kernel)(unsigned char *smartmask, unsigned char *smartmask_final,
+                                     unsigned short *smartmask_buffer, int count,
+                                     int sensitivity, unsigned int magic);
+
+/*
+ * Signature of a running average kernel. avg holds every pixel in 1/128 steps;
+ * each of the count pixels from x on moves towards new by its distance >> shift,
+ * or >> shift_motion when its bit in the motion bitmap row bits is set. ref gets
+ * the rounded result. new, avg and ref point to the start of the row and count
+ * must be a multiple of 16.
+ */
+typedef void (*alg_average_kernel)(unsigned char *new, unsigned short *avg, unsigned char *ref,
+                                   uint64_t *bits, int x, int count, int shift, int shift_motion);
+
+/*
+ * The mixture model of alg_bg.c has ALG_GMM_MODES modes for every pixel, each a
+ * mean and a mean absolute deviation in 1/128 steps and a weight out of
+ * ALG_GMM_WEIGHT_MAX. It is stored as ALG_GMM_PLANES planes of 16 bit values:
+ * the means, the deviations and the weights, every one ordered by falling weight.
+ */
+#define ALG_GMM_MODES        3
+#define ALG_GMM_MEAN(k)      (k)
+#define ALG_GMM_DEV(k)       (ALG_GMM_MODES + (k))
+#define ALG_GMM_WEIGHT(k)    (2 * ALG_GMM_MODES + (k))
+#define ALG_GMM_PLANES       (3 * ALG_GMM_MODES)
+#define ALG_GMM_DEV_MIN      (1 * 128)
+#define ALG_GMM_DEV_MAX      (20 * 128)
+#define ALG_GMM_DEV_INIT     (8 * 128)    /* Deviation of a new mode */
+#define ALG_GMM_WEIGHT_MAX   32767
+#define ALG_GMM_WEIGHT_INIT  1638         /* Weight of a new mode, 5% */
+#define ALG_GMM_BACKGROUND   22937        /* The strongest modes up to 70% are background */
+
+/*
+ * Signature of a mixture kernel. It does the update of gmm_pixel in alg_bg.c
+ * for count pixels, a multiple of 8. model points to the first of them in the
+ * first plane, the planes are stride values apart. The modes learn by >> shift.
+ */
+typedef void (*alg_gmm_kernel)(unsigned char *new, unsigned short *model, int stride,
+                               unsigned char *ref, unsigned char *limit, int count, int shift);
+
+struct alg_simd_ops {
+    const char *name;               /* Name of the instruction set, for logging */
+    int pixels;                     /* diff handles counts that are a multiple of this */
+    alg_diff_kernel diff[ALG_DIFF_VARIANTS]; /* NULL when only the scalar code is usable */
+    alg_tile_kernel tile_row;       /* NULL when only the scalar code is usable */
+    alg_halve_kernel halve;         /* NULL when only the scalar code is usable */
+    alg_pack_kernel pack;           /* NULL when only the scalar code is usable */
+    alg_morph_kernel morph;         /* NULL when only the scalar code is usable */
+    alg_smartmask_kernel smartmask; /* NULL when only the scalar code is usable */
+    alg_average_kernel average;     /* NULL when only the scalar code is usable */
+    alg_gmm_kernel gmm;             /* NULL when only the scalar code is usable */
+};
+
+extern struct alg_simd_ops alg_simd;
+
+void alg_simd_init(void);
+
+#endif /* _INCLUDE_ALG_SIMD_H */
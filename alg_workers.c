@@ -0,0 +1,260 @@
+/*    alg_workers.c
+ *
+ *    Per camera worker threads for the motion detection algorithms in alg.c.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ *
+ *    Every camera has a single motion_loop thread. With detection_threads set
+ *    above 1 the per pixel stages split the image into horizontal row bands
+ *    which are processed in parallel: the motion thread posts a job, works on
+ *    bands itself and waits until the workers have finished the rest.
+ *    Morphology reads one row above and below each band; those halo rows are
+ *    saved by alg_workers_save_halos before the bands start changing the image.
+ */
+#include "motion.h"
+#include "alg_workers.h"
+
+/**
+ * band_rows
+ *      Returns the first and one past the last image row of a band.
+ */
+static void band_rows(struct context *cnt, int band, int *y0, int *y1)
+{
+    int bands = cnt->workers->bands;
+    int height = cnt->imgs.det_height;
+
+    *y0 = band * height / bands;
+    *y1 = (band + 1) * height / bands;
+}
+
+/**
+ * run_bands
+ *      Claims and runs bands of the current job until none are left.
+ */
+static void run_bands(struct alg_workers *workers)
+{
+    int band, y0, y1, result;
+
+    for (;;) {
+        pthread_mutex_lock(&workers->lock);
+        band = workers->next_band < workers->bands ? workers->next_band++ : -1;
+        pthread_mutex_unlock(&workers->lock);
+
+        if (band < 0)
+            return;
+
+        band_rows(workers->cnt, band, &y0, &y1);
+        result = workers->job(workers->cnt, band, y0, y1, workers->arg);
+
+        pthread_mutex_lock(&workers->lock);
+        workers->result[band] = result;
+
+        if (--workers->pending == 0)
+            pthread_cond_signal(&workers->done);
+
+        pthread_mutex_unlock(&workers->lock);
+    }
+}
+
+/**
+ * worker_thread
+ *      Waits for jobs posted by alg_workers_run until alg_workers_stop.
+ */
+static void *worker_thread(void *arg)
+{
+    struct alg_workers *workers = arg;
+    unsigned int generation = 0;
+
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)workers->cnt->threadnr));
+
+    for (;;) {
+        pthread_mutex_lock(&workers->lock);
+
+        while (workers->generation == generation && !workers->finish)
+            pthread_cond_wait(&workers->start, &workers->lock);
+
+        generation = workers->generation;
+
+        if (workers->finish) {
+            pthread_mutex_unlock(&workers->lock);
+            break;
+        }
+
+        pthread_mutex_unlock(&workers->lock);
+        run_bands(workers);
+    }
+
+    return NULL;
+}
+
+/**
+ * alg_workers_start
+ *      Starts conf.detection_threads - 1 worker threads for the camera. Nothing
+ *      is started for a value of 0 or 1; every job then runs as one band in the
+ *      motion thread. Bands are at least 8 rows of the detection image high.
+ */
+void alg_workers_start(struct context *cnt)
+{
+    struct alg_workers *workers;
+    int bands = cnt->conf.detection_threads;
+    int i;
+
+    cnt->workers = NULL;
+
+    if (bands > ALG_MAX_WORKERS) {
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: detection_threads %d too high, using %d",
+                   bands, ALG_MAX_WORKERS);
+        bands = ALG_MAX_WORKERS;
+    }
+
+    if (bands > cnt->imgs.det_height / 8)
+        bands = cnt->imgs.det_height / 8;
+
+    if (bands <= 1)
+        return;
+
+    workers = mymalloc(sizeof(struct alg_workers));
+    workers->bands = bands;
+    workers->cnt = cnt;
+    workers->halo = mymalloc(2 * bands * cnt->imgs.det_width);
+    pthread_mutex_init(&workers->lock, NULL);
+    pthread_cond_init(&workers->start, NULL);
+    pthread_cond_init(&workers->done, NULL);
+
+    for (i = 0; i < bands - 1; i++) {
+        if (pthread_create(&workers->thread_id[i], NULL, &worker_thread, workers)) {
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Could not start detection thread %d", i + 1);
+            break;
+        }
+    }
+
+    workers->threads = i;
+    cnt->workers = workers;
+
+    /* Fewer threads just means more bands for each; none at all is pointless. */
+    if (workers->threads == 0) {
+        alg_workers_stop(cnt);
+        return;
+    }
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Motion detection split in %d bands on %d threads",
+               bands, workers->threads + 1);
+}
+
+/**
+ * alg_workers_stop
+ *      Stops the worker threads and frees the pool. May be called when no pool
+ *      was started.
+ */
+void alg_workers_stop(struct context *cnt)
+{
+    struct alg_workers *workers = cnt->workers;
+    int i;
+
+    if (!workers)
+        return;
+
+    pthread_mutex_lock(&workers->lock);
+    workers->finish = 1;
+    pthread_cond_broadcast(&workers->start);
+    pthread_mutex_unlock(&workers->lock);
+
+    for (i = 0; i < workers->threads; i++)
+        pthread_join(workers->thread_id[i], NULL);
+
+    pthread_cond_destroy(&workers->done);
+    pthread_cond_destroy(&workers->start);
+    pthread_mutex_destroy(&workers->lock);
+    free(workers->halo);
+    free(workers);
+    cnt->workers = NULL;
+}
+
+/**
+ * alg_workers_run
+ *      Runs job on all bands of the image and returns the sum of the results.
+ *      Returns only when all bands are finished.
+ */
+int alg_workers_run(struct context *cnt, alg_band_job job, void *arg)
+{
+    struct alg_workers *workers = cnt->workers;
+    int i, sum = 0;
+
+    if (!workers)
+        return job(cnt, 0, 0, cnt->imgs.det_height, arg);
+
+    pthread_mutex_lock(&workers->lock);
+    workers->job = job;
+    workers->arg = arg;
+    workers->next_band = 0;
+    workers->pending = workers->bands;
+    workers->generation++;
+    pthread_cond_broadcast(&workers->start);
+    pthread_mutex_unlock(&workers->lock);
+
+    run_bands(workers);
+
+    pthread_mutex_lock(&workers->lock);
+
+    while (workers->pending)
+        pthread_cond_wait(&workers->done, &workers->lock);
+
+    pthread_mutex_unlock(&workers->lock);
+
+    for (i = 0; i < workers->bands; i++)
+        sum += workers->result[i];
+
+    return sum;
+}
+
+/**
+ * alg_workers_save_halos
+ *      Copies the row above and the row below every band of img, so that a
+ *      following in place job sees the rows next to its band unchanged.
+ */
+void alg_workers_save_halos(struct context *cnt, unsigned char *img)
+{
+    struct alg_workers *workers = cnt->workers;
+    int width = cnt->imgs.det_width;
+    int band, y0, y1;
+
+    if (!workers)
+        return;
+
+    for (band = 0; band < workers->bands; band++) {
+        unsigned char *halo = workers->halo + 2 * band * width;
+
+        band_rows(cnt, band, &y0, &y1);
+
+        if (y0 > 0)
+            memcpy(halo, img + (y0 - 1) * width, width);
+
+        if (y1 < cnt->imgs.det_height)
+            memcpy(halo + width, img + y1 * width, width);
+    }
+}
+
+/**
+ * alg_workers_halo
+ *      Returns the rows saved by alg_workers_save_halos for a band. A row is
+ *      NULL at the top and bottom of the image.
+ */
+void alg_workers_halo(struct context *cnt, int band, unsigned char **above, unsigned char **below)
+{
+    struct alg_workers *workers = cnt->workers;
+    int width = cnt->imgs.det_width;
+    int y0, y1;
+
+    *above = *below = NULL;
+
+    if (!workers)
+        return;
+
+    band_rows(cnt, band, &y0, &y1);
+
+    if (y0 > 0)
+        *above = workers->halo + 2 * band * width;
+
+    if (y1 < cnt->imgs.det_height)
+        *below = workers->halo + 2 * band * width + width;
+}
@@ -0,0 +1,48 @@
+/*    alg_workers.h
+ *
+ *    Per camera worker threads for the motion detection algorithms in alg.c.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ *
+ */
+
+#ifndef _INCLUDE_ALG_WORKERS_H
+#define _INCLUDE_ALG_WORKERS_H
+
+#include "motion.h"
+
+/* Upper limit for the detection_threads option. */
+#define ALG_MAX_WORKERS 16
+
+/*
+ * A band job processes image rows y0 up to but not including y1. band is the
+ * index of the band and selects the per band scratch memory. The return values
+ * of all bands are summed by alg_workers_run.
+ */
+typedef int (*alg_band_job)(struct context *cnt, int band, int y0, int y1, void *arg);
+
+struct alg_workers {
+    int bands;                          /* Number of row bands, the motion thread does one */
+    int threads;                        /* Number of worker threads actually running */
+    pthread_t thread_id[ALG_MAX_WORKERS];
+    pthread_mutex_t lock;
+    pthread_cond_t start;               /* Signalled when a new job is posted */
+    pthread_cond_t done;                /* Signalled when the last band is finished */
+    unsigned int generation;            /* Incremented for every job */
+    int next_band;                      /* Next band to be claimed */
+    int pending;                        /* Bands not finished yet */
+    int finish;                         /* Set to make the workers exit */
+    alg_band_job job;
+    void *arg;
+    int result[ALG_MAX_WORKERS];
+    unsigned char *halo;                /* Two saved image rows per band */
+    struct context *cnt;
+};
+
+void alg_workers_start(struct context *cnt);
+void alg_workers_stop(struct context *cnt);
+int alg_workers_run(struct context *cnt, alg_band_job job, void *arg);
+void alg_workers_save_halos(struct context *cnt, unsigned char *img);
+void alg_workers_halo(struct context *cnt, int band, unsigned char **above, unsigned char **below);
+
+#endif /* _INCLUDE_ALG_WORKERS_H */
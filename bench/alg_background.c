@@ -0,0 +1,201 @@
+/*    alg_background.c
+ *
+ *    Benchmark of the average and gmm background models of alg_bg.c at 720p,
+ *    1080p and 4K: a sequence of frames is learnt once with the scalar code
+ *    and once with the kernels picked by alg_simd_init, both from the same
+ *    start. After every frame the models, the reference frames and the noise
+ *    levels must be the same byte for byte, else the program fails. The rows
+ *    start and end at varying pixels, so the scalar tails are run as well.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ *
+ *    Built and run by "make bench".
+ */
+#include "alg_bg.c"
+#include "bench.h"
+
+/* Every learning shift bg_shift can give comes up over the frames. */
+#define BG_SHIFT(frame) (1 + (frame) % BG_SHIFT_MAX)
+
+/* One model of the benchmark: its state and what it outputs. */
+struct bench_bg {
+    unsigned short *state;
+    unsigned char *ref;
+    unsigned char *limit;
+};
+
+/**
+ * bench_frame
+ *      Makes frame f: the base image with a little noise, and every fifth
+ *      frame a quarter of the pixels jumps to a random value, so that modes
+ *      are matched, missed and replaced.
+ */
+static void bench_frame(unsigned char *frame, unsigned char *base, unsigned char *noise,
+                        int size, int f)
+{
+    int i;
+
+    bench_random(noise, size);
+
+    for (i = 0; i < size; i++) {
+        int v = base[i] + noise[i] % 9 - 4;
+
+        if (f % 5 == 4 && noise[i] < 64)
+            v = noise[i] * 4;
+
+        frame[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+    }
+}
+
+/**
+ * bench_bits
+ *      Packs a motion mask of about 10% set pixels into the bitmap rows of
+ *      average_range, words 64 bit words per row.
+ */
+static void bench_bits(uint64_t *bits, unsigned char *mask, int width, int height, int words)
+{
+    int x, y;
+
+    bench_noise(mask, width * height, 10);
+    memset(bits, 0, (words * height + 1) * sizeof(*bits));
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            if (mask[y * width + x])
+                bits[y * words + x / 64] |= (uint64_t)1 << (x % 64);
+        }
+    }
+}
+
+/**
+ * bench_update
+ *      Learns frame into bg the way the band jobs do, one span per row, and
+ *      returns the microseconds it took.
+ */
+static long long bench_update(int gmm, struct bench_bg *bg, unsigned char *frame, uint64_t *bits,
+                              int width, int height, int words, int f)
+{
+    long long start = bench_usec();
+    int size = width * height;
+    int y, x0, x1, pos;
+
+    for (y = 0; y < height; y++) {
+        x0 = y % 17;
+        x1 = width - y % 13;
+        pos = y * width;
+
+        if (gmm)
+            gmm_range(frame + pos + x0, bg->state + pos + x0, size, bg->ref + pos + x0,
+                      bg->limit + pos + x0, x1 - x0, BG_SHIFT(f));
+        else
+            average_range(frame + pos, bg->state + pos, bg->ref + pos, bits + y * words,
+                          x0, x1, BG_SHIFT(f), BG_SHIFT(f + 5));
+    }
+
+    return bench_usec() - start;
+}
+
+/**
+ * bench_reset
+ *      Starts bg from frame as average_reset and gmm_reset do.
+ */
+static void bench_reset(int gmm, struct bench_bg *bg, unsigned char *frame, int size)
+{
+    int i, k;
+
+    for (i = 0; i < size; i++) {
+        if (!gmm) {
+            bg->state[i] = frame[i] << 7;
+            bg->ref[i] = frame[i];
+            continue;
+        }
+
+        for (k = 0; k < ALG_GMM_MODES; k++) {
+            bg->state[ALG_GMM_MEAN(k) * size + i] = frame[i] << 7;
+            bg->state[ALG_GMM_DEV(k) * size + i] = ALG_GMM_DEV_INIT;
+            bg->state[ALG_GMM_WEIGHT(k) * size + i] = k ? 0 : ALG_GMM_WEIGHT_MAX;
+        }
+
+        gmm_output(bg->state + i, size, bg->ref + i, bg->limit + i);
+    }
+}
+
+int main(void)
+{
+    static const char *models[] = { "average", "gmm" };
+    alg_average_kernel average;
+    alg_gmm_kernel gmm;
+    int s, m, f, failed = 0;
+
+    alg_simd_init();
+    average = alg_simd.average;
+    gmm = alg_simd.gmm;
+
+    printf("%-8s %-10s %12s %12s\n", "model", "size", "scalar us", alg_simd.name);
+
+    for (s = 0; s < BENCH_SIZES; s++) {
+        int width = bench_sizes[s].width;
+        int height = bench_sizes[s].height;
+        int size = width * height;
+        int words = (width + 63) / 64;
+        unsigned char *base = mymalloc(size);
+        unsigned char *noise = mymalloc(size);
+        unsigned char *frame = mymalloc(size);
+        uint64_t *bits = mymalloc((words * height + 1) * sizeof(*bits));
+        struct bench_bg bg[2];
+        int i;
+
+        for (i = 0; i < 2; i++) {
+            bg[i].state = mymalloc(ALG_GMM_PLANES * size * sizeof(*bg[i].state));
+            bg[i].ref = mymalloc(size);
+            bg[i].limit = mymalloc(size);
+        }
+
+        bench_random(base, size);
+
+        for (m = 0; m < 2; m++) {
+            int planes = m ? ALG_GMM_PLANES : 1;
+            long long t_scalar = 0, t_simd = 0;
+
+            for (i = 0; i < 2; i++)
+                bench_reset(m, &bg[i], base, size);
+
+            for (f = 0; f < BENCH_RUNS; f++) {
+                bench_frame(frame, base, noise, size, f);
+                bench_bits(bits, noise, width, height, words);
+
+                alg_simd.average = NULL;
+                alg_simd.gmm = NULL;
+                t_scalar += bench_update(m, &bg[0], frame, bits, width, height, words, f);
+                alg_simd.average = average;
+                alg_simd.gmm = gmm;
+                t_simd += bench_update(m, &bg[1], frame, bits, width, height, words, f);
+
+                if (memcmp(bg[0].state, bg[1].state, planes * size * sizeof(*bg[0].state)) ||
+                    memcmp(bg[0].ref, bg[1].ref, size) ||
+                    (m && memcmp(bg[0].limit, bg[1].limit, size))) {
+                    printf("%s %dx%d frame %d: %s differs from the scalar code\n", models[m],
+                           width, height, f, alg_simd.name);
+                    failed = 1;
+                    break;
+                }
+            }
+
+            printf("%-8s %4dx%-5d %12.0f %12.0f\n", models[m], width, height,
+                   (double)t_scalar / BENCH_RUNS, (double)t_simd / BENCH_RUNS);
+        }
+
+        for (i = 0; i < 2; i++) {
+            free(bg[i].state);
+            free(bg[i].ref);
+            free(bg[i].limit);
+        }
+
+        free(base);
+        free(noise);
+        free(frame);
+        free(bits);
+    }
+
+    return failed;
+}
@@ -0,0 +1,117 @@
+/*    alg_morph.c
+ *
+ *    Benchmark of the despeckle filters of alg.c: erode9, erode5, dilate9 and
+ *    dilate5 at 720p, 1080p and 4K, once with the scalar code and once with
+ *    the kernel picked by alg_simd_init. Both must give the same image and the
+ *    same count of set pixels, else the program fails.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ *
+ *    Built and run by "make bench".
+ */
+#include "alg.c"
+#include "bench.h"
+
+struct bench_filter {
+    char filter;
+    const char *name;
+    int percent;    /* Set pixels of the input; erosion needs a dense mask to keep any */
+};
+
+static const struct bench_filter filters[] = {
+    { 'E', "erode9",  95 },
+    { 'e', "erode5",  95 },
+    { 'D', "dilate9", 10 },
+    { 'd', "dilate5", 10 },
+};
+
+/**
+ * morph_run
+ *      Runs one filter step over img, the whole image as a single band.
+ */
+static int morph_run(unsigned char *img, int width, int height, void *buffer, char filter)
+{
+    switch (filter) {
+    case 'E':
+        return erode9(img, width, height, buffer, 0, NULL, NULL);
+    case 'e':
+        return erode5(img, width, height, buffer, 0, NULL, NULL);
+    case 'D':
+        return dilate9(img, width, height, buffer, NULL, NULL);
+    case 'd':
+        return dilate5(img, width, height, buffer, NULL, NULL);
+    }
+
+    return 0;
+}
+
+/**
+ * morph_time
+ *      Returns the average microseconds of one filter step over src, leaving
+ *      the result in img and its count in sum.
+ */
+static double morph_time(unsigned char *src, unsigned char *img, int width, int height,
+                         void *buffer, char filter, int *sum)
+{
+    long long total = 0;
+    int i;
+
+    for (i = 0; i < BENCH_RUNS; i++) {
+        long long start;
+
+        memcpy(img, src, width * height);
+        start = bench_usec();
+        *sum = morph_run(img, width, height, buffer, filter);
+        total += bench_usec() - start;
+    }
+
+    return (double)total / BENCH_RUNS;
+}
+
+int main(void)
+{
+    alg_morph_kernel kernel;
+    int s, f, failed = 0;
+
+    alg_simd_init();
+    kernel = alg_simd.morph;
+
+    printf("%-8s %-10s %12s %12s\n", "filter", "size", "scalar us", alg_simd.name);
+
+    for (s = 0; s < BENCH_SIZES; s++) {
+        int width = bench_sizes[s].width;
+        int height = bench_sizes[s].height;
+        unsigned char *src = mymalloc(width * height);
+        unsigned char *scalar = mymalloc(width * height);
+        unsigned char *simd = mymalloc(width * height);
+        void *buffer = mymalloc(3 * width);
+
+        for (f = 0; f < (int)(sizeof(filters) / sizeof(filters[0])); f++) {
+            double t_scalar, t_simd;
+            int sum_scalar, sum_simd;
+
+            bench_noise(src, width * height, filters[f].percent);
+            alg_simd.morph = NULL;
+            t_scalar = morph_time(src, scalar, width, height, buffer, filters[f].filter,
+                                  &sum_scalar);
+            alg_simd.morph = kernel;
+            t_simd = morph_time(src, simd, width, height, buffer, filters[f].filter, &sum_simd);
+
+            printf("%-8s %4dx%-5d %12.0f %12.0f\n", filters[f].name, width, height,
+                   t_scalar, t_simd);
+
+            if (sum_scalar != sum_simd || memcmp(scalar, simd, width * height)) {
+                printf("%s %dx%d: %s differs from the scalar code\n", filters[f].name,
+                       width, height, alg_simd.name);
+                failed = 1;
+            }
+        }
+
+        free(src);
+        free(scalar);
+        free(simd);
+        free(buffer);
+    }
+
+    return failed;
+}
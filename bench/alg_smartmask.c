@@ -0,0 +1,206 @@
+/*    alg_smartmask.c
+ *
+ *    Check and benchmark of the smartmask update of alg.c. The reciprocal
+ *    ALG_RECIPROCAL is checked against integer division for every 16 bit
+ *    smartmask_buffer value and every divisor below ALG_RECIPROCAL_MAX. Then
+ *    smartmask_band, with the scalar code and with the kernel picked by
+ *    alg_simd_init, is checked against the division loop it replaced and
+ *    timed at 720p, 1080p and 4K.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ *
+ *    Built and run by "make bench".
+ */
+#include "alg.c"
+#include "bench.h"
+
+/* Divisors tried against the division loop; the last one is divided per pixel. */
+static const int sensitivities[] = { 1, 2, 3, 7, 10, 55, 100, 257, 1000, 4097, 32767, 40000 };
+
+/**
+ * smartmask_divide
+ *      The smartmask update as it was before the reciprocal: one division and
+ *      one modulo for every pixel.
+ */
+static void smartmask_divide(unsigned char *smartmask, unsigned char *smartmask_final,
+                             unsigned short *smartmask_buffer, int count, int sensitivity)
+{
+    int i, diff;
+
+    for (i = 0; i < count; i++) {
+        if (smartmask[i] > 0)
+            smartmask[i]--;
+
+        diff = smartmask_buffer[i] / sensitivity;
+
+        if (diff) {
+            if (smartmask[i] <= diff + 80)
+                smartmask[i] += diff;
+            else
+                smartmask[i] = 80;
+            smartmask_buffer[i] %= sensitivity;
+        }
+
+        if (smartmask[i] > 20)
+            smartmask_final[i] = 0;
+        else
+            smartmask_final[i] = 255;
+    }
+}
+
+/**
+ * reciprocal_check
+ *      Returns the number of divisors for which the reciprocal gives a wrong
+ *      quotient for some 16 bit value.
+ */
+static int reciprocal_check(void)
+{
+    unsigned int d, n;
+    int failed = 0;
+
+    for (d = 1; d < ALG_RECIPROCAL_MAX; d++) {
+        unsigned int magic = ALG_RECIPROCAL(d);
+
+        for (n = 0; n < 65536; n++) {
+            if ((((uint64_t)n * magic) >> 31) != n / d) {
+                printf("ALG_RECIPROCAL(%u) gives %u / %u = %u\n", d, n, d,
+                       (unsigned int)(((uint64_t)n * magic) >> 31));
+                failed++;
+                break;
+            }
+        }
+    }
+
+    return failed;
+}
+
+/**
+ * smartmask_fill
+ *      Sets up the smartmask planes of cnt with random values and copies them
+ *      to the reference planes.
+ */
+static void smartmask_fill(struct context *cnt, unsigned char *smartmask,
+                           unsigned short *smartmask_buffer, int count)
+{
+    int i;
+
+    bench_random(cnt->imgs.smartmask, count);
+    bench_random((unsigned char *)cnt->imgs.smartmask_buffer,
+                 count * sizeof(*cnt->imgs.smartmask_buffer));
+
+    /* Keep most of the mask in the range alg_tune_smartmask leaves it in. */
+    for (i = 0; i < count; i++) {
+        if (i % 8)
+            cnt->imgs.smartmask[i] %= 90;
+    }
+
+    memcpy(smartmask, cnt->imgs.smartmask, count);
+    memcpy(smartmask_buffer, cnt->imgs.smartmask_buffer,
+           count * sizeof(*smartmask_buffer));
+}
+
+/**
+ * smartmask_time
+ *      Returns the average microseconds of smartmask_band over the whole image.
+ */
+static double smartmask_time(struct context *cnt, struct smartmask_job *job)
+{
+    long long total = 0;
+    int i;
+
+    for (i = 0; i < BENCH_RUNS; i++) {
+        long long start = bench_usec();
+
+        smartmask_band(cnt, 0, 0, cnt->imgs.det_height, job);
+        total += bench_usec() - start;
+    }
+
+    return (double)total / BENCH_RUNS;
+}
+
+int main(void)
+{
+    struct context *cnt = mymalloc(sizeof(struct context));
+    alg_smartmask_kernel kernel;
+    int s, k, pass, failed;
+
+    alg_simd_init();
+    kernel = alg_simd.smartmask;
+
+    failed = reciprocal_check();
+
+    printf("%-10s %12s %12s %12s\n", "size", "divide us", "scalar us", alg_simd.name);
+
+    for (s = 0; s < BENCH_SIZES; s++) {
+        /* An odd width also leaves a tail for the scalar loop after the kernel. */
+        int width = bench_sizes[s].width + 4 * (s == 0);
+        int height = bench_sizes[s].height;
+        int count = width * height;
+        unsigned char *smartmask = mymalloc(count);
+        unsigned char *smartmask_final = mymalloc(count);
+        unsigned short *smartmask_buffer = mymalloc(count * sizeof(*smartmask_buffer));
+        double t_divide = 0, t_scalar = 0, t_simd = 0;
+        struct smartmask_job job;
+
+        cnt->imgs.det_width = width;
+        cnt->imgs.det_height = height;
+        cnt->imgs.smartmask = mymalloc(count);
+        cnt->imgs.smartmask_final = mymalloc(count);
+        cnt->imgs.smartmask_buffer = mymalloc(count * sizeof(*cnt->imgs.smartmask_buffer));
+
+        for (k = 0; k < (int)(sizeof(sensitivities) / sizeof(sensitivities[0])); k++) {
+            job.sensitivity = sensitivities[k];
+            job.magic = 0;
+            if (job.sensitivity < ALG_RECIPROCAL_MAX)
+                job.magic = ALG_RECIPROCAL(job.sensitivity);
+
+            for (pass = 0; pass < 2; pass++) {
+                alg_simd.smartmask = pass ? kernel : NULL;
+
+                smartmask_fill(cnt, smartmask, smartmask_buffer, count);
+                smartmask_divide(smartmask, smartmask_final, smartmask_buffer, count,
+                                 job.sensitivity);
+                smartmask_band(cnt, 0, 0, height, &job);
+
+                if (memcmp(smartmask, cnt->imgs.smartmask, count) ||
+                    memcmp(smartmask_final, cnt->imgs.smartmask_final, count) ||
+                    memcmp(smartmask_buffer, cnt->imgs.smartmask_buffer,
+                           count * sizeof(*smartmask_buffer))) {
+                    printf("%dx%d sensitivity %d: %s differs from the division\n", width, height,
+                           job.sensitivity, pass ? alg_simd.name : "scalar");
+                    failed++;
+                }
+            }
+        }
+
+        /* Time a typical sensitivity: 5 frames per second at smartmask_speed 5. */
+        job.sensitivity = 30;
+        job.magic = ALG_RECIPROCAL(job.sensitivity);
+
+        for (k = 0; k < BENCH_RUNS; k++) {
+            long long start = bench_usec();
+
+            smartmask_divide(smartmask, smartmask_final, smartmask_buffer, count, job.sensitivity);
+            t_divide += bench_usec() - start;
+        }
+
+        alg_simd.smartmask = NULL;
+        t_scalar = smartmask_time(cnt, &job);
+        alg_simd.smartmask = kernel;
+        t_simd = smartmask_time(cnt, &job);
+
+        printf("%4dx%-5d %12.0f %12.0f %12.0f\n", width, height, t_divide / BENCH_RUNS,
+               t_scalar, t_simd);
+
+        free(smartmask);
+        free(smartmask_final);
+        free(smartmask_buffer);
+        free(cnt->imgs.smartmask);
+        free(cnt->imgs.smartmask_final);
+        free(cnt->imgs.smartmask_buffer);
+    }
+
+    free(cnt);
+
+    return failed != 0;
+}
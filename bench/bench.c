@@ -0,0 +1,67 @@
+/*    bench.c
+ *
+ *    Helpers shared by the benchmarks in this directory.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ */
+#include <stdlib.h>
+#include <sys/time.h>
+#include "bench.h"
+
+const struct bench_size bench_sizes[BENCH_SIZES] = {
+    { 1280, 720 },
+    { 1920, 1080 },
+    { 3840, 2160 },
+};
+
+/* Fixed seed, so every run and every build sees the same input. */
+static unsigned int bench_seed = 12345;
+
+/**
+ * bench_next
+ *      Returns the next value of a small linear congruential generator.
+ */
+static unsigned int bench_next(void)
+{
+    bench_seed = bench_seed * 1103515245 + 12345;
+
+    return bench_seed >> 16;
+}
+
+/**
+ * bench_usec
+ *      Returns the current time in microseconds.
+ */
+long long bench_usec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ * bench_random
+ *      Fills buf with random bytes.
+ */
+void bench_random(unsigned char *buf, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++)
+        buf[i] = bench_next();
+}
+
+/**
+ * bench_noise
+ *      Fills buf with a motion mask: about percent of the bytes are 255, the
+ *      rest 0.
+ */
+void bench_noise(unsigned char *buf, int size, int percent)
+{
+    int i;
+
+    for (i = 0; i < size; i++)
+        buf[i] = (int)(bench_next() % 100) < percent ? 255 : 0;
+}
@@ -0,0 +1,25 @@
+/*    bench.h
+ *
+ *    Helpers shared by the benchmarks in this directory.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ */
+#ifndef _INCLUDE_BENCH_H
+#define _INCLUDE_BENCH_H
+
+#define BENCH_RUNS  20  /* Timed runs of every kernel, the average is printed */
+#define BENCH_SIZES 3
+
+struct bench_size {
+    int width;
+    int height;
+};
+
+/* 720p, 1080p and 4K. */
+extern const struct bench_size bench_sizes[BENCH_SIZES];
+
+long long bench_usec(void);
+void bench_random(unsigned char *buf, int size);
+void bench_noise(unsigned char *buf, int size, int percent);
+
+#endif /* _INCLUDE_BENCH_H */
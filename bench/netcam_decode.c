@@ -0,0 +1,138 @@
+/*    netcam_decode.c
+ *
+ *    Benchmark of the netcam JPEG decoding at 720p, 1080p and 4K: the same
+ *    4:2:0 image is decoded straight into the YUV420P planes by
+ *    netcam_image_raw and through the interleaved YCbCr lines of
+ *    netcam_image_ycbcr. Both must give the same luma, else the program
+ *    fails; the mean chroma difference is printed.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ *
+ *    Built and run by "make bench".
+ */
+#include "netcam_jpeg.c"
+#include "picture.h"
+#include "bench.h"
+
+/**
+ * decode_ycbcr
+ *      Decodes a JPEG as netcam_decode_jpeg does, but without raw_data_out,
+ *      with a decoder netcam_decode_jpeg has already used. Returns the
+ *      jpeg_error of the decoder.
+ */
+static int decode_ycbcr(netcam_decoder *dec, unsigned char *data, int length,
+                        unsigned char *image)
+{
+    j_decompress_ptr cinfo = &dec->cinfo;
+
+    if (setjmp(dec->setjmp_buffer))
+        return NETCAM_GENERAL_ERROR | NETCAM_JPEG_CONV_ERROR;
+
+    dec->jpeg_error = 0;
+    netcam_memory_src(cinfo, (char *)data, length);
+    jpeg_read_header(cinfo, TRUE);
+    cinfo->out_color_space = JCS_YCbCr;
+    jpeg_start_decompress(cinfo);
+    netcam_image_ycbcr(dec->netcam->cnt, cinfo, image);
+    jpeg_finish_decompress(cinfo);
+
+    return dec->jpeg_error;
+}
+
+/**
+ * decode_time
+ *      Returns the average microseconds of decoding the JPEG into image with
+ *      the raw path, or else the interleaved one.
+ */
+static double decode_time(netcam_decoder *dec, unsigned char *jpeg, int size,
+                          unsigned char *image, int raw, int *error)
+{
+    long long start = bench_usec();
+    int i;
+
+    for (i = 0; i < BENCH_RUNS; i++) {
+        if (raw)
+            *error |= netcam_decode_jpeg(dec, jpeg, size, image);
+        else
+            *error |= decode_ycbcr(dec, jpeg, size, image);
+    }
+
+    return (double)(bench_usec() - start) / BENCH_RUNS;
+}
+
+int main(void)
+{
+    struct context *cnt = mymalloc(sizeof(struct context));
+    struct netcam_context *netcam = mymalloc(sizeof(struct netcam_context));
+    struct image_data current;
+    netcam_decoder dec;
+    int s, failed = 0;
+
+    memset(&current, 0, sizeof(current));
+    cnt->current_image = &current;
+    cnt->imgs.type = VIDEO_PALETTE_YUV420P;
+    netcam->cnt = cnt;
+
+    printf("%-10s %14s %12s %12s\n", "size", "interleaved us", "raw us", "chroma diff");
+
+    for (s = 0; s < BENCH_SIZES; s++) {
+        int width = bench_sizes[s].width;
+        int height = bench_sizes[s].height;
+        int size = (width * height * 3) / 2;
+        unsigned char *image = mymalloc(size);
+        unsigned char *raw = mymalloc(size);
+        unsigned char *ycbcr = mymalloc(size);
+        unsigned char *jpeg = mymalloc(size);
+        double t_ycbcr, t_raw;
+        long long chroma = 0;
+        int x, y, i, length, raw_out, error = 0;
+
+        /* Smooth gradients with some noise, more like a camera than noise alone. */
+        bench_random(image, size);
+
+        for (y = 0; y < height; y++) {
+            for (x = 0; x < width; x++)
+                image[y * width + x] = ((x + y) / 8 + image[y * width + x] / 16) & 255;
+        }
+
+        for (i = width * height; i < size; i++)
+            image[i] = 96 + image[i] / 64 + ((i - width * height) % (width / 2)) / 32;
+
+        cnt->imgs.width = width;
+        cnt->imgs.height = height;
+        length = put_picture_memory(cnt, jpeg, size, image, 85);
+
+        memset(&dec, 0, sizeof(dec));
+        dec.netcam = netcam;
+        netcam->width = width;
+        netcam->height = height;
+
+        /* The raw path first, netcam_start_jpeg creates the decompressor. */
+        t_raw = decode_time(&dec, jpeg, length, raw, 1, &error);
+        raw_out = dec.cinfo.raw_data_out;
+        t_ycbcr = decode_time(&dec, jpeg, length, ycbcr, 0, &error);
+
+        for (i = width * height; i < size; i++)
+            chroma += abs(raw[i] - ycbcr[i]);
+
+        printf("%4dx%-5d %14.0f %12.0f %12.2f\n", width, height, t_ycbcr, t_raw,
+               (double)chroma / (size - width * height));
+
+        if (error || !raw_out || memcmp(raw, ycbcr, width * height)) {
+            printf("%dx%d: the raw and interleaved luma differ\n", width, height);
+            failed = 1;
+        }
+
+        netcam_decoder_free(&dec);
+        free(image);
+        free(raw);
+        free(ycbcr);
+        free(jpeg);
+    }
+
+    picture_cleanup(cnt);
+    free(netcam);
+    free(cnt);
+
+    return failed;
+}
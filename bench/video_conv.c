@@ -0,0 +1,156 @@
+/*    video_conv.c
+ *
+ *    Check and benchmark of the pixel format conversions of video_common.c.
+ *    Every conversion is run with the scalar code and with the kernel picked
+ *    by video_simd_init for a range of small and odd sizes, which must give
+ *    the same image and write nothing past its end. Then both are timed at
+ *    720p, 1080p and 4K.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ *
+ *    Built and run by "make bench".
+ */
+#include "motion.h"
+#include "video.h"
+#include "video_simd.h"
+#include "bench.h"
+
+/* Bytes after the image which a conversion must leave alone. */
+#define GUARD_SIZE  64
+#define GUARD_BYTE  0xa5
+
+typedef void (*conv_func)(unsigned char *map, unsigned char *src, int width, int height);
+
+struct bench_conv {
+    const char *name;
+    int bytes;                  /* Source bytes per pixel */
+    video_conv_kernel *kernel;  /* Its entry in video_simd */
+    conv_func conv;
+};
+
+/**
+ * conv_uyvy
+ *      conv_uyvyto420p with the signature of the others.
+ */
+static void conv_uyvy(unsigned char *map, unsigned char *src, int width, int height)
+{
+    conv_uyvyto420p(map, src, width, height);
+}
+
+static struct bench_conv convs[] = {
+    { "yuyv",  2, &video_simd.yuyv,  conv_yuv422to420p },
+    { "uyvy",  2, &video_simd.uyvy,  conv_uyvy },
+    { "rgb24", 3, &video_simd.rgb24, conv_rgb24toyuv420p },
+    { "bayer", 1, &video_simd.bayer, bayer2yuv420p },
+};
+
+/* Sizes of the exactness check: around the kernel widths of 16 pixels. */
+static const int check_widths[] = {
+    2, 4, 6, 8, 14, 16, 18, 20, 22, 30, 32, 34, 36, 46, 48, 50, 638, 640
+};
+static const int check_heights[] = { 2, 4, 6, 8, 10, 16, 18, 480 };
+
+/**
+ * conv_check
+ *      Runs a conversion with the scalar code and with its kernel for one
+ *      size. Returns 1 when they differ or write past the image.
+ */
+static int conv_check(struct bench_conv *conv, video_conv_kernel kernel, int width, int height)
+{
+    int size = (width * height * 3) / 2;
+    unsigned char *src = mymalloc(width * height * conv->bytes);
+    unsigned char *scalar = mymalloc(size + GUARD_SIZE);
+    unsigned char *simd = mymalloc(size + GUARD_SIZE);
+    int i, failed = 0;
+
+    bench_random(src, width * height * conv->bytes);
+    memset(scalar, GUARD_BYTE, size + GUARD_SIZE);
+    memset(simd, GUARD_BYTE, size + GUARD_SIZE);
+
+    *conv->kernel = NULL;
+    conv->conv(scalar, src, width, height);
+    *conv->kernel = kernel;
+    conv->conv(simd, src, width, height);
+
+    if (memcmp(scalar, simd, size)) {
+        printf("%s %dx%d: %s differs from the scalar code\n", conv->name, width, height,
+               video_simd.name);
+        failed = 1;
+    }
+
+    for (i = size; i < size + GUARD_SIZE; i++) {
+        if (scalar[i] != GUARD_BYTE || simd[i] != GUARD_BYTE) {
+            printf("%s %dx%d: written past the image\n", conv->name, width, height);
+            failed = 1;
+            break;
+        }
+    }
+
+    free(src);
+    free(scalar);
+    free(simd);
+
+    return failed;
+}
+
+/**
+ * conv_time
+ *      Returns the average microseconds of one conversion.
+ */
+static double conv_time(struct bench_conv *conv, unsigned char *map, unsigned char *src,
+                        int width, int height)
+{
+    long long start = bench_usec();
+    int i;
+
+    for (i = 0; i < BENCH_RUNS; i++)
+        conv->conv(map, src, width, height);
+
+    return (double)(bench_usec() - start) / BENCH_RUNS;
+}
+
+int main(void)
+{
+    int c, w, h, s, failed = 0;
+
+    video_simd_init();
+
+    for (c = 0; c < (int)(sizeof(convs) / sizeof(convs[0])); c++) {
+        struct bench_conv *conv = &convs[c];
+        video_conv_kernel kernel = *conv->kernel;
+
+        for (w = 0; w < (int)(sizeof(check_widths) / sizeof(check_widths[0])); w++) {
+            for (h = 0; h < (int)(sizeof(check_heights) / sizeof(check_heights[0])); h++)
+                failed |= conv_check(conv, kernel, check_widths[w], check_heights[h]);
+        }
+    }
+
+    printf("%-6s %-10s %12s %12s\n", "format", "size", "scalar us", video_simd.name);
+
+    for (s = 0; s < BENCH_SIZES; s++) {
+        int width = bench_sizes[s].width;
+        int height = bench_sizes[s].height;
+        unsigned char *src = mymalloc(width * height * 3);
+        unsigned char *map = mymalloc((width * height * 3) / 2);
+
+        bench_random(src, width * height * 3);
+
+        for (c = 0; c < (int)(sizeof(convs) / sizeof(convs[0])); c++) {
+            struct bench_conv *conv = &convs[c];
+            video_conv_kernel kernel = *conv->kernel;
+            double t_scalar, t_simd;
+
+            *conv->kernel = NULL;
+            t_scalar = conv_time(conv, map, src, width, height);
+            *conv->kernel = kernel;
+            t_simd = conv_time(conv, map, src, width, height);
+
+            printf("%-6s %4dx%-5d %12.0f %12.0f\n", conv->name, width, height, t_scalar, t_simd);
+        }
+
+        free(src);
+        free(map);
+    }
+
+    return failed;
+}
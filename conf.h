@@ -46,6 +46,12 @@ struct config {
     const char *picture_type;
     int noise;
     int noise_tune;
+    int fused_detection;
+    int detection_threads;
+    int detection_scale;
+    const char *background_model;
+    int jpeg_idle_decode;
+    int jpeg_passthrough;
     int minimum_frame_time;
     int lightswitch;
     int autobright;
@@ -64,6 +70,7 @@ struct config {
     int ffmpeg_vbr;
     int ffmpeg_deinterlace;
     const char *ffmpeg_video_codec;
+    const char *ffmpeg_passthrough;
 #ifdef HAVE_SDL
     int sdl_threadnr;
 #endif
@@ -89,6 +96,8 @@ struct config {
 #endif
     const char *video_device;
     int v4l2_palette;
+    int v4l2_zero_copy;
+    int v4l2_capture_thread;
     const char *vidpipe;
     const char *filepath;
     const char *imagepath;
@@ -119,10 +128,14 @@ struct config {
     char *on_camera_lost;
     const char *motionvidpipe;
     const char *netcam_url;
+    const char *netcam_highres;
     const char *netcam_userpass;
     const char *netcam_keepalive;
     const char *netcam_proxy;
     unsigned int netcam_tolerant_check;
+    int netcam_idle_decode;
+    int netcam_decode_threads;
+    const char *netcam_decode_threading;
     int text_changes;
     const char *text_left;
     const char *text_right;
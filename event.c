@@ -14,6 +14,9 @@
 #if (!defined(BSD))
 #include "video.h"
 #endif
+#ifdef have_av_get_media_type_string
+#include "netcam_rtsp.h"
+#endif
 
 /* Various functions (most doing the actual action) */
 
@@ -537,6 +540,83 @@ static void grey2yuv420p(unsigned char *u, unsigned char *v, int width, int heig
 }
 
 
+#ifdef RTSP_PASSTHROUGH
+/**
+ * event_ffmpeg_passthrough
+ *      Opens the ffmpeg_output movie of an RTSP camera from the packets it
+ *      sends, when ffmpeg_passthrough asks for it.
+ *
+ * Returns
+ *      1 if the movie is open, 0 if it is to be encoded.
+ */
+static int event_ffmpeg_passthrough(struct context *cnt, const char *stamp)
+{
+    if (!cnt->netcam || cnt->netcam->caps.streaming != NCS_RTSP ||
+        !cnt->conf.ffmpeg_passthrough || !strcmp(cnt->conf.ffmpeg_passthrough, "off"))
+        return 0;
+
+    cnt->ffmpeg_output = netcam_rtsp_movie_open(cnt->netcam, cnt->conf.ffmpeg_passthrough,
+                                                cnt->newfilename);
+
+    if (cnt->ffmpeg_output)
+        return 1;
+
+    MOTION_LOG(WRN, TYPE_EVENTS, NO_ERRNO, "%s: No passthrough movie for this event, "
+               "encoding it");
+    snprintf(cnt->newfilename, PATH_MAX - 4, "%s/%s", cnt->conf.filepath, stamp);
+
+    return 0;
+}
+
+/**
+ * event_ffmpeg_passthrough_reopen
+ *      Ends the passthrough movie of an event once the camera was reconnected
+ *      and goes on with a new movie of the new stream, named for the time of
+ *      the picture at hand. The old one keeps its name should both fall into
+ *      the same second.
+ *
+ * Returns
+ *      Function returns nothing.
+ */
+static void event_ffmpeg_passthrough_reopen(struct context *cnt, struct tm *tm)
+{
+    char stamp[PATH_MAX];
+    char oldname[PATH_MAX];
+    char *ext;
+    const char *moviepath = cnt->conf.moviepath ? cnt->conf.moviepath : DEF_MOVIEPATH;
+    int generation = cnt->ffmpeg_output->generation;
+
+    netcam_rtsp_movie_close(cnt->netcam, cnt->ffmpeg_output);
+    cnt->ffmpeg_output = NULL;
+    event(cnt, EVENT_FILECLOSE, NULL, cnt->newfilename, (void *)FTYPE_MPEG, NULL);
+
+    /* Without the extension ffmpeg_open_passthrough appended. */
+    snprintf(oldname, sizeof(oldname), "%s", cnt->newfilename);
+
+    if ((ext = strrchr(oldname, '.')) != NULL)
+        *ext = '\0';
+
+    mystrftime(cnt, stamp, sizeof(stamp), moviepath, tm, NULL, 0);
+    snprintf(cnt->newfilename, PATH_MAX - 4, "%s/%s", cnt->conf.filepath, stamp);
+
+    if (!strcmp(cnt->newfilename, oldname))
+        snprintf(cnt->newfilename, PATH_MAX - 4, "%s/%s-%d", cnt->conf.filepath, stamp,
+                 generation + 1);
+
+    MOTION_LOG(NTC, TYPE_EVENTS, NO_ERRNO, "%s: Camera reconnected, the event goes on "
+               "in a new movie");
+
+    cnt->ffmpeg_output = netcam_rtsp_movie_open(cnt->netcam, cnt->conf.ffmpeg_passthrough,
+                                                cnt->newfilename);
+
+    if (cnt->ffmpeg_output)
+        event(cnt, EVENT_FILECREATE, NULL, cnt->newfilename, (void *)FTYPE_MPEG, NULL);
+    else
+        MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO, "%s: No passthrough movie for the rest "
+                   "of this event");
+}
+#endif
+
 static void event_ffmpeg_newfile(struct context *cnt, int type ATTRIBUTE_UNUSED,
             unsigned char *img, char *dummy1 ATTRIBUTE_UNUSED,
             void *dummy2 ATTRIBUTE_UNUSED, struct tm *currenttime_tm)
@@ -568,7 +648,12 @@ static void event_ffmpeg_newfile(struct context *cnt, int type ATTRIBUTE_UNUSED,
     snprintf(cnt->motionfilename, PATH_MAX - 4, "%s/%sm", cnt->conf.filepath, stamp);
     snprintf(cnt->newfilename, PATH_MAX - 4, "%s/%s", cnt->conf.filepath, stamp);
 
-    if (cnt->conf.ffmpeg_output) {
+#ifdef RTSP_PASSTHROUGH
+    if (cnt->conf.ffmpeg_output && event_ffmpeg_passthrough(cnt, stamp))
+        event(cnt, EVENT_FILECREATE, NULL, cnt->newfilename, (void *)FTYPE_MPEG, NULL);
+#endif
+
+    if (cnt->conf.ffmpeg_output && !cnt->ffmpeg_output) {
         if (cnt->imgs.type == VIDEO_PALETTE_GREY) {
             convbuf = mymalloc((width * height) / 2);
             y = img;
@@ -697,8 +782,20 @@ static void event_ffmpeg_timelapse(struct context *cnt,
 
 static void event_ffmpeg_put(struct context *cnt, int type ATTRIBUTE_UNUSED,
             unsigned char *img, char *dummy1 ATTRIBUTE_UNUSED,
-            void *dummy2 ATTRIBUTE_UNUSED, struct tm *tm ATTRIBUTE_UNUSED)
+            void *dummy2 ATTRIBUTE_UNUSED, struct tm *tm)
 {
+#ifdef RTSP_PASSTHROUGH
+    if (cnt->ffmpeg_output && cnt->ffmpeg_output->passthrough) {
+        int ret = netcam_rtsp_movie_put(cnt->netcam, cnt->ffmpeg_output);
+
+        if (ret == 1) {
+            event_ffmpeg_passthrough_reopen(cnt, tm);
+        } else if (ret == -1) {
+            cnt->finish = 1;
+            cnt->restart = 0;
+        }
+    } else
+#endif
     if (cnt->ffmpeg_output) {
         int width = cnt->imgs.width;
         int height = cnt->imgs.height;
@@ -735,6 +832,11 @@ static void event_ffmpeg_closefile(struct context *cnt,
         if (cnt->ffmpeg_output->udata)
             free(cnt->ffmpeg_output->udata);
 
+#ifdef RTSP_PASSTHROUGH
+        if (cnt->ffmpeg_output->passthrough)
+            netcam_rtsp_movie_close(cnt->netcam, cnt->ffmpeg_output);
+        else
+#endif
         ffmpeg_close(cnt->ffmpeg_output);
         cnt->ffmpeg_output = NULL;
 
@@ -722,6 +722,158 @@ struct ffmpeg *ffmpeg_open(char *ffmpeg_video_codec, char *filename,
     return ffmpeg;
 }
 
+#ifdef FFMPEG_PASSTHROUGH
+/**
+ * ffmpeg_stream_copy
+ *      Copies the codec setup and time base of a stream, so that passthrough
+ *      movies can be opened for it after the input is gone.
+ *
+ * Returns
+ *      The copy, or NULL if any error happens.
+ */
+struct ffmpeg_stream *ffmpeg_stream_copy(AVStream *st)
+{
+    struct ffmpeg_stream *stream = mymalloc(sizeof(struct ffmpeg_stream));
+    int ret;
+
+#ifdef FFMPEG_CODECPAR
+    stream->par = avcodec_parameters_alloc();
+    ret = stream->par ? avcodec_parameters_copy(stream->par, st->codecpar) : AVERROR(ENOMEM);
+#else
+    stream->codec = avcodec_alloc_context3(NULL);
+    ret = stream->codec ? avcodec_copy_context(stream->codec, st->codec) : AVERROR(ENOMEM);
+#endif
+
+    if (ret < 0) {
+        MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, "%s: Could not copy the stream setup");
+        ffmpeg_stream_free(stream);
+        return NULL;
+    }
+
+    stream->time_base = st->time_base;
+
+    return stream;
+}
+
+/**
+ * ffmpeg_stream_free
+ *      Frees a copy made by ffmpeg_stream_copy.
+ *
+ * Returns
+ *      Function returns nothing.
+ */
+void ffmpeg_stream_free(struct ffmpeg_stream *stream)
+{
+    if (!stream)
+        return;
+
+#ifdef FFMPEG_CODECPAR
+    avcodec_parameters_free(&stream->par);
+#else
+    if (stream->codec) {
+        av_freep(&stream->codec->extradata);
+        av_free(stream->codec);
+    }
+#endif
+    free(stream);
+}
+
+/**
+ * ffmpeg_open_passthrough
+ *      Opens a movie which the packets of the stream described by in are
+ *      written to as they are, see ffmpeg_put_packet. There is no encoder,
+ *      so the movie costs hardly more than the disk writes. container is
+ *      "mkv" for Matroska, anything else gives mp4. The extension is appended
+ *      to filename.
+ *
+ * Returns
+ *      A new allocated ffmpeg struct or NULL if any error happens.
+ */
+struct ffmpeg *ffmpeg_open_passthrough(const char *container, char *filename,
+                                       struct ffmpeg_stream *in)
+{
+    struct ffmpeg *ffmpeg;
+    const char *format = "mp4";
+    const char *ext = ".mp4";
+    int ret;
+
+    if (!strcmp(container, "mkv")) {
+        format = "matroska";
+        ext = ".mkv";
+    }
+
+    ffmpeg = mymalloc(sizeof(struct ffmpeg));
+    ffmpeg->passthrough = 1;
+    ffmpeg->in_time_base = in->time_base;
+    ffmpeg->start_dts = AV_NOPTS_VALUE;
+    ffmpeg->last_dts = AV_NOPTS_VALUE;
+    snprintf(ffmpeg->codec, sizeof(ffmpeg->codec), "%s", container);
+
+    /* The 4 allows for ".mp4" or ".mkv" to be appended. */
+    strncat(filename, ext, 4);
+
+    ffmpeg->oc = avformat_alloc_context();
+
+    if (!ffmpeg->oc || !(ffmpeg->oc->oformat = av_guess_format(format, NULL, NULL))) {
+        MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, "%s: Could not set up the %s container",
+                   format);
+        ffmpeg_close(ffmpeg);
+        return NULL;
+    }
+
+    snprintf(ffmpeg->oc->filename, sizeof(ffmpeg->oc->filename), "%s", filename);
+
+    ffmpeg->video_st = avformat_new_stream(ffmpeg->oc, NULL);
+
+    if (!ffmpeg->video_st) {
+        MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, "%s: Could not alloc stream");
+        ffmpeg_close(ffmpeg);
+        return NULL;
+    }
+
+    /* The codec tag of the camera's container may mean nothing in ours. */
+#ifdef FFMPEG_CODECPAR
+    ret = avcodec_parameters_copy(ffmpeg->video_st->codecpar, in->par);
+    ffmpeg->video_st->codecpar->codec_tag = 0;
+#else
+    ret = avcodec_copy_context(ffmpeg->video_st->codec, in->codec);
+    ffmpeg->video_st->codec->codec_tag = 0;
+
+    if (ffmpeg->oc->oformat->flags & AVFMT_GLOBALHEADER)
+        ffmpeg->video_st->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+#endif
+    ffmpeg->video_st->time_base = in->time_base;
+
+    if (ret < 0) {
+        MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, "%s: Could not copy the stream setup");
+        ffmpeg_close(ffmpeg);
+        return NULL;
+    }
+
+    if (avio_open(&ffmpeg->oc->pb, filename, AVIO_FLAG_WRITE) < 0) {
+        /* Path did not exist? */
+        if (errno != ENOENT || create_path(filename) == -1 ||
+            avio_open(&ffmpeg->oc->pb, filename, AVIO_FLAG_WRITE) < 0) {
+            MOTION_LOG(ERR, TYPE_ENCODER, SHOW_ERRNO, "%s: Error opening file %s",
+                       filename);
+            ffmpeg_close(ffmpeg);
+            return NULL;
+        }
+    }
+
+    if ((ret = avformat_write_header(ffmpeg->oc, NULL)) < 0) {
+        MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, "%s: Could not write the header of %s: %d",
+                   filename, ret);
+        avio_close(ffmpeg->oc->pb);
+        ffmpeg->oc->pb = NULL;
+        ffmpeg_close(ffmpeg);
+        return NULL;
+    }
+
+    return ffmpeg;
+}
+#endif /* FFMPEG_PASSTHROUGH */
+
 /**
  * ffmpeg_cleanups
  *      Clean up ffmpeg struct if something was wrong.
@@ -768,6 +920,22 @@ void ffmpeg_close(struct ffmpeg *ffmpeg)
 {
     unsigned int i;
 
+#ifdef FFMPEG_PASSTHROUGH
+    /* A passthrough movie has no codec of its own, see ffmpeg_open_passthrough. */
+    if (ffmpeg->passthrough) {
+        if (ffmpeg->oc && ffmpeg->oc->pb) {
+            av_write_trailer(ffmpeg->oc);
+            avio_close(ffmpeg->oc->pb);
+        }
+
+        if (ffmpeg->oc)
+            avformat_free_context(ffmpeg->oc);
+
+        free(ffmpeg);
+        return;
+    }
+#endif
+
     /* Close each codec */
     if (ffmpeg->video_st) {
         pthread_mutex_lock(&global_lock);
@@ -934,6 +1102,58 @@ int ffmpeg_put_frame(struct ffmpeg *ffmpeg, AVFrame *pic)
     return ret;
 }
 
+#ifdef FFMPEG_PASSTHROUGH
+/**
+ * ffmpeg_put_packet
+ *      Writes a packet to a passthrough movie. Its time stamps are moved so
+ *      that the movie starts at 0 and rescaled to the time base of the movie.
+ *      A packet which does not come after the one before it in decode order
+ *      (e.g. after the camera restarted its clock) is left out, the muxer
+ *      would refuse it.
+ *
+ * Returns
+ *      0, or -1 if the packet could not be written.
+ */
+int ffmpeg_put_packet(struct ffmpeg *ffmpeg, AVPacket *pkt)
+{
+    AVRational tb = ffmpeg->video_st->time_base;
+    int ret;
+
+    if (pkt->dts == AV_NOPTS_VALUE)
+        pkt->dts = pkt->pts;
+
+    if (pkt->dts == AV_NOPTS_VALUE)
+        return 0;
+
+    if (ffmpeg->start_dts == AV_NOPTS_VALUE)
+        ffmpeg->start_dts = pkt->dts;
+
+    if (ffmpeg->last_dts != AV_NOPTS_VALUE && pkt->dts <= ffmpeg->last_dts) {
+        MOTION_LOG(DBG, TYPE_ENCODER, NO_ERRNO, "%s: Packet out of order, dts %lld after %lld",
+                   (long long)pkt->dts, (long long)ffmpeg->last_dts);
+        return 0;
+    }
+
+    ffmpeg->last_dts = pkt->dts;
+
+    if (pkt->pts != AV_NOPTS_VALUE)
+        pkt->pts = av_rescale_q(pkt->pts - ffmpeg->start_dts, ffmpeg->in_time_base, tb);
+
+    pkt->dts = av_rescale_q(pkt->dts - ffmpeg->start_dts, ffmpeg->in_time_base, tb);
+    pkt->duration = av_rescale_q(pkt->duration, ffmpeg->in_time_base, tb);
+    pkt->stream_index = ffmpeg->video_st->index;
+    pkt->pos = -1;
+
+    if ((ret = av_interleaved_write_frame(ffmpeg->oc, pkt)) < 0) {
+        MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, "%s: Error while writing video packet: %d",
+                   ret);
+        return -1;
+    }
+
+    return 0;
+}
+#endif /* FFMPEG_PASSTHROUGH */
+
 /**
  * ffmpeg_prepare_frame
  *      Allocates and prepares a picture frame by setting up the U, Y and V pointers in
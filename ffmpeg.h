@@ -23,6 +23,18 @@
 
 #endif /* AVERROR */
 
+/*
+ * Movies can be written from the packets of a camera stream without decoding
+ * and encoding them, see ffmpeg_open_passthrough. Newer libraries describe a
+ * stream with AVCodecParameters instead of a codec context.
+ */
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(54, 56, 100)
+#define FFMPEG_PASSTHROUGH
+#endif
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57, 37, 100)
+#define FFMPEG_CODECPAR
+#endif
+
 #endif /* HAVE_FFMPEG */
 
 
@@ -48,11 +60,31 @@ struct ffmpeg {
     void *udata;            /* U & V planes for greyscale images */
     int vbr;                /* variable bitrate setting */
     char codec[20];         /* codec name */
+
+    int passthrough;        /* packets are copied, there is no encoder */
+    AVRational in_time_base;/* time base of the copied packets */
+    int64_t start_dts;      /* dts of the first packet written */
+    int64_t last_dts;       /* dts of the last packet written */
+    int64_t next_packet;    /* sequence number of the next packet wanted */
+    int key_wait;           /* packets are skipped until a keyframe */
+    int generation;         /* connection of the camera the packets come from */
 #else
     int dummy;
 #endif
 };
 
+#ifdef FFMPEG_PASSTHROUGH
+/* Copy of the setup of a stream, for ffmpeg_open_passthrough. */
+struct ffmpeg_stream {
+#ifdef FFMPEG_CODECPAR
+    AVCodecParameters *par;
+#else
+    AVCodecContext *codec;
+#endif
+    AVRational time_base;
+};
+#endif
+
 /* Initialize FFmpeg stuff. Needs to be called before ffmpeg_open. */
 void ffmpeg_init(void);
 
@@ -75,6 +107,22 @@ struct ffmpeg *ffmpeg_open(
     int vbr              /* variable bitrate */
     );
 
+#ifdef FFMPEG_PASSTHROUGH
+/* Copies and frees the setup of an input stream. */
+struct ffmpeg_stream *ffmpeg_stream_copy(AVStream *st);
+void ffmpeg_stream_free(struct ffmpeg_stream *stream);
+
+/*
+ * Open a movie of the packets of a stream as they are, in an mp4 or mkv
+ * container. The packets are added with ffmpeg_put_packet.
+ */
+struct ffmpeg *ffmpeg_open_passthrough(const char *container, char *filename,
+                                       struct ffmpeg_stream *in);
+
+/* Writes a packet of the stream a passthrough movie was opened for. */
+int ffmpeg_put_packet(struct ffmpeg *ffmpeg, AVPacket *pkt);
+#endif
+
 /* Puts the image pointed to by the picture member of struct ffmpeg. */
 int ffmpeg_put_image(struct ffmpeg *);
 
@@ -290,6 +290,78 @@ static void my_emit_message(j_common_ptr cinfo, int msg_level)
     (myerr->original_emit_message)(cinfo, msg_level);
 }
 
+/*
+ * A decompressor kept from frame to frame. Creating one and tearing it down
+ * for every frame costs about as much as decoding a small image, so each
+ * camera keeps its own, which is reset with jpeg_abort after an error.
+ */
+struct jpeg_decoder {
+    struct jpeg_decompress_struct dinfo;
+    struct my_error_mgr jerr;
+    int created;
+};
+
+/*
+ * Allocates a decoder for the decode_jpeg_* functions. The decompressor
+ * itself is made on first use.
+ */
+struct jpeg_decoder *jpeg_decoder_new(void)
+{
+    struct jpeg_decoder *dec = mymalloc(sizeof(struct jpeg_decoder));
+
+    memset(dec, 0, sizeof(struct jpeg_decoder));
+
+    return dec;
+}
+
+/*
+ * Destroys the decompressor of a decoder, if it made one, and frees it.
+ */
+void jpeg_decoder_free(struct jpeg_decoder *dec)
+{
+    if (!dec)
+        return;
+
+    if (dec->created)
+        jpeg_destroy_decompress(&dec->dinfo);
+
+    free(dec);
+}
+
+/*
+ * Gets a decoder ready for the next image: the decompressor is made the first
+ * time, then only the warning state of the last image is cleared. Must be
+ * called after the setjmp of the caller.
+ */
+static struct jpeg_decompress_struct *jpeg_decoder_start(struct jpeg_decoder *dec)
+{
+    if (!dec->created) {
+        /* We set up the normal JPEG error routines, then override error_exit. */
+        dec->dinfo.err = jpeg_std_error(&dec->jerr.pub);
+        dec->jerr.pub.error_exit = my_error_exit;
+        /* Also hook the emit_message routine to note corrupt-data warnings. */
+        dec->jerr.original_emit_message = dec->jerr.pub.emit_message;
+        dec->jerr.pub.emit_message = my_emit_message;
+
+        jpeg_create_decompress(&dec->dinfo);
+        dec->created = 1;
+    }
+
+    dec->jerr.pub.num_warnings = 0;
+    dec->jerr.warning_seen = 0;
+
+    return &dec->dinfo;
+}
+
+/*
+ * Returns a decoder whose image failed to the idle state, for the next one.
+ */
+static void jpeg_decoder_abort(struct jpeg_decoder *dec)
+{
+    if (dec->created)
+        jpeg_abort_decompress(&dec->dinfo);
+}
+
 #define MAX_LUMA_WIDTH   4096
 #define MAX_CHROMA_WIDTH 2048
 
@@ -333,70 +405,71 @@ static void add_huff_table(j_decompress_ptr dinfo, JHUFF_TBL **htblptr,
 
 
 
+/* The standard Huffman tables (cf. JPEG standard section K.3) */
+static const UINT8 bits_dc_luminance[17] =
+{ /* 0-base */ 0, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const UINT8 val_dc_luminance[] =
+{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const UINT8 bits_dc_chrominance[17] =
+{ /* 0-base */ 0, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const UINT8 val_dc_chrominance[] =
+{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const UINT8 bits_ac_luminance[17] =
+{ /* 0-base */ 0, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const UINT8 val_ac_luminance[] =
+{ 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+  0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+  0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+  0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+  0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
+  0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+  0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+  0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+  0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+  0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+  0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+  0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+  0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+  0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+  0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+  0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+  0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+  0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+  0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+  0xf9, 0xfa };
+
+static const UINT8 bits_ac_chrominance[17] =
+{ /* 0-base */ 0, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const UINT8 val_ac_chrominance[] =
+{ 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+  0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+  0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+  0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+  0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34,
+  0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+  0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
+  0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+  0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+  0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+  0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+  0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+  0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+  0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+  0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+  0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+  0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+  0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+  0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+  0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+  0xf9, 0xfa };
+
 static void std_huff_tables (j_decompress_ptr dinfo)
 /* Set up the standard Huffman tables (cf. JPEG standard section K.3) */
 /* IMPORTANT: these are only valid for 8-bit data precision! */
 {
-    static const UINT8 bits_dc_luminance[17] =
-    { /* 0-base */ 0, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
-    static const UINT8 val_dc_luminance[] =
-    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
-
-    static const UINT8 bits_dc_chrominance[17] =
-    { /* 0-base */ 0, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
-    static const UINT8 val_dc_chrominance[] =
-    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
-
-    static const UINT8 bits_ac_luminance[17] =
-    { /* 0-base */ 0, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
-    static const UINT8 val_ac_luminance[] =
-    { 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
-      0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
-      0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
-      0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
-      0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
-      0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
-      0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
-      0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
-      0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
-      0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
-      0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
-      0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
-      0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
-      0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
-      0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
-      0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
-      0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
-      0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
-      0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
-      0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
-      0xf9, 0xfa };
-
-    static const UINT8 bits_ac_chrominance[17] =
-    { /* 0-base */ 0, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
-    static const UINT8 val_ac_chrominance[] =
-    { 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
-      0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
-      0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
-      0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
-      0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34,
-      0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
-      0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
-      0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
-      0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
-      0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
-      0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
-      0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
-      0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
-      0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
-      0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
-      0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
-      0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
-      0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
-      0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
-      0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
-      0xf9, 0xfa };
-
     add_huff_table(dinfo, &dinfo->dc_huff_tbl_ptrs[0],
                    bits_dc_luminance, val_dc_luminance);
     add_huff_table(dinfo, &dinfo->ac_huff_tbl_ptrs[0],
@@ -420,6 +493,52 @@ static void guarantee_huff_tables(j_decompress_ptr dinfo)
 }
 
 
+static unsigned char *put_dht_table(unsigned char *dst, int class_id,
+                                    const UINT8 *bits, const UINT8 *val)
+{
+    int nsymbols = 0, len;
+
+    *dst++ = class_id;
+
+    for (len = 1; len <= 16; len++) {
+        *dst++ = bits[len];
+        nsymbols += bits[len];
+    }
+
+    memcpy(dst, val, nsymbols);
+
+    return dst + nsymbols;
+}
+
+/**
+ * jpeg_std_dht
+ *      Writes the standard Huffman tables as a DHT segment, for passing on
+ *      MJPEG frames that leave them out and rely on the decoder to use
+ *      them, as guarantee_huff_tables does.
+ *
+ * Parameters:
+ *      dst     Room for JPEG_STD_DHT_SIZE bytes.
+ *
+ * Returns the size of the segment, JPEG_STD_DHT_SIZE.
+ */
+int jpeg_std_dht(unsigned char *dst)
+{
+    unsigned char *p = dst + 4;
+
+    p = put_dht_table(p, 0x00, bits_dc_luminance, val_dc_luminance);
+    p = put_dht_table(p, 0x10, bits_ac_luminance, val_ac_luminance);
+    p = put_dht_table(p, 0x01, bits_dc_chrominance, val_dc_chrominance);
+    p = put_dht_table(p, 0x11, bits_ac_chrominance, val_ac_chrominance);
+
+    dst[0] = 0xFF;
+    dst[1] = 0xC4;
+    dst[2] = (p - dst - 2) >> 8;
+    dst[3] = (p - dst - 2) & 0xFF;
+
+    return p - dst;
+}
+
+
 #endif /* ...'std' Huffman table generation */
 
 
@@ -439,7 +558,7 @@ static void guarantee_huff_tables(j_decompress_ptr dinfo)
  *        in this case, "a damaged output image is likely."
  *
  */
-int decode_jpeg_raw (unsigned char *jpeg_data, int len,
+int decode_jpeg_raw (struct jpeg_decoder *dec, unsigned char *jpeg_data, int len,
                      int itype, int ctype, unsigned int width,
                      unsigned int height, unsigned char *raw0,
                      unsigned char *raw1, unsigned char *raw2)
@@ -463,51 +582,42 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
 
     JSAMPARRAY scanarray[3] = { row0, row1, row2};
 
-    struct jpeg_decompress_struct dinfo;
-    struct my_error_mgr jerr;
-
-    /* We set up the normal JPEG error routines, then override error_exit. */
-    dinfo.err = jpeg_std_error (&jerr.pub);
-    jerr.pub.error_exit = my_error_exit;
-    /* Also hook the emit_message routine to note corrupt-data warnings. */
-    jerr.original_emit_message = jerr.pub.emit_message;
-    jerr.pub.emit_message = my_emit_message;
-    jerr.warning_seen = 0;
+    struct jpeg_decompress_struct *dinfo;
 
     /* Establish the setjmp return context for my_error_exit to use. */
-    if (setjmp (jerr.setjmp_buffer)) {
+    if (setjmp (dec->jerr.setjmp_buffer)) {
         /* If we get here, the JPEG code has signaled an error. */
-        jpeg_destroy_decompress (&dinfo);
+        jpeg_decoder_abort (dec);
         return -1;
     }
 
-    jpeg_create_decompress (&dinfo);
+    dinfo = jpeg_decoder_start (dec);
 
-    jpeg_buffer_src (&dinfo, jpeg_data, len);
+    jpeg_buffer_src (dinfo, jpeg_data, len);
 
     /*
      * Read header, make some checks and try to figure out what the
      * user really wants.
      */
-    jpeg_read_header (&dinfo, TRUE);
-    dinfo.raw_data_out = TRUE;
+    jpeg_read_header (dinfo, TRUE);
+    dinfo->raw_data_out = TRUE;
 #if JPEG_LIB_VERSION >= 70    
-    dinfo.do_fancy_upsampling = FALSE;
+    dinfo->do_fancy_upsampling = FALSE;
 #endif    
-    dinfo.out_color_space = JCS_YCbCr;
-    dinfo.dct_method = JDCT_IFAST;
-    guarantee_huff_tables(&dinfo);
-    jpeg_start_decompress (&dinfo);
+    dinfo->out_color_space = JCS_YCbCr;
+    dinfo->dct_method = JDCT_IFAST;
+    guarantee_huff_tables(dinfo);
+    jpeg_start_decompress (dinfo);
 
-    if (dinfo.output_components != 3) {
+    if (dinfo->output_components != 3) {
         MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Output components of JPEG image"
-                   " = %d, must be 3", dinfo.output_components);
+                   " = %d, must be 3", dinfo->output_components);
         goto ERR_EXIT;
     }
 
     for (i = 0; i < 3; i++) {
-        hsf[i] = dinfo.comp_info[i].h_samp_factor;
-        vsf[i] = dinfo.comp_info[i].v_samp_factor;
+        hsf[i] = dinfo->comp_info[i].h_samp_factor;
+        vsf[i] = dinfo->comp_info[i].v_samp_factor;
     }
 
     if ((hsf[0] != 2 && hsf[0] != 1) || hsf[1] != 1 || hsf[2] != 1 ||
@@ -526,8 +636,8 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
         }
 
         for (y = 0; y < 16; y++) { // Allocate a special buffer for the extra sampling depth.
-            row1_444[y] = (unsigned char *)malloc(dinfo.output_width * sizeof(char));
-            row2_444[y] = (unsigned char *)malloc(dinfo.output_width * sizeof(char));
+            row1_444[y] = (unsigned char *)malloc(dinfo->output_width * sizeof(char));
+            row2_444[y] = (unsigned char *)malloc(dinfo->output_width * sizeof(char));
         }
         scanarray[1] = row1_444;
         scanarray[2] = row2_444;
@@ -535,40 +645,40 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
 
     /* Height match image height or be exact twice the image height. */
 
-    if (dinfo.output_height == height) {
+    if (dinfo->output_height == height) {
         numfields = 1;
-    } else if (2 * dinfo.output_height == height) {
+    } else if (2 * dinfo->output_height == height) {
         numfields = 2;
     } else {
         MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Read JPEG: requested height = %d, "
-                   "height of image = %d", height, dinfo.output_height);
+                   "height of image = %d", height, dinfo->output_height);
         goto ERR_EXIT;
     }
 
     /* Width is more flexible */
 
-    if (dinfo.output_width > MAX_LUMA_WIDTH) {
+    if (dinfo->output_width > MAX_LUMA_WIDTH) {
         MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Image width of %d exceeds max",
-                   dinfo.output_width);
+                   dinfo->output_width);
         goto ERR_EXIT;
     }
 
-    if (width < 2 * dinfo.output_width / 3) {
+    if (width < 2 * dinfo->output_width / 3) {
         /* Downsample 2:1 */
         hdown = 1;
-        if (2 * width < dinfo.output_width)
-            xsl = (dinfo.output_width - 2 * width) / 2;
+        if (2 * width < dinfo->output_width)
+            xsl = (dinfo->output_width - 2 * width) / 2;
         else
             xsl = 0;
-    } else if (width == 2 * dinfo.output_width / 3) {
+    } else if (width == 2 * dinfo->output_width / 3) {
         /* Special case of 3:2 downsampling */
       hdown = 2;
       xsl = 0;
     } else {
         /* No downsampling */
         hdown = 0;
-        if (width < dinfo.output_width)
-            xsl = (dinfo.output_width - width) / 2;
+        if (width < dinfo->output_width)
+            xsl = (dinfo->output_width - width) / 2;
         else
             xsl = 0;
    }
@@ -582,14 +692,14 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
 
     for (field = 0; field < numfields; field++) {
         if (field > 0) {
-            jpeg_read_header (&dinfo, TRUE);
-            dinfo.raw_data_out = TRUE;
+            jpeg_read_header (dinfo, TRUE);
+            dinfo->raw_data_out = TRUE;
 #if JPEG_LIB_VERSION >= 70            
-            dinfo.do_fancy_upsampling = FALSE;
+            dinfo->do_fancy_upsampling = FALSE;
 #endif            
-            dinfo.out_color_space = JCS_YCbCr;
-            dinfo.dct_method = JDCT_IFAST;
-            jpeg_start_decompress (&dinfo);
+            dinfo->out_color_space = JCS_YCbCr;
+            dinfo->dct_method = JDCT_IFAST;
+            jpeg_start_decompress (dinfo);
         }
 
         if (numfields == 2) {
@@ -609,11 +719,11 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
             yl = yc = 0;
         }
 
-        while (dinfo.output_scanline < dinfo.output_height) {
+        while (dinfo->output_scanline < dinfo->output_height) {
             /* Read raw data */
-            jpeg_read_raw_data (&dinfo, scanarray, 8 * vsf[0]);
+            jpeg_read_raw_data (dinfo, scanarray, 8 * vsf[0]);
 
-            for (y = 0; y < 8 * vsf[0]; yl += numfields, y++) {
+            for (y = 0; y < 8 * vsf[0] && yl < height; yl += numfields, y++) {
                 xd = yl * width;
                 xs = xsl;
 
@@ -707,7 +817,7 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
              */
                 if (vsf[0] == 1) {
                     /* Really downsample */
-                    for (y = 0; y < 8 /*&& yc < height/2*/; y += 2, yc += numfields) {
+                    for (y = 0; y < 8 && yc < height / 2; y += 2, yc += numfields) {
                         xd = yc * width / 2;
 
                         for (x = 0; x < width / 2; x++, xd++) {
@@ -719,7 +829,7 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
 
                 } else {
                     /* Just copy */
-                    for (y = 0; y < 8 /* && yc < height / 2 */; y++, yc += numfields) {
+                    for (y = 0; y < 8 && yc < height / 2; y++, yc += numfields) {
                         xd = yc * width / 2;
 
                         for (x = 0; x < width / 2; x++, xd++) {
@@ -732,9 +842,9 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
             }
         }
 
-        (void) jpeg_finish_decompress (&dinfo);
+        (void) jpeg_finish_decompress (dinfo);
         if (field == 0 && numfields > 1)
-            jpeg_skip_ff (&dinfo);
+            jpeg_skip_ff (dinfo);
     }
 
     if (hsf[0] == 1) {
@@ -744,15 +854,13 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
         }
     }
 
-    jpeg_destroy_decompress (&dinfo);
-
-    if (jerr.warning_seen)
+    if (dec->jerr.warning_seen)
         return 1;
     else
         return 0;
 
 ERR_EXIT:
-    jpeg_destroy_decompress (&dinfo);
+    jpeg_decoder_abort (dec);
     return -1;
 }
 
@@ -765,7 +873,7 @@ ERR_EXIT:
  * ctype            Chroma format for decompression.
  *                  Currently only Y4M_CHROMA_{420JPEG,422} are available
  */
-int decode_jpeg_gray_raw(unsigned char *jpeg_data, int len,
+int decode_jpeg_gray_raw(struct jpeg_decoder *dec, unsigned char *jpeg_data, int len,
                          int itype, int ctype, unsigned int width,
                          unsigned int height, unsigned char *raw0,
                          unsigned char *raw1, unsigned char *raw2)
@@ -779,84 +887,79 @@ int decode_jpeg_gray_raw(unsigned char *jpeg_data, int len,
                           buf0[12], buf0[13], buf0[14], buf0[15]};
 
     JSAMPARRAY scanarray[3] = { row0 };
-    struct jpeg_decompress_struct dinfo;
-    struct my_error_mgr jerr;
-
-    /* We set up the normal JPEG error routines, then override error_exit. */
-    dinfo.err = jpeg_std_error (&jerr.pub);
-    jerr.pub.error_exit = my_error_exit;
+    struct jpeg_decompress_struct *dinfo;
 
     /* Establish the setjmp return context for my_error_exit to use. */
-    if (setjmp (jerr.setjmp_buffer)) {
+    if (setjmp (dec->jerr.setjmp_buffer)) {
         /* If we get here, the JPEG code has signaled an error. */
-        jpeg_destroy_decompress (&dinfo);
+        jpeg_decoder_abort (dec);
         return -1;
     }
 
-    jpeg_create_decompress (&dinfo);
+    dinfo = jpeg_decoder_start (dec);
 
-    jpeg_buffer_src (&dinfo, jpeg_data, len);
+    jpeg_buffer_src (dinfo, jpeg_data, len);
 
     /*
      * Read header, make some checks and try to figure out what the
      * user really wants.
      */
-    jpeg_read_header (&dinfo, TRUE);
-    dinfo.raw_data_out = TRUE;
+    jpeg_read_header (dinfo, TRUE);
+    dinfo->raw_data_out = TRUE;
 #if JPEG_LIB_VERSION >= 70
-    dinfo.do_fancy_upsampling = FALSE;
+    dinfo->do_fancy_upsampling = FALSE;
 #endif    
-    dinfo.out_color_space = JCS_GRAYSCALE;
-    dinfo.dct_method = JDCT_IFAST;
+    dinfo->out_color_space = JCS_GRAYSCALE;
+    dinfo->dct_method = JDCT_IFAST;
 
-    if (dinfo.jpeg_color_space != JCS_GRAYSCALE) {
+    if (dinfo->jpeg_color_space != JCS_GRAYSCALE) {
         MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Expected grayscale colorspace"
                    " for JPEG raw decoding");
         goto ERR_EXIT;
     }
 
-    guarantee_huff_tables(&dinfo);
-    jpeg_start_decompress (&dinfo);
+    guarantee_huff_tables(dinfo);
+    jpeg_start_decompress (dinfo);
 
     hsf[0] = 1; hsf[1] = 1; hsf[2] = 1;
     vsf[0]= 1; vsf[1] = 1; vsf[2] = 1;
 
     /* Height match image height or be exact twice the image height. */
 
-    if (dinfo.output_height == height) {
+    if (dinfo->output_height == height) {
         numfields = 1;
-    } else if (2 * dinfo.output_height == height) {
+    } else if (2 * dinfo->output_height == height) {
         numfields = 2;
     } else {
         MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Read JPEG: requested height = %d, "
-                   "height of image = %d", height, dinfo.output_height);
+                   "height of image = %d", height, dinfo->output_height);
         goto ERR_EXIT;
     }
 
     /* Width is more flexible */
 
-    if (dinfo.output_width > MAX_LUMA_WIDTH) {
+    if (dinfo->output_width > MAX_LUMA_WIDTH) {
         MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Image width of %d exceeds max",
-                    dinfo.output_width);
+                    dinfo->output_width);
         goto ERR_EXIT;
     }
 
-    if (width < 2 * dinfo.output_width / 3) {
+    if (width < 2 * dinfo->output_width / 3) {
         /* Downsample 2:1 */
         hdown = 1;
-        if (2 * width < dinfo.output_width)
-            xsl = (dinfo.output_width - 2 * width) / 2;
+        if (2 * width < dinfo->output_width)
+            xsl = (dinfo->output_width - 2 * width) / 2;
         else
             xsl = 0;
-    } else if (width == 2 * dinfo.output_width / 3) {
+    } else if (width == 2 * dinfo->output_width / 3) {
         /* special case of 3:2 downsampling */
         hdown = 2;
         xsl = 0;
     } else {
         /* No downsampling */
         hdown = 0;
-        if (width < dinfo.output_width)
-            xsl = (dinfo.output_width - width) / 2;
+        if (width < dinfo->output_width)
+            xsl = (dinfo->output_width - width) / 2;
         else
             xsl = 0;
     }
@@ -870,14 +973,14 @@ int decode_jpeg_gray_raw(unsigned char *jpeg_data, int len,
 
     for (field = 0; field < numfields; field++) {
         if (field > 0) {
-            jpeg_read_header (&dinfo, TRUE);
-            dinfo.raw_data_out = TRUE;
+            jpeg_read_header (dinfo, TRUE);
+            dinfo->raw_data_out = TRUE;
 #if JPEG_LIB_VERSION >= 70
-            dinfo.do_fancy_upsampling = FALSE;
+            dinfo->do_fancy_upsampling = FALSE;
 #endif            
-            dinfo.out_color_space = JCS_GRAYSCALE;
-            dinfo.dct_method = JDCT_IFAST;
-            jpeg_start_decompress (&dinfo);
+            dinfo->out_color_space = JCS_GRAYSCALE;
+            dinfo->dct_method = JDCT_IFAST;
+            jpeg_start_decompress (dinfo);
         }
 
         if (numfields == 2) {
@@ -897,8 +1000,8 @@ int decode_jpeg_gray_raw(unsigned char *jpeg_data, int len,
             yl = yc = 0;
         }
 
-        while (dinfo.output_scanline < dinfo.output_height) {
-            jpeg_read_raw_data (&dinfo, scanarray, 16);
+        while (dinfo->output_scanline < dinfo->output_height) {
+            jpeg_read_raw_data (dinfo, scanarray, 16);
 
             for (y = 0; y < 8 * vsf[0]; yl += numfields, y++) {
                 xd = yl * width;
@@ -1010,17 +1113,79 @@ int decode_jpeg_gray_raw(unsigned char *jpeg_data, int len,
             }
         }
 
-        (void) jpeg_finish_decompress (&dinfo);
+        (void) jpeg_finish_decompress (dinfo);
 
         if (field == 0 && numfields > 1)
-            jpeg_skip_ff (&dinfo);
+            jpeg_skip_ff (dinfo);
     }
 
-    jpeg_destroy_decompress (&dinfo);
     return 0;
 
 ERR_EXIT:
-    jpeg_destroy_decompress (&dinfo);
+    jpeg_decoder_abort (dec);
+    return -1;
+}
+
+/*
+ * jpeg_data:       Buffer with jpeg data to decode
+ * len:             Length of buffer
+ * scale:           1, 2, 4 or 8, the image is decoded at 1/scale of its size.
+ *                  libjpeg then does a reduced IDCT, at 8 only the DC
+ *                  coefficient of every block is used.
+ * width, height:   Expected size of the scaled luma plane
+ * raw0             buffer for the output Y channel
+ *
+ * Only the luma is decoded, the chroma components are skipped after the
+ * entropy decoding.
+ *
+ * returns:
+ *    -1 on fatal error or when the scaled image is not width x height
+ *    0 on success
+ *    1 if jpeg lib threw a "corrupt jpeg data" warning.
+ */
+int decode_jpeg_luma(struct jpeg_decoder *dec, unsigned char *jpeg_data, int len, int scale,
+                     unsigned int width, unsigned int height,
+                     unsigned char *raw0)
+{
+    JSAMPROW row;
+    struct jpeg_decompress_struct *dinfo;
+
+    /* Establish the setjmp return context for my_error_exit to use. */
+    if (setjmp (dec->jerr.setjmp_buffer)) {
+        /* If we get here, the JPEG code has signaled an error. */
+        jpeg_decoder_abort (dec);
+        return -1;
+    }
+
+    dinfo = jpeg_decoder_start (dec);
+
+    jpeg_buffer_src (dinfo, jpeg_data, len);
+
+    jpeg_read_header (dinfo, TRUE);
+    dinfo->out_color_space = JCS_GRAYSCALE;
+    dinfo->scale_num = 1;
+    dinfo->scale_denom = scale;
+    dinfo->dct_method = JDCT_IFAST;
+    guarantee_huff_tables(dinfo);
+    jpeg_start_decompress (dinfo);
+
+    /* The caller falls back to a full decode, which reports the size. */
+    if (dinfo->output_width != width || dinfo->output_height != height)
+        goto ERR_EXIT;
+
+    while (dinfo->output_scanline < height) {
+        row = raw0 + dinfo->output_scanline * width;
+        jpeg_read_scanlines (dinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress (dinfo);
+    if (dec->jerr.warning_seen)
+        return 1;
+    else
+        return 0;
+
+ERR_EXIT:
+    jpeg_decoder_abort (dec);
     return -1;
 }
 
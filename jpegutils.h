@@ -43,18 +43,34 @@
 
 
 
-int decode_jpeg_raw(unsigned char *jpeg_data, int len,
+/* A decompressor kept from frame to frame, see jpegutils.c */
+struct jpeg_decoder;
+
+struct jpeg_decoder *jpeg_decoder_new(void);
+void jpeg_decoder_free(struct jpeg_decoder *dec);
+
+int decode_jpeg_raw(struct jpeg_decoder *dec, unsigned char *jpeg_data, int len,
                     int itype, int ctype, unsigned int width,
                     unsigned int height, unsigned char *raw0,
                     unsigned char *raw1, unsigned char *raw2);
 
-int decode_jpeg_gray_raw(unsigned char *jpeg_data, int len,
+int decode_jpeg_gray_raw(struct jpeg_decoder *dec, unsigned char *jpeg_data, int len,
                          int itype, int ctype, unsigned int width,
                          unsigned int height, unsigned char *raw0,
                          unsigned char *raw1, unsigned char *raw2);
 
+int decode_jpeg_luma(struct jpeg_decoder *dec, unsigned char *jpeg_data, int len, int scale,
+                     unsigned int width, unsigned int height,
+                     unsigned char *raw0);
+
 int encode_jpeg_raw(unsigned char *jpeg_data, int len, int quality,
                     int itype, int ctype, unsigned int width,
                     unsigned int height, unsigned char *raw0,
                     unsigned char *raw1, unsigned char *raw2);
+
+/* Size of the DHT segment jpeg_std_dht writes */
+#define JPEG_STD_DHT_SIZE 420
+
+int jpeg_std_dht(unsigned char *dst);
+
 #endif
@@ -17,6 +17,10 @@
 
 #include "conf.h"
 #include "alg.h"
+#include "alg_simd.h"
+#include "alg_workers.h"
+#include "alg_bg.h"
+#include "jpegutils.h"
 #include "track.h"
 #include "event.h"
 #include "picture.h"
@@ -124,10 +128,21 @@ static void image_ring_resize(struct context *cnt, int new_size)
                 int i;
                 for(i = smallest; i < new_size; i++) {
                     tmp[i].image = mymalloc(cnt->imgs.size);
+                    tmp[i].buffer = tmp[i].image;
                     memset(tmp[i].image, 0x80, cnt->imgs.size);  /* initialize to grey */
                 }
             }
             
+            /* Free the buffers of the items that are dropped */
+            {
+                int i;
+                for (i = new_size; i < cnt->imgs.image_ring_size; i++) {
+                    vid_give_back(cnt, &cnt->imgs.image_ring[i]);
+                    free(cnt->imgs.image_ring[i].buffer);
+                    free(cnt->imgs.image_ring[i].jpeg);
+                }
+            }
+
             /* Free the old ring */
             free(cnt->imgs.image_ring);
 
@@ -159,8 +174,10 @@ static void image_ring_destroy(struct context *cnt)
         return;
 
     /* Free all image buffers */
-    for (i = 0; i < cnt->imgs.image_ring_size; i++) 
-        free(cnt->imgs.image_ring[i].image);
+    for (i = 0; i < cnt->imgs.image_ring_size; i++) {
+        free(cnt->imgs.image_ring[i].buffer);
+        free(cnt->imgs.image_ring[i].jpeg);
+    }
     
     
     /* Free the ring */
@@ -185,12 +202,30 @@ static void image_ring_destroy(struct context *cnt)
 static void image_save_as_preview(struct context *cnt, struct image_data *img)
 {
     void * image;
+    unsigned char *jpeg;
+    int jpeg_alloc;
     /* Save preview image pointer */
     image = cnt->imgs.preview_image.image;
+    jpeg = cnt->imgs.preview_image.jpeg;
+    jpeg_alloc = cnt->imgs.preview_image.jpeg_alloc;
     /* Copy all info */
     memcpy(&cnt->imgs.preview_image.image, img, sizeof(struct image_data));
-    /* restore image pointer */
+    /* restore image pointer, the compressed frame stays with img */
     cnt->imgs.preview_image.image = image;
+    cnt->imgs.preview_image.jpeg = jpeg;
+    cnt->imgs.preview_image.jpeg_size = 0;
+    cnt->imgs.preview_image.jpeg_alloc = jpeg_alloc;
+
+    /* The camera's JPEG of the frame goes with it for jpeg_passthrough */
+    if (img->flags & IMAGE_ORIG_JPEG) {
+        if (img->jpeg_size > jpeg_alloc) {
+            cnt->imgs.preview_image.jpeg = myrealloc(jpeg, img->jpeg_size, "image_save_as_preview");
+            cnt->imgs.preview_image.jpeg_alloc = img->jpeg_size;
+        }
+
+        memcpy(cnt->imgs.preview_image.jpeg, img->jpeg, img->jpeg_size);
+        cnt->imgs.preview_image.jpeg_size = img->jpeg_size;
+    }
 
     /* Copy image */
     memcpy(cnt->imgs.preview_image.image, img->image, cnt->imgs.size);
@@ -204,6 +239,7 @@ static void image_save_as_preview(struct context *cnt, struct image_data *img)
 
     /* draw locate box here when mode = LOCATE_PREVIEW */
     if (cnt->locate_motion_mode == LOCATE_PREVIEW) {
+        cnt->imgs.preview_image.flags &= ~IMAGE_ORIG_JPEG;
 
         if (cnt->locate_motion_style == LOCATE_BOX) {
             alg_draw_location(&img->location, &cnt->imgs, cnt->imgs.width, cnt->imgs.preview_image.image,
@@ -221,6 +257,150 @@ static void image_save_as_preview(struct context *cnt, struct image_data *img)
     }
 }
 
+/**
+ * image_text
+ *
+ *   Adds the text_changes, text_left and text_right overlays to a frame.
+ *
+ * Parameters:
+ *
+ *   cnt      - current thread's context struct
+ *   img      - the frame, it must be cnt->current_image for the conversion
+ *              specifiers of the texts
+ */
+static void image_text(struct context *cnt, struct image_data *img)
+{
+    int text_size_factor = cnt->conf.text_double ? 2 : 1;
+
+    /* The camera's JPEG no longer shows the frame */
+    if (cnt->conf.text_changes || cnt->conf.text_left || cnt->conf.text_right)
+        img->flags &= ~IMAGE_ORIG_JPEG;
+
+    /* Add changed pixels in upper right corner of the pictures */
+    if (cnt->conf.text_changes) {
+        char tmp[15];
+
+        if (!cnt->pause)
+            sprintf(tmp, "%d", img->diffs);
+        else
+            sprintf(tmp, "-");
+
+        draw_text(img->image, cnt->imgs.width - 10, 10, 
+                  cnt->imgs.width, tmp, cnt->conf.text_double);
+    }
+
+    /* Add text in lower left corner of the pictures */
+    if (cnt->conf.text_left) {
+        char tmp[PATH_MAX];
+        mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.text_left, 
+                   &img->timestamp_tm, NULL, 0);
+        draw_text(img->image, 10, cnt->imgs.height - 10 * text_size_factor, 
+                  cnt->imgs.width, tmp, cnt->conf.text_double);
+    }
+
+    /* Add text in lower right corner of the pictures */
+    if (cnt->conf.text_right) {
+        char tmp[PATH_MAX];
+        mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.text_right, 
+                   &img->timestamp_tm, NULL, 0);
+        draw_text(img->image, cnt->imgs.width - 10, 
+                  cnt->imgs.height - 10 * text_size_factor,
+                  cnt->imgs.width, tmp, cnt->conf.text_double);
+    }
+}
+
+/**
+ * image_decode
+ *
+ *   Decodes a frame vid_next kept compressed with jpeg_idle_decode, nothing
+ *   to do for other frames. Frames decoded after they passed the overlay
+ *   section of motion_loop get their text here.
+ *
+ * Parameters:
+ *
+ *   cnt      - current thread's context struct
+ *   img      - the frame
+ *   text     - add the text overlays
+ */
+static void image_decode(struct context *cnt, struct image_data *img, int text)
+{
+    if (!(img->flags & IMAGE_JPEG))
+        return;
+
+    if (vid_decode(cnt, img))
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Error decoding a kept JPEG frame");
+
+    if (text)
+        image_text(cnt, img);
+}
+
+/**
+ * image_defer_decode
+ *
+ *   Tells vid_next whether it may keep the next JPEG frame compressed and
+ *   decode only the detection image of it. That is when jpeg_idle_decode is
+ *   on and nothing needs the pixels of every frame: there is no event going
+ *   on, no stream client, no video loopback and no SDL window, and no option
+ *   works on the full image before the detection.
+ *
+ * Parameters:
+ *
+ *   cnt      - current thread's context struct
+ */
+static int image_defer_decode(struct context *cnt)
+{
+    if (!cnt->conf.jpeg_idle_decode || cnt->conf.setup_mode || cnt->conf.emulate_motion)
+        return 0;
+
+    if (cnt->detecting_motion || cnt->postcap || cnt->pipe >= 0 || cnt->stream_count)
+        return 0;
+
+    if (cnt->rotate_data.degrees || cnt->conf.autobright)
+        return 0;
+
+#ifdef HAVE_FFMPEG
+    if (cnt->conf.ffmpeg_deinterlace)
+        return 0;
+#endif
+
+#ifdef HAVE_SDL
+    if (cnt_list[0]->conf.sdl_threadnr == cnt->threadnr)
+        return 0;
+#endif
+
+    return 1;
+}
+
+/**
+ * image_idle_decode
+ *
+ *   Tells an RTSP camera whether it may drop frames from decoding, as set by
+ *   netcam_idle_decode. That is when there is no event going on and motion
+ *   has not been suspected, at half the threshold, for a second.
+ *
+ * Parameters:
+ *
+ *   cnt      - current thread's context struct
+ */
+static int image_idle_decode(struct context *cnt)
+{
+    if (!cnt->conf.netcam_idle_decode || cnt->conf.setup_mode || cnt->conf.emulate_motion)
+        return 0;
+
+    if (cnt->detecting_motion || cnt->postcap || cnt->event_nr == cnt->prev_event ||
+        cnt->current_image->diffs > cnt->threshold / 2) {
+        cnt->quiet_frames = 0;
+        return 0;
+    }
+
+    if (cnt->quiet_frames < cnt->conf.frame_limit) {
+        cnt->quiet_frames++;
+        return 0;
+    }
+
+    return 1;
+}
+
 /**
  * context_init
  *
@@ -416,6 +596,7 @@ static void motion_detected(struct context *cnt, int dev, struct image_data *img
 
     /* Draw location */
     if (cnt->locate_motion_mode == LOCATE_ON) {
+        img->flags &= ~IMAGE_ORIG_JPEG;
 
         if (cnt->locate_motion_style == LOCATE_BOX) {
             alg_draw_location(location, imgs, imgs->width, img->image, LOCATE_BOX,
@@ -533,6 +714,9 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
         cnt->current_image = &cnt->imgs.image_ring[cnt->imgs.image_ring_out];
 
         if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].shot < cnt->conf.frame_limit) {
+            /* Decode a pre_capture frame that was kept compressed */
+            image_decode(cnt, &cnt->imgs.image_ring[cnt->imgs.image_ring_out], 1);
+
             if (cnt->log_level >= DBG) {
                 char tmp[32];
                 const char *t;
@@ -550,6 +734,7 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
 
                 mystrftime(cnt, tmp, sizeof(tmp), "%H%M%S-%q", 
                            &cnt->imgs.image_ring[cnt->imgs.image_ring_out].timestamp_tm, NULL, 0);
+                cnt->imgs.image_ring[cnt->imgs.image_ring_out].flags &= ~IMAGE_ORIG_JPEG;
                 draw_text(cnt->imgs.image_ring[cnt->imgs.image_ring_out].image, 10, 20, 
                           cnt->imgs.width, tmp, cnt->conf.text_double);
                 draw_text(cnt->imgs.image_ring[cnt->imgs.image_ring_out].image, 10, 30, 
@@ -583,6 +768,7 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
                             MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: Added %d fillerframes into movie", 
                                        frames);
                             sprintf(tmp, "Fillerframes %d", frames);
+                            cnt->imgs.image_ring[cnt->imgs.image_ring_out].flags &= ~IMAGE_ORIG_JPEG;
                             draw_text(cnt->imgs.image_ring[cnt->imgs.image_ring_out].image, 10, 40, 
                                       cnt->imgs.width, tmp, cnt->conf.text_double);
                         }
@@ -678,6 +864,9 @@ static int motion_init(struct context *cnt)
 
     cnt->smartmask_speed = 0;
 
+    /* Pick the fastest motion detection kernels this CPU supports */
+    alg_simd_init();
+
     /* 
      * We initialize cnt->event_nr to 1 and cnt->prev_event to 0 (not really needed) so
      * that certain code below does not run until motion has been detected the first time 
@@ -694,6 +883,9 @@ static int motion_init(struct context *cnt)
     if (!cnt->conf.filepath)
         cnt->conf.filepath = mystrdup(".");
 
+    /* The decompressor for MJPEG frames is made on the first one */
+    cnt->jpeg_decoder = jpeg_decoder_new();
+
     /* set the device settings */
     cnt->video_dev = vid_start(cnt);
 
@@ -718,18 +910,40 @@ static int motion_init(struct context *cnt)
 
     image_ring_resize(cnt, 1); /* Create a initial precapture ring buffer with 1 frame */
 
-    cnt->imgs.ref = mymalloc(cnt->imgs.size);
+    /* Set the size of the images motion detection works on */
+    alg_det_init(cnt);
+
+    cnt->imgs.ref = mymalloc(cnt->imgs.det_motionsize);
     cnt->imgs.out = mymalloc(cnt->imgs.size);
     memset(cnt->imgs.out, 0, cnt->imgs.size);
 
     /* contains the moving objects of ref. frame */
-    cnt->imgs.ref_dyn = mymalloc(cnt->imgs.motionsize * sizeof(cnt->imgs.ref_dyn));
+    cnt->imgs.ref_dyn = mymalloc(cnt->imgs.det_motionsize * sizeof(cnt->imgs.ref_dyn));
     cnt->imgs.image_virgin = mymalloc(cnt->imgs.size);
-    cnt->imgs.smartmask = mymalloc(cnt->imgs.motionsize);
-    cnt->imgs.smartmask_final = mymalloc(cnt->imgs.motionsize);
-    cnt->imgs.smartmask_buffer = mymalloc(cnt->imgs.motionsize * sizeof(cnt->imgs.smartmask_buffer));
-    cnt->imgs.labels = mymalloc(cnt->imgs.motionsize * sizeof(cnt->imgs.labels));
-    cnt->imgs.labelsize = mymalloc((cnt->imgs.motionsize/2+1) * sizeof(cnt->imgs.labelsize));
+
+    if (cnt->imgs.det_scale > 1) {
+        cnt->imgs.det_image = mymalloc(cnt->imgs.det_motionsize);
+        cnt->imgs.det_out = mymalloc(cnt->imgs.det_motionsize * 3 / 2);
+    } else {
+        cnt->imgs.det_image = cnt->imgs.image_virgin;
+        cnt->imgs.det_out = cnt->imgs.out;
+    }
+
+    cnt->imgs.smartmask = mymalloc(cnt->imgs.det_motionsize);
+    cnt->imgs.smartmask_final = mymalloc(cnt->imgs.det_motionsize);
+    cnt->imgs.smartmask_buffer = mymalloc(cnt->imgs.det_motionsize * sizeof(*cnt->imgs.smartmask_buffer));
+    cnt->imgs.tile_cols = (cnt->imgs.det_width + ALG_TILE_SIZE - 1) / ALG_TILE_SIZE;
+    cnt->imgs.tile_rows = (cnt->imgs.det_height + ALG_TILE_SIZE - 1) / ALG_TILE_SIZE;
+    cnt->imgs.tiles = mymalloc(cnt->imgs.tile_cols * cnt->imgs.tile_rows * sizeof(*cnt->imgs.tiles));
+    cnt->imgs.det_bits_words = (cnt->imgs.det_width + 63) / 64;
+    cnt->imgs.det_bits = mymalloc(cnt->imgs.det_bits_words * cnt->imgs.det_height * sizeof(uint64_t));
+    cnt->imgs.det_bits_tmp = mymalloc(cnt->imgs.det_bits_words * cnt->imgs.det_height * sizeof(uint64_t));
+    cnt->imgs.labels = mymalloc(cnt->imgs.det_motionsize * sizeof(*cnt->imgs.labels));
+    /* The run and component tables grow in alg_labeling when needed. */
+    cnt->imgs.label_runs_size = cnt->imgs.det_height * 4;
+    cnt->imgs.label_runs = mymalloc(cnt->imgs.label_runs_size * sizeof(*cnt->imgs.label_runs));
+    cnt->imgs.label_stats_size = 256;
+    cnt->imgs.label_stats = mymalloc(cnt->imgs.label_stats_size * sizeof(*cnt->imgs.label_stats));
 
     /* Set output picture type */
     if (!strcmp(cnt->conf.picture_type, "ppm"))
@@ -746,6 +960,12 @@ static int motion_init(struct context *cnt)
      */
     cnt->imgs.common_buffer = mymalloc(3 * cnt->imgs.width * cnt->imgs.height);
 
+    /* Start the threads that share the motion detection, if any */
+    alg_workers_start(cnt);
+
+    /* Allocate the background model, it is filled in with the first image below */
+    alg_bg_start(cnt);
+
     /* 
      * Now is a good time to init rotation data. Since vid_start has been
      * called, we know that we have imgs.width and imgs.height. When capturing
@@ -757,6 +977,11 @@ static int motion_init(struct context *cnt)
      */
     rotate_init(cnt); /* rotate_deinit is called in main */
 
+    /* The first frames are decoded in full, see image_defer_decode */
+    cnt->defer_decode = 0;
+    cnt->idle_decode = 0;
+    cnt->quiet_frames = 0;
+
     /* Capture first image, or we will get an alarm on start */
     if (cnt->video_dev > 0) {
         int i;
@@ -776,6 +1001,7 @@ static int motion_init(struct context *cnt)
     }
 
     /* create a reference frame */
+    alg_det_downscale(cnt, cnt->imgs.image_virgin, cnt->imgs.det_image);
     alg_update_reference_frame(cnt, RESET_REF_FRAME);
 
 #if defined(HAVE_LINUX_VIDEODEV_H) && !defined(WITHOUT_V4L) && !defined(BSD)    
@@ -894,6 +1120,15 @@ static int motion_init(struct context *cnt)
              */
             cnt->imgs.mask = get_pgm(picture, cnt->imgs.width, cnt->imgs.height);
             myfclose(picture);
+
+            /* Motion detection needs the mask at its own size */
+            if (cnt->imgs.mask && cnt->imgs.det_scale > 1) {
+                unsigned char *mask = mymalloc(cnt->imgs.det_motionsize);
+
+                alg_det_downscale(cnt, cnt->imgs.mask, mask);
+                free(cnt->imgs.mask);
+                cnt->imgs.mask = mask;
+            }
         } else {
             MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Error opening mask file %s", 
                        cnt->conf.mask_file);
@@ -909,15 +1144,16 @@ static int motion_init(struct context *cnt)
         } else {
             MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Maskfile \"%s\" loaded.", 
                        cnt->conf.mask_file);
+            alg_mask_spans(cnt);
         }
     } else {
         cnt->imgs.mask = NULL;
     }
 
     /* Always initialize smart_mask - someone could turn it on later... */
-    memset(cnt->imgs.smartmask, 0, cnt->imgs.motionsize);
-    memset(cnt->imgs.smartmask_final, 255, cnt->imgs.motionsize);
-    memset(cnt->imgs.smartmask_buffer, 0, cnt->imgs.motionsize*sizeof(cnt->imgs.smartmask_buffer));
+    memset(cnt->imgs.smartmask, 0, cnt->imgs.det_motionsize);
+    memset(cnt->imgs.smartmask_final, 255, cnt->imgs.det_motionsize);
+    memset(cnt->imgs.smartmask_buffer, 0, cnt->imgs.det_motionsize * sizeof(*cnt->imgs.smartmask_buffer));
 
     /* Set noise level */
     cnt->noise = cnt->conf.noise;
@@ -982,19 +1218,70 @@ static void motion_cleanup(struct context *cnt)
         cnt->imgs.ref_dyn = NULL;
     }
 
+    if (cnt->imgs.ref_next) {
+        free(cnt->imgs.ref_next);
+        cnt->imgs.ref_next = NULL;
+    }
+
+    if (cnt->imgs.ref_dyn_next) {
+        free(cnt->imgs.ref_dyn_next);
+        cnt->imgs.ref_dyn_next = NULL;
+    }
+
+    /* det_image and det_out only have their own memory when detection is scaled */
+    if (cnt->imgs.det_scale > 1) {
+        free(cnt->imgs.det_image);
+        free(cnt->imgs.det_out);
+    }
+
+    cnt->imgs.det_image = NULL;
+    cnt->imgs.det_out = NULL;
+
     if (cnt->imgs.image_virgin) {
         free(cnt->imgs.image_virgin);
         cnt->imgs.image_virgin = NULL;
     }
 
+    if (cnt->imgs.tiles) {
+        free(cnt->imgs.tiles);
+        cnt->imgs.tiles = NULL;
+    }
+
     if (cnt->imgs.labels) {
         free(cnt->imgs.labels);
         cnt->imgs.labels = NULL;
     }
 
-    if (cnt->imgs.labelsize) {
-        free(cnt->imgs.labelsize);
-        cnt->imgs.labelsize = NULL;
+    if (cnt->imgs.det_bits) {
+        free(cnt->imgs.det_bits);
+        cnt->imgs.det_bits = NULL;
+    }
+
+    if (cnt->imgs.det_bits_tmp) {
+        free(cnt->imgs.det_bits_tmp);
+        cnt->imgs.det_bits_tmp = NULL;
+    }
+
+    if (cnt->imgs.label_runs) {
+        free(cnt->imgs.label_runs);
+        cnt->imgs.label_runs = NULL;
+    }
+
+    if (cnt->imgs.label_stats) {
+        free(cnt->imgs.label_stats);
+        cnt->imgs.label_stats = NULL;
+    }
+
+    if (cnt->imgs.mask_threshold) {
+        free(cnt->imgs.mask_threshold);
+        cnt->imgs.mask_threshold = NULL;
+    }
+
+    if (cnt->imgs.mask_spans) {
+        free(cnt->imgs.mask_spans);
+        free(cnt->imgs.mask_span_row);
+        free(cnt->imgs.mask_tiles);
+        cnt->imgs.mask_spans = NULL;
     }
 
     if (cnt->imgs.smartmask) {
@@ -1012,6 +1299,9 @@ static void motion_cleanup(struct context *cnt)
         cnt->imgs.smartmask_buffer = NULL;
     }
 
+    alg_bg_stop(cnt);
+    alg_workers_stop(cnt);
+
     if (cnt->imgs.common_buffer) {
         free(cnt->imgs.common_buffer);
         cnt->imgs.common_buffer = NULL;
@@ -1022,10 +1312,21 @@ static void motion_cleanup(struct context *cnt)
         cnt->imgs.preview_image.image = NULL;
     }
 
+    if (cnt->imgs.preview_image.jpeg) {
+        free(cnt->imgs.preview_image.jpeg);
+        cnt->imgs.preview_image.jpeg = NULL;
+        cnt->imgs.preview_image.jpeg_alloc = 0;
+    }
+
     image_ring_destroy(cnt); /* Cleanup the precapture ring buffer */
 
     rotate_deinit(cnt); /* cleanup image rotation data */
 
+    picture_cleanup(cnt); /* cleanup the jpeg compressors */
+
+    jpeg_decoder_free(cnt->jpeg_decoder); /* and the decompressor */
+    cnt->jpeg_decoder = NULL;
+
     if (cnt->pipe != -1) {
         close(cnt->pipe);
         cnt->pipe = -1;
@@ -1294,7 +1595,7 @@ static void *motion_loop(void *arg)
                 cnt->current_image->timestamp_tm = old_image->timestamp_tm;
                 cnt->current_image->shot = old_image->shot;
                 cnt->current_image->cent_dist = old_image->cent_dist;
-                cnt->current_image->flags = old_image->flags & (~IMAGE_SAVED);
+                cnt->current_image->flags = old_image->flags & (~(IMAGE_SAVED | IMAGE_JPEG | IMAGE_ORIG_JPEG));
                 cnt->current_image->location = old_image->location;
                 cnt->current_image->total_labels = old_image->total_labels;
             }
@@ -1348,10 +1649,18 @@ static void *motion_loop(void *arg)
              * <0 = fatal error - leave the thread by breaking out of the main loop
              * >0 = non fatal error - copy last image or show grey image with message
              */
-            if (cnt->video_dev >= 0)
+            if (cnt->video_dev >= 0) {
+                cnt->defer_decode = image_defer_decode(cnt);
+                /* The capture buffer the slot held since the ring came round last goes back */
+                vid_give_back(cnt, cnt->current_image);
                 vid_return_code = vid_next(cnt, cnt->current_image->image);
-            else
+            } else {
                 vid_return_code = 1; /* Non fatal error */
+            }
+
+            /* Only a good capture leaves the camera's JPEG with the frame */
+            if (vid_return_code != 0)
+                cnt->current_image->flags &= ~IMAGE_ORIG_JPEG;
 
             // VALID PICTURE
             if (vid_return_code == 0) {
@@ -1368,23 +1677,41 @@ static void *motion_loop(void *arg)
 
 #ifdef HAVE_FFMPEG
                 /* Deinterlace the image with ffmpeg, before the image is modified. */
-                if (cnt->conf.ffmpeg_deinterlace) 
+                if (cnt->conf.ffmpeg_deinterlace) {
                     ffmpeg_deinterlace(cnt->current_image->image, cnt->imgs.width, cnt->imgs.height);
+                    cnt->current_image->flags &= ~IMAGE_ORIG_JPEG;
+                }
 #endif
 
                 /* 
                  * Save the newly captured still virgin image to a buffer
-                 * which we will not alter with text and location graphics
+                 * which we will not alter with text and location graphics.
+                 * A frame vid_next kept compressed has only its detection
+                 * image decoded, image_virgin keeps the last full frame.
+                 * A frame in a lent capture buffer is not touched before the
+                 * texts go on, so the detection image is scaled down from it
+                 * and image_virgin, only wanted for missing frames, is
+                 * refreshed once a second.
                  */
-                memcpy(cnt->imgs.image_virgin, cnt->current_image->image, cnt->imgs.size);
+                if (!(cnt->current_image->flags & IMAGE_JPEG)) {
+                    if (cnt->current_image->lent && cnt->imgs.det_scale > 1) {
+                        if (cnt->shots == 0)
+                            memcpy(cnt->imgs.image_virgin, cnt->current_image->image, cnt->imgs.size);
+                        alg_det_downscale(cnt, cnt->current_image->image, cnt->imgs.det_image);
+                    } else {
+                        memcpy(cnt->imgs.image_virgin, cnt->current_image->image, cnt->imgs.size);
+                        alg_det_downscale(cnt, cnt->imgs.image_virgin, cnt->imgs.det_image);
+                    }
+                }
 
                 /* 
                  * If the camera is a netcam we let the camera decide the pace.
                  * Otherwise we will keep on adding duplicate frames.
                  * By resetting the timer the framerate becomes maximum the rate
-                 * of the Netcam.
+                 * of the Netcam. The same goes for a V4L2 capture thread,
+                 * which paces its frames to the framerate itself.
                  */
-                if (cnt->conf.netcam_url) {
+                if (cnt->conf.netcam_url || (cnt->current_image->flags & IMAGE_TIMED)) {
                     gettimeofday(&tv1, NULL);
                     timenow = tv1.tv_usec + 1000000L * tv1.tv_sec;
                 }
@@ -1496,9 +1823,8 @@ static void *motion_loop(void *arg)
              * Make a differences picture in image_out
              *
              * alg_diff_standard is the slower full feature motion detection algorithm
-             * alg_diff first calls a fast detection algorithm which only looks at a
-             * fraction of the pixels. If this detects possible motion alg_diff_standard
-             * is called.
+             * alg_diff first builds a cheap change map of small tiles. If this detects
+             * possible motion the full diff is done, but only in the tiles that changed.
              */
             if (cnt->process_thisframe) {
                 if (cnt->threshold && !cnt->pause) {
@@ -1508,10 +1834,14 @@ static void *motion_loop(void *arg)
                      * motion, the alg_diff will trigger alg_diff_standard
                      * anyway
                      */
-                    if (cnt->detecting_motion || cnt->conf.setup_mode)
-                        cnt->current_image->diffs = alg_diff_standard(cnt, cnt->imgs.image_virgin);
-                    else
-                        cnt->current_image->diffs = alg_diff(cnt, cnt->imgs.image_virgin);
+                    if (cnt->detecting_motion || cnt->conf.setup_mode) {
+                        if (cnt->conf.fused_detection)
+                            cnt->current_image->diffs = alg_diff_fused(cnt, cnt->imgs.det_image);
+                        else
+                            cnt->current_image->diffs = alg_diff_standard(cnt, cnt->imgs.det_image);
+                    } else {
+                        cnt->current_image->diffs = alg_diff(cnt, cnt->imgs.det_image);
+                    }
 
                     /* Lightswitch feature - has light intensity changed?
                      * This can happen due to change of light conditions or due to a sudden change of the camera
@@ -1541,6 +1871,7 @@ static void *motion_loop(void *arg)
                      * because with Round Robin this is controlled by roundrobin_skip.
                      */
                     if (cnt->conf.switchfilter && cnt->current_image->diffs > cnt->threshold) {
+                        image_decode(cnt, cnt->current_image, 0);
                         cnt->current_image->diffs = alg_switchfilter(cnt, cnt->current_image->diffs, 
                                                                      cnt->current_image->image);
                     
@@ -1603,7 +1934,7 @@ static void *motion_loop(void *arg)
              */
             if ((cnt->conf.noise_tune && cnt->shots == 0) &&
                  (!cnt->detecting_motion && (cnt->current_image->diffs <= cnt->threshold)))
-                alg_noise_tune(cnt, cnt->imgs.image_virgin);
+                alg_noise_tune(cnt, cnt->imgs.det_image);
             
 
             /* 
@@ -1630,7 +1961,8 @@ static void *motion_loop(void *arg)
                  * for adding the locate rectangle 
                  */
                 if (cnt->current_image->diffs > cnt->threshold)
-                    alg_locate_center_size(&cnt->imgs, cnt->imgs.width, cnt->imgs.height, &cnt->current_image->location);
+                    alg_locate_center_size(&cnt->imgs, cnt->imgs.det_width, cnt->imgs.det_height,
+                                           &cnt->current_image->location);
 
                 /* 
                  * Update reference frame. 
@@ -1661,29 +1993,43 @@ static void *motion_loop(void *arg)
                 previous_location_y = cnt->current_image->location.y;
             }
 
+            /* A frame with motion gets saved or streamed, decode it before the overlays */
+            if (cnt->current_image->diffs > cnt->threshold)
+                image_decode(cnt, cnt->current_image, 0);
+
         /***** MOTION LOOP - TEXT AND GRAPHICS OVERLAY SECTION *****/
 
             /* 
              * Some overlays on top of the motion image
-             * Note that these now modifies the cnt->imgs.out so this buffer
+             * Note that these now modifies the cnt->imgs.det_out so this buffer
              * can no longer be used for motion detection features until next
              * picture frame is captured.
              */
 
+            /* Erode and dilate only changed the motion bitmap so far */
+            if (cnt->conf.motion_img || cnt->conf.ffmpeg_output_debug || cnt->conf.setup_mode ||
+                cnt->mpipe >= 0)
+                alg_despeckle_out(cnt);
+
             /* Smartmask overlay */
             if (cnt->smartmask_speed && (cnt->conf.motion_img || cnt->conf.ffmpeg_output_debug || 
                 cnt->conf.setup_mode))
-                overlay_smartmask(cnt, cnt->imgs.out);
+                overlay_smartmask(cnt, cnt->imgs.det_out);
 
             /* Largest labels overlay */
             if (cnt->imgs.largest_label && (cnt->conf.motion_img || cnt->conf.ffmpeg_output_debug || 
                 cnt->conf.setup_mode))
-                overlay_largest_label(cnt, cnt->imgs.out);
+                overlay_largest_label(cnt, cnt->imgs.det_out);
 
             /* Fixed mask overlay */
             if (cnt->imgs.mask && (cnt->conf.motion_img || cnt->conf.ffmpeg_output_debug || 
                 cnt->conf.setup_mode))
-                overlay_fixed_mask(cnt, cnt->imgs.out);
+                overlay_fixed_mask(cnt, cnt->imgs.det_out);
+
+            /* Bring the motion image to full size for the outputs that use it */
+            if (cnt->conf.motion_img || cnt->conf.ffmpeg_output_debug || cnt->conf.setup_mode ||
+                cnt->mpipe >= 0)
+                alg_det_upscale(cnt);
 
             /* Initialize the double sized characters if needed. */
             if (cnt->conf.text_double && text_size_factor == 1) {
@@ -1693,18 +2039,9 @@ static void *motion_loop(void *arg)
                 text_size_factor = 1;
             }
 
-            /* Add changed pixels in upper right corner of the pictures */
-            if (cnt->conf.text_changes) {
-                char tmp[15];
-
-                if (!cnt->pause)
-                    sprintf(tmp, "%d", cnt->current_image->diffs);
-                else
-                    sprintf(tmp, "-");
-
-                draw_text(cnt->current_image->image, cnt->imgs.width - 10, 10, 
-                          cnt->imgs.width, tmp, cnt->conf.text_double);
-            }
+            /* Add the texts, a frame that is still compressed gets them when it is decoded */
+            if (!(cnt->current_image->flags & IMAGE_JPEG))
+                image_text(cnt, cnt->current_image);
 
             /* 
              * Add changed pixels to motion-images (for stream) in setup_mode
@@ -1721,25 +2058,6 @@ static void *motion_loop(void *arg)
                           cnt->imgs.width, tmp, cnt->conf.text_double);
             }
 
-            /* Add text in lower left corner of the pictures */
-            if (cnt->conf.text_left) {
-                char tmp[PATH_MAX];
-                mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.text_left, 
-                           &cnt->current_image->timestamp_tm, NULL, 0);
-                draw_text(cnt->current_image->image, 10, cnt->imgs.height - 10 * text_size_factor, 
-                          cnt->imgs.width, tmp, cnt->conf.text_double);
-            }
-
-            /* Add text in lower right corner of the pictures */
-            if (cnt->conf.text_right) {
-                char tmp[PATH_MAX];
-                mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.text_right, 
-                           &cnt->current_image->timestamp_tm, NULL, 0);
-                draw_text(cnt->current_image->image, cnt->imgs.width - 10, 
-                          cnt->imgs.height - 10 * text_size_factor,
-                          cnt->imgs.width, tmp, cnt->conf.text_double);
-            }
-
 
         /***** MOTION LOOP - ACTIONS AND EVENT CONTROL SECTION *****/
 
@@ -1849,6 +2167,9 @@ static void *motion_loop(void *arg)
             /* Update last frame saved time, so we can end event after gap time */
             if (cnt->current_image->flags & IMAGE_SAVE) 
                 cnt->lasttime = cnt->current_image->timestamp;
+
+            /* Let an RTSP camera decode less while nothing happens */
+            cnt->idle_decode = image_idle_decode(cnt);
             
 
             /* 
@@ -1986,6 +2307,7 @@ static void *motion_loop(void *arg)
         if ((cnt->conf.snapshot_interval > 0 && cnt->shots == 0 &&
              time_current_frame % cnt->conf.snapshot_interval <= time_last_frame % cnt->conf.snapshot_interval) ||
              cnt->snapshot) {
+            image_decode(cnt, cnt->current_image, 1);
             event(cnt, EVENT_IMAGE_SNAPSHOT, cnt->current_image->image, NULL, NULL, &cnt->current_image->timestamp_tm);
             cnt->snapshot = 0;
         }
@@ -2050,9 +2372,11 @@ static void *motion_loop(void *arg)
              * add a timelapse frame to the timelapse movie.
              */
             if (cnt->shots == 0 && time_current_frame % cnt->conf.timelapse <= 
-                time_last_frame % cnt->conf.timelapse)
+                time_last_frame % cnt->conf.timelapse) {
+                image_decode(cnt, cnt->current_image, 1);
                 event(cnt, EVENT_TIMELAPSE, cnt->current_image->image, NULL, NULL, 
                       &cnt->current_image->timestamp_tm);
+            }
         } else if (cnt->ffmpeg_timelapse) {
         /* 
          * If timelapse movie is in progress but conf.timelapse is zero then close timelapse file
@@ -2090,9 +2414,14 @@ static void *motion_loop(void *arg)
             event(cnt, EVENT_IMAGE, cnt->current_image->image, NULL, 
                   &cnt->pipe, &cnt->current_image->timestamp_tm);
 
-            if (!cnt->conf.stream_motion || cnt->shots == 1)
+            if (!cnt->conf.stream_motion || cnt->shots == 1) {
+                /* A client that connects now gets this frame */
+                if ((cnt->current_image->flags & IMAGE_JPEG) && stream_waiting(cnt))
+                    image_decode(cnt, cnt->current_image, 1);
+
                 event(cnt, EVENT_STREAM, cnt->current_image->image, NULL, NULL, 
                       &cnt->current_image->timestamp_tm);
+            }
 #ifdef HAVE_SDL
             if (cnt_list[0]->conf.sdl_threadnr == cnt->threadnr)
                 event(cnt, EVENT_SDL_PUT, cnt->current_image->image, NULL, NULL,
@@ -2144,8 +2473,8 @@ static void *motion_loop(void *arg)
             if (cnt->conf.smart_mask_speed != cnt->smartmask_speed || 
                 smartmask_lastrate != cnt->lastrate) {
                 if (cnt->conf.smart_mask_speed == 0) {
-                    memset(cnt->imgs.smartmask, 0, cnt->imgs.motionsize);
-                    memset(cnt->imgs.smartmask_final, 255, cnt->imgs.motionsize);
+                    memset(cnt->imgs.smartmask, 0, cnt->imgs.det_motionsize);
+                    memset(cnt->imgs.smartmask_final, 255, cnt->imgs.det_motionsize);
                 }
 
                 smartmask_lastrate = cnt->lastrate;
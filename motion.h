@@ -230,9 +230,14 @@ struct images;
 #define IMAGE_SAVED      8
 #define IMAGE_PRECAP    16
 #define IMAGE_POSTCAP   32
+#define IMAGE_JPEG      64    /* Not decoded yet, the frame is in image_data.jpeg */
+#define IMAGE_TIMED    128    /* timestamp and shot are the capture's, see v4l2_next */
+#define IMAGE_ORIG_JPEG 256   /* image_data.jpeg is the camera's picture of image, see vid_keep_jpeg */
 
 struct image_data {
     unsigned char *image;
+    unsigned char *buffer;      /* Memory of the slot, image points elsewhere while lent */
+    int lent;                   /* Index + 1 of the capture buffer lent to image, see v4l2_lend */
     int diffs;
     time_t timestamp;           /* Timestamp when image was captured */
     struct tm timestamp_tm;
@@ -249,6 +254,10 @@ struct image_data {
     struct coord location;      /* coordinates for center and size of last motion detection*/
 
     int total_labels;
+
+    unsigned char *jpeg;        /* Compressed frame kept by vid_keep_jpeg */
+    int jpeg_size;
+    int jpeg_alloc;
 };
 
 /* 
@@ -290,15 +299,41 @@ struct images {
     unsigned char *ref;               /* The reference frame */
     unsigned char *out;               /* Picture buffer for motion images */
     int *ref_dyn;                     /* Dynamic objects to be excluded from reference frame */
+    unsigned char *ref_next;          /* Next reference frame, built by alg_diff_fused */
+    int *ref_dyn_next;                /* Next ref_dyn, built by alg_diff_fused */
+    struct fused_pass fused;          /* Frame statistics from alg_diff_fused */
     unsigned char *image_virgin;      /* Last picture frame with no text or locate overlay */
+    unsigned char *det_image;         /* Y plane of image_virgin at detection size */
+    unsigned char *det_out;           /* Motion image at detection size, see alg_det_upscale */
+    uint64_t *det_bits;               /* det_out as one bit per pixel, see alg_despeckle */
+    uint64_t *det_bits_tmp;
+    int det_bits_words;               /* 64 bit words per row of det_bits */
+    int det_bits_changed;             /* det_bits was despeckled, det_out not updated yet */
     struct image_data preview_image;  /* Picture buffer for best image when enables */
     unsigned char *mask;              /* Buffer for the mask file */
+    unsigned char *mask_threshold;    /* Per pixel noise limit from mask and bg_limit, see alg_diff_standard */
+    int mask_threshold_noise;         /* noise level mask_threshold was made for */
+    int diff_variant;                 /* ALG_DIFF_* flags of the current frame */
+    unsigned short *bg_state;         /* Model of the average and gmm background models, see alg_bg.c */
+    unsigned char *bg_limit;          /* Per pixel noise level from the background model, or NULL */
+    int bg_limit_changed;             /* bg_limit changed since mask_threshold was made */
+    struct mask_span *mask_spans;     /* Parts of the rows the mask does not hide, see alg_mask_spans */
+    int *mask_span_row;               /* Index of the first span of every row, det_height + 1 entries */
+    struct mask_span mask_full_row;   /* A whole row, for the stages without a span index */
+    unsigned char *mask_tiles;        /* MASK_TILE_* of every tile */
     unsigned char *smartmask;
     unsigned char *smartmask_final;
     unsigned char *common_buffer;
-    int *smartmask_buffer;
-    int *labels;
-    int *labelsize;
+    unsigned short *smartmask_buffer; /* Saturating motion counters for the smartmask */
+    struct tile_stat *tiles;          /* Change map of ALG_TILE_SIZE square tiles, see alg_diff */
+    int tile_cols;
+    int tile_rows;
+    unsigned short *labels;           /* Component number of every pixel, see alg_labeling */
+    struct label_run *label_runs;
+    struct label_stat *label_stats;   /* Indexed by component number */
+    int label_runs_size;
+    int label_stats_size;
+    int label_count;
     int width;
     int height;
     int type;
@@ -309,6 +344,15 @@ struct images {
     int labels_above;
     int labelsize_max;
     int largest_label;
+    /* 
+     * Motion detection size. ref, det_out, mask, the smartmasks, tiles and
+     * labels are at this size. With a det_scale of 1 det_image and det_out
+     * are the same buffers as image_virgin and out.
+     */
+    int det_scale;
+    int det_width;
+    int det_height;
+    int det_motionsize;
 };
 
 /* Contains data for image rotation, see rotate.c. */
@@ -356,12 +400,21 @@ struct context {
     int locate_motion_mode;
     int locate_motion_style;
     int process_thisframe;
+    int defer_decode;                        /* vid_next may keep a JPEG frame compressed */
+    int idle_decode;                         /* an RTSP camera may drop frames from decoding */
+    int quiet_frames;                        /* frames since motion was last suspected */
     struct rotdata rotate_data;              /* rotation data is thread-specific */
 
     int noise;
     int threshold;
     int diffs_last[THRESHOLD_TUNE_LENGTH];
     int smartmask_speed;
+    struct alg_workers *workers;             /* Detection threads, NULL when there are none */
+    const struct alg_bg_model *bg_model;     /* Background model engine, see alg_bg.c */
+    long long bg_cost;                       /* Microseconds spent in bg_model since the last report */
+    struct picture_cache *picture_cache;     /* JPEG compressors and EXIF block, see picture.c */
+    struct jpeg_decoder *jpeg_decoder;       /* JPEG decompressor of the captured frames, see jpegutils.c */
+    int bg_cost_frames;                      /* Updates since the last report */
 
     /* Commands to the motion thread */
     volatile unsigned int snapshot;    /* Make a snapshot */
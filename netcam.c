@@ -39,6 +39,12 @@
  */
 #include "motion.h"
 
+#if (defined(BSD) && !defined(PWCBSD))
+#include "video_freebsd.h"
+#else
+#include "video.h"
+#endif /* BSD */
+
 #include <netdb.h>
 #include <netinet/in.h>
 #include <regex.h>                    /* For parsing of the URL */
@@ -1072,6 +1078,83 @@ static void netcam_check_buffsize(netcam_buff_ptr buff, size_t numbytes)
     buff->size = new_size;
 }
 
+/**
+ * netcam_image_ready
+ *
+ *      Called by the camera handler when an image has been read into
+ *      netcam->receiving. If the motion loop takes decoded frames, the
+ *      image is decoded here, while the motion loop is still busy with the
+ *      previous one. Then the 'receiving' buffer is set atomically as
+ *      'latest', the buffer previously in 'latest' becomes the new
+ *      'receiving', and the decoded frame becomes 'frame_ready'.
+ *
+ *      Every image is decoded, replacing a 'frame_ready' that has not been
+ *      taken yet, so the motion loop always gets the newest frame even
+ *      when the camera sends faster than the motion framerate. A frame
+ *      whose decode overlapped netcam_next dropping the frames is thrown
+ *      away, it may be older than the motion loop's next picture.
+ *
+ * Parameters:
+ *      netcam          Pointer to netcam context
+ *
+ * Returns:             Nothing
+ */
+static void netcam_image_ready(netcam_context_ptr netcam)
+{
+    netcam_buff *xchg, *jpeg;
+    unsigned char *frame;
+    unsigned int reset;
+    int decode, ret = 0;
+
+    pthread_mutex_lock(&netcam->mutex);
+    decode = netcam->frame_wanted && netcam->frame_decoding;
+    reset = netcam->frame_reset;
+    pthread_mutex_unlock(&netcam->mutex);
+
+    if (decode) {
+        ret = netcam_decode_jpeg(&netcam->handler_decoder,
+                                 (unsigned char *)netcam->receiving->ptr,
+                                 netcam->receiving->used, netcam->frame_decoding);
+
+        /* Keep the image with the frame for jpeg_passthrough */
+        if (netcam->jpeg_decoding) {
+            netcam->jpeg_decoding->used = 0;
+            netcam_check_buffsize(netcam->jpeg_decoding, netcam->receiving->used);
+            memcpy(netcam->jpeg_decoding->ptr, netcam->receiving->ptr,
+                   netcam->receiving->used);
+            netcam->jpeg_decoding->used = netcam->receiving->used;
+        }
+    }
+
+    pthread_mutex_lock(&netcam->mutex);
+
+    xchg = netcam->latest;
+    netcam->latest = netcam->receiving;
+    netcam->receiving = xchg;
+    netcam->imgcnt++;
+
+    /* The motion loop dropped the frames while this one was decoded. */
+    if (decode && reset == netcam->frame_reset) {
+        frame = netcam->frame_ready;
+        netcam->frame_ready = netcam->frame_decoding;
+        netcam->frame_decoding = frame;
+        jpeg = netcam->jpeg_ready;
+        netcam->jpeg_ready = netcam->jpeg_decoding;
+        netcam->jpeg_decoding = jpeg;
+        netcam->frame_error = ret;
+        netcam->frame_new = 1;
+    }
+
+    /*
+     * We have a new frame ready.  We send a signal so that
+     * any thread (e.g. the motion main loop) waiting for the
+     * next frame to become available may proceed.
+     */
+    pthread_cond_signal(&netcam->pic_ready);
+
+    pthread_mutex_unlock(&netcam->mutex);
+}
+
 /**
  * netcam_read_html_jpeg
  *
@@ -1137,7 +1220,6 @@ static int netcam_read_html_jpeg(netcam_context_ptr netcam)
     size_t rem, rlen, ix;   /* Working vars */
     int retval;
     char *ptr, *bptr, *rptr;
-    netcam_buff *xchg;
     struct timeval curtime;
     /*
      * Initialisation - set our local pointers to the context
@@ -1341,20 +1423,7 @@ static int netcam_read_html_jpeg(netcam_context_ptr netcam)
     }
     netcam->last_image = curtime;
 
-    pthread_mutex_lock(&netcam->mutex);
-
-    xchg = netcam->latest;
-    netcam->latest = netcam->receiving;
-    netcam->receiving = xchg;
-    netcam->imgcnt++;
-    /*
-     * We have a new frame ready.  We send a signal so that
-     * any thread (e.g. the motion main loop) waiting for the
-     * next frame to become available may proceed.
-     */
-    pthread_cond_signal(&netcam->pic_ready);
-
-    pthread_mutex_unlock(&netcam->mutex);
+    netcam_image_ready(netcam);
 
     if (netcam->caps.streaming == NCS_UNSUPPORTED) {
         if (!netcam->connect_keepalive) {
@@ -1511,7 +1580,6 @@ static int netcam_mjpg_buffer_refill(netcam_context_ptr netcam)
 static int netcam_read_mjpg_jpeg(netcam_context_ptr netcam)
 {
     netcam_buff_ptr buffer;
-    netcam_buff *xchg;
     struct timeval curtime;
     mjpg_header mh;
     size_t read_bytes;
@@ -1621,20 +1689,7 @@ static int netcam_read_mjpg_jpeg(netcam_context_ptr netcam)
     }
     netcam->last_image = curtime;
 
-    pthread_mutex_lock(&netcam->mutex);
-
-    xchg = netcam->latest;
-    netcam->latest = netcam->receiving;
-    netcam->receiving = xchg;
-    netcam->imgcnt++;
-    /*
-     * We have a new frame ready.  We send a signal so that
-     * any thread (e.g. the motion main loop) waiting for the
-     * next frame to become available may proceed.
-     */
-    pthread_cond_signal(&netcam->pic_ready);
-
-    pthread_mutex_unlock(&netcam->mutex);
+    netcam_image_ready(netcam);
 
     return 0;
 }
@@ -1651,7 +1706,6 @@ static int netcam_read_ftp_jpeg(netcam_context_ptr netcam)
 {
     netcam_buff_ptr buffer;
     int len;
-    netcam_buff *xchg;
     struct timeval curtime;
 
     /* Point to our working buffer. */
@@ -1701,21 +1755,7 @@ static int netcam_read_ftp_jpeg(netcam_context_ptr netcam)
      * as 'latest', and make the buffer previously in 'latest' become
      * the new 'receiving'.
      */
-    pthread_mutex_lock(&netcam->mutex);
-
-    xchg = netcam->latest;
-    netcam->latest = netcam->receiving;
-    netcam->receiving = xchg;
-    netcam->imgcnt++;
-
-    /*
-     * We have a new frame ready.  We send a signal so that
-     * any thread (e.g. the motion main loop) waiting for the
-     * next frame to become available may proceed.
-     */
-    pthread_cond_signal(&netcam->pic_ready);
-
-    pthread_mutex_unlock(&netcam->mutex);
+    netcam_image_ready(netcam);
 
     return 0;
 }
@@ -1737,7 +1777,6 @@ static int netcam_read_file_jpeg(netcam_context_ptr netcam)
 
     netcam_buff_ptr buffer;
     int len;
-    netcam_buff *xchg;
     struct timeval curtime;
     struct stat statbuf;
 
@@ -1828,20 +1867,7 @@ static int netcam_read_file_jpeg(netcam_context_ptr netcam)
      * as 'latest', and make the buffer previously in 'latest' become
      * the new 'receiving'.
      */
-    pthread_mutex_lock(&netcam->mutex);
-
-    xchg = netcam->latest;
-    netcam->latest = netcam->receiving;
-    netcam->receiving = xchg;
-    netcam->imgcnt++;
-
-    /*
-     * We have a new frame ready.  We send a signal so that
-     * any thread (e.g. the motion main loop) waiting for the
-     * next frame to become available may proceed.
-     */
-    pthread_cond_signal(&netcam->pic_ready);
-    pthread_mutex_unlock(&netcam->mutex);
+    netcam_image_ready(netcam);
 
     MOTION_LOG(DBG, TYPE_NETCAM, NO_ERRNO, "%s: End");
     
@@ -2616,6 +2642,13 @@ void netcam_cleanup(netcam_context_ptr netcam, int init_retry_flag)
     /* We don't need any lock anymore, so release it. */
     pthread_mutex_unlock(&netcam->mutex);
 
+#ifdef have_av_get_media_type_string
+    if (netcam->caps.streaming == NCS_RTSP) {
+        netcam_rtsp_highres_stop(netcam);
+        netcam_shutdown_rtsp(netcam);
+    }
+#endif
+
     /* and cleanup the rest of the netcam_context structure. */
     if (netcam->connect_host != NULL) 
         free(netcam->connect_host);
@@ -2649,6 +2682,33 @@ void netcam_cleanup(netcam_context_ptr netcam, int init_retry_flag)
         free(netcam->jpegbuf);
     }
 
+    if (netcam->frame_decoding != NULL)
+        free(netcam->frame_decoding);
+
+    if (netcam->frame_ready != NULL)
+        free(netcam->frame_ready);
+
+    if (netcam->frame_taken != NULL)
+        free(netcam->frame_taken);
+
+    if (netcam->jpeg_decoding != NULL) {
+        free(netcam->jpeg_decoding->ptr);
+        free(netcam->jpeg_decoding);
+    }
+
+    if (netcam->jpeg_ready != NULL) {
+        free(netcam->jpeg_ready->ptr);
+        free(netcam->jpeg_ready);
+    }
+
+    if (netcam->jpeg_taken != NULL) {
+        free(netcam->jpeg_taken->ptr);
+        free(netcam->jpeg_taken);
+    }
+
+    netcam_decoder_free(&netcam->decoder);
+    netcam_decoder_free(&netcam->handler_decoder);
+
     if (netcam->ftp != NULL) 
         ftp_free_context(netcam->ftp);
     else 
@@ -2665,12 +2725,87 @@ void netcam_cleanup(netcam_context_ptr netcam, int init_retry_flag)
     free(netcam);
 }
 
+/**
+ * netcam_next_frame
+ *
+ *      Hands the latest frame decoded by the camera handler to the
+ *      motion loop, waiting for it if it has not arrived yet. The handler
+ *      goes on decoding every image it receives.
+ *
+ * Parameters:
+ *      netcam          Pointer to netcam context
+ *      image           Pointer to a buffer for the returned image
+ *
+ * Returns:             Error code
+ */
+static int netcam_next_frame(netcam_context_ptr netcam, unsigned char *image)
+{
+    unsigned char *frame;
+    netcam_buff *jpeg;
+    int ret;
+
+    pthread_mutex_lock(&netcam->mutex);
+
+    if (!netcam->frame_new) {
+        struct timespec waittime;
+        struct timeval curtime;
+        int retcode = 0;
+
+        /*
+         * As in netcam_latest_jpeg we wait at most 0.5 seconds, which
+         * gives a practical minimum framerate of 2.
+         */
+        netcam->frame_wanted = 1;
+
+        gettimeofday(&curtime, NULL);
+        curtime.tv_usec += 500000;
+
+        if (curtime.tv_usec > 1000000) {
+            curtime.tv_usec -= 1000000;
+            curtime.tv_sec++;
+        }
+
+        waittime.tv_sec = curtime.tv_sec;
+        waittime.tv_nsec = 1000L * curtime.tv_usec;
+
+        while (!netcam->frame_new && (retcode == 0 || retcode == EINTR))
+            retcode = pthread_cond_timedwait(&netcam->pic_ready,
+                                             &netcam->mutex, &waittime);
+
+        if (!netcam->frame_new) {
+            pthread_mutex_unlock(&netcam->mutex);
+
+            MOTION_LOG(WRN, TYPE_NETCAM, NO_ERRNO,
+                       "%s: no new pic, no signal rcvd");
+
+            return NETCAM_GENERAL_ERROR | NETCAM_NOTHING_NEW_ERROR;
+        }
+    }
+
+    frame = netcam->frame_taken;
+    netcam->frame_taken = netcam->frame_ready;
+    netcam->frame_ready = frame;
+    jpeg = netcam->jpeg_taken;
+    netcam->jpeg_taken = netcam->jpeg_ready;
+    netcam->jpeg_ready = jpeg;
+    netcam->frame_new = 0;
+    netcam->frame_wanted = 1;
+    ret = netcam->frame_error;
+
+    pthread_mutex_unlock(&netcam->mutex);
+
+    memcpy(image, netcam->frame_taken, (netcam->width * netcam->height * 3) / 2);
+
+    return ret;
+}
+
 /**
  * netcam_next
  *
  *      This routine is called when the main 'motion' thread wants a new
  *      frame of video.  It fetches the most recent frame available from
- *      the netcam, converts it to YUV420P, and returns it to motion.
+ *      the netcam, converted to YUV420P by the camera handler, and
+ *      returns it to motion.
  *
  * Parameters:
  *      cnt             Pointer to the context for this thread
@@ -2681,6 +2816,7 @@ void netcam_cleanup(netcam_context_ptr netcam, int init_retry_flag)
 int netcam_next(struct context *cnt, unsigned char *image)
 {
     netcam_context_ptr netcam;
+    int ret;
 
     /*
      * Here we have some more "defensive programming".  This check should
@@ -2714,16 +2850,32 @@ int netcam_next(struct context *cnt, unsigned char *image)
     }
 
     /*
-     * If an error occurs in the JPEG decompression which follows this,
-     * jpeglib will return to the code within this 'if'.  Basically, our
-     * approach is to just return a NULL (failed) to the caller (an
-     * error message has already been produced by the libjpeg routines).
+     * With jpeg_idle_decode motion may let us keep the frame compressed,
+     * vid_defer_jpeg then decodes only what the detection needs.
      */
-    if (setjmp(netcam->setjmp_buffer)) 
-        return NETCAM_GENERAL_ERROR | NETCAM_JPEG_CONV_ERROR;
-    
-    /* If there was no error, process the latest image buffer. */
-    return netcam_proc_jpeg(netcam, image);
+    if (cnt->defer_decode) {
+        /* Nothing to decode meanwhile, nor an old frame to hand out later. */
+        pthread_mutex_lock(&netcam->mutex);
+        netcam->frame_wanted = 0;
+        netcam->frame_new = 0;
+        netcam->frame_reset++;
+        pthread_mutex_unlock(&netcam->mutex);
+
+        ret = netcam_latest_jpeg(netcam);
+
+        if (ret != 0)
+            return ret;
+
+        return vid_defer_jpeg(cnt, (unsigned char *)netcam->jpegbuf->ptr, netcam->jpegbuf->used);
+    }
+
+    /* The camera handler has decoded the frame, see netcam_image_ready. */
+    ret = netcam_next_frame(netcam, image);
+
+    if (ret == 0 && netcam->jpeg_taken)
+        vid_keep_jpeg(cnt, (unsigned char *)netcam->jpeg_taken->ptr, netcam->jpeg_taken->used);
+
+    return ret;
 }
 
 /**
@@ -2764,6 +2916,8 @@ int netcam_start(struct context *cnt)
     memset(cnt->netcam, 0, sizeof(struct netcam_context));
     netcam = cnt->netcam;           /* Just for clarity in remaining code. */
     netcam->cnt = cnt;              /* Fill in the "parent" info. */
+    netcam->decoder.netcam = netcam;
+    netcam->handler_decoder.netcam = netcam;
 
     /*
      * Fill in our new netcam context with all known initial
@@ -2928,7 +3082,7 @@ int netcam_start(struct context *cnt)
         * jpeglib will return to the code within this 'if'.  If such an error
         * occurs during startup, we will just abandon this attempt.
         */
-        if (setjmp(netcam->setjmp_buffer)) {
+        if (setjmp(netcam->decoder.setjmp_buffer)) {
             MOTION_LOG(CRT, TYPE_NETCAM, NO_ERRNO, "%s: libjpeg decompression failure "
                        "on first frame - giving up!");
             return -1;
@@ -2968,6 +3122,28 @@ int netcam_start(struct context *cnt)
     cnt->imgs.motionsize = netcam->width * netcam->height;
     cnt->imgs.type = VIDEO_PALETTE_YUV420P;
 
+    /* The camera handler decodes JPEG images into these, RTSP does its own. */
+    if (netcam->caps.streaming != NCS_RTSP) {
+        netcam->frame_decoding = mymalloc(cnt->imgs.size);
+        netcam->frame_ready = mymalloc(cnt->imgs.size);
+        netcam->frame_taken = mymalloc(cnt->imgs.size);
+
+        if (cnt->conf.jpeg_passthrough) {
+            netcam->jpeg_decoding = mymalloc(sizeof(netcam_buff));
+            netcam->jpeg_ready = mymalloc(sizeof(netcam_buff));
+            netcam->jpeg_taken = mymalloc(sizeof(netcam_buff));
+        }
+    }
+
+#ifdef have_av_get_media_type_string
+    /*
+     * Movies then come from the second stream, detection stays on this one.
+     * Started first, so that the handler never puts packets of this stream.
+     */
+    if (netcam->caps.streaming == NCS_RTSP && cnt->conf.netcam_highres)
+        netcam_rtsp_highres_start(netcam);
+#endif
+
     /*
      * Everything is now ready - start up the
      * "handler thread".
@@ -107,6 +107,25 @@ typedef struct file_context {
 #define NCS_BLOCK               2  /* streaming is done via MJPG-block */
 #define NCS_RTSP                3  /* streaming is done via RTSP */
 
+/*
+ * struct netcam_decoder holds the state of one JPEG decompression.
+ * The motion loop and the camera-handling thread decode at the same
+ * time, each with its own.
+ */
+typedef struct netcam_decoder {
+    struct netcam_context *netcam;  /* camera the decoder belongs to */
+
+    struct jpeg_decompress_struct cinfo; /* kept from frame to frame,
+                                   created on first use */
+    int created;
+
+    struct jpeg_error_mgr jerr;
+    jmp_buf setjmp_buffer;
+
+    int jpeg_error;             /* flag to show error or warning
+                                   occurred during decompression*/
+} netcam_decoder;
+
 /*
  * struct netcam_context contains all the structures and other data
  * for an individual netcam.
@@ -201,7 +220,17 @@ typedef struct netcam_context {
                                    context for FILE connection */
 
     struct rtsp_context *rtsp;  /* this structure contains the
-                                   context for RTSP connection */                                                                       
+                                   context for RTSP connection */
+
+    struct rtsp_packets *packets;
+                                /* latest packets of an RTSP camera,
+                                   for passthrough movies */
+
+    struct rtsp_context *rtsp_highres;
+                                /* second stream of the camera which only
+                                   feeds the packets, see netcam_highres */
+
+    pthread_t highres_thread;   /* thread reading rtsp_highres */                                                                       
 
     int (*get_image)(netcam_context_ptr);
                                 /* Function to fetch the image from
@@ -257,11 +286,44 @@ typedef struct netcam_context {
     float av_frame_time;        /* "running average" of time between
                                    successive frames (microseconds) */
 
-    struct jpeg_error_mgr jerr;
-    jmp_buf setjmp_buffer;
+    netcam_decoder decoder;     /* decoder for the motion loop */
 
-    int jpeg_error;             /* flag to show error or warning
-                                   occurred during decompression*/
+    netcam_decoder handler_decoder; /* decoder for the camera-handling
+                                   thread */
+
+                                /* Three frame buffers hand the
+                                   images decoded by the camera-
+                                   handling thread to the motion loop
+                                   (see netcam_image_ready): */
+
+    unsigned char *frame_decoding; /* frame being decoded by the
+                                   handler */
+
+    unsigned char *frame_ready; /* latest decoded frame, waiting for
+                                   the motion loop */
+
+    unsigned char *frame_taken; /* frame the motion loop is copying */
+
+                                /* With jpeg_passthrough, the images
+                                   the three frames were decoded from,
+                                   handed on together with them: */
+
+    netcam_buff_ptr jpeg_decoding; /* image of frame_decoding */
+
+    netcam_buff_ptr jpeg_ready; /* image of frame_ready */
+
+    netcam_buff_ptr jpeg_taken; /* image of frame_taken */
+
+    int frame_wanted;           /* the motion loop takes decoded
+                                   frames, so decode every image */
+
+    int frame_new;              /* frame_ready has not been taken */
+
+    int frame_error;            /* decoder result for frame_ready */
+
+    unsigned int frame_reset;   /* counts the times the motion loop
+                                   dropped the decoded frames; a frame
+                                   decoded across one is stale */
 } netcam_context;
 
 #define MJPG_MH_MAGIC          "MJPG"
@@ -290,8 +352,10 @@ typedef struct {
  * Declare prototypes for our external entry points
  */
 /*     Within netcam_jpeg.c    */
-int netcam_proc_jpeg (struct netcam_context *, unsigned char *);
+int netcam_latest_jpeg (struct netcam_context *);
+int netcam_decode_jpeg (struct netcam_decoder *, unsigned char *, int, unsigned char *);
 void netcam_get_dimensions (struct netcam_context *);
+void netcam_decoder_free (struct netcam_decoder *);
 /*     Within netcam.c        */
 int netcam_start (struct context *);
 int netcam_next (struct context *, unsigned char *);
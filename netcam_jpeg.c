@@ -166,20 +166,20 @@ static void netcam_memory_src(j_decompress_ptr cinfo, char *data, int length)
  */
 static void netcam_error_exit(j_common_ptr cinfo)
 {
-    /* Fetch our pre-stored pointer to the netcam context. */
-    netcam_context_ptr netcam = cinfo->client_data;
+    /* Fetch our pre-stored pointer to the decoder. */
+    netcam_decoder *dec = cinfo->client_data;
     /* Output the message associated with the error. */
     (*cinfo->err->output_message)(cinfo);
     /* Set flag to show the decompression had errors. */
-    netcam->jpeg_error |= 1;
-    /* Need to "cleanup" the aborted decompression. */
-    jpeg_destroy (cinfo);
+    dec->jpeg_error |= 1;
+    /* Need to "cleanup" the aborted decompression, the object is kept. */
+    jpeg_abort (cinfo);
 
-    MOTION_LOG(INF, TYPE_NETCAM, NO_ERRNO, "%s: netcam->jpeg_error %d",
-               netcam->jpeg_error);
+    MOTION_LOG(INF, TYPE_NETCAM, NO_ERRNO, "%s: dec->jpeg_error %d",
+               dec->jpeg_error);
 
     /* Jump back to wherever we started. */
-    longjmp(netcam->setjmp_buffer, 1);
+    longjmp(dec->setjmp_buffer, 1);
 }
 
 /**
@@ -200,8 +200,8 @@ static void netcam_output_message(j_common_ptr cinfo)
 {
     char buffer[JMSG_LENGTH_MAX];
 
-    /* Fetch our pre-stored pointer to the netcam context. */
-    netcam_context_ptr netcam = cinfo->client_data;
+    /* Fetch our pre-stored pointer to the decoder. */
+    netcam_decoder *dec = cinfo->client_data;
 
     /*
      * While experimenting with a "appro" netcam it was discovered
@@ -215,8 +215,8 @@ static void netcam_output_message(j_common_ptr cinfo)
      * care about.
      */
     if ((cinfo->err->msg_code != JWRN_EXTRANEOUS_DATA) &&
-        (cinfo->err->msg_code == JWRN_NOT_SEQUENTIAL) && (!netcam->netcam_tolerant_check))
-        netcam->jpeg_error |= 2;    /* Set flag to show problem */
+        (cinfo->err->msg_code == JWRN_NOT_SEQUENTIAL) && (!dec->netcam->netcam_tolerant_check))
+        dec->jpeg_error |= 2;    /* Set flag to show problem */
 
     /*
      * Format the message according to library standards.
@@ -228,18 +228,17 @@ static void netcam_output_message(j_common_ptr cinfo)
 }
 
 /**
- * netcam_init_jpeg
+ * netcam_latest_jpeg
  *
- *     Initialises the JPEG library prior to doing a
- *     decompression.
+ *     Makes the latest image from the camera handler netcam->jpegbuf,
+ *     waiting for it if it has not arrived yet.
  *
  * Parameters:
  *     netcam          pointer to netcam_context.
- *     cinfo           pointer to JPEG decompression context.
  *
  * Returns:           Error code.
  */
-static int netcam_init_jpeg(netcam_context_ptr netcam, j_decompress_ptr cinfo)
+int netcam_latest_jpeg(netcam_context_ptr netcam)
 {
     netcam_buff_ptr buff;
 
@@ -300,24 +299,74 @@ static int netcam_init_jpeg(netcam_context_ptr netcam, j_decompress_ptr cinfo)
     netcam->jpegbuf = buff;
     pthread_mutex_unlock(&netcam->mutex);
 
-    /* Clear any error flag from previous work. */
-    netcam->jpeg_error = 0;
+    return 0;
+}
 
-    buff = netcam->jpegbuf;
-    /*
-     * Prepare for the decompression.
-     * Initialize the JPEG decompression object.
-     */
-    jpeg_create_decompress(cinfo);
+/**
+ * netcam_jpeg_420
+ *
+ *     Checks whether an image is a YCbCr JPEG with 4:2:0 sampling and a
+ *     width which fills whole MCUs, which libjpeg can then decode straight
+ *     into the planes of a YUV420P buffer (see netcam_image_raw).
+ *
+ * Parameters:
+ *     cinfo           pointer to JPEG decompression context, after
+ *                     jpeg_read_header.
+ *
+ * Returns:           1 if so, 0 if not.
+ */
+static int netcam_jpeg_420(j_decompress_ptr cinfo)
+{
+    jpeg_component_info *comp = cinfo->comp_info;
+
+    if (cinfo->num_components != 3 || cinfo->jpeg_color_space != JCS_YCbCr)
+        return 0;
+
+    if (comp[0].h_samp_factor != 2 || comp[0].v_samp_factor != 2 ||
+        comp[1].h_samp_factor != 1 || comp[1].v_samp_factor != 1 ||
+        comp[2].h_samp_factor != 1 || comp[2].v_samp_factor != 1)
+        return 0;
 
-    /* Set up own error exit routine. */
-    cinfo->err = jpeg_std_error(&netcam->jerr);
-    cinfo->client_data = netcam;
-    netcam->jerr.error_exit = netcam_error_exit;
-    netcam->jerr.output_message = netcam_output_message;
+    return (cinfo->image_width % 16) == 0;
+}
+
+/**
+ * netcam_start_jpeg
+ *
+ *     Starts the decompression of length bytes of JPEG data with the
+ *     decompression object of the decoder. The object is created on
+ *     first use and then kept, along with its source manager, for all
+ *     the following frames; jpeg_finish_decompress or jpeg_abort only
+ *     release what was allocated for the image.
+ *
+ * Parameters:
+ *     dec             pointer to the netcam_decoder to use.
+ *     data            the JPEG data.
+ *     length          its size in bytes.
+ *
+ * Returns:           Error code.
+ */
+static int netcam_start_jpeg(netcam_decoder *dec, char *data, int length)
+{
+    j_decompress_ptr cinfo = &dec->cinfo;
+
+    /* Clear any error flag from previous work. */
+    dec->jpeg_error = 0;
+
+    if (!dec->created) {
+        /* Set up own error exit routine. */
+        cinfo->err = jpeg_std_error(&dec->jerr);
+        dec->jerr.error_exit = netcam_error_exit;
+        dec->jerr.output_message = netcam_output_message;
+
+        /* Initialize the JPEG decompression object. */
+        jpeg_create_decompress(cinfo);
+        cinfo->client_data = dec;
+        dec->created = 1;
+    }
 
     /* Specify the data source as our own routine. */
-    netcam_memory_src(cinfo, buff->ptr, buff->used);
+    netcam_memory_src(cinfo, data, length);
 
     /* Read file parameters (rejecting tables-only). */
     jpeg_read_header(cinfo, TRUE);
@@ -325,27 +374,134 @@ static int netcam_init_jpeg(netcam_context_ptr netcam, j_decompress_ptr cinfo)
     /* Override the desired colour space. */
     cinfo->out_color_space = JCS_YCbCr;
 
+    /* Planes of a 4:2:0 image need no colour conversion nor upsampling. */
+    if (netcam_jpeg_420(cinfo)) {
+        cinfo->raw_data_out = TRUE;
+#if JPEG_LIB_VERSION >= 70
+        cinfo->do_fancy_upsampling = FALSE;
+#endif
+    }
+
     /* Start the decompressor. */
     jpeg_start_decompress(cinfo);
 
     MOTION_LOG(INF, TYPE_NETCAM, NO_ERRNO, "%s: jpeg_error %d",
-               netcam->jpeg_error);
+               dec->jpeg_error);
 
-    return netcam->jpeg_error;
+    return dec->jpeg_error;
 }
 
 /**
- * netcam_image_conv
+ * netcam_init_jpeg
+ *
+ *     Initialises the JPEG library prior to doing a
+ *     decompression of the latest image, with the decoder
+ *     of the motion loop.
+ *
+ * Parameters:
+ *     netcam          pointer to netcam_context.
+ *
+ * Returns:           Error code.
+ */
+static int netcam_init_jpeg(netcam_context_ptr netcam)
+{
+    int ret;
+
+    ret = netcam_latest_jpeg(netcam);
+
+    if (ret != 0)
+        return ret;
+
+    return netcam_start_jpeg(&netcam->decoder, netcam->jpegbuf->ptr,
+                             netcam->jpegbuf->used);
+}
+
+/**
+ * netcam_image_raw
+ *
+ *      Reads the raw Y, Cb and Cr planes of a 4:2:0 JPEG straight into the
+ *      planes of a YUV420P image, 16 lines at a time. Lines of the last
+ *      iMCU row which lie below the image go to a spare line. When the image
+ *      is rotated the lines are read into a strip and rotated into place
+ *      from there while they are still in the cache.
+ *
+ * Parameters:
+ *      cnt             pointer to the context of the camera
+ *      cinfo           pointer to JPEG decompression context, started with
+ *                      raw_data_out
+ *      image           pointer to buffer of destination image (yuv420)
+ *
+ * Returns:             Nothing
+ */
+static void netcam_image_raw(struct context *cnt, struct jpeg_decompress_struct *cinfo,
+                             unsigned char *image)
+{
+    unsigned int width = cinfo->output_width;
+    unsigned int height = cinfo->output_height;
+    unsigned char *upic = image + width * height;
+    unsigned char *vpic = upic + (width * height) / 4;
+    unsigned char *strip = NULL;
+    JSAMPROW yrows[16], urows[8], vrows[8];
+    JSAMPARRAY planes[3] = {yrows, urows, vrows};
+    JSAMPARRAY spare;
+    unsigned int y, i, rows;
+
+    spare = (cinfo->mem->alloc_sarray)((j_common_ptr) cinfo, JPOOL_IMAGE, width, 1);
+
+    if (cnt->rotate_data.degrees > 0) {
+        /* 16 lines of Y, 8 of U and 8 of V. */
+        strip = (cinfo->mem->alloc_large)((j_common_ptr) cinfo, JPOOL_IMAGE, width * 24);
+        upic = strip + width * 16;
+        vpic = upic + (width / 2) * 8;
+    }
+
+    while ((y = cinfo->output_scanline) < height) {
+        for (i = 0; i < 16; i++) {
+            if (strip)
+                yrows[i] = strip + i * width;
+            else
+                yrows[i] = (y + i < height) ? image + (y + i) * width : spare[0];
+        }
+
+        for (i = 0; i < 8; i++) {
+            if (strip) {
+                urows[i] = upic + i * (width / 2);
+                vrows[i] = vpic + i * (width / 2);
+            } else if ((y + 2 * i) < height) {
+                urows[i] = upic + (y / 2 + i) * (width / 2);
+                vrows[i] = vpic + (y / 2 + i) * (width / 2);
+            } else {
+                urows[i] = vrows[i] = spare[0];
+            }
+        }
+
+        jpeg_read_raw_data(cinfo, planes, 16);
+
+        if (strip) {
+            rows = (height - y < 16) ? height - y : 16;
+            rotate_rows(cnt, 0, strip, y, rows, image);
+            rotate_rows(cnt, 1, upic, y / 2, rows / 2, image);
+            rotate_rows(cnt, 2, vpic, y / 2, rows / 2, image);
+        }
+    }
+}
+
+/**
+ * netcam_image_ycbcr
+ *
+ *      Reads an image of any other sampling as interleaved YCbCr lines
+ *      upsampled by libjpeg, and picks the YUV420P planes out of them.
+ *      Rotated images are collected in a strip of 16 lines which is rotated
+ *      into place each time it is full.
  *
  * Parameters:
- *      netcam          pointer to netcam_context
+ *      cnt             pointer to the context of the camera
  *      cinfo           pointer to JPEG decompression context
  *      image           pointer to buffer of destination image (yuv420)
  *
- * Returns :  netcam->jpeg_error
+ * Returns:             Nothing
  */
-static int netcam_image_conv(netcam_context_ptr netcam,
-                               struct jpeg_decompress_struct *cinfo,
+static void netcam_image_ycbcr(struct context *cnt, struct jpeg_decompress_struct *cinfo,
                                unsigned char *image)
 {
     JSAMPARRAY      line;           /* Array of decomp data lines */
@@ -354,24 +510,24 @@ static int netcam_image_conv(netcam_context_ptr netcam,
     int             linesize, i;
     unsigned char  *upic, *vpic;
     unsigned char  *pic = image;
+    unsigned char  *strip = NULL;
     unsigned char   y;              /* Switch for decoding YUV data */
-    unsigned int    width, height;
+    unsigned int    width, height, first = 0;
 
     width = cinfo->output_width;
     height = cinfo->output_height;
 
-    if (width && ((width != netcam->width) || (height != netcam->height))) {
-        MOTION_LOG(WRN, TYPE_NETCAM, NO_ERRNO,
-                   "%s: JPEG image size %dx%d, JPEG was %dx%d",
-                    netcam->width, netcam->height, width, height);
-        jpeg_destroy_decompress(cinfo);
-        netcam->jpeg_error |= 4;
-        return netcam->jpeg_error;
-    }
     /* Set the output pointers (these come from YUV411P definition. */
     upic = pic + width * height;
     vpic = upic + (width * height) / 4;
 
+    if (cnt->rotate_data.degrees > 0) {
+        /* 16 lines of Y, 8 of U and 8 of V. */
+        strip = (cinfo->mem->alloc_large)((j_common_ptr) cinfo, JPOOL_IMAGE, width * 24);
+        pic = strip;
+        upic = strip + width * 16;
+        vpic = upic + (width / 2) * 8;
+    }
 
     /* YCbCr format will give us one byte each for YUV. */
     linesize = cinfo->output_width * 3;
@@ -400,57 +556,106 @@ static int netcam_image_conv(netcam_context_ptr netcam,
             upic += width / 2;
             vpic += width / 2;
         }
+
+        if (strip && ((cinfo->output_scanline & 15) == 0 || cinfo->output_scanline == height)) {
+            i = cinfo->output_scanline - first;
+            pic = strip;
+            upic = strip + width * 16;
+            vpic = upic + (width / 2) * 8;
+            rotate_rows(cnt, 0, pic, first, i, image);
+            rotate_rows(cnt, 1, upic, first / 2, i / 2, image);
+            rotate_rows(cnt, 2, vpic, first / 2, i / 2, image);
+            first = cinfo->output_scanline;
+        }
     }
+}
 
-    jpeg_finish_decompress(cinfo);
-    jpeg_destroy_decompress(cinfo);
+/**
+ * netcam_image_conv
+ *
+ * Parameters:
+ *      dec             pointer to the netcam_decoder in use
+ *      cinfo           pointer to JPEG decompression context
+ *      image           pointer to buffer of destination image (yuv420)
+ *
+ * Returns :  dec->jpeg_error
+ */
+static int netcam_image_conv(netcam_decoder *dec,
+                               struct jpeg_decompress_struct *cinfo,
+                               unsigned char *image)
+{
+    netcam_context_ptr netcam = dec->netcam;
+    unsigned int    width, height;
 
-    if (netcam->cnt->rotate_data.degrees > 0)
-        /* Rotate as specified */
-        rotate_map(netcam->cnt, image);
+    width = cinfo->output_width;
+    height = cinfo->output_height;
+
+    if (width && ((width != netcam->width) || (height != netcam->height))) {
+        MOTION_LOG(WRN, TYPE_NETCAM, NO_ERRNO,
+                   "%s: JPEG image size %dx%d, JPEG was %dx%d",
+                    netcam->width, netcam->height, width, height);
+        jpeg_abort_decompress(cinfo);
+        dec->jpeg_error |= 4;
+        return dec->jpeg_error;
+    }
+
+    /* Both rotate the image as they go if it is to be rotated. */
+    if (cinfo->raw_data_out)
+        netcam_image_raw(netcam->cnt, cinfo, image);
+    else
+        netcam_image_ycbcr(netcam->cnt, cinfo, image);
+
+    jpeg_finish_decompress(cinfo);
 
     MOTION_LOG(INF, TYPE_NETCAM, NO_ERRNO, "%s: jpeg_error %d",
-               netcam->jpeg_error);
+               dec->jpeg_error);
 
-    return netcam->jpeg_error;
+    return dec->jpeg_error;
 }
 
 /**
- * netcam_proc_jpeg
+ * netcam_decode_jpeg
  *
- *    Routine to decode an image received from a netcam into a YUV420P buffer
- *    suitable for processing by motion.
+ *    Routine to decode length bytes of JPEG data from the netcam into
+ *    a YUV420P buffer suitable for processing by motion. The camera
+ *    handler uses it for the images it receives (see netcam_image_ready),
+ *    motion for the frames it kept compressed with jpeg_idle_decode.
  *
  * Parameters:
- *    netcam    pointer to the netcam_context structure.
+ *       dec    pointer to the netcam_decoder of the calling thread.
+ *      data    the JPEG data.
+ *    length    its size in bytes.
  *     image    pointer to a buffer for the returned image.
  *
  * Returns:
  *
  *      0         Success
  *      non-zero  error code from other routines
- *                (e.g. netcam_init_jpeg or netcam_image_conv)
+ *                (e.g. netcam_start_jpeg or netcam_image_conv)
  *                or just NETCAM_GENERAL_ERROR
  */
-int netcam_proc_jpeg(netcam_context_ptr netcam, unsigned char *image)
+int netcam_decode_jpeg(netcam_decoder *dec, unsigned char *data, int length,
+                       unsigned char *image)
 {
-    struct jpeg_decompress_struct cinfo;    /* Decompression control struct. */
+    netcam_context_ptr netcam = dec->netcam;
+    j_decompress_ptr cinfo = &dec->cinfo;   /* Decompression control struct. */
     int retval = 0;                         /* Value returned to caller. */
     int ret;                                /* Working var. */
 
     /*
-     * This routine is only called from the main thread.
-     * We need to "protect" the "latest" image while we
-     * decompress it.  netcam_init_jpeg uses
-     * netcam->mutex to do this.
+     * If an error occurs in the JPEG decompression which follows this,
+     * jpeglib will return here (an error message has already been
+     * produced by the libjpeg routines).
      */
-    MOTION_LOG(INF, TYPE_NETCAM, NO_ERRNO, "%s: processing jpeg image"
-               " - content length %d", netcam->latest->content_length);
+    if (setjmp(dec->setjmp_buffer))
+        return NETCAM_GENERAL_ERROR | NETCAM_JPEG_CONV_ERROR;
 
-    ret = netcam_init_jpeg(netcam, &cinfo);
+    ret = netcam_start_jpeg(dec, (char *)data, length);
 
     if (ret != 0) {
         MOTION_LOG(INF, TYPE_NETCAM, NO_ERRNO, "%s: ret %d", ret);
+        /* The kept decompressor must be idle for the next frame. */
+        jpeg_abort_decompress(cinfo);
         return ret;
     }
 
@@ -461,19 +666,20 @@ int netcam_proc_jpeg(netcam_context_ptr netcam, unsigned char *image)
      * restart of Motion.
      */
     if (netcam->width) {    /* 0 means not yet init'ed */
-        if ((cinfo.output_width != netcam->width) ||
-            (cinfo.output_height != netcam->height)) {
+        if ((cinfo->output_width != netcam->width) ||
+            (cinfo->output_height != netcam->height)) {
             retval = NETCAM_RESTART_ERROR;
             MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Camera width/height mismatch "
                        "with JPEG image - expected %dx%d, JPEG %dx%d",
                        " retval %d", netcam->width, netcam->height,
-                       cinfo.output_width, cinfo.output_height, retval);
+                       cinfo->output_width, cinfo->output_height, retval);
+            jpeg_abort_decompress(cinfo);
             return retval;
         }
     }
 
     /* Do the conversion */
-    ret = netcam_image_conv(netcam, &cinfo, image);
+    ret = netcam_image_conv(dec, cinfo, image);
 
     if (ret != 0) {
         retval |= NETCAM_JPEG_CONV_ERROR;
@@ -499,17 +705,37 @@ int netcam_proc_jpeg(netcam_context_ptr netcam, unsigned char *image)
  */
 void netcam_get_dimensions(netcam_context_ptr netcam)
 {
-    struct jpeg_decompress_struct cinfo; /* Decompression control struct. */
+    j_decompress_ptr cinfo = &netcam->decoder.cinfo;
     int ret;
 
-    ret = netcam_init_jpeg(netcam, &cinfo);
+    ret = netcam_init_jpeg(netcam);
 
-    netcam->width = cinfo.output_width;
-    netcam->height = cinfo.output_height;
-    netcam->JFIF_marker = cinfo.saw_JFIF_marker;
+    netcam->width = cinfo->output_width;
+    netcam->height = cinfo->output_height;
+    netcam->JFIF_marker = cinfo->saw_JFIF_marker;
 
-    jpeg_destroy_decompress(&cinfo);
+    if (netcam->decoder.created)
+        jpeg_abort_decompress(cinfo);
 
     MOTION_LOG(INF, TYPE_NETCAM, NO_ERRNO, "%s: JFIF_marker %s PRESENT ret %d",
                netcam->JFIF_marker ? "IS" : "NOT", ret);
 }
+
+/**
+ * netcam_decoder_free
+ *
+ *    Destroys the decompression object a decoder kept, if it made one.
+ *
+ * Parameters
+ *
+ *    dec        pointer to the netcam_decoder.
+ *
+ * Returns:   Nothing
+ */
+void netcam_decoder_free(netcam_decoder *dec)
+{
+    if (dec->created) {
+        jpeg_destroy_decompress(&dec->cinfo);
+        dec->created = 0;
+    }
+}
@@ -51,122 +51,1241 @@ static void netcam_check_buffsize(netcam_buff_ptr buff, size_t numbytes)
  * End Duplicated static functions - FIXME
  ****************************************************/
 
-static int decode_packet(AVPacket *packet, netcam_buff_ptr buffer, AVFrame *frame, AVCodecContext *cc)
+/**
+ * rtsp_frame_to_buffer
+ *
+ *      Puts a decoded frame into buffer as YUV420P. 4:2:0 frames (including
+ *      the full range YUVJ420P of many cameras) are copied plane by plane,
+ *      anything else is converted with swscale if motion was built with it.
+ *
+ * Parameters:
+ *      netcam          Pointer to a netcam_context structure.
+ *      frame           The decoded frame.
+ *      buffer          Pointer to the netcam_image_buffer to fill.
+ *
+ * Returns:             Size of the image, 0 if the frame can not be used.
+ */
+static int rtsp_frame_to_buffer(netcam_context_ptr netcam, AVFrame *frame, netcam_buff_ptr buffer)
+{
+    struct rtsp_context *rtsp = netcam->rtsp;
+    int width = frame->width;
+    int height = frame->height;
+    int size = (width * height * 3) / 2;
+    uint8_t *planes[4];
+    int linesizes[4];
+
+    if (netcam->width && (width != netcam->width || height != netcam->height)) {
+        MOTION_LOG(WRN, TYPE_NETCAM, NO_ERRNO, "%s: Frame size %dx%d, expected %dx%d",
+                   width, height, netcam->width, netcam->height);
+        return 0;
+    }
+
+    netcam_check_buffsize(buffer, size);
+
+    planes[0] = (uint8_t *)buffer->ptr;
+    planes[1] = planes[0] + width * height;
+    planes[2] = planes[1] + (width * height) / 4;
+    planes[3] = NULL;
+    linesizes[0] = width;
+    linesizes[1] = linesizes[2] = width / 2;
+    linesizes[3] = 0;
+
+    switch (frame->format) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+        av_image_copy(planes, linesizes, (const uint8_t **)frame->data, frame->linesize,
+                      AV_PIX_FMT_YUV420P, width, height);
+        break;
+
+    default:
+#ifdef HAVE_SWSCALE
+        rtsp->sws_context = sws_getCachedContext(rtsp->sws_context, width, height, frame->format,
+                                                 width, height, AV_PIX_FMT_YUV420P,
+                                                 SWS_BILINEAR, NULL, NULL, NULL);
+        if (rtsp->sws_context) {
+            sws_scale(rtsp->sws_context, (const uint8_t * const *)frame->data, frame->linesize,
+                      0, height, planes, linesizes);
+            break;
+        }
+#endif
+        if (!rtsp->bad_format)
+            MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Cannot convert %s frames to YUV420P",
+                       av_get_pix_fmt_name(frame->format));
+
+        rtsp->bad_format = 1;
+        return 0;
+    }
+
+    buffer->used = size;
+
+    return size;
+}
+
+/**
+ * rtsp_latency_sent
+ *
+ *      Notes when a packet goes into the decoder, see rtsp_latency_done.
+ *
+ * Parameters:
+ *      rtsp            Pointer to the rtsp_context structure.
+ *      packet          The packet.
+ *
+ * Returns:             Nothing
+ */
+static void rtsp_latency_sent(struct rtsp_context *rtsp, AVPacket *packet)
+{
+    struct rtsp_latency *slot = &rtsp->latency[rtsp->latency_next];
+
+    if (packet->dts == AV_NOPTS_VALUE)
+        return;
+
+    rtsp->sent_dts = packet->dts;
+    slot->dts = packet->dts;
+    gettimeofday(&slot->sent, NULL);
+    rtsp->latency_next = (rtsp->latency_next + 1) % RTSP_LATENCY_SLOTS;
+}
+
+/**
+ * rtsp_latency_done
+ *
+ *      Adds the time from sending the packet of a frame to the decoder until
+ *      the frame came out to the statistics. With frame threading this is
+ *      the delay the threads add on top of the decode itself.
+ *
+ * Parameters:
+ *      rtsp            Pointer to the rtsp_context structure.
+ *      frame           The decoded frame.
+ *
+ * Returns:             Nothing
+ */
+static void rtsp_latency_done(struct rtsp_context *rtsp, AVFrame *frame)
+{
+    struct timeval now;
+    long usec;
+    int i;
+
+    if (frame->pkt_dts == AV_NOPTS_VALUE)
+        return;
+
+    for (i = 0; i < RTSP_LATENCY_SLOTS; i++) {
+        if (rtsp->latency[i].dts != frame->pkt_dts)
+            continue;
+
+        gettimeofday(&now, NULL);
+        usec = (now.tv_sec - rtsp->latency[i].sent.tv_sec) * 1000000L +
+               (now.tv_usec - rtsp->latency[i].sent.tv_usec);
+
+        rtsp->stats_latency_frames++;
+        rtsp->stats_latency_usec += usec;
+
+        if (usec > rtsp->stats_latency_max)
+            rtsp->stats_latency_max = usec;
+
+        rtsp->latency[i].dts = AV_NOPTS_VALUE;
+        return;
+    }
+}
+
+/**
+ * rtsp_receive_frame
+ *
+ *      Takes the next decoded frame out of the decoder, if it has one.
+ *
+ * Parameters:
+ *      rtsp            Pointer to the rtsp_context structure.
+ *
+ * Returns:             1 with a frame in rtsp->frame, 0 when the decoder needs
+ *                      more packets or dropped a frame, -1 at the end of the
+ *                      stream.
+ */
+static int rtsp_receive_frame(struct rtsp_context *rtsp)
+{
+#ifdef RTSP_SEND_RECEIVE
+    int ret = avcodec_receive_frame(rtsp->codec_context, rtsp->frame);
+
+    if (ret == AVERROR(EAGAIN))
+        return 0;
+
+    if (ret == AVERROR_EOF)
+        return -1;
+
+    if (ret < 0) {
+        /* A broken frame loses that frame only, the stream goes on. */
+        MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Error receiving frame: %s",
+                   av_err2str(ret));
+        rtsp->stats_dropped++;
+        return 0;
+    }
+
+    rtsp_latency_done(rtsp, rtsp->frame);
+
+    return 1;
+#else
+    /* avcodec_decode_video2 hands its frame out with the packet. */
+    return 0;
+#endif
+}
+
+/**
+ * rtsp_send_packet
+ *
+ *      Gives a video packet to the decoder. Packets the decoder refuses are
+ *      counted as dropped. Decoders without the send / receive API decode
+ *      the packet right away and return its frame, if any.
+ *
+ * Parameters:
+ *      rtsp            Pointer to the rtsp_context structure.
+ *      packet          The packet.
+ *
+ * Returns:             1 with a frame in rtsp->frame, 0 otherwise.
+ */
+static int rtsp_send_packet(struct rtsp_context *rtsp, AVPacket *packet)
+{
+    int ret;
+#ifndef RTSP_SEND_RECEIVE
+    int check = 0;
+#endif
+
+    rtsp_latency_sent(rtsp, packet);
+
+#ifdef RTSP_SEND_RECEIVE
+    /* The frames it had are all taken out, so EAGAIN does not happen here. */
+    ret = avcodec_send_packet(rtsp->codec_context, packet);
+
+    if (ret < 0) {
+        MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Error decoding video packet: %s",
+                   av_err2str(ret));
+        rtsp->stats_dropped++;
+    }
+
+    return 0;
+#else
+    ret = avcodec_decode_video2(rtsp->codec_context, rtsp->frame, &check, packet);
+
+    if (ret < 0) {
+        MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Error decoding video packet");
+        rtsp->stats_dropped++;
+        return 0;
+    }
+
+    if (check)
+        rtsp_latency_done(rtsp, rtsp->frame);
+
+    return check != 0;
+#endif
+}
+
+/**
+ * rtsp_decode_level
+ *
+ *      Sets up the codec for the decode level the motion loop allows, see
+ *      netcam_idle_decode. Dropping the non reference frames leaves the other
+ *      frames as they are, so that level can be entered and left at any packet.
+ *      Keyframes only drops whole GOPs, the way back from there decodes nothing
+ *      until the next keyframe so that no frame is missing its references.
+ *
+ * Parameters:
+ *      netcam          Pointer to a netcam_context structure.
+ *
+ * Returns:             The decode level for the next packet.
+ */
+static int rtsp_decode_level(netcam_context_ptr netcam)
+{
+    struct rtsp_context *rtsp = netcam->rtsp;
+    AVCodecContext *cc = rtsp->codec_context;
+    int level = RTSP_DECODE_FULL;
+
+    if (netcam->cnt->idle_decode) {
+        level = netcam->cnt->conf.netcam_idle_decode;
+
+        if (level > RTSP_DECODE_KEY)
+            level = RTSP_DECODE_KEY;
+
+        if (level == RTSP_DECODE_KEY && rtsp->no_keyframes)
+            level = RTSP_DECODE_NONREF;
+    }
+
+    if (level < RTSP_DECODE_KEY && rtsp->decode_level >= RTSP_DECODE_KEY)
+        level = RTSP_DECODE_RESYNC;
+
+    if (level == rtsp->decode_level)
+        return level;
+
+    switch (level) {
+    case RTSP_DECODE_NONREF:
+        cc->skip_frame = AVDISCARD_NONREF;
+        break;
+    case RTSP_DECODE_KEY:
+    case RTSP_DECODE_RESYNC:
+        cc->skip_frame = AVDISCARD_NONKEY;
+        break;
+    default:
+        cc->skip_frame = AVDISCARD_DEFAULT;
+    }
+
+    MOTION_LOG(DBG, TYPE_NETCAM, NO_ERRNO, "%s: decode level %d -> %d",
+               rtsp->decode_level, level);
+
+    rtsp->decode_level = level;
+    rtsp->key_wait = 0;
+
+    return level;
+}
+
+/**
+ * rtsp_decode_done
+ *
+ *      Leaves the keyframe levels once they are done with. Resync ends with
+ *      the first keyframe decoded. A stream which shows no keyframe within
+ *      RTSP_KEY_WAIT packets (e.g. one using intra refresh) is decoded at full
+ *      rate again, and with reference frames only while idle from then on.
+ *
+ * Parameters:
+ *      rtsp            Pointer to the rtsp_context structure.
+ *      level           The level the packet was decoded at.
+ *      frame_size      Size of the decoded frame, 0 when there was none.
+ *
+ * Returns:             Nothing
+ */
+static void rtsp_decode_done(struct rtsp_context *rtsp, int level, int frame_size)
+{
+    if (level < RTSP_DECODE_KEY)
+        return;
+
+    if (frame_size) {
+        rtsp->key_wait = 0;
+
+        if (level == RTSP_DECODE_RESYNC) {
+            rtsp->codec_context->skip_frame = AVDISCARD_DEFAULT;
+            rtsp->decode_level = RTSP_DECODE_FULL;
+        }
+    } else if (++rtsp->key_wait > RTSP_KEY_WAIT) {
+        MOTION_LOG(WRN, TYPE_NETCAM, NO_ERRNO, "%s: No keyframe in %d packets, "
+                   "decoding reference frames only while idle", RTSP_KEY_WAIT);
+        rtsp->no_keyframes = 1;
+        rtsp->codec_context->skip_frame = AVDISCARD_DEFAULT;
+        rtsp->decode_level = RTSP_DECODE_FULL;
+        rtsp->key_wait = 0;
+    }
+}
+
+/**
+ * rtsp_decode_stats
+ *
+ *      Adds up the packets, frames and time spent decoding at each level and
+ *      logs them every RTSP_STATS_INTERVAL seconds, which shows what
+ *      netcam_idle_decode saves on this camera, together with the decoder
+ *      latency and the packets it dropped.
+ *
+ * Parameters:
+ *      rtsp            Pointer to the rtsp_context structure.
+ *      level           The level the packet was decoded at.
+ *      frame_size      Size of the decoded frame, 0 when there was none.
+ *      usec            Time taken to decode the packet.
+ *
+ * Returns:             Nothing
+ */
+static void rtsp_decode_stats(struct rtsp_context *rtsp, int level, int frame_size, long usec)
+{
+    static const char *level_names[RTSP_DECODE_LEVELS] = {
+        "every frame", "reference frames", "keyframes", "resync"
+    };
+    time_t now = time(NULL);
+    int i;
+
+    rtsp->stats_packets[level]++;
+    rtsp->stats_usec[level] += usec;
+
+    if (frame_size)
+        rtsp->stats_frames[level]++;
+
+    if (rtsp->stats_start == 0)
+        rtsp->stats_start = now;
+
+    if (now - rtsp->stats_start < RTSP_STATS_INTERVAL)
+        return;
+
+    for (i = 0; i < RTSP_DECODE_LEVELS; i++) {
+        if (rtsp->stats_packets[i] == 0)
+            continue;
+
+        MOTION_LOG(NTC, TYPE_NETCAM, NO_ERRNO, "%s: Decoding %s: %ld packets, %ld frames, "
+                   "%.2f ms per frame, %.1f%% of a core", level_names[i],
+                   rtsp->stats_packets[i], rtsp->stats_frames[i],
+                   rtsp->stats_frames[i] ? rtsp->stats_usec[i] / 1000.0 / rtsp->stats_frames[i] : 0.0,
+                   rtsp->stats_usec[i] / 10000.0 / (now - rtsp->stats_start));
+    }
+
+    MOTION_LOG(NTC, TYPE_NETCAM, NO_ERRNO, "%s: Decoder latency %.2f ms average, %.2f ms "
+               "maximum, %ld packets dropped",
+               rtsp->stats_latency_frames ? rtsp->stats_latency_usec / 1000.0 / rtsp->stats_latency_frames : 0.0,
+               rtsp->stats_latency_max / 1000.0, rtsp->stats_dropped);
+
+    rtsp->stats_latency_frames = 0;
+    rtsp->stats_latency_usec = 0;
+    rtsp->stats_latency_max = 0;
+    rtsp->stats_dropped = 0;
+    memset(rtsp->stats_packets, 0, sizeof(rtsp->stats_packets));
+    memset(rtsp->stats_frames, 0, sizeof(rtsp->stats_frames));
+    memset(rtsp->stats_usec, 0, sizeof(rtsp->stats_usec));
+    rtsp->stats_start = now;
+}
+
+/**
+ * open_codec_context
+ *
+ *      Finds the best stream of the given type and opens a decoder for it,
+ *      threaded as netcam_decode_threads and netcam_decode_threading say.
+ *
+ * Parameters:
+ *      cnt             Pointer to the context of the camera.
+ *      stream_idx      Where to put the index of the stream.
+ *      codec_ctx       Where to put the opened decoder.
+ *      fmt_ctx         The opened input.
+ *      type            The media type wanted.
+ *
+ * Returns:             0 on success, a negative AVERROR otherwise.
+ */
+static int open_codec_context(struct context *cnt, int *stream_idx, AVCodecContext **codec_ctx,
+                              AVFormatContext *fmt_ctx, enum AVMediaType type)
+{
+    int ret;
+    AVStream *st;
+    AVCodecContext *dec_ctx = NULL;
+    AVCodec *dec = NULL;
+    const char *threading = cnt->conf.netcam_decode_threading;
+
+    ret = av_find_best_stream(fmt_ctx, type, -1, -1, NULL, 0);
+    if (ret < 0) {
+        MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Could not find stream %s in input!", av_get_media_type_string(type));
+        return ret;
+    }
+
+    *stream_idx = ret;
+    st = fmt_ctx->streams[*stream_idx];
+
+    /* find decoder for the stream */
+#ifdef RTSP_SEND_RECEIVE
+    dec = (AVCodec *)avcodec_find_decoder(st->codecpar->codec_id);
+#else
+    dec_ctx = st->codec;
+    dec = avcodec_find_decoder(dec_ctx->codec_id);
+#endif
+    if (!dec) {
+        MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Failed to find %s codec!", av_get_media_type_string(type));
+        return AVERROR_DECODER_NOT_FOUND;
+    }
+
+#ifdef RTSP_SEND_RECEIVE
+    dec_ctx = avcodec_alloc_context3(dec);
+    if (!dec_ctx)
+        return AVERROR(ENOMEM);
+
+    if ((ret = avcodec_parameters_to_context(dec_ctx, st->codecpar)) < 0) {
+        avcodec_free_context(&dec_ctx);
+        return ret;
+    }
+#endif
+
+    dec_ctx->thread_count = cnt->conf.netcam_decode_threads;
+
+    if (threading && !strcmp(threading, "frame"))
+        dec_ctx->thread_type = FF_THREAD_FRAME;
+    else if (threading && !strcmp(threading, "slice"))
+        dec_ctx->thread_type = FF_THREAD_SLICE;
+    else
+        dec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+    if ((ret = avcodec_open2(dec_ctx, dec, NULL)) < 0) {
+        MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Failed to open %s codec!", av_get_media_type_string(type));
+#ifdef RTSP_SEND_RECEIVE
+        avcodec_free_context(&dec_ctx);
+#endif
+        return ret;
+    }
+
+    MOTION_LOG(NTC, TYPE_NETCAM, NO_ERRNO, "%s: Decoding %s with %d threads (%s)",
+               dec->name, dec_ctx->thread_count,
+               (dec_ctx->active_thread_type & FF_THREAD_FRAME) ? "frame" :
+               (dec_ctx->active_thread_type & FF_THREAD_SLICE) ? "slice" : "none");
+
+    *codec_ctx = dec_ctx;
+
+    return 0;
+}
+
+/**
+* rtsp_free_context
+*
+*      Free the resources allocated for this context.
+*
+* Parameters
+*
+*      ctxt    Pointer to the rtsp_context structure.
+*
+* Returns:     Nothing
+*
+*/
+static void rtsp_free_context(struct rtsp_context *ctxt)
+{
+  if (ctxt == NULL)
+    return;
+  
+  if (ctxt->path != NULL)
+    free(ctxt->path);
+  
+  if (ctxt->user)
+    free(ctxt->user);
+  
+  if (ctxt->pass)
+    free(ctxt->pass);
+  
+  /* The decoder goes first, the old API keeps it in the input's stream. */
+  if (ctxt->codec_context != NULL) {
+#ifdef RTSP_SEND_RECEIVE
+    	avcodec_free_context(&ctxt->codec_context);
+#else
+    	avcodec_close(ctxt->codec_context);
+#endif
+  }
+
+  if (ctxt->format_context != NULL) {
+    	avformat_close_input(&ctxt->format_context);
+  }
+
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55, 28, 1)
+  av_frame_free(&ctxt->frame);
+#else
+  av_free(ctxt->frame);
+#endif
+#ifdef RTSP_SEND_RECEIVE
+  av_packet_free(&ctxt->packet);
+#else
+  free(ctxt->packet);
+#endif
+#ifdef HAVE_SWSCALE
+  sws_freeContext(ctxt->sws_context);
+#endif
+
+  free(ctxt);
+}
+
+/**
+* rtsp_new_context
+*
+*      Create a new RTSP context structure.
+*
+* Parameters
+*
+*       None
+*
+* Returns:     Pointer to the newly-created structure, NULL if error.
+*
+*/
+struct rtsp_context *rtsp_new_context(void)
+{
+  struct rtsp_context *ret;
+  int i;
+  
+  /* Note that mymalloc will exit on any problem. */
+  ret = mymalloc(sizeof(struct rtsp_context));
+
+  memset(ret, 0, sizeof(struct rtsp_context));
+
+  /* The frame and packet are reused for every image. */
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55, 28, 1)
+  ret->frame = av_frame_alloc();
+#else
+  ret->frame = avcodec_alloc_frame();
+#endif
+#ifdef RTSP_SEND_RECEIVE
+  ret->packet = av_packet_alloc();
+#else
+  ret->packet = mymalloc(sizeof(AVPacket));
+  av_init_packet(ret->packet);
+#endif
+
+  if (ret->frame == NULL || ret->packet == NULL) {
+    rtsp_free_context(ret);
+    return NULL;
+  }
+
+  for (i = 0; i < RTSP_LATENCY_SLOTS; i++)
+    ret->latency[i].dts = AV_NOPTS_VALUE;
+
+  ret->sent_dts = AV_NOPTS_VALUE;
+
+  return ret;
+}
+
+#ifdef RTSP_PASSTHROUGH
+/**
+ * rtsp_packet_clone
+ *
+ *      Makes a reference to the data of a packet, or a copy of it with
+ *      libraries before reference counted packets.
+ *
+ * Parameters:
+ *      packet          The packet.
+ *
+ * Returns:             The new packet, NULL on error.
+ */
+static AVPacket *rtsp_packet_clone(AVPacket *packet)
+{
+#ifdef RTSP_SEND_RECEIVE
+    return av_packet_clone(packet);
+#else
+    AVPacket *copy = mymalloc(sizeof(AVPacket));
+
+    if (av_copy_packet(copy, packet) < 0) {
+        free(copy);
+        return NULL;
+    }
+
+    return copy;
+#endif
+}
+
+/**
+ * rtsp_packet_free
+ *
+ *      Frees a packet made by rtsp_packet_clone and clears the pointer to it.
+ *
+ * Parameters:
+ *      packet          Pointer to the packet pointer.
+ *
+ * Returns:             Nothing
+ */
+static void rtsp_packet_free(AVPacket **packet)
+{
+#ifdef RTSP_SEND_RECEIVE
+    av_packet_free(packet);
+#else
+    if (*packet) {
+        av_free_packet(*packet);
+        free(*packet);
+        *packet = NULL;
+    }
+#endif
+}
+
+/**
+ * rtsp_packets_drop
+ *
+ *      Drops the oldest packets of the ring. Called with the mutex held.
+ *
+ * Parameters:
+ *      packets         Pointer to the rtsp_packets structure.
+ *      n               Number of packets to drop.
+ *
+ * Returns:             Nothing
+ */
+static void rtsp_packets_drop(struct rtsp_packets *packets, int n)
+{
+    while (n-- > 0 && packets->count > 0) {
+        rtsp_packet_free(&packets->ring[packets->first]);
+        packets->first = (packets->first + 1) % RTSP_PACKETS_MAX;
+        packets->count--;
+    }
+}
+
+/**
+ * rtsp_packets_at
+ *
+ *      Returns the i-th oldest packet of the ring. Called with the mutex held.
+ */
+static AVPacket *rtsp_packets_at(struct rtsp_packets *packets, int i)
+{
+    return packets->ring[(packets->first + i) % RTSP_PACKETS_MAX];
+}
+
+/**
+ * rtsp_packets_wanted
+ *
+ *      Tells whether ffmpeg_output movies are to be made from the packets.
+ */
+static int rtsp_packets_wanted(struct context *cnt)
+{
+    return cnt->conf.ffmpeg_output && cnt->conf.ffmpeg_passthrough &&
+           strcmp(cnt->conf.ffmpeg_passthrough, "off");
+}
+
+/**
+ * rtsp_packets_stream
+ *
+ *      Sets the packet ring up for a new connection to the camera. Packets
+ *      of the connection before are dropped, a movie still taking them ends
+ *      there, see netcam_rtsp_movie_put.
+ *
+ * Parameters:
+ *      netcam          Pointer to a netcam_context structure.
+ *      rtsp            The connection the packets come from, netcam->rtsp
+ *                      or netcam->rtsp_highres.
+ *
+ * Returns:             Nothing
+ */
+static void rtsp_packets_stream(netcam_context_ptr netcam, struct rtsp_context *rtsp)
+{
+    struct rtsp_packets *packets = netcam->packets;
+
+    if (packets == NULL) {
+        packets = mymalloc(sizeof(struct rtsp_packets));
+        pthread_mutex_init(&packets->mutex, NULL);
+        packets->hold = -1;
+        netcam->packets = packets;
+    }
+
+    pthread_mutex_lock(&packets->mutex);
+
+    rtsp_packets_drop(packets, packets->count);
+    ffmpeg_stream_free(packets->stream);
+    packets->stream = ffmpeg_stream_copy(rtsp->format_context->streams[rtsp->video_stream_index]);
+    packets->generation++;
+
+    pthread_mutex_unlock(&packets->mutex);
+}
+
+/**
+ * rtsp_packet_time
+ *
+ *      Returns the time stamp of a packet in the time base of its stream,
+ *      AV_NOPTS_VALUE if it has none.
+ */
+static int64_t rtsp_packet_time(AVPacket *packet)
+{
+    return packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+}
+
+/**
+ * rtsp_packets_window
+ *
+ *      Returns how far back in time the ring has to reach for a movie to
+ *      start with the first of the pictures of an event: pre_capture plus
+ *      minimum_motion_frames pictures at frame_limit, plus how far the decoded
+ *      pictures are behind the packets. Called with the mutex held.
+ *
+ * Parameters:
+ *      netcam          Pointer to a netcam_context structure.
+ *
+ * Returns:             The window in the time base of the packets.
+ */
+static int64_t rtsp_packets_window(netcam_context_ptr netcam)
+{
+    struct context *cnt = netcam->cnt;
+    int64_t usec = netcam->packets->lag_usec;
+
+    if (cnt->conf.frame_limit > 0)
+        usec += (int64_t)(cnt->conf.pre_capture + cnt->conf.minimum_motion_frames) *
+                1000000 / cnt->conf.frame_limit;
+
+    return av_rescale_q(usec, AV_TIME_BASE_Q, netcam->packets->stream->time_base);
+}
+
+/**
+ * rtsp_packets_lag
+ *
+ *      Notes how far the frame which came out of the decoder is behind the
+ *      last packet sent to it, for rtsp_packets_window. Rises at once and
+ *      falls slowly, so that the window covers the longer lags of a stream
+ *      with reordered frames.
+ *
+ * Parameters:
+ *      netcam          Pointer to a netcam_context structure.
+ *      rtsp            The decoding connection, netcam->rtsp.
+ *
+ * Returns:             Nothing
+ */
+static void rtsp_packets_lag(netcam_context_ptr netcam, struct rtsp_context *rtsp)
+{
+    struct rtsp_packets *packets = netcam->packets;
+    int64_t lag;
+
+    if (packets == NULL || rtsp->sent_dts == AV_NOPTS_VALUE ||
+        rtsp->frame->pkt_dts == AV_NOPTS_VALUE)
+        return;
+
+    lag = av_rescale_q(rtsp->sent_dts - rtsp->frame->pkt_dts,
+                       rtsp->format_context->streams[rtsp->video_stream_index]->time_base,
+                       AV_TIME_BASE_Q);
+
+    if (lag < 0)
+        lag = 0;
+
+    pthread_mutex_lock(&packets->mutex);
+
+    if (lag > packets->lag_usec)
+        packets->lag_usec = lag;
+    else
+        packets->lag_usec = (9 * packets->lag_usec + lag) / 10;
+
+    pthread_mutex_unlock(&packets->mutex);
+}
+
+/**
+ * rtsp_packets_put
+ *
+ *      Adds a video packet to the ring. The ring keeps the packets of the
+ *      last rtsp_packets_window and the ones back to the keyframe before
+ *      them, so that a movie can start with the first of the pictures of the
+ *      event. Packets a movie has yet to take are kept as well, up to
+ *      RTSP_PACKETS_MAX packets. Packets without time stamps are counted
+ *      instead, one per picture.
+ *
+ * Parameters:
+ *      netcam          Pointer to a netcam_context structure.
+ *      packet          The packet.
+ *
+ * Returns:             Nothing
+ */
+static void rtsp_packets_put(netcam_context_ptr netcam, AVPacket *packet)
 {
-  int check = 0;
-  int ret = avcodec_decode_video2(cc, frame, &check, packet);
-  
-  if (ret < 0) {
-    MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Error decoding video packet");
-    return 0;
-  }
-  
-  if (check == 0) {
-    // no frame could be decoded...keep trying
-    return 0;
-  }
+    struct rtsp_packets *packets = netcam->packets;
+    struct context *cnt = netcam->cnt;
+    int keep = cnt->conf.pre_capture + cnt->conf.minimum_motion_frames;
+    int64_t seq, window, newest, age;
+    int i;
+
+    if (packets == NULL)
+        return;
+
+    pthread_mutex_lock(&packets->mutex);
+
+    if (!rtsp_packets_wanted(cnt) || packets->stream == NULL) {
+        rtsp_packets_drop(packets, packets->count);
+        pthread_mutex_unlock(&packets->mutex);
+        return;
+    }
 
-  int frame_size = av_image_get_buffer_size(cc->pix_fmt, cc->width, cc->height, 1);
+    if ((packet = rtsp_packet_clone(packet)) == NULL) {
+        pthread_mutex_unlock(&packets->mutex);
+        return;
+    }
 
-  /* Assure there's enough room in the buffer. */
-  netcam_check_buffsize(buffer, frame_size);
+    if (packets->count == RTSP_PACKETS_MAX)
+        rtsp_packets_drop(packets, 1);
 
-  av_image_copy_to_buffer((uint8_t *)buffer->ptr, frame_size,
-			  (const uint8_t **)(frame->data), frame->linesize,
-			  cc->pix_fmt, cc->width, cc->height, 1);
+    packets->ring[(packets->first + packets->count) % RTSP_PACKETS_MAX] = packet;
+    packets->count++;
+    packets->next_seq++;
 
-  buffer->used = frame_size;
-  
-  return frame_size;
+    window = rtsp_packets_window(netcam);
+    newest = rtsp_packet_time(packet);
+
+    /* Drop the oldest GOP while the keyframe after it still covers the window. */
+    for (;;) {
+        for (i = 1; i < packets->count; i++) {
+            if (rtsp_packets_at(packets, i)->flags & AV_PKT_FLAG_KEY)
+                break;
+        }
+
+        if (i >= packets->count)
+            break;
+
+        seq = packets->next_seq - packets->count + i;
+
+        if (packets->hold >= 0 && seq > packets->hold)
+            break;
+
+        age = rtsp_packet_time(rtsp_packets_at(packets, i));
+
+        if (newest != AV_NOPTS_VALUE && age != AV_NOPTS_VALUE)
+            age = newest - age;
+        else
+            age = AV_NOPTS_VALUE;
+
+        /* A clock which went back makes the packets before it useless. */
+        if (age == AV_NOPTS_VALUE ? packets->count - i < keep : age >= 0 && age < window)
+            break;
+
+        rtsp_packets_drop(packets, i);
+    }
+
+    pthread_mutex_unlock(&packets->mutex);
+}
+
+/**
+ * rtsp_packets_free
+ *
+ *      Frees the packet ring of the netcam.
+ *
+ * Parameters:
+ *      netcam          Pointer to a netcam_context structure.
+ *
+ * Returns:             Nothing
+ */
+static void rtsp_packets_free(netcam_context_ptr netcam)
+{
+    struct rtsp_packets *packets = netcam->packets;
+
+    if (packets == NULL)
+        return;
+
+    rtsp_packets_drop(packets, packets->count);
+    ffmpeg_stream_free(packets->stream);
+    pthread_mutex_destroy(&packets->mutex);
+    free(packets);
+    netcam->packets = NULL;
 }
 
-static int open_codec_context(int *stream_idx, AVFormatContext *fmt_ctx, enum AVMediaType type)
+/**
+ * netcam_rtsp_movie_open
+ *
+ *      Opens an ffmpeg_output movie of the packets of the camera, which
+ *      starts with the oldest keyframe the ring has.
+ *
+ * Parameters:
+ *      netcam          Pointer to a netcam_context structure.
+ *      container       Value of ffmpeg_passthrough.
+ *      filename        Name of the movie, without the extension.
+ *
+ * Returns:             The movie, NULL if there is no stream or on error.
+ */
+struct ffmpeg *netcam_rtsp_movie_open(netcam_context_ptr netcam, const char *container, char *filename)
 {
-    int ret;
+    struct rtsp_packets *packets = netcam->packets;
+    struct ffmpeg *movie = NULL;
+    int i;
+
+    if (packets == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&packets->mutex);
+
+    if (packets->stream)
+        movie = ffmpeg_open_passthrough(container, filename, packets->stream);
+
+    if (movie) {
+        for (i = 0; i < packets->count; i++) {
+            if (rtsp_packets_at(packets, i)->flags & AV_PKT_FLAG_KEY)
+                break;
+        }
+
+        movie->next_packet = packets->next_seq - packets->count + i;
+        movie->key_wait = 1;
+        movie->generation = packets->generation;
+        packets->hold = movie->next_packet;
+    }
+
+    pthread_mutex_unlock(&packets->mutex);
+
+    return movie;
+}
+
+/**
+ * netcam_rtsp_movie_put
+ *
+ *      Writes the packets which came in since the last call to a movie opened
+ *      with netcam_rtsp_movie_open. They are referenced under the mutex and
+ *      written after it is released, so that the netcam thread does not wait
+ *      for the disk. After packets were lost, packets are left out until the
+ *      next keyframe. Once the camera has been reconnected the packets are
+ *      not written, the stream may have another setup and time stamps which
+ *      start over, so the movie has to be closed and a new one opened.
+ *
+ * Parameters:
+ *      netcam          Pointer to a netcam_context structure, may be NULL.
+ *      movie           The movie.
+ *
+ * Returns:             0, 1 if the camera was reconnected, or -1 if writing
+ *                      to the movie failed.
+ */
+int netcam_rtsp_movie_put(netcam_context_ptr netcam, struct ffmpeg *movie)
+{
+    struct rtsp_packets *packets;
+    AVPacket **pending;
+    int64_t oldest;
+    int count, i, ret = 0;
+
+    if (netcam == NULL || netcam->packets == NULL)
+        return 0;
+
+    packets = netcam->packets;
+
+    pthread_mutex_lock(&packets->mutex);
+
+    if (movie->generation != packets->generation) {
+        pthread_mutex_unlock(&packets->mutex);
+        return 1;
+    }
+
+    oldest = packets->next_seq - packets->count;
+
+    if (movie->next_packet < oldest) {
+        MOTION_LOG(WRN, TYPE_NETCAM, NO_ERRNO, "%s: Packets lost, the movie goes on "
+                   "with the next keyframe");
+        movie->next_packet = oldest;
+        movie->key_wait = 1;
+    }
+
+    count = packets->next_seq - movie->next_packet;
+    pending = mymalloc((count + 1) * sizeof(AVPacket *));
+
+    for (i = 0; i < count; i++)
+        pending[i] = rtsp_packet_clone(rtsp_packets_at(packets, movie->next_packet - oldest + i));
+
+    movie->next_packet = packets->next_seq;
+    packets->hold = movie->next_packet;
+
+    pthread_mutex_unlock(&packets->mutex);
+
+    for (i = 0; i < count; i++) {
+        if (pending[i] == NULL)
+            continue;
+
+        if (movie->key_wait && !(pending[i]->flags & AV_PKT_FLAG_KEY)) {
+            rtsp_packet_free(&pending[i]);
+            continue;
+        }
+
+        movie->key_wait = 0;
+
+        if (ret == 0)
+            ret = ffmpeg_put_packet(movie, pending[i]);
+
+        rtsp_packet_free(&pending[i]);
+    }
+
+    free(pending);
+
+    return ret;
+}
+
+/**
+ * netcam_rtsp_movie_close
+ *
+ *      Writes the last packets to a movie opened with netcam_rtsp_movie_open,
+ *      if the camera was not reconnected since, and closes it.
+ *
+ * Parameters:
+ *      netcam          Pointer to a netcam_context structure, may be NULL.
+ *      movie           The movie.
+ *
+ * Returns:             Nothing
+ */
+void netcam_rtsp_movie_close(netcam_context_ptr netcam, struct ffmpeg *movie)
+{
+    netcam_rtsp_movie_put(netcam, movie);
+
+    if (netcam && netcam->packets) {
+        pthread_mutex_lock(&netcam->packets->mutex);
+        netcam->packets->hold = -1;
+        pthread_mutex_unlock(&netcam->packets->mutex);
+    }
+
+    ffmpeg_close(movie);
+}
+/**
+ * rtsp_interrupt
+ *
+ *      Interrupt callback of the high resolution stream, so that a camera
+ *      which stops sending does not hold up netcam_rtsp_highres_stop.
+ */
+static int rtsp_interrupt(void *ctx)
+{
+    netcam_context_ptr netcam = ctx;
+
+    return netcam->finish;
+}
+
+/**
+ * rtsp_highres_connect
+ *
+ *      Opens the netcam_highres stream and points the packet ring at it.
+ *      There is no decoder, the packets only go into movies.
+ *
+ * Parameters:
+ *      netcam          Pointer to a netcam_context structure.
+ *
+ * Returns:             0 on success, -1 on error.
+ */
+static int rtsp_highres_connect(netcam_context_ptr netcam)
+{
+    struct rtsp_context *rtsp = netcam->rtsp_highres;
+    AVDictionary *opts = NULL;
     AVStream *st;
-    AVCodecContext *dec_ctx = NULL;
-    AVCodec *dec = NULL;
-    ret = av_find_best_stream(fmt_ctx, type, -1, -1, NULL, 0);
+    int ret;
+
+    rtsp->format_context = avformat_alloc_context();
+    rtsp->format_context->interrupt_callback.callback = rtsp_interrupt;
+    rtsp->format_context->interrupt_callback.opaque = netcam;
+
+    av_dict_set(&opts, "rtsp_transport", "tcp", 0);
+    ret = avformat_open_input(&rtsp->format_context, rtsp->path, NULL, &opts);
+    av_dict_free(&opts);
+
     if (ret < 0) {
-		MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Could not find stream %s in input!", av_get_media_type_string(type));
-        return ret;
-    } else {
-        *stream_idx = ret;
-        st = fmt_ctx->streams[*stream_idx];
-        /* find decoder for the stream */
-        dec_ctx = st->codec;
-        dec = avcodec_find_decoder(dec_ctx->codec_id);
-        if (!dec) {
-    		MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Failed to find %s codec!", av_get_media_type_string(type));
-            return ret;
+        MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: unable to open high resolution input: %s",
+                   av_err2str(ret));
+        return -1;
+    }
+
+    if ((ret = avformat_find_stream_info(rtsp->format_context, NULL)) < 0 ||
+        (ret = av_find_best_stream(rtsp->format_context, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0) {
+        MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: no video in the high resolution input: %s",
+                   av_err2str(ret));
+        avformat_close_input(&rtsp->format_context);
+        return -1;
+    }
+
+    rtsp->video_stream_index = ret;
+    st = rtsp->format_context->streams[ret];
+
+#ifdef FFMPEG_CODECPAR
+    MOTION_LOG(NTC, TYPE_NETCAM, NO_ERRNO, "%s: High resolution stream %dx%d",
+               st->codecpar->width, st->codecpar->height);
+#else
+    MOTION_LOG(NTC, TYPE_NETCAM, NO_ERRNO, "%s: High resolution stream %dx%d",
+               st->codec->width, st->codec->height);
+#endif
+
+    rtsp_packets_stream(netcam, rtsp);
+    av_read_play(rtsp->format_context);
+
+    return 0;
+}
+
+/**
+ * rtsp_highres_loop
+ *
+ *      Thread reading the packets of the netcam_highres stream into the
+ *      packet ring until netcam->finish is set. A lost stream is opened
+ *      again every 5 seconds.
+ *
+ * Parameters:
+ *      arg             Pointer to a netcam_context structure.
+ *
+ * Returns:             NULL
+ */
+static void *rtsp_highres_loop(void *arg)
+{
+    netcam_context_ptr netcam = arg;
+    struct rtsp_context *rtsp = netcam->rtsp_highres;
+    struct context *cnt = netcam->cnt;
+
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
+
+    while (!netcam->finish) {
+        if (rtsp->format_context == NULL && rtsp_highres_connect(netcam) < 0) {
+            SLEEP(5, 0);
+            continue;
         }
-        if ((ret = avcodec_open2(dec_ctx, dec, NULL)) < 0) {
-    		MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: Failed to open %s codec!", av_get_media_type_string(type));
-            return ret;
+
+        if (av_read_frame(rtsp->format_context, rtsp->packet) < 0) {
+            if (!netcam->finish)
+                MOTION_LOG(WRN, TYPE_NETCAM, NO_ERRNO, "%s: High resolution stream lost, "
+                           "reconnecting");
+            avformat_close_input(&rtsp->format_context);
+            continue;
         }
+
+        if (rtsp->packet->stream_index == rtsp->video_stream_index)
+            rtsp_packets_put(netcam, rtsp->packet);
+
+        RTSP_PACKET_UNREF(rtsp->packet);
     }
-    return 0;
+
+    if (rtsp->format_context)
+        avformat_close_input(&rtsp->format_context);
+
+    pthread_mutex_lock(&global_lock);
+    threads_running--;
+    pthread_mutex_unlock(&global_lock);
+
+    return NULL;
 }
+#endif /* RTSP_PASSTHROUGH */
 
 /**
-* rtsp_new_context
-*
-*      Create a new RTSP context structure.
-*
-* Parameters
-*
-*       None
-*
-* Returns:     Pointer to the newly-created structure, NULL if error.
-*
-*/
-struct rtsp_context *rtsp_new_context(void)
+ * netcam_rtsp_highres_start
+ *
+ *      Starts reading the netcam_highres stream, see rtsp_highres_loop.
+ *      The packets of netcam_url are not kept from then on. Called before
+ *      the handler thread starts, which tells the streams apart by
+ *      netcam->rtsp_highres. Nothing is started unless ffmpeg_output_movies
+ *      and ffmpeg_passthrough are on.
+ *
+ * Parameters:
+ *      netcam          Pointer to a netcam_context structure.
+ *
+ * Returns:             0 on success, -1 on error.
+ */
+int netcam_rtsp_highres_start(netcam_context_ptr netcam)
 {
-  struct rtsp_context *ret;
-  
-  /* Note that mymalloc will exit on any problem. */
-  ret = mymalloc(sizeof(struct rtsp_context));
+#ifdef RTSP_PASSTHROUGH
+    const char *url = netcam->cnt->conf.netcam_highres;
 
-  memset(ret, 0, sizeof(struct rtsp_context));
-  
-  return ret;
+    if (strncmp(url, "rtsp://", 7)) {
+        MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: netcam_highres must be an rtsp:// URL");
+        return -1;
+    }
+
+    if (!rtsp_packets_wanted(netcam->cnt)) {
+        MOTION_LOG(WRN, TYPE_NETCAM, NO_ERRNO, "%s: netcam_highres is only used with "
+                   "ffmpeg_output_movies and ffmpeg_passthrough on");
+        return -1;
+    }
+
+    if ((netcam->rtsp_highres = rtsp_new_context()) == NULL)
+        return -1;
+
+    netcam->rtsp_highres->path = mystrdup(url);
+
+    /* No movie is opened from netcam_url until the second stream is there. */
+    if (netcam->packets) {
+        pthread_mutex_lock(&netcam->packets->mutex);
+        rtsp_packets_drop(netcam->packets, netcam->packets->count);
+        ffmpeg_stream_free(netcam->packets->stream);
+        netcam->packets->stream = NULL;
+        pthread_mutex_unlock(&netcam->packets->mutex);
+    }
+
+    pthread_mutex_lock(&global_lock);
+    threads_running++;
+    pthread_mutex_unlock(&global_lock);
+
+    if (pthread_create(&netcam->highres_thread, NULL, &rtsp_highres_loop, netcam)) {
+        MOTION_LOG(ERR, TYPE_NETCAM, SHOW_ERRNO, "%s: Starting the high resolution "
+                   "stream thread");
+        pthread_mutex_lock(&global_lock);
+        threads_running--;
+        pthread_mutex_unlock(&global_lock);
+        rtsp_free_context(netcam->rtsp_highres);
+        netcam->rtsp_highres = NULL;
+
+        /* The movies are taken from netcam_url again. */
+        if (netcam->rtsp && netcam->rtsp->format_context)
+            rtsp_packets_stream(netcam, netcam->rtsp);
+
+        return -1;
+    }
+
+    return 0;
+#else
+    MOTION_LOG(ERR, TYPE_NETCAM, NO_ERRNO, "%s: netcam_highres needs an FFmpeg "
+               "with passthrough support");
+    return -1;
+#endif
 }
 
 /**
-* rtsp_free_context
-*
-*      Free the resources allocated for this context.
-*
-* Parameters
-*
-*      ctxt    Pointer to the rtsp_context structure.
-*
-* Returns:     Nothing
-*
-*/
-static void rtsp_free_context(struct rtsp_context *ctxt)
+ * netcam_rtsp_highres_stop
+ *
+ *      Waits for the thread of the netcam_highres stream, which stops once
+ *      netcam->finish is set, and frees its connection.
+ *
+ * Parameters:
+ *      netcam          Pointer to a netcam_context structure.
+ *
+ * Returns:             Nothing
+ */
+void netcam_rtsp_highres_stop(netcam_context_ptr netcam)
 {
-  if (ctxt == NULL)
-    return;
-  
-  if (ctxt->path != NULL)
-    free(ctxt->path);
-  
-  if (ctxt->user)
-    free(ctxt->user);
-  
-  if (ctxt->pass)
-    free(ctxt->pass);
-  
-  if (ctxt->format_context != NULL) {
-    	avformat_close_input(&ctxt->format_context);
-  }
-  
-  if (ctxt->codec_context != NULL) {
-    	avcodec_close(ctxt->codec_context);
-  }
-  
-  free(ctxt);
+    if (netcam->rtsp_highres == NULL)
+        return;
+
+    pthread_join(netcam->highres_thread, NULL);
+    rtsp_free_context(netcam->rtsp_highres);
+    netcam->rtsp_highres = NULL;
 }
 
 int rtsp_connect(netcam_context_ptr netcam)
@@ -175,7 +1294,8 @@ int rtsp_connect(netcam_context_ptr netcam)
     netcam->rtsp = rtsp_new_context();
 
     if (netcam->rtsp == NULL) {
-      MOTION_LOG(ALR, TYPE_NETCAM, NO_ERRNO, "%s: unable to create context(%s)", netcam->rtsp->path);
+      MOTION_LOG(ALR, TYPE_NETCAM, NO_ERRNO, "%s: unable to create context(%s)",
+                 netcam->cnt->conf.netcam_url);
       return -1;
     }
   }
@@ -201,16 +1321,20 @@ int rtsp_connect(netcam_context_ptr netcam)
     return -1;
   }
 
-  ret = open_codec_context(&netcam->rtsp->video_stream_index, netcam->rtsp->format_context, AVMEDIA_TYPE_VIDEO);
+  ret = open_codec_context(netcam->cnt, &netcam->rtsp->video_stream_index, &netcam->rtsp->codec_context,
+                           netcam->rtsp->format_context, AVMEDIA_TYPE_VIDEO);
   if (ret < 0) {
     MOTION_LOG(ALR, TYPE_NETCAM, NO_ERRNO, "%s: unable to open codec context: %d", ret);
     rtsp_free_context(netcam->rtsp);
     netcam->rtsp = NULL;
     return -1;
   }
-  
-  netcam->rtsp->codec_context = netcam->rtsp->format_context->streams[netcam->rtsp->video_stream_index]->codec;
-  
+
+#ifdef RTSP_PASSTHROUGH
+  if (netcam->rtsp_highres == NULL)
+    rtsp_packets_stream(netcam, netcam->rtsp);
+#endif
+
   // start up the feed
   av_read_play(netcam->rtsp->format_context);
 
@@ -225,34 +1349,73 @@ int netcam_read_rtsp_image(netcam_context_ptr netcam)
     }
   }
 
-  AVCodecContext *cc = netcam->rtsp->codec_context;
-  AVFormatContext *fc = netcam->rtsp->format_context;
+  struct rtsp_context *rtsp = netcam->rtsp;
+  AVFormatContext *fc = rtsp->format_context;
+  AVPacket *packet = rtsp->packet;
   netcam_buff_ptr buffer;
 
   /* Point to our working buffer. */
   buffer = netcam->receiving;
   buffer->used = 0;
 
-  AVFrame *frame = avcodec_alloc_frame();
-
-  AVPacket packet;
-  
-  av_init_packet(&packet);
+  int size_decoded = 0;
+  int got_frame;
+  struct timeval decode_start, decode_end;
+  int level;
 
-  packet.data = NULL;
-  packet.size = 0;
+  while (size_decoded == 0) {
+    /* A frame threaded decoder may still hold frames of earlier packets. */
+    got_frame = rtsp_receive_frame(rtsp);
 
-  int size_decoded = 0;
-  static int usual_size_decoded = 0;
+    if (got_frame > 0) {
+      size_decoded = rtsp_frame_to_buffer(netcam, rtsp->frame, buffer);
+      rtsp_decode_done(rtsp, rtsp->decode_level, size_decoded);
+#ifdef RTSP_PASSTHROUGH
+      rtsp_packets_lag(netcam, rtsp);
+#endif
+      continue;
+    }
 
-  while (size_decoded == 0 && av_read_frame(fc, &packet) >= 0) {
+    if (got_frame < 0 || av_read_frame(fc, packet) < 0)
+      break;
 
-    if(packet.stream_index != netcam->rtsp->video_stream_index) {
+    if (packet->stream_index != rtsp->video_stream_index) {
       // not our packet, skip
+      RTSP_PACKET_UNREF(packet);
       continue;
     }
 
-    size_decoded = decode_packet(&packet, buffer, frame, cc);
+#ifdef RTSP_PASSTHROUGH
+    if (netcam->rtsp_highres == NULL)
+      rtsp_packets_put(netcam, packet);
+#endif
+
+    level = rtsp_decode_level(netcam);
+
+    gettimeofday(&decode_start, NULL);
+    got_frame = rtsp_send_packet(rtsp, packet);
+    RTSP_PACKET_UNREF(packet);
+
+    if (got_frame == 0)
+      got_frame = rtsp_receive_frame(rtsp);
+
+    if (got_frame > 0)
+      size_decoded = rtsp_frame_to_buffer(netcam, rtsp->frame, buffer);
+    gettimeofday(&decode_end, NULL);
+
+#ifdef RTSP_PASSTHROUGH
+    if (got_frame > 0)
+      rtsp_packets_lag(netcam, rtsp);
+#endif
+
+    // packets are read until one gives a frame, which may be a whole GOP when idle
+    rtsp_decode_done(rtsp, level, size_decoded);
+    rtsp_decode_stats(rtsp, level, size_decoded,
+                      (decode_end.tv_sec - decode_start.tv_sec) * 1000000L +
+                      (decode_end.tv_usec - decode_start.tv_usec));
+
+    if (got_frame < 0)
+      break;
   }
 
   if (size_decoded == 0) {
@@ -261,15 +1424,6 @@ int netcam_read_rtsp_image(netcam_context_ptr netcam)
     return -1;
   }
 
-  if (size_decoded != usual_size_decoded) {
-    MOTION_LOG(WRN, TYPE_NETCAM, SHOW_ERRNO, "%s: unusual frame size of %d!", size_decoded);
-    usual_size_decoded = size_decoded;
-  }
-
-  // at this point, we are finished with the packet and frame, so free them.
-  av_free_packet(&packet);
-  av_free(frame);
-  
   struct timeval curtime;
   
   if (gettimeofday(&curtime, NULL) < 0) {
@@ -327,6 +1481,10 @@ void netcam_shutdown_rtsp(netcam_context_ptr netcam)
     rtsp_free_context(netcam->rtsp);
     netcam->rtsp = NULL;
   }
+
+#ifdef RTSP_PASSTHROUGH
+  rtsp_packets_free(netcam);
+#endif
 }
 
 #endif
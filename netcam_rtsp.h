@@ -1,10 +1,65 @@
 #include "netcam.h"
+#include "ffmpeg.h"
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
 #include <libavutil/avutil.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#ifdef HAVE_SWSCALE
+#include <libswscale/swscale.h>
+#endif
 
+/* Decoders with avcodec_send_packet / avcodec_receive_frame and codecpar */
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57, 37, 100)
+#define RTSP_SEND_RECEIVE
+#define RTSP_PACKET_UNREF(packet) av_packet_unref(packet)
+#else
+#define RTSP_PACKET_UNREF(packet) av_free_packet(packet)
+#endif
+
+
+/* Decode levels for netcam_idle_decode */
+#define RTSP_DECODE_FULL      0    /* Every frame */
+#define RTSP_DECODE_NONREF    1    /* Reference frames only */
+#define RTSP_DECODE_KEY       2    /* Keyframes only */
+#define RTSP_DECODE_RESYNC    3    /* Back from keyframes only, nothing until the next one */
+#define RTSP_DECODE_LEVELS    4
+
+#define RTSP_KEY_WAIT         1000 /* Packets to wait for a keyframe before giving up on them */
+#define RTSP_STATS_INTERVAL   60   /* Seconds between two decode statistics lines */
+#define RTSP_LATENCY_SLOTS    64   /* Packets in the decoder whose send time is kept */
+#define RTSP_PACKETS_MAX      1024 /* Packets kept for passthrough movies at the most */
+
+#ifdef FFMPEG_PASSTHROUGH
+#define RTSP_PASSTHROUGH
+#endif
+
+/* When a packet went into the decoder, to time it when its frame comes out. */
+struct rtsp_latency {
+	int64_t               dts;
+	struct timeval        sent;
+};
+
+/*
+ * The latest packets of the camera, for movies written without decoding them,
+ * see ffmpeg_passthrough. The netcam thread adds the packets, the motion
+ * thread copies them to the movie. It lives in the netcam context, so that it
+ * outlasts reconnects.
+ */
+struct rtsp_packets {
+	pthread_mutex_t       mutex;
+	AVPacket*             ring[RTSP_PACKETS_MAX];
+	int                   first;          /* Index of the oldest packet */
+	int                   count;
+	int64_t               next_seq;       /* Sequence number of the next packet added */
+	int64_t               hold;           /* Oldest packet a movie still needs, -1 if none */
+	int                   generation;     /* Counts the connections to the camera */
+	int64_t               lag_usec;       /* Decoded pictures behind the newest packet */
+#ifdef FFMPEG_PASSTHROUGH
+	struct ffmpeg_stream* stream;         /* Setup of the stream of the packets */
+#endif
+};
 
 struct rtsp_context {
 	AVFormatContext*      format_context;
@@ -13,6 +68,26 @@ struct rtsp_context {
 	char*                 path;
 	char*                 user;
 	char*                 pass;
+	int                   decode_level;
+	int                   key_wait;
+	int                   no_keyframes;
+	time_t                stats_start;
+	long                  stats_packets[RTSP_DECODE_LEVELS];
+	long                  stats_frames[RTSP_DECODE_LEVELS];
+	long long             stats_usec[RTSP_DECODE_LEVELS];
+	AVFrame*              frame;          /* Kept from one packet to the next */
+	AVPacket*             packet;
+#ifdef HAVE_SWSCALE
+	struct SwsContext*    sws_context;    /* Only for streams which are not 4:2:0 */
+#endif
+	int                   bad_format;     /* Unusable pixel format already logged */
+	struct rtsp_latency   latency[RTSP_LATENCY_SLOTS];
+	int                   latency_next;
+	int64_t               sent_dts;       /* Last packet given to the decoder */
+	long                  stats_dropped;
+	long                  stats_latency_frames;
+	long long             stats_latency_usec;
+	long                  stats_latency_max;
 };
 
 //int netcam_setup_rtsp(netcam_context_ptr netcam, struct url_t *url);
@@ -20,3 +95,10 @@ struct rtsp_context *rtsp_new_context(void);
 void netcam_shutdown_rtsp(netcam_context_ptr netcam);
 int rtsp_connect(netcam_context_ptr netcam);
 int netcam_read_rtsp_image(netcam_context_ptr netcam);
+int netcam_rtsp_highres_start(netcam_context_ptr netcam);
+void netcam_rtsp_highres_stop(netcam_context_ptr netcam);
+#ifdef RTSP_PASSTHROUGH
+struct ffmpeg *netcam_rtsp_movie_open(netcam_context_ptr netcam, const char *container, char *filename);
+int netcam_rtsp_movie_put(netcam_context_ptr netcam, struct ffmpeg *movie);
+void netcam_rtsp_movie_close(netcam_context_ptr netcam, struct ffmpeg *movie);
+#endif
@@ -11,6 +11,7 @@
 
 #include "picture.h"
 #include "event.h"
+#include "jpegutils.h"
 
 #include <assert.h>
 
@@ -217,20 +218,218 @@ static void put_subjectarea(struct tiff_writing *into, const struct coord *box)
 }
 
 /*
- * put_jpeg_exif writes the EXIF APP1 chunk to the jpeg file.
- * It must be called after jpeg_start_compress() but before
- * any image data is written by jpeg_write_scanlines().
+ * A camera keeps a jpeg compressor for each kind of picture it makes: to
+ * memory or to a file, colour or grey, size and quality. Once
+ * jpeg_finish_compress is done a compressor can take the next picture
+ * with its parameters, quantisation tables and destination manager
+ * already set up, so only the first picture of a kind pays for them.
+ * The last EXIF block is kept as well and written again as long as the
+ * description, the time stamp and the motion box do not change.
  */
-static void put_jpeg_exif(j_compress_ptr cinfo,
-			  const struct context *cnt,
-			  const struct tm *timestamp,
-			  const struct coord *box)
+#define PICTURE_JPEG_MAX 4
+
+struct picture_jpeg {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    int used;
+    int to_file;
+    int type;
+    int width;
+    int height;
+    int quality;
+};
+
+struct picture_cache {
+    struct picture_jpeg jpeg[PICTURE_JPEG_MAX];
+    int jpeg_next;              /* compressor to replace when all are taken */
+
+    JOCTET *exif;               /* last EXIF marker */
+    unsigned int exif_size;     /* allocated size of exif */
+    unsigned int exif_len;      /* length of the marker, 0 for none */
+    int exif_valid;             /* the fields below describe exif */
+    char *exif_text;            /* description the marker was made with */
+    char *description;          /* description of the picture being made */
+    int has_text;
+    char datetime[22];
+    int has_datetime;
+    long gmtoff;
+    struct coord box;
+    int has_box;
+};
+
+/*
+ * picture_cache_get returns the camera's picture cache, set up the first
+ * time it is asked for.
+ */
+static struct picture_cache *picture_cache_get(struct context *cnt)
+{
+    struct picture_cache *cache = cnt->picture_cache;
+
+    if (cache == NULL) {
+        cache = mymalloc(sizeof(struct picture_cache));
+        memset(cache, 0, sizeof(struct picture_cache));
+        cache->exif_text = mymalloc(PATH_MAX);
+        cache->description = mymalloc(PATH_MAX);
+        cnt->picture_cache = cache;
+    }
+
+    return cache;
+}
+
+/**
+ * picture_jpeg
+ *      Returns the camera's compressor for pictures of the given kind and
+ *      sets one up the first time a kind is asked for. When all of them are
+ *      taken the compressors are replaced in turn.
+ *
+ * Parameters:
+ *      cnt     Pointer to the motion context.
+ *      to_file 1 when the picture is written with jpeg_stdio_dest, 0 for memory.
+ *      type    VIDEO_PALETTE_YUV420P or VIDEO_PALETTE_GREY.
+ *      width, height, quality  Picture size and jpeg quality.
+ *
+ * Returns the compressor, ready for a destination and jpeg_start_compress.
+ */
+static j_compress_ptr picture_jpeg(struct context *cnt, int to_file, int type,
+                                   int width, int height, int quality)
 {
+    struct picture_cache *cache = picture_cache_get(cnt);
+    struct picture_jpeg *enc;
+    j_compress_ptr cinfo;
+    int i;
+
+    for (i = 0; i < PICTURE_JPEG_MAX; i++) {
+        enc = &cache->jpeg[i];
+        if (enc->used && enc->to_file == to_file && enc->type == type &&
+            enc->width == width && enc->height == height &&
+            enc->quality == quality)
+            return &enc->cinfo;
+    }
+
+    i = 0;
+    while (i < PICTURE_JPEG_MAX && cache->jpeg[i].used)
+        i++;
+
+    if (i == PICTURE_JPEG_MAX) {
+        i = cache->jpeg_next;
+        cache->jpeg_next = (i + 1) % PICTURE_JPEG_MAX;
+        jpeg_destroy_compress(&cache->jpeg[i].cinfo);
+    }
+
+    enc = &cache->jpeg[i];
+    enc->used = 1;
+    enc->to_file = to_file;
+    enc->type = type;
+    enc->width = width;
+    enc->height = height;
+    enc->quality = quality;
+
+    cinfo = &enc->cinfo;
+    cinfo->err = jpeg_std_error(&enc->jerr);  // Errors get written to stderr
+
+    jpeg_create_compress(cinfo);
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+
+    if (type == VIDEO_PALETTE_GREY) {
+        cinfo->input_components = 1; /* One colour component */
+        cinfo->in_color_space = JCS_GRAYSCALE;
+        jpeg_set_defaults(cinfo);
+    } else {
+        cinfo->input_components = 3;
+        jpeg_set_defaults(cinfo);
+
+        jpeg_set_colorspace(cinfo, JCS_YCbCr);
+
+        cinfo->raw_data_in = TRUE; // Supply downsampled data
+#if JPEG_LIB_VERSION >= 70
+        cinfo->do_fancy_downsampling = FALSE;  // Fix segfault with v7
+#endif
+        cinfo->comp_info[0].h_samp_factor = 2;
+        cinfo->comp_info[0].v_samp_factor = 2;
+        cinfo->comp_info[1].h_samp_factor = 1;
+        cinfo->comp_info[1].v_samp_factor = 1;
+        cinfo->comp_info[2].h_samp_factor = 1;
+        cinfo->comp_info[2].v_samp_factor = 1;
+    }
+
+    jpeg_set_quality(cinfo, quality, TRUE);
+    cinfo->dct_method = JDCT_FASTEST;
+
+    return cinfo;
+}
+
+/**
+ * picture_cleanup
+ *      Releases the compressors and the EXIF block kept for the camera.
+ *
+ * Returns nothing.
+ */
+void picture_cleanup(struct context *cnt)
+{
+    struct picture_cache *cache = cnt->picture_cache;
+    int i;
+
+    if (cache == NULL)
+        return;
+
+    for (i = 0; i < PICTURE_JPEG_MAX; i++) {
+        if (cache->jpeg[i].used)
+            jpeg_destroy_compress(&cache->jpeg[i].cinfo);
+    }
+
+    free(cache->exif);
+    free(cache->exif_text);
+    free(cache->description);
+    free(cache);
+    cnt->picture_cache = NULL;
+}
+
+/*
+ * exif_unchanged tells whether the kept EXIF block was made from the same
+ * description, time stamp and box.
+ */
+static int exif_unchanged(const struct picture_cache *cache,
+                          const char *description, const char *datetime,
+                          long gmtoff, const struct coord *box)
+{
+    if (!cache->exif_valid)
+        return 0;
+
+    if ((description != NULL) != cache->has_text ||
+        (datetime != NULL) != cache->has_datetime ||
+        (box != NULL) != cache->has_box)
+        return 0;
+
+    if (description && strcmp(description, cache->exif_text))
+        return 0;
+
+    if (datetime && (strcmp(datetime, cache->datetime) || gmtoff != cache->gmtoff))
+        return 0;
+
+    if (box && (box->x != cache->box.x || box->y != cache->box.y ||
+        box->width != cache->box.width || box->height != cache->box.height))
+        return 0;
+
+    return 1;
+}
+
+/*
+ * picture_exif makes the EXIF APP1 chunk of a picture in the camera's
+ * picture cache, which must have been set up by picture_cache_get.
+ * Returns the length of the chunk, 0 when there is nothing to put in.
+ */
+static unsigned int picture_exif(const struct context *cnt,
+				 const struct tm *timestamp,
+				 const struct coord *box)
+{
+    struct picture_cache *cache = cnt->picture_cache;
     /* description, datetime, and subtime are the values that are actually
      * put into the EXIF data
     */
     char *description, *datetime, *subtime;
     char datetime_buf[22];
+    long gmtoff = 0;
 
     if (timestamp) {
 	/* Exif requires this exact format */
@@ -242,6 +441,7 @@ static void put_jpeg_exif(j_compress_ptr cinfo,
 		        timestamp->tm_min,
 		        timestamp->tm_sec);
 	    datetime = datetime_buf;
+	    gmtoff = timestamp->tm_gmtoff / 3600;
     } else {
 	    datetime = NULL;
     }
@@ -251,7 +451,7 @@ static void put_jpeg_exif(j_compress_ptr cinfo,
     subtime = NULL;
 
     if (cnt->conf.exif_text) {
-	    description = malloc(PATH_MAX);
+	    description = cache->description;
 	    mystrftime(cnt, description, PATH_MAX-1,
 		        cnt->conf.exif_text,
 		        timestamp, NULL, 0);
@@ -259,6 +459,29 @@ static void put_jpeg_exif(j_compress_ptr cinfo,
 	    description = NULL;
     }
 
+    /* Pictures of the same second and box get the block made last time */
+    if (exif_unchanged(cache, description, datetime, gmtoff, box))
+	    return cache->exif_len;
+
+    cache->exif_valid = 1;
+    cache->exif_len = 0;
+    cache->has_text = (description != NULL);
+    cache->has_datetime = (datetime != NULL);
+    cache->has_box = (box != NULL);
+    cache->gmtoff = gmtoff;
+
+    if (description) {
+	    /* Keep this description and write the next one in the other buffer */
+	    cache->description = cache->exif_text;
+	    cache->exif_text = description;
+    }
+
+    if (datetime)
+	    strcpy(cache->datetime, datetime);
+
+    if (box)
+	    cache->box = *box;
+
     /* Calculate an upper bound on the size of the APP1 marker so
      * we can allocate a buffer for it.
      */
@@ -314,7 +537,7 @@ static void put_jpeg_exif(j_compress_ptr cinfo,
 
     if (ifds_size == 0) {
 	    /* We're not actually going to write any information. */
-	    return;
+	    return 0;
     }
 
     unsigned int buffer_size = 6 /* EXIF marker signature */ +
@@ -322,7 +545,12 @@ static void put_jpeg_exif(j_compress_ptr cinfo,
                                ifds_size /* the tag directories */ +
                                datasize;
 
-    JOCTET *marker = malloc(buffer_size);
+    if (buffer_size > cache->exif_size) {
+	    cache->exif = myrealloc(cache->exif, buffer_size, "picture_exif");
+	    cache->exif_size = buffer_size;
+    }
+
+    JOCTET *marker = cache->exif;
     memcpy(marker, exif_marker_start, 14); /* EXIF and TIFF headers */
     
     struct tiff_writing writing = (struct tiff_writing) {
@@ -352,7 +580,7 @@ static void put_jpeg_exif(j_compress_ptr cinfo,
 
     if (datetime) {
         memcpy(writing.buf, exif_tzoffset_tag, 12);
-        put_sint16(writing.buf+8, timestamp->tm_gmtoff / 3600);
+        put_sint16(writing.buf+8, gmtoff);
         writing.buf += 12;
     }
 
@@ -389,13 +617,28 @@ static void put_jpeg_exif(j_compress_ptr cinfo,
     /* assert we didn't underestimate the original buffer size */
     assert(marker_len <= buffer_size);
 
-    /* EXIF data lives in a JPEG APP1 marker */
-    jpeg_write_marker(cinfo, JPEG_APP0 + 1, marker, marker_len);
+    cache->exif_len = marker_len;
 
-    if (description)
-	    free(description);
-    
-    free(marker);
+    return marker_len;
+}
+
+/*
+ * put_jpeg_exif writes the EXIF APP1 chunk to the jpeg file.
+ * It must be called after jpeg_start_compress() but before
+ * any image data is written by jpeg_write_scanlines().
+ * The compressor must come from picture_jpeg, which sets up the
+ * camera's picture cache the block is kept in.
+ */
+static void put_jpeg_exif(j_compress_ptr cinfo,
+			  const struct context *cnt,
+			  const struct tm *timestamp,
+			  const struct coord *box)
+{
+    unsigned int len = picture_exif(cnt, timestamp, box);
+
+    /* EXIF data lives in a JPEG APP1 marker */
+    if (len > 0)
+        jpeg_write_marker(cinfo, JPEG_APP0 + 1, cnt->picture_cache->exif, len);
 }
 
 /**
@@ -423,42 +666,19 @@ static int put_jpeg_yuv420p_memory(unsigned char *dest_image, int image_size,
     JSAMPROW y[16],cb[16],cr[16]; // y[2][5] = color sample of row 2 and pixel column 5; (one plane)
     JSAMPARRAY data[3]; // t[0][2][5] = color sample 0 of row 2 and column 5
 
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+    j_compress_ptr cinfo;
 
     data[0] = y;
     data[1] = cb;
     data[2] = cr;
 
-    cinfo.err = jpeg_std_error(&jerr);  // Errors get written to stderr
-
-    jpeg_create_compress(&cinfo);
-    cinfo.image_width = width;
-    cinfo.image_height = height;
-    cinfo.input_components = 3;
-    jpeg_set_defaults(&cinfo);
-
-    jpeg_set_colorspace(&cinfo, JCS_YCbCr);
-
-    cinfo.raw_data_in = TRUE; // Supply downsampled data
-#if JPEG_LIB_VERSION >= 70
-    cinfo.do_fancy_downsampling = FALSE;  // Fix segfault with v7
-#endif
-    cinfo.comp_info[0].h_samp_factor = 2;
-    cinfo.comp_info[0].v_samp_factor = 2;
-    cinfo.comp_info[1].h_samp_factor = 1;
-    cinfo.comp_info[1].v_samp_factor = 1;
-    cinfo.comp_info[2].h_samp_factor = 1;
-    cinfo.comp_info[2].v_samp_factor = 1;
-
-    jpeg_set_quality(&cinfo, quality, TRUE);
-    cinfo.dct_method = JDCT_FASTEST;
+    cinfo = picture_jpeg(cnt, 0, VIDEO_PALETTE_YUV420P, width, height, quality);
 
-    _jpeg_mem_dest(&cinfo, dest_image, image_size);  // Data written to mem
+    _jpeg_mem_dest(cinfo, dest_image, image_size);  // Data written to mem
 
-    jpeg_start_compress(&cinfo, TRUE);
+    jpeg_start_compress(cinfo, TRUE);
 
-    put_jpeg_exif(&cinfo, cnt, tm, box);
+    put_jpeg_exif(cinfo, cnt, tm, box);
 
     for (j = 0; j < height; j += 16) {
         for (i = 0; i < 16; i++) {
@@ -469,12 +689,11 @@ static int put_jpeg_yuv420p_memory(unsigned char *dest_image, int image_size,
                 cr[i / 2] = input_image + width * height + width * height / 4 + width / 2 * ((i + j) / 2);
             }
         }
-        jpeg_write_raw_data(&cinfo, data, 16);
+        jpeg_write_raw_data(cinfo, data, 16);
     }
 
-    jpeg_finish_compress(&cinfo);
-    jpeg_image_size = _jpeg_mem_size(&cinfo);
-    jpeg_destroy_compress(&cinfo);
+    jpeg_finish_compress(cinfo);
+    jpeg_image_size = _jpeg_mem_size(cinfo);
 
     return jpeg_image_size;
 }
@@ -494,40 +713,31 @@ static int put_jpeg_yuv420p_memory(unsigned char *dest_image, int image_size,
  *
  * Returns buffer size of jpeg image.
  */
-static int put_jpeg_grey_memory(unsigned char *dest_image, int image_size, unsigned char *input_image, int width, int height, int quality)
+static int put_jpeg_grey_memory(unsigned char *dest_image, int image_size, unsigned char *input_image,
+                                int width, int height, int quality,
+                                struct context *cnt, struct tm *tm, struct coord *box)
 {
     int y, dest_image_size;
     JSAMPROW row_ptr[1];
-    struct jpeg_compress_struct cjpeg;
-    struct jpeg_error_mgr jerr;
-
-    cjpeg.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cjpeg);
-    cjpeg.image_width = width;
-    cjpeg.image_height = height;
-    cjpeg.input_components = 1; /* One colour component */
-    cjpeg.in_color_space = JCS_GRAYSCALE;
+    j_compress_ptr cjpeg;
 
-    jpeg_set_defaults(&cjpeg);
+    cjpeg = picture_jpeg(cnt, 0, VIDEO_PALETTE_GREY, width, height, quality);
 
-    jpeg_set_quality(&cjpeg, quality, TRUE);
-    cjpeg.dct_method = JDCT_FASTEST;
-    _jpeg_mem_dest(&cjpeg, dest_image, image_size);  // Data written to mem
+    _jpeg_mem_dest(cjpeg, dest_image, image_size);  // Data written to mem
 
-    jpeg_start_compress (&cjpeg, TRUE);
+    jpeg_start_compress (cjpeg, TRUE);
 
-    put_jpeg_exif(&cjpeg, NULL, NULL, NULL);
+    put_jpeg_exif(cjpeg, cnt, tm, box);
 
     row_ptr[0] = input_image;
 
     for (y = 0; y < height; y++) {
-        jpeg_write_scanlines(&cjpeg, row_ptr, 1);
+        jpeg_write_scanlines(cjpeg, row_ptr, 1);
         row_ptr[0] += width;
     }
 
-    jpeg_finish_compress(&cjpeg);
-    dest_image_size = _jpeg_mem_size(&cjpeg);
-    jpeg_destroy_compress(&cjpeg);
+    jpeg_finish_compress(cjpeg);
+    dest_image_size = _jpeg_mem_size(cjpeg);
 
     return dest_image_size;
 }
@@ -557,41 +767,18 @@ static void put_jpeg_yuv420p_file(FILE *fp,
     JSAMPROW y[16],cb[16],cr[16]; // y[2][5] = color sample of row 2 and pixel column 5; (one plane)
     JSAMPARRAY data[3]; // t[0][2][5] = color sample 0 of row 2 and column 5
 
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+    j_compress_ptr cinfo;
 
     data[0] = y;
     data[1] = cb;
     data[2] = cr;
 
-    cinfo.err = jpeg_std_error(&jerr);  // Errors get written to stderr
-
-    jpeg_create_compress(&cinfo);
-    cinfo.image_width = width;
-    cinfo.image_height = height;
-    cinfo.input_components = 3;
-    jpeg_set_defaults(&cinfo);
-
-    jpeg_set_colorspace(&cinfo, JCS_YCbCr);
-
-    cinfo.raw_data_in = TRUE; // Supply downsampled data
-#if JPEG_LIB_VERSION >= 70
-    cinfo.do_fancy_downsampling = FALSE;  // Fix segfault with v7
-#endif
-    cinfo.comp_info[0].h_samp_factor = 2;
-    cinfo.comp_info[0].v_samp_factor = 2;
-    cinfo.comp_info[1].h_samp_factor = 1;
-    cinfo.comp_info[1].v_samp_factor = 1;
-    cinfo.comp_info[2].h_samp_factor = 1;
-    cinfo.comp_info[2].v_samp_factor = 1;
+    cinfo = picture_jpeg(cnt, 1, VIDEO_PALETTE_YUV420P, width, height, quality);
 
-    jpeg_set_quality(&cinfo, quality, TRUE);
-    cinfo.dct_method = JDCT_FASTEST;
+    jpeg_stdio_dest(cinfo, fp);        // Data written to file
+    jpeg_start_compress(cinfo, TRUE);
 
-    jpeg_stdio_dest(&cinfo, fp);        // Data written to file
-    jpeg_start_compress(&cinfo, TRUE);
-
-    put_jpeg_exif(&cinfo, cnt, tm, box);
+    put_jpeg_exif(cinfo, cnt, tm, box);
 
     for (j = 0; j < height; j += 16) {
         for (i = 0; i < 16; i++) {
@@ -601,11 +788,10 @@ static void put_jpeg_yuv420p_file(FILE *fp,
                 cr[i / 2] = image + width * height + width * height / 4 + width / 2 * ((i + j) / 2);
             }
         }
-        jpeg_write_raw_data(&cinfo, data, 16);
+        jpeg_write_raw_data(cinfo, data, 16);
     }
 
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
+    jpeg_finish_compress(cinfo);
 }
 
 
@@ -623,39 +809,29 @@ static void put_jpeg_yuv420p_file(FILE *fp,
  *
  * Returns nothing
  */
-static void put_jpeg_grey_file(FILE *picture, unsigned char *image, int width, int height, int quality)
+static void put_jpeg_grey_file(FILE *picture, unsigned char *image, int width, int height, int quality,
+                               struct context *cnt, struct tm *tm, struct coord *box)
 {
     int y;
     JSAMPROW row_ptr[1];
-    struct jpeg_compress_struct cjpeg;
-    struct jpeg_error_mgr jerr;
-
-    cjpeg.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cjpeg);
-    cjpeg.image_width = width;
-    cjpeg.image_height = height;
-    cjpeg.input_components = 1; /* One colour component */
-    cjpeg.in_color_space = JCS_GRAYSCALE;
+    j_compress_ptr cjpeg;
 
-    jpeg_set_defaults(&cjpeg);
+    cjpeg = picture_jpeg(cnt, 1, VIDEO_PALETTE_GREY, width, height, quality);
 
-    jpeg_set_quality(&cjpeg, quality, TRUE);
-    cjpeg.dct_method = JDCT_FASTEST;
-    jpeg_stdio_dest(&cjpeg, picture);
+    jpeg_stdio_dest(cjpeg, picture);
 
-    jpeg_start_compress(&cjpeg, TRUE);
+    jpeg_start_compress(cjpeg, TRUE);
 
-    put_jpeg_exif(&cjpeg, NULL, NULL, NULL);
+    put_jpeg_exif(cjpeg, cnt, tm, box);
 
     row_ptr[0] = image;
 
     for (y = 0; y < height; y++) {
-        jpeg_write_scanlines(&cjpeg, row_ptr, 1);
+        jpeg_write_scanlines(cjpeg, row_ptr, 1);
         row_ptr[0] += width;
     }
 
-    jpeg_finish_compress(&cjpeg);
-    jpeg_destroy_compress(&cjpeg);
+    jpeg_finish_compress(cjpeg);
 }
 
 
@@ -734,6 +910,7 @@ static void put_ppm_bgr24_file(FILE *picture, unsigned char *image, int width, i
 /**
  * overlay_smartmask
  *      Copies smartmask as an overlay into motion images and movies.
+ *      out is the motion image at detection size, imgs.det_out.
  *
  * Returns nothing.
  */
@@ -744,10 +921,10 @@ void overlay_smartmask(struct context *cnt, unsigned char *out)
     unsigned char *smartmask = imgs->smartmask_final;
     unsigned char *out_y, *out_u, *out_v;
 
-    i = imgs->motionsize;
-    v = i + ((imgs->motionsize) / 4);
-    width = imgs->width;
-    height = imgs->height;
+    i = imgs->det_motionsize;
+    v = i + ((imgs->det_motionsize) / 4);
+    width = imgs->det_width;
+    height = imgs->det_height;
 
     /* Set V to 255 to make smartmask appear red. */
     out_v = out + v;
@@ -768,7 +945,7 @@ void overlay_smartmask(struct context *cnt, unsigned char *out)
     }
     out_y = out;
     /* Set colour intensity for smartmask. */
-    for (i = 0; i < imgs->motionsize; i++) {
+    for (i = 0; i < imgs->det_motionsize; i++) {
         if (smartmask[i] == 0)
             *out_y = 0;
         out_y++;
@@ -788,10 +965,10 @@ void overlay_fixed_mask(struct context *cnt, unsigned char *out)
     unsigned char *mask = imgs->mask;
     unsigned char *out_y, *out_u, *out_v;
 
-    i = imgs->motionsize;
-    v = i + ((imgs->motionsize) / 4);
-    width = imgs->width;
-    height = imgs->height;
+    i = imgs->det_motionsize;
+    v = i + ((imgs->det_motionsize) / 4);
+    width = imgs->det_width;
+    height = imgs->det_height;
 
     /* Set U and V to 0 to make fixed mask appear green. */
     out_v = out + v;
@@ -812,7 +989,7 @@ void overlay_fixed_mask(struct context *cnt, unsigned char *out)
     }
     out_y = out;
     /* Set colour intensity for mask. */
-    for (i = 0; i < imgs->motionsize; i++) {
+    for (i = 0; i < imgs->det_motionsize; i++) {
         if (mask[i] == 0)
             *out_y = 0;
         out_y++;
@@ -829,13 +1006,14 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
 {
     int i, x, v, width, height, line;
     struct images *imgs = &cnt->imgs;
-    int *labels = imgs->labels;
+    unsigned short *labels = imgs->labels;
+    struct label_stat *stats = imgs->label_stats;
     unsigned char *out_y, *out_u, *out_v;
 
-    i = imgs->motionsize;
-    v = i + ((imgs->motionsize) / 4);
-    width = imgs->width;
-    height = imgs->height;
+    i = imgs->det_motionsize;
+    v = i + ((imgs->det_motionsize) / 4);
+    width = imgs->det_width;
+    height = imgs->det_height;
 
     /* Set U to 255 to make label appear blue. */
     out_u = out + i;
@@ -843,9 +1021,9 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
     for (i = 0; i < height; i += 2) {
         line = i * width;
         for (x = 0; x < width; x += 2) {
-            if (labels[line + x] & 32768 || labels[line + x + 1] & 32768 ||
-                labels[line + width + x] & 32768 ||
-                labels[line + width + x + 1] & 32768) {
+            if (stats[labels[line + x]].above || stats[labels[line + x + 1]].above ||
+                stats[labels[line + width + x]].above ||
+                stats[labels[line + width + x + 1]].above) {
 
                 *out_u = 255;
                 *out_v = 128;
@@ -856,17 +1034,176 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
     }
     out_y = out;
     /* Set intensity for coloured label to have better visibility. */
-    for (i = 0; i < imgs->motionsize; i++) {
-        if (*labels++ & 32768)
+    for (i = 0; i < imgs->det_motionsize; i++) {
+        if (stats[*labels++].above)
             *out_y = 0;
         out_y++;
     }
 }
 
+/*
+ * With jpeg_passthrough a picture is the JPEG the camera sent, with the
+ * EXIF block of the picture spliced in after SOI and a JFIF APP0 segment.
+ * An EXIF block of the camera's is left out. MJPEG frames without Huffman
+ * tables get the standard ones, which decoders of the frames assume.
+ */
+struct jpeg_splice {
+    int head;                   /* bytes of the camera's JPEG before the EXIF block */
+    int tail;                   /* where the rest of the camera's JPEG starts */
+    unsigned int exif_len;      /* length of the EXIF block, 0 for none */
+    int dht;                    /* the standard Huffman tables go in */
+};
+
+/**
+ * picture_orig_jpeg
+ *      Returns the frame whose camera JPEG can stand in for the picture of
+ *      image, NULL when the picture has to be encoded. That is the frame
+ *      being saved or sent, as long as nothing was drawn on it since it was
+ *      decoded, see IMAGE_ORIG_JPEG.
+ */
+static struct image_data *picture_orig_jpeg(struct context *cnt, unsigned char *image)
+{
+    struct image_data *img = cnt->current_image;
+
+    if (img == NULL || img->image != image || !(img->flags & IMAGE_ORIG_JPEG))
+        return NULL;
+
+    return img;
+}
+
+/**
+ * jpeg_splice
+ *      Finds where the EXIF block goes into the camera's JPEG of img and
+ *      makes the block.
+ *
+ * Returns the size of the picture, 0 when the JPEG is not usable.
+ */
+static int jpeg_splice(struct context *cnt, struct image_data *img, struct jpeg_splice *sp)
+{
+    const unsigned char *jpeg = img->jpeg;
+    int size = img->jpeg_size;
+    int pos, len;
+
+    if (size < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8)
+        return 0;
+
+    pos = 2;
+
+    /* The JFIF APP0 segment stays in front, where libjpeg writes it */
+    if (pos + 4 <= size && jpeg[pos] == 0xFF && jpeg[pos + 1] == 0xE0)
+        pos += 2 + ((jpeg[pos + 2] << 8) | jpeg[pos + 3]);
+
+    sp->head = pos;
+
+    if (pos + 10 <= size && jpeg[pos] == 0xFF && jpeg[pos + 1] == 0xE1 &&
+        !memcmp(jpeg + pos + 4, "Exif\0\0", 6))
+        pos += 2 + ((jpeg[pos + 2] << 8) | jpeg[pos + 3]);
+
+    sp->tail = pos;
+    sp->dht = 1;
+
+    /* Look for Huffman tables in the segments up to the scan */
+    while (pos + 4 <= size && jpeg[pos] == 0xFF && jpeg[pos + 1] != 0xDA) {
+        if (jpeg[pos + 1] == 0xC4)
+            sp->dht = 0;
+
+        len = (jpeg[pos + 2] << 8) | jpeg[pos + 3];
+        if (len < 2)
+            return 0;
+
+        pos += 2 + len;
+    }
+
+    if (pos + 4 > size || jpeg[pos] != 0xFF || jpeg[pos + 1] != 0xDA)
+        return 0;
+
+    picture_cache_get(cnt);
+    sp->exif_len = picture_exif(cnt, &img->timestamp_tm, &img->location);
+
+    return size - (sp->tail - sp->head) + (sp->exif_len ? 4 + sp->exif_len : 0) +
+           (sp->dht ? JPEG_STD_DHT_SIZE : 0);
+}
+
+/*
+ * jpeg_app1 fills in the marker and length of the APP1 segment of an EXIF
+ * block of len bytes.
+ */
+static void jpeg_app1(unsigned char *marker, unsigned int len)
+{
+    marker[0] = 0xFF;
+    marker[1] = 0xE1;
+    marker[2] = (len + 2) >> 8;
+    marker[3] = (len + 2) & 0xFF;
+}
+
+/**
+ * put_jpeg_orig_memory
+ *      Puts the camera's JPEG of img, with the EXIF block, in dest_image.
+ *
+ * Returns the size of the picture, 0 when it has to be encoded instead.
+ */
+static int put_jpeg_orig_memory(struct context *cnt, struct image_data *img,
+                                unsigned char *dest_image, int image_size)
+{
+    struct jpeg_splice sp;
+    unsigned char *dest = dest_image;
+    int size = jpeg_splice(cnt, img, &sp);
+
+    if (size == 0 || size > image_size)
+        return 0;
+
+    memcpy(dest, img->jpeg, sp.head);
+    dest += sp.head;
+
+    if (sp.exif_len) {
+        jpeg_app1(dest, sp.exif_len);
+        memcpy(dest + 4, cnt->picture_cache->exif, sp.exif_len);
+        dest += 4 + sp.exif_len;
+    }
+
+    if (sp.dht)
+        dest += jpeg_std_dht(dest);
+
+    memcpy(dest, img->jpeg + sp.tail, img->jpeg_size - sp.tail);
+
+    return size;
+}
+
+/**
+ * put_jpeg_orig_file
+ *      Writes the camera's JPEG of img, with the EXIF block, to picture.
+ *
+ * Returns 1 when written, 0 when the picture has to be encoded instead.
+ */
+static int put_jpeg_orig_file(struct context *cnt, struct image_data *img, FILE *picture)
+{
+    struct jpeg_splice sp;
+    unsigned char marker[JPEG_STD_DHT_SIZE];
+
+    if (jpeg_splice(cnt, img, &sp) == 0)
+        return 0;
+
+    fwrite(img->jpeg, 1, sp.head, picture);
+
+    if (sp.exif_len) {
+        jpeg_app1(marker, sp.exif_len);
+        fwrite(marker, 1, 4, picture);
+        fwrite(cnt->picture_cache->exif, 1, sp.exif_len, picture);
+    }
+
+    if (sp.dht)
+        fwrite(marker, 1, jpeg_std_dht(marker), picture);
+
+    fwrite(img->jpeg + sp.tail, 1, img->jpeg_size - sp.tail, picture);
+
+    return 1;
+}
+
 /**
  * put_picture_mem
  *      Is used for the webcam feature. Depending on the image type
  *      (colour YUV420P or greyscale) the corresponding put_jpeg_X_memory function is called.
+ *      With jpeg_passthrough the camera's JPEG of the frame is put instead when it can be.
  * Inputs:
  * - cnt is the global context struct and only cnt->imgs.type is used.
  * - image_size is the size of the input image buffer
@@ -882,13 +1219,22 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
 int put_picture_memory(struct context *cnt, unsigned char* dest_image, int image_size,
                        unsigned char *image, int quality)
 {
+    struct image_data *img = picture_orig_jpeg(cnt, image);
+
+    if (img) {
+        int size = put_jpeg_orig_memory(cnt, img, dest_image, image_size);
+
+        if (size)
+            return size;
+    }
+
     switch (cnt->imgs.type) {
     case VIDEO_PALETTE_YUV420P:
         return put_jpeg_yuv420p_memory(dest_image, image_size, image,
                                        cnt->imgs.width, cnt->imgs.height, quality, cnt, &(cnt->current_image->timestamp_tm), &(cnt->current_image->location));
     case VIDEO_PALETTE_GREY:
         return put_jpeg_grey_memory(dest_image, image_size, image,
-                                    cnt->imgs.width, cnt->imgs.height, quality);
+                                    cnt->imgs.width, cnt->imgs.height, quality, cnt, &(cnt->current_image->timestamp_tm), &(cnt->current_image->location));
     default:
         MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Unknow image type %d",
                    cnt->imgs.type);
@@ -899,6 +1245,12 @@ int put_picture_memory(struct context *cnt, unsigned char* dest_image, int image
 
 void put_picture_fd(struct context *cnt, FILE *picture, unsigned char *image, int quality)
 {
+    struct image_data *img;
+
+    if (cnt->imgs.picture_type != IMAGE_TYPE_PPM && (img = picture_orig_jpeg(cnt, image)) &&
+        put_jpeg_orig_file(cnt, img, picture))
+        return;
+
     if (cnt->imgs.picture_type == IMAGE_TYPE_PPM) {
         put_ppm_bgr24_file(picture, image, cnt->imgs.width, cnt->imgs.height);
     } else {
@@ -907,7 +1259,7 @@ void put_picture_fd(struct context *cnt, FILE *picture, unsigned char *image, in
             put_jpeg_yuv420p_file(picture, image, cnt->imgs.width, cnt->imgs.height, quality, cnt, &(cnt->current_image->timestamp_tm), &(cnt->current_image->location));
             break;
         case VIDEO_PALETTE_GREY:
-            put_jpeg_grey_file(picture, image, cnt->imgs.width, cnt->imgs.height, quality);
+            put_jpeg_grey_file(picture, image, cnt->imgs.width, cnt->imgs.height, quality, cnt, &(cnt->current_image->timestamp_tm), &(cnt->current_image->location));
             break;
         default:
             MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Unknow image type %d",
@@ -21,5 +21,6 @@ int put_picture_memory(struct context *, unsigned char*, int, unsigned char *, i
 void put_picture(struct context *, char *, unsigned char *, int);
 unsigned char *get_pgm(FILE *, int, int);
 void preview_save(struct context *);
+void picture_cleanup(struct context *);
 
 #endif /* _INCLUDE_PICTURE_H_ */
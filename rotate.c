@@ -14,6 +14,11 @@
  *    increases the Motion CPU usage slightly.
  *
  *    Version history:
+ *      v7 (17-Oct-2026) - 90/270 degrees rotate 8x8 tiles in cache sized
+ *                         blocks, with SSE2 where available
+ *                       - rotation from one buffer to another, and of
+ *                         strips, for capture code that rotates as it
+ *                         converts
  *      v6 (29-Aug-2005) - simplified the code as Motion now requires
  *                         that width and height are multiples of 16
  *      v5 (3-Aug-2005)  - cleanup in code comments
@@ -31,6 +36,21 @@
  */
 #include "rotate.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_ROTATE_SSE2
+#include <immintrin.h>
+#endif
+
+/*
+ * 90 and 270 degrees are rotated in blocks of ROTATE_BLOCK x ROTATE_BLOCK
+ * pixels, each made of 8x8 tiles, so the source and the destination lines a
+ * block touches stay in the cache while it is done.
+ */
+#define ROTATE_BLOCK 64
+
+static int rotate_sse2;
+static pthread_once_t rotate_once = PTHREAD_ONCE_INIT;
+
 #ifndef __uint32
 /**
  * We don't have a 32-bit unsigned integer type, so define it, given
@@ -148,72 +168,233 @@ static void reverse_inplace_quad(unsigned char *src, int size)
 }
 
 /**
- * rot90cw
+ * rotate_rect
  *
- *  Performs a 90 degrees clockwise rotation of the memory block pointed to
- *  by src. The rotation is NOT performed in-place; dst must point to a
- *  receiving memory block the same size as src.
+ *  Scalar rotation of the lines i0 .. i1 - 1 and columns c0 .. c1 - 1 of a
+ *  strip of a plane. Line i of the strip is line first + i of the plane.
  *
  * Parameters:
  *
- *   src    - pointer to the memory block (image) to rotate clockwise
- *   dst    - where to put the rotated memory block
- *   size   - the size (in bytes) of the memory blocks (both src and dst)
- *   width  - the width of the memory block when seen as an image
- *   height - the height of the memory block when seen as an image
+ *   src    - the strip, width bytes per line
+ *   dst    - the rotated plane
+ *   deg    - 90, 180 or 270
+ *   width  - the width of the plane before rotation
+ *   height - the height of the plane before rotation
+ *   first  - the line of the plane the strip starts at
+ *
+ * Returns: nothing
+ */
+static void rotate_rect(unsigned char *src, unsigned char *dst, int deg, int width,
+                        int height, int first, int i0, int i1, int c0, int c1)
+{
+    unsigned char *s, *d;
+    int i, c, r;
+
+    for (i = i0; i < i1; i++) {
+        s = src + i * width;
+        r = first + i;
+
+        switch (deg) {
+        case 90:
+            d = dst + height - 1 - r;
+            for (c = c0; c < c1; c++)
+                d[c * height] = s[c];
+            break;
+        case 270:
+            d = dst + (width - 1) * height + r;
+            for (c = c0; c < c1; c++)
+                d[-c * height] = s[c];
+            break;
+        default:
+            d = dst + (height - 1 - r) * width + width - 1;
+            for (c = c0; c < c1; c++)
+                d[-c] = s[c];
+            break;
+        }
+    }
+}
+
+#ifdef HAVE_ROTATE_SSE2
+/**
+ * rotate_tile_sse2
+ *
+ *  Rotates the 8x8 tile at line i, column c of a strip by 90 or 270 degrees
+ *  with a transpose in registers, reading eight lines and writing eight
+ *  lines of 8 bytes. Parameters as for rotate_rect.
+ *
+ * Returns: nothing
+ */
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) void rotate_tile_sse2(unsigned char *src, unsigned char *dst, int deg, int width,
+                             int height, int first, int i, int c)
+{
+    __m128i a[8], t0, t1, t2, t3, u0, u1, u2, u3, v[4];
+    unsigned char *d;
+    int k;
+
+    /* For 90 degrees the lines are read bottom up, which reverses the columns. */
+    for (k = 0; k < 8; k++)
+        a[k] = _mm_loadl_epi64((const __m128i *)(src + (i + (deg == 90 ? 7 - k : k)) * width + c));
+
+    t0 = _mm_unpacklo_epi8(a[0], a[1]);
+    t1 = _mm_unpacklo_epi8(a[2], a[3]);
+    t2 = _mm_unpacklo_epi8(a[4], a[5]);
+    t3 = _mm_unpacklo_epi8(a[6], a[7]);
+    u0 = _mm_unpacklo_epi16(t0, t1);
+    u1 = _mm_unpackhi_epi16(t0, t1);
+    u2 = _mm_unpacklo_epi16(t2, t3);
+    u3 = _mm_unpackhi_epi16(t2, t3);
+    v[0] = _mm_unpacklo_epi32(u0, u2);
+    v[1] = _mm_unpackhi_epi32(u0, u2);
+    v[2] = _mm_unpacklo_epi32(u1, u3);
+    v[3] = _mm_unpackhi_epi32(u1, u3);
+
+    for (k = 0; k < 8; k++) {
+        if (deg == 90)
+            d = dst + (c + k) * height + height - 8 - (first + i);
+        else
+            d = dst + (width - 1 - c - k) * height + first + i;
+
+        _mm_storel_epi64((__m128i *)d, (k & 1) ? _mm_unpackhi_epi64(v[k / 2], v[k / 2]) : v[k / 2]);
+    }
+}
+
+/**
+ * rotate_tiles_sse2
+ *
+ *  Rotates the 8x8 tiles of lines i0 .. i1 - 1 and columns c0 .. c1 - 1,
+ *  both multiples of 8 apart. deg is a constant in every caller so each
+ *  direction gets a loop of its own.
  *
  * Returns: nothing
  */
-static void rot90cw(unsigned char *src, register unsigned char *dst, int size,
-                    int width, int height)
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) void rotate_tiles_sse2(unsigned char *src,
+        unsigned char *dst, const int deg, int width, int height, int first,
+        int i0, int i1, int c0, int c1)
+{
+    int i, c;
+
+    for (i = i0; i < i1; i += 8)
+        for (c = c0; c < c1; c += 8)
+            rotate_tile_sse2(src, dst, deg, width, height, first, i, c);
+}
+
+__attribute__((target("sse2")))
+static void rotate_tiles90_sse2(unsigned char *src, unsigned char *dst, int width, int height,
+                                int first, int i0, int i1, int c0, int c1)
 {
-    unsigned char *endp;
-    register unsigned char *base;
-    int j;
+    rotate_tiles_sse2(src, dst, 90, width, height, first, i0, i1, c0, c1);
+}
 
-    endp = src + size;
-    for (base = endp - width; base < endp; base++) {
-        src = base;
-        for (j = 0; j < height; j++, src -= width)
-            *dst++ = *src;
+__attribute__((target("sse2")))
+static void rotate_tiles270_sse2(unsigned char *src, unsigned char *dst, int width, int height,
+                                 int first, int i0, int i1, int c0, int c1)
+{
+    rotate_tiles_sse2(src, dst, 270, width, height, first, i0, i1, c0, c1);
+}
 
+/**
+ * rotate_line180_sse2
+ *
+ *  Copies count bytes, a multiple of 16, from src to the count bytes before
+ *  dst in reverse order.
+ *
+ * Returns: nothing
+ */
+__attribute__((target("sse2")))
+static void rotate_line180_sse2(unsigned char *src, unsigned char *dst, int count)
+{
+    __m128i x;
+    int c;
+
+    for (c = 0; c < count; c += 16) {
+        x = _mm_loadu_si128((const __m128i *)(src + c));
+        x = _mm_shuffle_epi32(x, _MM_SHUFFLE(0, 1, 2, 3));
+        x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+        x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+        _mm_storeu_si128((__m128i *)(dst - c - 16), x);
     }
 }
+#endif /* HAVE_ROTATE_SSE2 */
 
 /**
- * rot90ccw
+ * rotate_plane
  *
- *  Performs a 90 degrees counterclockwise rotation of the memory block pointed
- *  to by src. The rotation is not performed in-place; dst must point to a
- *  receiving memory block the same size as src.
+ *  Rotates rows lines of a plane, starting at line first, into the rotated
+ *  plane. The bulk of the strip is done with SSE2 when the CPU has it, the
+ *  lines and columns left over by the 8x8 tiles with rotate_rect.
  *
  * Parameters:
  *
- *   src    - pointer to the memory block (image) to rotate counterclockwise
- *   dst    - where to put the rotated memory block
- *   size   - the size (in bytes) of the memory blocks (both src and dst)
- *   width  - the width of the memory block when seen as an image
- *   height - the height of the memory block when seen as an image
+ *   src    - the strip, width bytes per line
+ *   dst    - the rotated plane
+ *   deg    - 90, 180 or 270
+ *   width  - the width of the plane before rotation
+ *   height - the height of the plane before rotation
+ *   first  - the line of the plane the strip starts at
+ *   rows   - the number of lines in the strip
  *
  * Returns: nothing
  */
-static inline void rot90ccw(unsigned char *src, register unsigned char *dst,
-                            int size, int width, int height)
+static void rotate_plane(unsigned char *src, unsigned char *dst, int deg, int width,
+                         int height, int first, int rows)
 {
-    unsigned char *endp;
-    register unsigned char *base;
-    int j;
+    int i0, i1, c0, c1, ti, tc, i;
+
+    if (deg == 180) {
+        tc = rotate_sse2 ? width & ~15 : 0;
+
+        for (i = 0; i < rows; i++) {
+#ifdef HAVE_ROTATE_SSE2
+            if (tc)
+                rotate_line180_sse2(src + i * width,
+                                    dst + (height - first - i) * width, tc);
+#endif
+            rotate_rect(src, dst, deg, width, height, first, i, i + 1, tc, width);
+        }
+        return;
+    }
+
+    for (i0 = 0; i0 < rows; i0 += ROTATE_BLOCK) {
+        i1 = (i0 + ROTATE_BLOCK < rows) ? i0 + ROTATE_BLOCK : rows;
 
-    endp = src + size;
-    dst = dst + size - 1;
-    for (base = endp - width; base < endp; base++) {
-        src = base;
-        for (j = 0; j < height; j++, src -= width)
-            *dst-- = *src;
+        for (c0 = 0; c0 < width; c0 += ROTATE_BLOCK) {
+            c1 = (c0 + ROTATE_BLOCK < width) ? c0 + ROTATE_BLOCK : width;
+            ti = i0;
+            tc = c0;
 
+#ifdef HAVE_ROTATE_SSE2
+            if (rotate_sse2) {
+                ti = i0 + ((i1 - i0) & ~7);
+                tc = c0 + ((c1 - c0) & ~7);
+
+                if (deg == 90)
+                    rotate_tiles90_sse2(src, dst, width, height, first, i0, ti, c0, tc);
+                else
+                    rotate_tiles270_sse2(src, dst, width, height, first, i0, ti, c0, tc);
+            }
+#endif
+            /* The right hand columns, then the bottom lines. */
+            rotate_rect(src, dst, deg, width, height, first, i0, ti, tc, c1);
+            rotate_rect(src, dst, deg, width, height, first, ti, i1, c0, c1);
+        }
     }
 }
 
+/**
+ * rotate_select
+ *
+ *  Checks once whether the CPU has SSE2.
+ */
+static void rotate_select(void)
+{
+#ifdef HAVE_ROTATE_SSE2
+    __builtin_cpu_init();
+    rotate_sse2 = __builtin_cpu_supports("sse2");
+#endif
+}
+
 /**
  * rotate_init
  *
@@ -233,6 +414,8 @@ void rotate_init(struct context *cnt)
     /* Make sure temp_buf isn't freed if it hasn't been allocated. */
     cnt->rotate_data.temp_buf = NULL;
 
+    pthread_once(&rotate_once, rotate_select);
+
     /*
      * Assign the value in conf.rotate_deg to rotate_data.degrees. This way,
      * we have a value that is safe from changes caused by motion-control.
@@ -321,6 +504,53 @@ void rotate_deinit(struct context *cnt)
         free(cnt->rotate_data.temp_buf);
 }
 
+/**
+ * rotate_rows
+ *
+ *  Rotates a strip of lines of one plane of a capture image into the
+ *  rotated image. See rotate.h.
+ */
+void rotate_rows(struct context *cnt, int plane, unsigned char *src, int first,
+                 int rows, unsigned char *dst)
+{
+    int width = cnt->rotate_data.cap_width;
+    int height = cnt->rotate_data.cap_height;
+    int wh = width * height;
+
+    if (plane > 0) {
+        dst += (plane == 1) ? wh : wh + wh / 4;
+        width /= 2;
+        height /= 2;
+    }
+
+    rotate_plane(src, dst, cnt->rotate_data.degrees, width, height, first, rows);
+}
+
+/**
+ * rotate_map_to
+ *
+ *  Rotates the capture image at src into dst. See rotate.h.
+ */
+int rotate_map_to(struct context *cnt, unsigned char *src, unsigned char *dst)
+{
+    int width = cnt->rotate_data.cap_width;
+    int height = cnt->rotate_data.cap_height;
+    int wh = width * height;
+    int deg = cnt->rotate_data.degrees;
+
+    if ((deg != 90) && (deg != 180) && (deg != 270))
+        return -1;
+
+    rotate_rows(cnt, 0, src, 0, height, dst);
+
+    if (cnt->imgs.type == VIDEO_PALETTE_YUV420P) {
+        rotate_rows(cnt, 1, src + wh, 0, height / 2, dst);
+        rotate_rows(cnt, 2, src + wh + wh / 4, 0, height / 2, dst);
+    }
+
+    return 0;
+}
+
 /**
  * rotate_map
  *
@@ -348,44 +578,22 @@ int rotate_map(struct context *cnt, unsigned char *map)
      * or, it is in greyscale, in which case the pixel data simply consists
      * of width x height bytes.
      */
-    int wh, wh4 = 0, w2 = 0, h2 = 0;  /* width * height, width * height / 4 etc. */
-    int size, deg;
-    int width, height;
-
-    deg = cnt->rotate_data.degrees;
-    width = cnt->rotate_data.cap_width;
-    height = cnt->rotate_data.cap_height;
+    int wh, wh4 = 0;  /* width * height, width * height / 4 */
+    int size;
 
-    /*
-     * Pre-calculate some stuff:
-     *  wh   - size of the Y plane, or the entire greyscale image
-     *  size - size of the entire memory block
-     *  wh4  - size of the U plane, and the V plane
-     *  w2   - width of the U plane, and the V plane
-     *  h2   - as w2, but height instead
-     */
-    wh = width * height;
+    wh = cnt->rotate_data.cap_width * cnt->rotate_data.cap_height;
     if (cnt->imgs.type == VIDEO_PALETTE_YUV420P) {
         size = wh * 3 / 2;
         wh4 = wh / 4;
-        w2 = width / 2;
-        h2 = height / 2;
     } else { /* VIDEO_PALETTE_GREY */
         size = wh;
     }
 
-    switch (deg) {
+    switch (cnt->rotate_data.degrees) {
     case 90:
-        /* First do the Y part */
-        rot90cw(map, cnt->rotate_data.temp_buf, wh, width, height);
-        if (cnt->imgs.type == VIDEO_PALETTE_YUV420P) {
-            /* Then do U and V */
-            rot90cw(map + wh, cnt->rotate_data.temp_buf + wh, wh4, w2, h2);
-            rot90cw(map + wh + wh4, cnt->rotate_data.temp_buf + wh + wh4,
-                    wh4, w2, h2);
-        }
-
-        /* Then copy back from the temp buffer to map. */
+    case 270:
+        /* Rotate into the temp buffer, then copy back to map. */
+        rotate_map_to(cnt, map, cnt->rotate_data.temp_buf);
         memcpy(map, cnt->rotate_data.temp_buf, size);
         break;
 
@@ -401,21 +609,6 @@ int rotate_map(struct context *cnt, unsigned char *map)
         }
         break;
 
-    case 270:
-
-        /* First do the Y part */
-        rot90ccw(map, cnt->rotate_data.temp_buf, wh, width, height);
-        if (cnt->imgs.type == VIDEO_PALETTE_YUV420P) {
-            /* Then do U and V */
-            rot90ccw(map + wh, cnt->rotate_data.temp_buf + wh, wh4, w2, h2);
-            rot90ccw(map + wh + wh4, cnt->rotate_data.temp_buf + wh + wh4,
-                     wh4, w2, h2);
-        }
-
-        /* Then copy back from the temp buffer to map. */
-        memcpy(map, cnt->rotate_data.temp_buf, size);
-        break;
-
     default:
         /* Invalid */
         return -1;
@@ -423,4 +616,3 @@ int rotate_map(struct context *cnt, unsigned char *map)
 
     return 0;
 }
-
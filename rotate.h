@@ -64,4 +64,45 @@ void rotate_deinit(struct context *cnt);
  */
 int rotate_map(struct context *cnt, unsigned char *map);
 
+/**
+ * rotate_map_to
+ *
+ *  Rotates the capture image at src into dst, which must not overlap it.
+ *  This saves the copy rotate_map makes for 90 and 270 degrees when the
+ *  capture code has the image in a buffer of its own anyway.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *   src - the image in capture dimensions
+ *   dst - where to put the rotated image
+ *
+ * Returns:
+ *
+ *   0  - success
+ *   -1 - failure (not rotating)
+ */
+int rotate_map_to(struct context *cnt, unsigned char *src, unsigned char *dst);
+
+/**
+ * rotate_rows
+ *
+ *  Rotates a strip of lines of one plane of a capture image into place in
+ *  the rotated image, so a decoder can rotate each group of lines while it
+ *  is still in the cache instead of rotating the whole image afterwards.
+ *
+ * Parameters:
+ *
+ *   cnt   - current thread's context structure
+ *   plane - 0 for Y (or greyscale), 1 for U, 2 for V
+ *   src   - the lines, as wide as the plane in capture dimensions
+ *   first - the line of the plane src starts at
+ *   rows  - the number of lines at src
+ *   dst   - the whole rotated image
+ *
+ * Returns: nothing
+ */
+void rotate_rows(struct context *cnt, int plane, unsigned char *src, int first,
+                 int rows, unsigned char *dst);
+
 #endif
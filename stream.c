@@ -1078,6 +1078,27 @@ void stream_stop(struct context *cnt)
                " & active motion-stream sockets");
 }
 
+/*
+ * stream_waiting
+ *      Tells whether a new client is waiting to connect. stream_put accepts
+ *      it and sends it the image it is given, so that image must be complete.
+ */
+int stream_waiting(struct context *cnt)
+{
+    struct timeval timeout;
+    fd_set fdread;
+
+    if (!cnt->conf.stream_port || cnt->stream.socket == -1)
+        return 0;
+
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 0;
+    FD_ZERO(&fdread);
+    FD_SET(cnt->stream.socket, &fdread);
+
+    return select(cnt->stream.socket + 1, &fdread, NULL, NULL, &timeout) > 0;
+}
+
 /*
  * stream_put
  *      Is the starting point of the stream loop. It is called from
@@ -1176,8 +1197,8 @@ void stream_put(struct context *cnt, unsigned char *image)
             wptr += headlength;
 
             /* Create a jpeg image and place into tmpbuffer. */
-            tmpbuffer->size = put_picture_memory(cnt, wptr, cnt->imgs.size, image,
-                                                 cnt->conf.stream_quality);
+            tmpbuffer->size = put_picture_memory(cnt, wptr, cnt->imgs.size - headlength - 2,
+                                                 image, cnt->conf.stream_quality);
 
             /* Fill in the image length into the header. */
             imgsize = sprintf(len, "%9ld\r\n\r\n", tmpbuffer->size);
@@ -39,6 +39,7 @@ struct stream {
 };
 
 int stream_init(struct context *);
+int stream_waiting(struct context *);
 void stream_put(struct context *, unsigned char *);
 void stream_stop(struct context *);
 
@@ -45,6 +45,7 @@ typedef struct video_image_buff {
     size_t size;                    /* total allocated size */
     size_t used;                    /* bytes already used */
     struct timeval image_time;      /* time this image was received */
+    int lent;                       /* held by an image ring slot, see v4l2_lend */
 } video_buff;
 
 
@@ -96,8 +97,13 @@ void conv_uyvyto420p(unsigned char *map, unsigned char *cap_map, unsigned int wi
 void conv_rgb24toyuv420p(unsigned char *map, unsigned char *cap_map, int width, int height);
 int sonix_decompress(unsigned char *outp, unsigned char *inp, int width, int height);
 void bayer2rgb24(unsigned char *dst, unsigned char *src, long int width, long int height);
+void bayer2yuv420p(unsigned char *map, unsigned char *src, int width, int height);
 int vid_do_autobright(struct context *cnt, struct video_dev *viddev);
-int mjpegtoyuv420p(unsigned char *map, unsigned char *cap_map, int width, int height, unsigned int size);
+int mjpegtoyuv420p(struct jpeg_decoder *dec, unsigned char *map, unsigned char *cap_map, int width, int height, unsigned int size);
+int vid_decode(struct context *cnt, struct image_data *img);
+void vid_keep_jpeg(struct context *cnt, unsigned char *data, int size);
+int vid_defer_jpeg(struct context *cnt, unsigned char *data, int size);
+void vid_give_back(struct context *cnt, struct image_data *img);
 
 #ifndef WITHOUT_V4L
 /* video functions, video.c */
@@ -113,6 +119,7 @@ unsigned char *v4l2_start(struct context *cnt, struct video_dev *viddev, int wid
 void v4l2_set_input(struct context *cnt, struct video_dev *viddev, unsigned char *map, int width, int height,
                     struct config *conf);
 int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char *map, int width, int height);
+void v4l2_give_back(struct video_dev *viddev, struct image_data *img);
 void v4l2_close(struct video_dev *viddev);
 void v4l2_cleanup(struct video_dev *viddev);
 #endif /* WITHOUT_V4L */
@@ -72,6 +72,8 @@
 
 #include "motion.h"
 #include "video.h"
+#include "rotate.h"
+#include <poll.h>
 
 #ifdef MOTION_V4L2_OLD
 // Seems that is needed for some system
@@ -86,6 +88,7 @@
 
 #define MMAP_BUFFERS 4
 #define MIN_MMAP_BUFFERS 2
+#define CAPTURE_QUEUE 4     /* frames the capture thread can hold for the motion loop */
 
 #ifndef V4L2_PIX_FMT_SBGGR8
 /* see http://www.siliconimaging.com/RGB%20Bayer.htm */
@@ -157,6 +160,12 @@ static const u32 queried_ctrls[] = {
     0
 };
 
+/* A frame handed from the capture thread to the motion loop */
+struct v4l2_frame {
+    struct v4l2_buffer buf;         /* timestamp in gettimeofday time */
+    int shot;                       /* number of the frame within its second */
+};
+
 typedef struct {
     int fd;
     u32 fps;
@@ -170,10 +179,28 @@ typedef struct {
     video_buff *buffers;
 
     s32 pframe;
+    int lent;                       /* buffers held by the image ring */
 
     u32 ctrl_flags;
     struct v4l2_queryctrl *controls;
 
+    /*
+     * Capture thread, see v4l2_capture_thread. queue_in is only written by
+     * the thread and queue_out only by the motion loop, the mutex and
+     * condition are only used to wait for a frame when the queue is empty.
+     */
+    int threaded;
+    volatile int finish;
+    pthread_t thread_id;
+    pthread_mutex_t mutex;
+    pthread_cond_t frame_ready;
+    struct v4l2_frame queue[CAPTURE_QUEUE];
+    volatile unsigned int queue_in;
+    volatile unsigned int queue_out;
+    struct timeval last_time;       /* capture time of the last frame queued */
+    int shot;                       /* shot of the last frame queued */
+    int skipped;                    /* frames given back to pace or for a full queue */
+
 } src_v4l2_t;
 
 /**
@@ -561,8 +588,10 @@ static void v4l2_set_fps(src_v4l2_t * vid_source) {
 
 /**
  * v4l2_set_mmap
+ *      Maps count capture buffers, or as many as the driver gives, and
+ *      starts streaming.
  */
-static int v4l2_set_mmap(src_v4l2_t * vid_source)
+static int v4l2_set_mmap(src_v4l2_t * vid_source, u32 count)
 {
     enum v4l2_buf_type type;
     u32 buffer_index;
@@ -573,7 +602,7 @@ static int v4l2_set_mmap(src_v4l2_t * vid_source)
 
     memset(&vid_source->req, 0, sizeof(struct v4l2_requestbuffers));
 
-    vid_source->req.count = MMAP_BUFFERS;
+    vid_source->req.count = count;
     vid_source->req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     vid_source->req.memory = V4L2_MEMORY_MMAP;
 
@@ -799,6 +828,219 @@ static void v4l2_picture_controls(struct context *cnt, struct video_dev *viddev)
 
 }
 
+/**
+ * v4l2_capture_time
+ *      Turns the time the driver stamped on buf into gettimeofday time, the
+ *      clock the rest of Motion uses. Most drivers stamp buffers with the
+ *      monotonic clock. Buffers without a stamp get the time they were
+ *      dequeued.
+ */
+static void v4l2_capture_time(struct v4l2_buffer *buf)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+
+    if (buf->timestamp.tv_sec == 0 && buf->timestamp.tv_usec == 0) {
+        buf->timestamp = now;
+        return;
+    }
+
+#ifdef V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+    if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        struct timespec mono;
+        long long stamp;
+
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+
+        /* Now, less the age of the frame */
+        stamp = now.tv_sec * 1000000LL + now.tv_usec -
+                ((mono.tv_sec - buf->timestamp.tv_sec) * 1000000LL +
+                 mono.tv_nsec / 1000 - buf->timestamp.tv_usec);
+
+        buf->timestamp.tv_sec = stamp / 1000000;
+        buf->timestamp.tv_usec = stamp % 1000000;
+    }
+#endif
+}
+
+/**
+ * v4l2_capture_thread
+ *      Dequeues the frames of the device as the driver fills them and queues
+ *      them for v4l2_next, so a busy motion loop does not leave the driver
+ *      without buffers. Frames that come sooner than the framerate asks for,
+ *      or when the queue is full, or when keeping them would leave the driver
+ *      fewer than MIN_MMAP_BUFFERS buffers, go straight back to the driver.
+ */
+static void *v4l2_capture_thread(void *arg)
+{
+    src_v4l2_t *vid_source = arg;
+    struct v4l2_buffer buf;
+    struct v4l2_frame *frame;
+    struct pollfd pfd;
+    sigset_t set;
+    long long interval, elapsed;
+    int held;
+
+    /* Signals are for the motion threads */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    while (!vid_source->finish) {
+        pfd.fd = vid_source->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, 1000) <= 0)
+            continue;
+
+        memset(&buf, 0, sizeof(struct v4l2_buffer));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+
+        if (xioctl(vid_source->fd, VIDIOC_DQBUF, &buf) == -1) {
+            if (!vid_source->finish && errno != EAGAIN) {
+                MOTION_LOG(ERR, TYPE_VIDEO, SHOW_ERRNO, "%s: VIDIOC_DQBUF");
+                SLEEP(0, 100000000L);
+            }
+            continue;
+        }
+
+        v4l2_capture_time(&buf);
+
+        elapsed = (buf.timestamp.tv_sec - vid_source->last_time.tv_sec) * 1000000LL +
+                  buf.timestamp.tv_usec - vid_source->last_time.tv_usec;
+        interval = vid_source->fps ? 1000000 / vid_source->fps : 0;
+
+        /* Queued, lent to the image ring, in the motion loop and this one */
+        held = vid_source->queue_in - vid_source->queue_out + vid_source->lent + 2;
+
+        /* A quarter of a frame is allowed for jitter */
+        if ((elapsed >= 0 && elapsed < interval - interval / 4) ||
+            vid_source->queue_in - vid_source->queue_out == CAPTURE_QUEUE ||
+            (int)vid_source->req.count - held < MIN_MMAP_BUFFERS) {
+            if (xioctl(vid_source->fd, VIDIOC_QBUF, &buf) == -1)
+                MOTION_LOG(ERR, TYPE_VIDEO, SHOW_ERRNO, "%s: VIDIOC_QBUF");
+            vid_source->skipped++;
+            continue;
+        }
+
+        if (buf.timestamp.tv_sec != vid_source->last_time.tv_sec)
+            vid_source->shot = 0;
+        else
+            vid_source->shot++;
+
+        vid_source->last_time = buf.timestamp;
+
+        frame = &vid_source->queue[vid_source->queue_in % CAPTURE_QUEUE];
+        frame->buf = buf;
+        frame->shot = vid_source->shot;
+
+        /* The frame is written before it is counted */
+        __sync_synchronize();
+        vid_source->queue_in++;
+
+        pthread_mutex_lock(&vid_source->mutex);
+        pthread_cond_signal(&vid_source->frame_ready);
+        pthread_mutex_unlock(&vid_source->mutex);
+    }
+
+    return NULL;
+}
+
+/**
+ * v4l2_queue_get
+ *      Takes the oldest frame the capture thread queued, waiting up to a
+ *      second for one.
+ *
+ * Returns 0 with the frame in vid_source->buf and its shot in *shot,
+ *      1 when no frame came.
+ */
+static int v4l2_queue_get(src_v4l2_t *vid_source, int *shot)
+{
+    struct v4l2_frame *frame;
+
+    if (vid_source->queue_in == vid_source->queue_out) {
+        struct timeval now;
+        struct timespec timeout;
+
+        gettimeofday(&now, NULL);
+        timeout.tv_sec = now.tv_sec + 1;
+        timeout.tv_nsec = now.tv_usec * 1000;
+
+        pthread_mutex_lock(&vid_source->mutex);
+
+        while (vid_source->queue_in == vid_source->queue_out) {
+            if (pthread_cond_timedwait(&vid_source->frame_ready, &vid_source->mutex,
+                                       &timeout) == ETIMEDOUT)
+                break;
+        }
+
+        pthread_mutex_unlock(&vid_source->mutex);
+
+        if (vid_source->queue_in == vid_source->queue_out)
+            return 1;
+    }
+
+    /* The frame is read after its count, and before its slot is freed */
+    __sync_synchronize();
+    frame = &vid_source->queue[vid_source->queue_out % CAPTURE_QUEUE];
+    vid_source->buf = frame->buf;
+    *shot = frame->shot;
+    __sync_synchronize();
+    vid_source->queue_out++;
+
+    return 0;
+}
+
+/**
+ * v4l2_start_thread
+ *      Starts the capture thread of the device. The frames are dequeued by
+ *      v4l2_next itself when that fails.
+ */
+static void v4l2_start_thread(src_v4l2_t *vid_source)
+{
+    pthread_mutex_init(&vid_source->mutex, NULL);
+    pthread_cond_init(&vid_source->frame_ready, NULL);
+
+    if (pthread_create(&vid_source->thread_id, NULL, &v4l2_capture_thread, vid_source)) {
+        MOTION_LOG(ERR, TYPE_VIDEO, SHOW_ERRNO, "%s: Unable to start the capture thread");
+        pthread_cond_destroy(&vid_source->frame_ready);
+        pthread_mutex_destroy(&vid_source->mutex);
+        return;
+    }
+
+    vid_source->threaded = 1;
+    MOTION_LOG(NTC, TYPE_VIDEO, NO_ERRNO, "%s: Started the capture thread");
+}
+
+/**
+ * v4l2_stop_thread
+ *      Stops the capture thread of the device and gives the frames it still
+ *      had queued back to the driver. v4l2_next dequeues the frames itself
+ *      from then on.
+ */
+static void v4l2_stop_thread(src_v4l2_t *vid_source)
+{
+    vid_source->finish = 1;
+    pthread_join(vid_source->thread_id, NULL);
+
+    while (vid_source->queue_out != vid_source->queue_in) {
+        struct v4l2_frame *frame = &vid_source->queue[vid_source->queue_out % CAPTURE_QUEUE];
+
+        if (xioctl(vid_source->fd, VIDIOC_QBUF, &frame->buf) == -1)
+            MOTION_LOG(ERR, TYPE_VIDEO, SHOW_ERRNO, "%s: VIDIOC_QBUF");
+
+        vid_source->queue_out++;
+    }
+
+    pthread_cond_destroy(&vid_source->frame_ready);
+    pthread_mutex_destroy(&vid_source->mutex);
+    vid_source->threaded = 0;
+    MOTION_LOG(INF, TYPE_VIDEO, NO_ERRNO, "%s: Capture thread stopped, %d frames"
+               " went back to the driver unused", vid_source->skipped);
+}
+
 /* public functions */
 /**
  * v4l2_start
@@ -807,6 +1049,7 @@ unsigned char *v4l2_start(struct context *cnt, struct video_dev *viddev, int wid
               int input, int norm, unsigned long freq, int tuner_number)
 {
     src_v4l2_t *vid_source;
+    u32 count = MMAP_BUFFERS;
 
     /* Allocate memory for the state structure. */
     if (!(vid_source = calloc(sizeof(src_v4l2_t), 1))) {
@@ -835,9 +1078,23 @@ unsigned char *v4l2_start(struct context *cnt, struct video_dev *viddev, int wid
 #if 0
     v4l2_set_fps(vid_source);
 #endif
-    if (v4l2_set_mmap(vid_source))
+    /* Zero copy capture lends a buffer to each slot of the image ring */
+    if (cnt->conf.v4l2_zero_copy)
+        count += cnt->conf.pre_capture + cnt->conf.minimum_motion_frames;
+
+    /* The capture thread holds up to CAPTURE_QUEUE frames */
+    if (cnt->conf.v4l2_capture_thread)
+        count += CAPTURE_QUEUE;
+
+    if (count > VIDEO_MAX_FRAME)
+        count = VIDEO_MAX_FRAME;
+
+    if (v4l2_set_mmap(vid_source, count))
         goto err;
 
+    if (cnt->conf.v4l2_capture_thread)
+        v4l2_start_thread(vid_source);
+
     viddev->size_map = 0;
     viddev->v4l_buffers[0] = NULL;
     viddev->v4l_maxbuffer = 1;
@@ -937,6 +1194,73 @@ void v4l2_set_input(struct context *cnt, struct video_dev *viddev, unsigned char
     }
 }
 
+/**
+ * v4l2_lend
+ *      Lends the buffer just dequeued to the image ring slot being captured
+ *      into instead of copying the frame out of it. The slot gives it back
+ *      with v4l2_give_back when the ring comes round to it again. A frame is
+ *      copied as usual when lending would leave the driver fewer than
+ *      MIN_MMAP_BUFFERS buffers to capture into.
+ *
+ * Returns 1 when the buffer was lent, 0 when the frame must be copied to map.
+ */
+static int v4l2_lend(struct context *cnt, struct video_dev *viddev, unsigned char *map)
+{
+    src_v4l2_t *vid_source = (src_v4l2_t *) viddev->v4l2_private;
+    struct image_data *img = cnt->current_image;
+    u32 index = vid_source->buf.index;
+
+    if (!cnt->conf.v4l2_zero_copy || viddev->usage_count > 1 ||
+        cnt->rotate_data.degrees > 0 || img == NULL || map != img->buffer)
+        return 0;
+
+    /* Frames skipped after an input switch give back the one before */
+    if (img->lent)
+        v4l2_give_back(viddev, img);
+
+    if ((int)vid_source->req.count - vid_source->lent - 1 < MIN_MMAP_BUFFERS)
+        return 0;
+
+    vid_source->buffers[index].lent = 1;
+    vid_source->lent++;
+
+    img->image = vid_source->buffers[index].ptr;
+    img->lent = index + 1;
+
+    return 1;
+}
+
+/**
+ * v4l2_give_back
+ *      Queues the capture buffer lent to img again and points img back at
+ *      the slot's own memory.
+ */
+void v4l2_give_back(struct video_dev *viddev, struct image_data *img)
+{
+    src_v4l2_t *vid_source = (src_v4l2_t *) viddev->v4l2_private;
+    struct v4l2_buffer buf;
+    u32 index = img->lent - 1;
+
+    img->image = img->buffer;
+    img->lent = 0;
+
+    if (!vid_source || !vid_source->buffers || index >= vid_source->req.count ||
+        !vid_source->buffers[index].lent)
+        return;
+
+    vid_source->buffers[index].lent = 0;
+    vid_source->lent--;
+
+    memset(&buf, 0, sizeof(struct v4l2_buffer));
+
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+
+    if (xioctl(vid_source->fd, VIDIOC_QBUF, &buf) == -1)
+        MOTION_LOG(ERR, TYPE_VIDEO, SHOW_ERRNO, "%s: VIDIOC_QBUF");
+}
+
 /**
  * v4l2_next
  */
@@ -945,6 +1269,7 @@ int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char *map,
 {
     sigset_t set, old;
     src_v4l2_t *vid_source = (src_v4l2_t *) viddev->v4l2_private;
+    int shot = 0;
 
     if (viddev->v4l_fmt != VIDEO_PALETTE_YUV420P)
         return V4L_FATAL_ERROR;
@@ -961,7 +1286,8 @@ int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char *map,
     MOTION_LOG(DBG, TYPE_VIDEO, NO_ERRNO, "%s: 1) vid_source->pframe %i",
                vid_source->pframe);
 
-    if (vid_source->pframe >= 0) {
+    /* A buffer lent to the image ring is queued again by v4l2_give_back */
+    if (vid_source->pframe >= 0 && !vid_source->buffers[vid_source->pframe].lent) {
         if (xioctl(vid_source->fd, VIDIOC_QBUF, &vid_source->buf) == -1) {
             MOTION_LOG(ERR, TYPE_VIDEO, SHOW_ERRNO, "%s: VIDIOC_QBUF");
             pthread_sigmask(SIG_UNBLOCK, &old, NULL);
@@ -969,12 +1295,31 @@ int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char *map,
         }
     }
 
+    /*
+     * Round robin cameras switch the input between frames, so frames queued
+     * ahead by the capture thread could come from the input before.
+     */
+    if (vid_source->threaded && viddev->usage_count > 1) {
+        MOTION_LOG(NTC, TYPE_VIDEO, NO_ERRNO, "%s: Device shared by more cameras,"
+                   " no capture thread");
+        v4l2_stop_thread(vid_source);
+    }
+
     memset(&vid_source->buf, 0, sizeof(struct v4l2_buffer));
 
     vid_source->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     vid_source->buf.memory = V4L2_MEMORY_MMAP;
 
-    if (xioctl(vid_source->fd, VIDIOC_DQBUF, &vid_source->buf) == -1) {
+    if (vid_source->threaded) {
+        if (v4l2_queue_get(vid_source, &shot)) {
+            MOTION_LOG(ERR, TYPE_VIDEO, NO_ERRNO, "%s: No frame from the capture thread"
+                       " for a second");
+            /* There is no buffer to queue again on the next call */
+            vid_source->pframe = -1;
+            pthread_sigmask(SIG_UNBLOCK, &old, NULL);
+            return 1;
+        }
+    } else if (xioctl(vid_source->fd, VIDIOC_DQBUF, &vid_source->buf) == -1) {
         int ret;
         /*
          * Some drivers return EIO when there is no signal,
@@ -1018,35 +1363,69 @@ int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char *map,
 
     pthread_sigmask(SIG_UNBLOCK, &old, NULL);    /*undo the signal blocking */
 
+    /* The capture thread knows when the frame was taken */
+    if (vid_source->threaded && cnt->current_image && map == cnt->current_image->buffer) {
+        struct image_data *img = cnt->current_image;
+
+        img->timestamp = vid_source->buf.timestamp.tv_sec;
+        localtime_r(&img->timestamp, &img->timestamp_tm);
+        img->shot = shot;
+        img->flags |= IMAGE_TIMED;
+    }
+
     {
         video_buff *the_buffer = &vid_source->buffers[vid_source->buf.index];
+        int rotate = cnt->rotate_data.degrees;
+        unsigned char *out = map;
+        int ret = 0;
 
         MOTION_LOG(DBG, TYPE_VIDEO, NO_ERRNO, "%s: the_buffer index %d Address (%x)",
                    vid_source->buf.index, the_buffer->ptr);
 
+        /*
+         * The frame is rotated here rather than by vid_next. For 90 and 270
+         * degrees it is converted to the rotation buffer and rotated from
+         * there into map, YUV420 is rotated straight out of the driver's
+         * buffer, which saves a copy of the frame either way.
+         */
+        if (rotate == 90 || rotate == 270)
+            out = cnt->rotate_data.temp_buf;
+
         switch (vid_source->dst_fmt.fmt.pix.pixelformat) {
         case V4L2_PIX_FMT_RGB24:
-            conv_rgb24toyuv420p(map, the_buffer->ptr, width, height);
-            return 0;
+            conv_rgb24toyuv420p(out, the_buffer->ptr, width, height);
+            break;
 
         case V4L2_PIX_FMT_UYVY:
-            conv_uyvyto420p(map, the_buffer->ptr, (unsigned)width, (unsigned)height);
-            return 0;
+            conv_uyvyto420p(out, the_buffer->ptr, (unsigned)width, (unsigned)height);
+            break;
 
         case V4L2_PIX_FMT_YUYV:
         case V4L2_PIX_FMT_YUV422P:
-            conv_yuv422to420p(map, the_buffer->ptr, width, height);
-            return 0;
+            conv_yuv422to420p(out, the_buffer->ptr, width, height);
+            break;
 
         case V4L2_PIX_FMT_YUV420:
-            memcpy(map, the_buffer->ptr, viddev->v4l_bufsize);
+            if (rotate)
+                rotate_map_to(cnt, the_buffer->ptr, map);
+            else if (!v4l2_lend(cnt, viddev, map))
+                memcpy(map, the_buffer->ptr, viddev->v4l_bufsize);
             return 0;
 
         case V4L2_PIX_FMT_PJPG:
         case V4L2_PIX_FMT_JPEG:
         case V4L2_PIX_FMT_MJPEG:
-            return mjpegtoyuv420p(map, the_buffer->ptr, width, height,
-                                  vid_source->buffers[vid_source->buf.index].content_length);
+            if (cnt->defer_decode)
+                return vid_defer_jpeg(cnt, the_buffer->ptr,
+                                      vid_source->buffers[vid_source->buf.index].content_length);
+
+            if (cnt->conf.jpeg_passthrough)
+                vid_keep_jpeg(cnt, the_buffer->ptr,
+                              vid_source->buffers[vid_source->buf.index].content_length);
+
+            ret = mjpegtoyuv420p(cnt->jpeg_decoder, out, the_buffer->ptr, width, height,
+                                 vid_source->buffers[vid_source->buf.index].content_length);
+            break;
 
         /* FIXME: quick hack to allow work all bayer formats */
         case V4L2_PIX_FMT_SBGGR16:
@@ -1054,20 +1433,26 @@ int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char *map,
         case V4L2_PIX_FMT_SGRBG8:
         /* case V4L2_PIX_FMT_SPCA561: */
         case V4L2_PIX_FMT_SBGGR8:    /* bayer */
-            bayer2rgb24(cnt->imgs.common_buffer, the_buffer->ptr, width, height);
-            conv_rgb24toyuv420p(map, cnt->imgs.common_buffer, width, height);
-            return 0;
+            bayer2yuv420p(out, the_buffer->ptr, width, height);
+            break;
 
         case V4L2_PIX_FMT_SPCA561:
         case V4L2_PIX_FMT_SN9C10X:
-            sonix_decompress(map, the_buffer->ptr, width, height);
-            bayer2rgb24(cnt->imgs.common_buffer, map, width, height);
-            conv_rgb24toyuv420p(map, cnt->imgs.common_buffer, width, height);
-            return 0;
+            sonix_decompress(cnt->imgs.common_buffer, the_buffer->ptr, width, height);
+            bayer2yuv420p(out, cnt->imgs.common_buffer, width, height);
+            break;
+
+        default:
+            return 1;
         }
-    }
 
-    return 1;
+        if (out != map)
+            rotate_map_to(cnt, out, map);
+        else if (rotate)
+            rotate_map(cnt, map);
+
+        return ret;
+    }
 }
 
 /**
@@ -1078,8 +1463,15 @@ void v4l2_close(struct video_dev *viddev)
     src_v4l2_t *vid_source = (src_v4l2_t *) viddev->v4l2_private;
     enum v4l2_buf_type type;
 
+    if (vid_source->threaded)
+        vid_source->finish = 1;
+
     type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     xioctl(vid_source->fd, VIDIOC_STREAMOFF, &type);
+
+    if (vid_source->threaded)
+        v4l2_stop_thread(vid_source);
+
     close(vid_source->fd);
     vid_source->fd = -1;
 }
@@ -13,6 +13,7 @@
 #include "rotate.h"    /* Already includes motion.h */
 #include "video.h"
 #include "jpegutils.h"
+#include "video_simd.h"
 
 typedef unsigned char uint8_t;
 typedef unsigned short int uint16_t;
@@ -253,177 +254,359 @@ void bayer2rgb24(unsigned char *dst, unsigned char *src, long int width, long in
 
 }
 
+/**
+ * bayer_edge
+ *      The colour bayer2rgb24 gives the pixel at x, y of the bayer image src,
+ *      including its rules for the first and last lines and columns. Used for
+ *      the border of bayer2yuv420p, the inner pixels take the fast path.
+ */
+static void bayer_edge(unsigned char *src, int width, int height, int x, int y,
+                       int *r, int *g, int *b)
+{
+    unsigned char *p = src + y * width + x;
+
+    if ((y & 1) == 0) {
+        if ((x & 1) == 0) {
+            if (y > 0 && x > 0) {
+                *b = *p;
+                *g = (*(p - 1) + *(p + 1) + *(p + width) + *(p - width)) / 4;
+                *r = (*(p - width - 1) + *(p - width + 1) + *(p + width - 1) + *(p + width + 1)) / 4;
+            } else {
+                *b = *p;
+                *g = (*(p + 1) + *(p + width)) / 2;
+                *r = *(p + width + 1);
+            }
+        } else {
+            if (y > 0 && x < width - 1) {
+                *b = (*(p - 1) + *(p + 1)) / 2;
+                *g = *p;
+                *r = (*(p + width) + *(p - width)) / 2;
+            } else {
+                *b = *(p - 1);
+                *g = *p;
+                *r = *(p + width);
+            }
+        }
+    } else {
+        if ((x & 1) == 0) {
+            if (y < height - 1 && x > 0) {
+                *b = (*(p + width) + *(p - width)) / 2;
+                *g = *p;
+                *r = (*(p - 1) + *(p + 1)) / 2;
+            } else {
+                *b = *(p - width);
+                *g = *p;
+                *r = *(p + 1);
+            }
+        } else {
+            if (y < height - 1 && x < width - 1) {
+                *b = (*(p - width - 1) + *(p - width + 1) + *(p + width - 1) + *(p + width + 1)) / 4;
+                *g = (*(p - 1) + *(p + 1) + *(p - width) + *(p + width)) / 4;
+                *r = *p;
+            } else {
+                *b = *(p - width - 1);
+                *g = (*(p - 1) + *(p - width)) / 2;
+                *r = *p;
+            }
+        }
+    }
+}
+
+/**
+ * bayer_block
+ *      Converts the 2x2 block at x, y of the bayer image src to YUV420P.
+ *      y_out, u and v point to the block in the output planes.
+ */
+static inline void bayer_block(unsigned char *src, int width, int height, int x, int y,
+                               unsigned char *y_out, unsigned char *u, unsigned char *v)
+{
+    unsigned char *p;
+    int r[4], g[4], b[4];
+    int k;
+
+    if (y > 0 && y + 2 < height && x > 0 && x + 2 < width) {
+        p = src + y * width + x;
+        /* B G on the upper line, G R on the lower one. */
+        b[0] = p[0];
+        g[0] = (p[-1] + p[1] + p[width] + p[-width]) / 4;
+        r[0] = (p[-width - 1] + p[-width + 1] + p[width - 1] + p[width + 1]) / 4;
+        p++;
+        b[1] = (p[-1] + p[1]) / 2;
+        g[1] = p[0];
+        r[1] = (p[width] + p[-width]) / 2;
+        p += width - 1;
+        b[2] = (p[width] + p[-width]) / 2;
+        g[2] = p[0];
+        r[2] = (p[-1] + p[1]) / 2;
+        p++;
+        b[3] = (p[-width - 1] + p[-width + 1] + p[width - 1] + p[width + 1]) / 4;
+        g[3] = (p[-1] + p[1] + p[-width] + p[width]) / 4;
+        r[3] = p[0];
+    } else {
+        for (k = 0; k < 4; k++)
+            bayer_edge(src, width, height, x + (k & 1), y + k / 2, &r[k], &g[k], &b[k]);
+    }
+
+    y_out[0] = VIDEO_Y(r[0], g[0], b[0]);
+    y_out[1] = VIDEO_Y(r[1], g[1], b[1]);
+    y_out[width] = VIDEO_Y(r[2], g[2], b[2]);
+    y_out[width + 1] = VIDEO_Y(r[3], g[3], b[3]);
+    *u = VIDEO_U(r[0], g[0], b[0]) + VIDEO_U(r[1], g[1], b[1]) +
+         VIDEO_U(r[2], g[2], b[2]) + VIDEO_U(r[3], g[3], b[3]);
+    *v = VIDEO_V(r[0], g[0], b[0]) + VIDEO_V(r[1], g[1], b[1]) +
+         VIDEO_V(r[2], g[2], b[2]) + VIDEO_V(r[3], g[3], b[3]);
+}
+
+/**
+ * bayer2yuv420p
+ *      Converts a BGGR bayer image straight to YUV420P. The result is the
+ *      same as bayer2rgb24 followed by conv_rgb24toyuv420p but without the
+ *      24 bit image in between.
+ */
+void bayer2yuv420p(unsigned char *map, unsigned char *src, int width, int height)
+{
+    unsigned char *y = map;
+    unsigned char *u = map + width * height;
+    unsigned char *v = u + (width * height) / 4;
+    int i, j, n;
+
+    /* The kernel does the inner pixels from the third column on. */
+    n = video_simd.bayer && width > 4 ? (width - 4) & ~15 : 0;
+
+    for (i = 0; i < height; i += 2) {
+        j = 0;
+
+        if (n && i > 0 && i + 2 < height) {
+            bayer_block(src, width, height, 0, i, y, u, v);
+            video_simd.bayer(src + i * width + 2, width, y + 2, width, u + 1, v + 1, n);
+            j = n + 2;
+        }
+
+        for (; j < width; j += 2)
+            bayer_block(src, width, height, j, i, y + j, u + j / 2, v + j / 2);
+
+        y += 2 * width;
+        u += width / 2;
+        v += width / 2;
+    }
+}
+
 /**
  * conv_yuv422to420p
- *
- *
+ *      Y is taken from every line, U and V are averaged over each pair of
+ *      lines. video_simd does the bulk of each pair of lines.
  */
 void conv_yuv422to420p(unsigned char *map, unsigned char *cap_map, int width, int height)
 {
-    unsigned char *src, *dest, *src2, *dest2;
-    int i, j;
-
-    /* Create the Y plane. */
-    src = cap_map;
-    dest = map;
-    for (i = width * height; i > 0; i--) {
-        *dest++ = *src;
-        src += 2;
-    }
-    /* Create U and V planes. */
-    src = cap_map + 1;
-    src2 = cap_map + width * 2 + 1;
-    dest = map + width * height;
-    dest2 = dest + (width * height) / 4;
-    for (i = height / 2; i > 0; i--) {
-        for (j = width / 2; j > 0; j--) {
-            *dest = ((int) *src + (int) *src2) / 2;
-            src += 2;
-            src2 += 2;
-            dest++;
-            *dest2 = ((int) *src + (int) *src2) / 2;
-            src += 2;
-            src2 += 2;
-            dest2++;
+    unsigned char *y = map;
+    unsigned char *u = map + width * height;
+    unsigned char *v = u + (width * height) / 4;
+    unsigned char *src, *src2;
+    int i, j, n;
+
+    n = video_simd.yuyv ? width & ~15 : 0;
+
+    for (i = 0; i < height; i += 2) {
+        src = cap_map + i * width * 2;
+        src2 = src + width * 2;
+
+        if (n)
+            video_simd.yuyv(src, width * 2, y, width, u, v, n);
+
+        for (j = n; j < width; j += 2) {
+            y[j] = src[2 * j];
+            y[j + 1] = src[2 * j + 2];
+            y[width + j] = src2[2 * j];
+            y[width + j + 1] = src2[2 * j + 2];
+            u[j / 2] = ((int) src[2 * j + 1] + (int) src2[2 * j + 1]) / 2;
+            v[j / 2] = ((int) src[2 * j + 3] + (int) src2[2 * j + 3]) / 2;
         }
-        src += width * 2;
-        src2 += width * 2;
+
+        y += 2 * width;
+        u += width / 2;
+        v += width / 2;
     }
 }
 
 /**
  * conv_uyvyto420p
- *
- *
+ *      As conv_yuv422to420p with the chroma bytes before the luma ones.
  */
 void conv_uyvyto420p(unsigned char *map, unsigned char *cap_map, unsigned int width, unsigned int height)
 {
     uint8_t *pY = map;
     uint8_t *pU = pY + (width * height);
     uint8_t *pV = pU + (width * height) / 4;
-    uint32_t uv_offset = width * 2 * sizeof(uint8_t);
-    uint32_t ix, jx;
-
-    for (ix = 0; ix < height; ix++) {
-        for (jx = 0; jx < width; jx += 2) {
-            uint16_t calc;
-
-            if ((ix&1) == 0) {
-                calc = *cap_map;
-                calc += *(cap_map + uv_offset);
-                calc /= 2;
-                *pU++ = (uint8_t) calc;
-            }
+    uint8_t *src, *src2;
+    uint32_t ix, jx, n;
 
-            cap_map++;
-            *pY++ = *cap_map++;
+    n = video_simd.uyvy ? width & ~15 : 0;
 
-            if ((ix&1) == 0) {
-                calc = *cap_map;
-                calc += *(cap_map + uv_offset);
-                calc /= 2;
-                *pV++ = (uint8_t) calc;
-            }
+    for (ix = 0; ix < height; ix += 2) {
+        src = cap_map + ix * width * 2;
+        src2 = src + width * 2;
 
-            cap_map++;
-            *pY++ = *cap_map++;
+        if (n)
+            video_simd.uyvy(src, width * 2, pY, width, pU, pV, n);
+
+        for (jx = n; jx < width; jx += 2) {
+            pY[jx] = src[2 * jx + 1];
+            pY[jx + 1] = src[2 * jx + 3];
+            pY[width + jx] = src2[2 * jx + 1];
+            pY[width + jx + 1] = src2[2 * jx + 3];
+            pU[jx / 2] = ((uint16_t) src[2 * jx] + src2[2 * jx]) / 2;
+            pV[jx / 2] = ((uint16_t) src[2 * jx + 2] + src2[2 * jx + 2]) / 2;
         }
+
+        pY += 2 * width;
+        pU += width / 2;
+        pV += width / 2;
     }
 }
 
 /**
  * conv_rgb24toyuv420p
- *
- *
+ *      cap_map holds b, g, r bytes. U and V are the byte sums of VIDEO_U and
+ *      VIDEO_V over each 2x2 block. video_simd does the bulk of each pair of
+ *      lines.
  */
 void conv_rgb24toyuv420p(unsigned char *map, unsigned char *cap_map, int width, int height)
 {
-    unsigned char *y, *u, *v;
-    unsigned char *r, *g, *b;
-    int i, loop;
-
-    b = cap_map;
-    g = b + 1;
-    r = g + 1;
-    y = map;
-    u = y + width * height;
-    v = u + (width * height) / 4;
-    memset(u, 0, width * height / 4);
-    memset(v, 0, width * height / 4);
-
-    for (loop = 0; loop < height; loop++) {
-        for (i = 0; i < width; i += 2) {
-            *y++ = (9796 ** r + 19235 ** g + 3736 ** b) >> 15;
-            *u += ((-4784 ** r - 9437 ** g + 14221 ** b) >> 17) + 32;
-            *v += ((20218 ** r - 16941 ** g - 3277 ** b) >> 17) + 32;
-            r += 3;
-            g += 3;
-            b += 3;
-            *y++ = (9796 ** r + 19235 ** g + 3736 ** b) >> 15;
-            *u += ((-4784 ** r - 9437 ** g + 14221 ** b) >> 17) + 32;
-            *v += ((20218 ** r - 16941 ** g - 3277 ** b) >> 17) + 32;
-            r += 3;
-            g += 3;
-            b += 3;
-            u++;
-            v++;
+    unsigned char *y = map;
+    unsigned char *u = map + width * height;
+    unsigned char *v = u + (width * height) / 4;
+    unsigned char *p0, *p1, *q0, *q1;
+    int i, j, n;
+
+    n = video_simd.rgb24 ? width & ~15 : 0;
+
+    for (i = 0; i < height; i += 2) {
+        p0 = cap_map + i * width * 3;
+
+        if (n)
+            video_simd.rgb24(p0, width * 3, y, width, u, v, n);
+
+        for (j = n; j < width; j += 2) {
+            p0 = cap_map + (i * width + j) * 3;
+            p1 = p0 + 3;
+            q0 = p0 + width * 3;
+            q1 = q0 + 3;
+
+            y[j] = VIDEO_Y(p0[2], p0[1], p0[0]);
+            y[j + 1] = VIDEO_Y(p1[2], p1[1], p1[0]);
+            y[width + j] = VIDEO_Y(q0[2], q0[1], q0[0]);
+            y[width + j + 1] = VIDEO_Y(q1[2], q1[1], q1[0]);
+            u[j / 2] = VIDEO_U(p0[2], p0[1], p0[0]) + VIDEO_U(p1[2], p1[1], p1[0]) +
+                       VIDEO_U(q0[2], q0[1], q0[0]) + VIDEO_U(q1[2], q1[1], q1[0]);
+            v[j / 2] = VIDEO_V(p0[2], p0[1], p0[0]) + VIDEO_V(p1[2], p1[1], p1[0]) +
+                       VIDEO_V(q0[2], q0[1], q0[0]) + VIDEO_V(q1[2], q1[1], q1[0]);
         }
 
-        if ((loop & 1) == 0) {
-            u -= width / 2;
-            v -= width / 2;
-        }
+        y += 2 * width;
+        u += width / 2;
+        v += width / 2;
     }
 }
 
 /**
  * mjpegtoyuv420p
  *
+ * Decodes an MJPEG frame with the camera's decompressor dec.
+ *
  * Return values
  *  -1 on fatal error
  *  0  on success
  *  2  if jpeg lib threw a "corrupt jpeg data" warning.
  *     in this case, "a damaged output image is likely."
  */
-int mjpegtoyuv420p(unsigned char *map, unsigned char *cap_map, int width, int height, unsigned int size)
+int mjpegtoyuv420p(struct jpeg_decoder *dec, unsigned char *map, unsigned char *cap_map, int width, int height, unsigned int size)
 {
-    uint8_t *yuv[3];
-    unsigned char *y, *u, *v;
-    int loop, ret;
-
-    yuv[0] = mymalloc(width * height * sizeof(yuv[0][0]));
-    yuv[1] = mymalloc(width * height / 4 * sizeof(yuv[1][0]));
-    yuv[2] = mymalloc(width * height / 4 * sizeof(yuv[2][0]));
+    int ret;
 
-
-    ret = decode_jpeg_raw(cap_map, size, 0, 420, width, height, yuv[0], yuv[1], yuv[2]);
+    /* The planes are decoded in place, no scratch copy needed. */
+    ret = decode_jpeg_raw(dec, cap_map, size, 0, 420, width, height, map,
+                          map + width * height, map + (width * height * 5) / 4);
 
     if (ret == 1) {
         MOTION_LOG(CRT, TYPE_VIDEO, NO_ERRNO, "%s: Corrupt image ... continue");
         ret = 2;
     }
 
-    y = map;
-    u = y + width * height;
-    v = u + (width * height) / 4;
-    memset(y, 0, width * height);
-    memset(u, 0, width * height / 4);
-    memset(v, 0, width * height / 4);
+    return ret;
+}
+
+/**
+ * vid_decode
+ *
+ *      Decodes the frame vid_defer_jpeg kept in img->jpeg to img->image with
+ *      the decoder the capture would have used.
+ *
+ * Returns the return value of the decoder, 0 on success.
+ */
+int vid_decode(struct context *cnt, struct image_data *img)
+{
+    img->flags &= ~IMAGE_JPEG;
+
+    if (cnt->netcam)
+        return netcam_decode_jpeg(&cnt->netcam->decoder, img->jpeg, img->jpeg_size, img->image);
+
+    return mjpegtoyuv420p(cnt->jpeg_decoder, img->image, img->jpeg, cnt->imgs.width,
+                          cnt->imgs.height, img->jpeg_size);
+}
+
+/**
+ * vid_keep_jpeg
+ *
+ *      Keeps the size bytes of the JPEG the current frame is decoded from in
+ *      cnt->current_image. With jpeg_passthrough the frame is flagged
+ *      IMAGE_ORIG_JPEG, and the stream and the pictures use these bytes
+ *      instead of encoding the frame again until something is drawn on it.
+ *      A rotated frame is not the camera's picture any more.
+ *
+ * Returns nothing.
+ */
+void vid_keep_jpeg(struct context *cnt, unsigned char *data, int size)
+{
+    struct image_data *img = cnt->current_image;
+
+    if (size > img->jpeg_alloc) {
+        img->jpeg = myrealloc(img->jpeg, size, "vid_keep_jpeg");
+        img->jpeg_alloc = size;
+    }
+
+    memcpy(img->jpeg, data, size);
+    img->jpeg_size = size;
 
-    for(loop = 0; loop < width * height; loop++)
-        *map++ = yuv[0][loop];
+    if (cnt->conf.jpeg_passthrough && !cnt->rotate_data.degrees)
+        img->flags |= IMAGE_ORIG_JPEG;
+}
 
-    for(loop = 0; loop < width * height / 4; loop++)
-        *map++ = yuv[1][loop];
+/**
+ * vid_defer_jpeg
+ *
+ *      Called by the capture code instead of decoding a JPEG frame when
+ *      cnt->defer_decode is set. The size bytes at data are kept in
+ *      cnt->current_image and only the luma at the detection size is decoded,
+ *      to imgs.det_image, which libjpeg does at a fraction of the cost by
+ *      skipping most of the IDCT. vid_decode decodes the rest when the pixels
+ *      turn out to be needed. A frame the scaled decode fails on is decoded
+ *      in full right away.
+ *
+ * Returns 0 on success or the error of the full decode.
+ */
+int vid_defer_jpeg(struct context *cnt, unsigned char *data, int size)
+{
+    struct image_data *img = cnt->current_image;
 
-    for(loop = 0; loop < width * height / 4; loop++)
-        *map++ = yuv[2][loop];
+    vid_keep_jpeg(cnt, data, size);
 
-    free(yuv[0]);
-    free(yuv[1]);
-    free(yuv[2]);
+    if (decode_jpeg_luma(cnt->jpeg_decoder, img->jpeg, size, cnt->imgs.det_scale, cnt->imgs.det_width,
+                         cnt->imgs.det_height, cnt->imgs.det_image) == 0) {
+        img->flags |= IMAGE_JPEG;
+        return 0;
+    }
 
-    return ret;
+    return vid_decode(cnt, img);
 }
 
 #define MAX2(x, y) ((x) > (y) ? (x) : (y))
@@ -459,7 +642,7 @@ int vid_do_autobright(struct context *cnt, struct video_dev *viddev)
     int brightness_window_low;
     int brightness_target;
     int i, j = 0, avg = 0, step = 0;
-    unsigned char *image = cnt->imgs.image_virgin; /* Or cnt->current_image ? */
+    unsigned char *image = cnt->imgs.det_image; /* Luma of the last frame */
 
     int make_change = 0;
 
@@ -471,7 +654,7 @@ int vid_do_autobright(struct context *cnt, struct video_dev *viddev)
     brightness_window_high = MIN2(brightness_target + AUTOBRIGHT_HYSTERESIS, 255);
     brightness_window_low = MAX2(brightness_target - AUTOBRIGHT_HYSTERESIS, 1);
 
-    for (i = 0; i < cnt->imgs.motionsize; i += 101) {
+    for (i = 0; i < cnt->imgs.det_motionsize; i += 101) {
         avg += image[i];
         j++;
     }
@@ -519,11 +702,12 @@ static struct video_dev *viddevs = NULL;
  * vid_init
  *
  * Called from motion.c at the very beginning before setting up the threads.
- * Function prepares the vid_mutex.
+ * Function prepares the vid_mutex and picks the pixel format conversions.
  */
 void vid_init(void)
 {
     pthread_mutex_init(&vid_mutex, NULL);
+    video_simd_init();
 }
 
 /**
@@ -538,6 +722,39 @@ void vid_cleanup(void)
 
 #endif    /* WITHOUT_V4L */
 
+/**
+ * vid_give_back
+ *
+ * Gives the capture buffer lent to an image ring slot back to the device,
+ * see v4l2_lend. Called before the slot is captured into again or dropped.
+ */
+void vid_give_back(struct context *cnt, struct image_data *img)
+{
+#if !defined(WITHOUT_V4L) && defined(MOTION_V4L2)
+    struct video_dev *dev;
+
+    if (!img->lent)
+        return;
+
+    pthread_mutex_lock(&vid_mutex);
+    dev = viddevs;
+    while (dev) {
+        if (dev->fd == cnt->video_dev)
+            break;
+        dev = dev->next;
+    }
+    pthread_mutex_unlock(&vid_mutex);
+
+    if (dev && dev->v4l2) {
+        v4l2_give_back(dev, img);
+        return;
+    }
+#endif /* !WITHOUT_V4L && MOTION_V4L2 */
+
+    img->image = img->buffer;
+    img->lent = 0;
+}
+
 /**
  * vid_close
  *
@@ -578,6 +795,22 @@ void vid_close(struct context *cnt)
         return;
     }
 
+#ifdef MOTION_V4L2
+    /* The image ring keeps the frames it holds in capture buffers */
+    if (dev->v4l2) {
+        int i;
+
+        for (i = 0; i < cnt->imgs.image_ring_size; i++) {
+            struct image_data *img = &cnt->imgs.image_ring[i];
+
+            if (img->lent) {
+                memcpy(img->buffer, img->image, cnt->imgs.size);
+                v4l2_give_back(dev, img);
+            }
+        }
+    }
+#endif
+
     if (--dev->usage_count == 0) {
         MOTION_LOG(NTC, TYPE_VIDEO, NO_ERRNO, "%s: Closing video device %s",
                    dev->video_device);
@@ -915,6 +1148,7 @@ int vid_next(struct context *cnt, unsigned char *map)
     {
         struct video_dev *dev;
         int width, height;
+        int rotated = 0;
 
         /* NOTE: Since this is a capture, we need to use capture dimensions. */
         width = cnt->rotate_data.cap_width;
@@ -941,6 +1175,7 @@ int vid_next(struct context *cnt, unsigned char *map)
         if (dev->v4l2) {
             v4l2_set_input(cnt, dev, map, width, height, conf);
             ret = v4l2_next(cnt, dev, map, width, height);
+            rotated = 1;    /* v4l2_next rotates as it converts */
         } else {
 #endif
 #if defined(HAVE_LINUX_VIDEODEV_H) && (!defined(WITHOUT_V4L))           
@@ -957,7 +1192,7 @@ int vid_next(struct context *cnt, unsigned char *map)
         }
 
         /* Rotate the image as specified. */
-        if (cnt->rotate_data.degrees > 0)
+        if (cnt->rotate_data.degrees > 0 && !rotated)
             rotate_map(cnt, map);
 
     }
@@ -10,6 +10,7 @@
 /* For rotation */
 #include "rotate.h"     /* Already includes motion.h */
 #include "video_freebsd.h"
+#include "jpegutils.h"
 
 #ifndef WITHOUT_V4L
 
@@ -1257,6 +1258,84 @@ int vid_start(struct context *cnt)
 }
 
 
+/**
+ * vid_decode
+ *
+ *      Decodes the frame vid_defer_jpeg kept in img->jpeg to img->image.
+ *      Only netcams keep frames compressed here.
+ *
+ * Returns the return value of the decoder, 0 on success.
+ */
+int vid_decode(struct context *cnt, struct image_data *img)
+{
+    img->flags &= ~IMAGE_JPEG;
+
+    if (!cnt->netcam)
+        return NETCAM_GENERAL_ERROR;
+
+    return netcam_decode_jpeg(&cnt->netcam->decoder, img->jpeg, img->jpeg_size, img->image);
+}
+
+/**
+ * vid_keep_jpeg
+ *
+ *      Keeps the size bytes of the JPEG the current frame is decoded from in
+ *      cnt->current_image for jpeg_passthrough, see video_common.c.
+ *
+ * Returns nothing.
+ */
+void vid_keep_jpeg(struct context *cnt, unsigned char *data, int size)
+{
+    struct image_data *img = cnt->current_image;
+
+    if (size > img->jpeg_alloc) {
+        img->jpeg = myrealloc(img->jpeg, size, "vid_keep_jpeg");
+        img->jpeg_alloc = size;
+    }
+
+    memcpy(img->jpeg, data, size);
+    img->jpeg_size = size;
+
+    if (cnt->conf.jpeg_passthrough && !cnt->rotate_data.degrees)
+        img->flags |= IMAGE_ORIG_JPEG;
+}
+
+/**
+ * vid_defer_jpeg
+ *
+ *      Keeps the size bytes of JPEG data in cnt->current_image and decodes
+ *      only the luma at the detection size, see video_common.c.
+ *
+ * Returns 0 on success or the error of the full decode.
+ */
+int vid_defer_jpeg(struct context *cnt, unsigned char *data, int size)
+{
+    struct image_data *img = cnt->current_image;
+
+    vid_keep_jpeg(cnt, data, size);
+
+    if (decode_jpeg_luma(cnt->jpeg_decoder, img->jpeg, size, cnt->imgs.det_scale, cnt->imgs.det_width,
+                         cnt->imgs.det_height, cnt->imgs.det_image) == 0) {
+        img->flags |= IMAGE_JPEG;
+        return 0;
+    }
+
+    return vid_decode(cnt, img);
+}
+
+/**
+ * vid_give_back
+ *
+ *      Only V4L2 devices lend capture buffers to the image ring, see
+ *      video_common.c. Here the slot just gets its own memory back.
+ */
+void vid_give_back(struct context *cnt ATTRIBUTE_UNUSED, struct image_data *img)
+{
+    img->image = img->buffer;
+    img->lent = 0;
+}
+
+
 /**
  * vid_next fetches a video frame from a either v4l device or netcam
  * Parameters:
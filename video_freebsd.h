@@ -128,6 +128,10 @@ struct video_dev {
 int vid_start(struct context *);
 int vid_next(struct context *, unsigned char *);
 void vid_close(struct context *);
+int vid_decode(struct context *, struct image_data *);
+void vid_keep_jpeg(struct context *, unsigned char *, int);
+int vid_defer_jpeg(struct context *, unsigned char *, int);
+void vid_give_back(struct context *, struct image_data *);
 
 #ifndef WITHOUT_V4L
 void vid_init(void);
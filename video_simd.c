@@ -0,0 +1,338 @@
+/*    video_simd.c
+ *
+ *    Vectorised pixel format conversions for the capture code in video_common.c.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ *
+ *    Like the kernels in alg_simd.c these are compiled with function
+ *    attributes and picked at run time by video_simd_init. Each kernel does
+ *    the bulk of a pair of rows; the callers in video_common.c do what is
+ *    left over and the image borders with the scalar code, which stays the
+ *    reference the kernels must match bit for bit.
+ */
+#include "video_simd.h"
+
+#ifdef HAVE_VIDEO_SIMD_X86
+#include <immintrin.h>
+#endif
+
+struct video_simd_ops video_simd = {
+    name:     "scalar",
+    yuyv:     NULL,
+    uyvy:     NULL,
+    rgb24:    NULL,
+    bayer:    NULL,
+};
+
+static pthread_once_t video_simd_once = PTHREAD_ONCE_INIT;
+
+#ifdef HAVE_VIDEO_SIMD_X86
+
+#define VIDEO_INLINE inline __attribute__((always_inline))
+
+/* Pairs of 16 bit factors for _mm_madd_epi16 */
+#define MADD_PAIR(a, b) _mm_setr_epi16(a, b, a, b, a, b, a, b)
+
+/**
+ * packed_sse2
+ *      conv_yuv422to420p (uyvy 0) and conv_uyvyto420p (uyvy 1) for 16
+ *      pixels per iteration. Y is every other byte of each row, the chroma
+ *      bytes of the two rows are averaged rounding down like the scalar
+ *      division.
+ */
+__attribute__((target("sse2")))
+static VIDEO_INLINE void packed_sse2(unsigned char *src, int stride, unsigned char *y, int width,
+                                     unsigned char *u, unsigned char *v, int count, const int uyvy)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low = _mm_set1_epi16(0x00ff);
+    const __m128i one = _mm_set1_epi8(1);
+    int i;
+
+    for (i = 0; i < count; i += 16) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(src + stride + 2 * i));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(src + stride + 2 * i + 16));
+        __m128i ya, yb, ca, cb, c;
+
+        if (uyvy) {
+            ya = _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(a1, 8));
+            yb = _mm_packus_epi16(_mm_srli_epi16(b0, 8), _mm_srli_epi16(b1, 8));
+            ca = _mm_packus_epi16(_mm_and_si128(a0, low), _mm_and_si128(a1, low));
+            cb = _mm_packus_epi16(_mm_and_si128(b0, low), _mm_and_si128(b1, low));
+        } else {
+            ya = _mm_packus_epi16(_mm_and_si128(a0, low), _mm_and_si128(a1, low));
+            yb = _mm_packus_epi16(_mm_and_si128(b0, low), _mm_and_si128(b1, low));
+            ca = _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(a1, 8));
+            cb = _mm_packus_epi16(_mm_srli_epi16(b0, 8), _mm_srli_epi16(b1, 8));
+        }
+
+        _mm_storeu_si128((__m128i *)(y + i), ya);
+        _mm_storeu_si128((__m128i *)(y + width + i), yb);
+
+        /* _mm_avg_epu8 rounds up, take the odd bit back off. */
+        c = _mm_sub_epi8(_mm_avg_epu8(ca, cb), _mm_and_si128(_mm_xor_si128(ca, cb), one));
+        _mm_storel_epi64((__m128i *)(u + i / 2), _mm_packus_epi16(_mm_and_si128(c, low), zero));
+        _mm_storel_epi64((__m128i *)(v + i / 2), _mm_packus_epi16(_mm_srli_epi16(c, 8), zero));
+    }
+}
+
+__attribute__((target("sse2")))
+static void yuyv_sse2(unsigned char *src, int stride, unsigned char *y, int width,
+                      unsigned char *u, unsigned char *v, int count)
+{
+    packed_sse2(src, stride, y, width, u, v, count, 0);
+}
+
+__attribute__((target("sse2")))
+static void uyvy_sse2(unsigned char *src, int stride, unsigned char *y, int width,
+                      unsigned char *u, unsigned char *v, int count)
+{
+    packed_sse2(src, stride, y, width, u, v, count, 1);
+}
+
+/**
+ * chroma_ssse3
+ *      VIDEO_U or VIDEO_V of 8 pixels given as 16 bit r, g and b, summed
+ *      over horizontal pairs into 4 32 bit lanes.
+ */
+__attribute__((target("ssse3")))
+static VIDEO_INLINE __m128i chroma_ssse3(__m128i r, __m128i g, __m128i b, __m128i krg, __m128i kb)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi32(32);
+    __m128i lo, hi;
+
+    lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r, g), krg),
+                       _mm_madd_epi16(_mm_unpacklo_epi16(b, zero), kb));
+    hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r, g), krg),
+                       _mm_madd_epi16(_mm_unpackhi_epi16(b, zero), kb));
+    lo = _mm_add_epi32(_mm_srai_epi32(lo, 17), bias);
+    hi = _mm_add_epi32(_mm_srai_epi32(hi, 17), bias);
+
+    return _mm_hadd_epi32(lo, hi);
+}
+
+/**
+ * yuv_ssse3
+ *      Converts 8 pixels of two rows, given as 16 bit r, g and b, to 8 Y
+ *      values of each row as 16 bit lanes and 4 U and V values in 32 bit
+ *      lanes. U and V wrap around at 256 like the byte sums of the scalar
+ *      code.
+ */
+__attribute__((target("ssse3")))
+static VIDEO_INLINE void yuv_ssse3(__m128i r0, __m128i g0, __m128i b0, __m128i r1, __m128i g1, __m128i b1,
+                                   __m128i *y0, __m128i *y1, __m128i *u, __m128i *v)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i byte = _mm_set1_epi32(0xff);
+    const __m128i ky = MADD_PAIR(9796, 19235);
+    const __m128i kyb = MADD_PAIR(3736, 0);
+    __m128i lo, hi;
+
+    lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r0, g0), ky),
+                       _mm_madd_epi16(_mm_unpacklo_epi16(b0, zero), kyb));
+    hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r0, g0), ky),
+                       _mm_madd_epi16(_mm_unpackhi_epi16(b0, zero), kyb));
+    *y0 = _mm_packs_epi32(_mm_srli_epi32(lo, 15), _mm_srli_epi32(hi, 15));
+
+    lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r1, g1), ky),
+                       _mm_madd_epi16(_mm_unpacklo_epi16(b1, zero), kyb));
+    hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r1, g1), ky),
+                       _mm_madd_epi16(_mm_unpackhi_epi16(b1, zero), kyb));
+    *y1 = _mm_packs_epi32(_mm_srli_epi32(lo, 15), _mm_srli_epi32(hi, 15));
+
+    *u = _mm_and_si128(_mm_add_epi32(chroma_ssse3(r0, g0, b0, MADD_PAIR(-4784, -9437), MADD_PAIR(14221, 0)),
+                                     chroma_ssse3(r1, g1, b1, MADD_PAIR(-4784, -9437), MADD_PAIR(14221, 0))),
+                       byte);
+    *v = _mm_and_si128(_mm_add_epi32(chroma_ssse3(r0, g0, b0, MADD_PAIR(20218, -16941), MADD_PAIR(-3277, 0)),
+                                     chroma_ssse3(r1, g1, b1, MADD_PAIR(20218, -16941), MADD_PAIR(-3277, 0))),
+                       byte);
+}
+
+/**
+ * store_ssse3
+ *      Stores the results of yuv_ssse3 for the two halves of 16 pixels.
+ */
+__attribute__((target("ssse3")))
+static VIDEO_INLINE void store_ssse3(unsigned char *y, int width, unsigned char *u, unsigned char *v,
+                                     __m128i y0[2], __m128i y1[2], __m128i uu[2], __m128i vv[2])
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    _mm_storeu_si128((__m128i *)y, _mm_packus_epi16(y0[0], y0[1]));
+    _mm_storeu_si128((__m128i *)(y + width), _mm_packus_epi16(y1[0], y1[1]));
+    _mm_storel_epi64((__m128i *)u, _mm_packus_epi16(_mm_packs_epi32(uu[0], uu[1]), zero));
+    _mm_storel_epi64((__m128i *)v, _mm_packus_epi16(_mm_packs_epi32(vv[0], vv[1]), zero));
+}
+
+/**
+ * deinterleave_ssse3
+ *      Splits 16 pixels of packed b, g, r bytes into one register per
+ *      colour.
+ */
+__attribute__((target("ssse3")))
+static VIDEO_INLINE void deinterleave_ssse3(unsigned char *src, __m128i *r, __m128i *g, __m128i *b)
+{
+    __m128i s0 = _mm_loadu_si128((const __m128i *)src);
+    __m128i s1 = _mm_loadu_si128((const __m128i *)(src + 16));
+    __m128i s2 = _mm_loadu_si128((const __m128i *)(src + 32));
+
+    *b = _mm_or_si128(_mm_or_si128(
+             _mm_shuffle_epi8(s0, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+             _mm_shuffle_epi8(s1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+             _mm_shuffle_epi8(s2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+    *g = _mm_or_si128(_mm_or_si128(
+             _mm_shuffle_epi8(s0, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+             _mm_shuffle_epi8(s1, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+             _mm_shuffle_epi8(s2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+    *r = _mm_or_si128(_mm_or_si128(
+             _mm_shuffle_epi8(s0, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+             _mm_shuffle_epi8(s1, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+             _mm_shuffle_epi8(s2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
+
+/**
+ * rgb24_ssse3
+ *      conv_rgb24toyuv420p for 16 pixels of two rows per iteration.
+ */
+__attribute__((target("ssse3")))
+static void rgb24_ssse3(unsigned char *src, int stride, unsigned char *y, int width,
+                        unsigned char *u, unsigned char *v, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i r0, g0, b0, r1, g1, b1;
+    __m128i y0[2], y1[2], uu[2], vv[2];
+    int i;
+
+    for (i = 0; i < count; i += 16) {
+        deinterleave_ssse3(src + 3 * i, &r0, &g0, &b0);
+        deinterleave_ssse3(src + stride + 3 * i, &r1, &g1, &b1);
+
+        yuv_ssse3(_mm_unpacklo_epi8(r0, zero), _mm_unpacklo_epi8(g0, zero), _mm_unpacklo_epi8(b0, zero),
+                  _mm_unpacklo_epi8(r1, zero), _mm_unpacklo_epi8(g1, zero), _mm_unpacklo_epi8(b1, zero),
+                  &y0[0], &y1[0], &uu[0], &vv[0]);
+        yuv_ssse3(_mm_unpackhi_epi8(r0, zero), _mm_unpackhi_epi8(g0, zero), _mm_unpackhi_epi8(b0, zero),
+                  _mm_unpackhi_epi8(r1, zero), _mm_unpackhi_epi8(g1, zero), _mm_unpackhi_epi8(b1, zero),
+                  &y0[1], &y1[1], &uu[1], &vv[1]);
+
+        store_ssse3(y + i, width, u + i / 2, v + i / 2, y0, y1, uu, vv);
+    }
+}
+
+/**
+ * demosaic_ssse3
+ *      The bayer2rgb24 interpolation of 8 pixels of one row as 16 bit
+ *      lanes. half selects the low or high 8 of the 16 bytes loaded. On a
+ *      B G row (odd 0) the even pixels are blue and the odd ones green, on a
+ *      G R row (odd 1) the even pixels are green and the odd ones red.
+ */
+__attribute__((target("ssse3")))
+static VIDEO_INLINE void demosaic_ssse3(unsigned char *p, int stride, const int half, const int odd,
+                                        __m128i *r, __m128i *g, __m128i *b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i even = _mm_set1_epi32(0x0000ffff);
+    __m128i row[9], cross, diag, horiz, vert;
+    unsigned char *q[9];
+    int k;
+
+    q[0] = p;                   /* Centre */
+    q[1] = p - 1;               /* Left */
+    q[2] = p + 1;               /* Right */
+    q[3] = p - stride;          /* Up */
+    q[4] = p + stride;          /* Down */
+    q[5] = p - stride - 1;
+    q[6] = p - stride + 1;
+    q[7] = p + stride - 1;
+    q[8] = p + stride + 1;
+
+    for (k = 0; k < 9; k++) {
+        row[k] = _mm_loadu_si128((const __m128i *)q[k]);
+        row[k] = half ? _mm_unpackhi_epi8(row[k], zero) : _mm_unpacklo_epi8(row[k], zero);
+    }
+
+    horiz = _mm_add_epi16(row[1], row[2]);
+    vert = _mm_add_epi16(row[3], row[4]);
+    cross = _mm_srli_epi16(_mm_add_epi16(horiz, vert), 2);
+    diag = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(row[5], row[6]), _mm_add_epi16(row[7], row[8])), 2);
+    horiz = _mm_srli_epi16(horiz, 1);
+    vert = _mm_srli_epi16(vert, 1);
+
+#define SELECT(a, b) _mm_or_si128(_mm_and_si128(even, a), _mm_andnot_si128(even, b))
+    if (!odd) {
+        *b = SELECT(row[0], horiz);
+        *g = SELECT(cross, row[0]);
+        *r = SELECT(diag, vert);
+    } else {
+        *b = SELECT(vert, diag);
+        *g = SELECT(row[0], cross);
+        *r = SELECT(horiz, row[0]);
+    }
+#undef SELECT
+}
+
+/**
+ * bayer_ssse3
+ *      bayer2yuv420p for 16 inner pixels of a pair of rows per iteration,
+ *      without the 24 bit RGB image in between.
+ */
+__attribute__((target("ssse3")))
+static void bayer_ssse3(unsigned char *src, int stride, unsigned char *y, int width,
+                        unsigned char *u, unsigned char *v, int count)
+{
+    __m128i r0, g0, b0, r1, g1, b1;
+    __m128i y0[2], y1[2], uu[2], vv[2];
+    int i;
+
+    for (i = 0; i < count; i += 16) {
+        demosaic_ssse3(src + i, stride, 0, 0, &r0, &g0, &b0);
+        demosaic_ssse3(src + stride + i, stride, 0, 1, &r1, &g1, &b1);
+        yuv_ssse3(r0, g0, b0, r1, g1, b1, &y0[0], &y1[0], &uu[0], &vv[0]);
+
+        demosaic_ssse3(src + i, stride, 1, 0, &r0, &g0, &b0);
+        demosaic_ssse3(src + stride + i, stride, 1, 1, &r1, &g1, &b1);
+        yuv_ssse3(r0, g0, b0, r1, g1, b1, &y0[1], &y1[1], &uu[1], &vv[1]);
+
+        store_ssse3(y + i, width, u + i / 2, v + i / 2, y0, y1, uu, vv);
+    }
+}
+
+#endif /* HAVE_VIDEO_SIMD_X86 */
+
+/**
+ * video_simd_select
+ *      Checks the CPU features once and fills in video_simd.
+ */
+static void video_simd_select(void)
+{
+#ifdef HAVE_VIDEO_SIMD_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("ssse3")) {
+        video_simd.name = "SSSE3";
+        video_simd.yuyv = yuyv_sse2;
+        video_simd.uyvy = uyvy_sse2;
+        video_simd.rgb24 = rgb24_ssse3;
+        video_simd.bayer = bayer_ssse3;
+    } else if (__builtin_cpu_supports("sse2")) {
+        video_simd.name = "SSE2";
+        video_simd.yuyv = yuyv_sse2;
+        video_simd.uyvy = uyvy_sse2;
+    }
+#endif
+}
+
+/**
+ * video_simd_init
+ *      Selects the fastest conversion kernels for this CPU. Called from
+ *      vid_init, the selection itself only happens once.
+ */
+void video_simd_init(void)
+{
+    pthread_once(&video_simd_once, video_simd_select);
+
+    MOTION_LOG(INF, TYPE_VIDEO, NO_ERRNO, "%s: Using %s pixel format conversions",
+               video_simd.name);
+}
@@ -0,0 +1,51 @@
+/*    video_simd.h
+ *
+ *    Vectorised pixel format conversions for the capture code in video_common.c.
+ *    This software is distributed under the GNU public license version 2
+ *    See also the file 'COPYING'.
+ *
+ */
+
+#ifndef _INCLUDE_VIDEO_SIMD_H
+#define _INCLUDE_VIDEO_SIMD_H
+
+#include "motion.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_VIDEO_SIMD_X86
+#endif
+
+/*
+ * The YUV420P the conversions produce from RGB. U and V are the sums of the
+ * VIDEO_U and VIDEO_V of the four pixels of a 2x2 block, kept in a byte.
+ */
+#define VIDEO_Y(r, g, b) ((9796 * (r) + 19235 * (g) + 3736 * (b)) >> 15)
+#define VIDEO_U(r, g, b) (((-4784 * (r) - 9437 * (g) + 14221 * (b)) >> 17) + 32)
+#define VIDEO_V(r, g, b) (((20218 * (r) - 16941 * (g) - 3277 * (b)) >> 17) + 32)
+
+/*
+ * Signature of a conversion kernel. It converts count pixels, a multiple of
+ * 16, of a pair of rows to YUV420P: the two Y rows at y and y + width and
+ * count / 2 pixels of the U and V rows. src points to the first of the pixels
+ * in the upper row of the source, the lower row starts stride bytes further.
+ * A bayer kernel also reads the row above and the row below the pair and the
+ * pixel before and after each row, so it is only given the inner pixels of
+ * the image. Results must be exactly those of the scalar code in
+ * video_common.c.
+ */
+typedef void (*video_conv_kernel)(unsigned char *src, int stride, unsigned char *y, int width,
+                                  unsigned char *u, unsigned char *v, int count);
+
+struct video_simd_ops {
+    const char *name;               /* Name of the instruction set, for logging */
+    video_conv_kernel yuyv;         /* NULL when only the scalar code is usable */
+    video_conv_kernel uyvy;         /* NULL when only the scalar code is usable */
+    video_conv_kernel rgb24;        /* NULL when only the scalar code is usable */
+    video_conv_kernel bayer;        /* NULL when only the scalar code is usable */
+};
+
+extern struct video_simd_ops video_simd;
+
+void video_simd_init(void);
+
+#endif /* _INCLUDE_VIDEO_SIMD_H */